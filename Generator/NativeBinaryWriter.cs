@@ -0,0 +1,43 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Text;
+
+namespace Generator
+{
+
+    /// <summary> Binary writer that writes integers in this machine's byte order. </summary>
+    public class NativeBinaryWriter : BinaryWriter
+    {
+        /// <summary> Open file 'path' for writing. </summary>
+        public NativeBinaryWriter(string path)
+            : base(new FileStream(path, FileMode.Create, FileAccess.Write), Encoding.ASCII) { }
+        /// <summary> Use stream for writing. </summary>
+        public NativeBinaryWriter(Stream output)
+            : base(output, Encoding.ASCII) { }
+        /// <summary> Write 64-bit unsigned int in native order. </summary>
+        public override void Write(ulong value) { Write(BitConverter.GetBytes(value)); }
+        /// <summary> Write 32-bit unsigned int in native order. </summary>
+        public override void Write(uint value) { Write(BitConverter.GetBytes(value)); }
+        /// <summary> Write 16-bit unsigned int in native order. </summary>
+        public override void Write(ushort value) { Write(BitConverter.GetBytes(value)); }
+        /// <summary> Write 64-bit signed int in native order. </summary>
+        public override void Write(long value) { Write(BitConverter.GetBytes(value)); }
+        /// <summary> Write 32-bit signed int in native order. </summary>
+        public override void Write(int value) { Write(BitConverter.GetBytes(value)); }
+        /// <summary> Write 16-bit signed int in native order. </summary>
+        public override void Write(short value) { Write(BitConverter.GetBytes(value)); }
+        /// <summary> Write fixed-length string, preceded by 32-bit length. </summary>
+        public void Write(int fixedLength, string str)
+        {
+            if (str.Length > fixedLength)
+                throw new ArgumentException($"String length ({str.Length}) exceeds fixed length ({fixedLength}).");
+            Write(fixedLength);
+            var encoded = Encoding.ASCII.GetBytes(str);
+            Write(encoded);
+            for (int i = str.Length; i < fixedLength; ++i)
+                Write('\0');
+        }
+    }
+
+}
@@ -13,6 +13,10 @@ namespace Generator
     public class TiledMap
     {
         public const int FILENAME_LENGTH_LIMIT = 28;
+        public const int DEFAULT_CHUNK_SIZE = 32;
+        public const int NATIVE_MAP_VERSION = 2;
+        public const uint NATIVE_BYTE_ORDER_MARK = 0x01020304;
+        public const int NATIVE_CELL_ALIGNMENT = 64;
 
         public string MapFilename { get; private set; }
         public string MapFilenameNewExt { get { return Path.ChangeExtension(MapFilename, ".wtm"); } }
@@ -56,8 +60,16 @@ namespace Generator
             };
         }
 
-        public void Save(string filename)
+        /// <summary>
+        /// Save the map. If chunkSize is nonzero, the cells are written as a chunked map
+        /// that the game streams in a chunk at a time instead of loading all at once.
+        /// If native is set, the map is written in this machine's byte order with aligned
+        /// cells, so the game can memory-map it and use the cells in place.
+        /// </summary>
+        public void Save(string filename, int chunkSize = 0, bool native = false)
         {
+            if (chunkSize < 0 || (chunkSize & (chunkSize - 1)) != 0)
+                throw new ArgumentException($"Chunk size must be a power of two: {chunkSize}");
             foreach (var ts in Tilesets)
             {
                 if (ts.ImageFilename.Length > FILENAME_LENGTH_LIMIT)
@@ -65,23 +77,32 @@ namespace Generator
                         $"Image filename more than {FILENAME_LENGTH_LIMIT} characters: {ts.ImageFilename}");
             }
             CheckCellValueLimit();
-            using (var w = new PortableBinaryWriter(MapFilenameNewExt))
+            if (native)
+                SaveNative(chunkSize > 0 ? chunkSize : DEFAULT_CHUNK_SIZE);
+            else using (var w = new PortableBinaryWriter(MapFilenameNewExt))
             {
+                if (chunkSize > 0)
+                    w.Write(Encoding.ASCII.GetBytes("WTMC"));
                 w.Write(Width);
                 w.Write(Height);
                 w.Write(TileWidth);
                 w.Write(TileHeight);
                 w.Write(Tilesets.Count());
                 w.Write(Layers.Count());
+                if (chunkSize > 0)
+                    w.Write(chunkSize);
                 foreach (var ts in Tilesets)
                 {
                     w.Write(ts.FirstGid);
                     w.Write(FILENAME_LENGTH_LIMIT, ts.TilesetFilenameNewExt);
                 }
-                for (int r = 0; r < Height; ++r)
-                    for (int c = 0; c < Width; ++c)
-                        foreach (var layer in Layers)
-                            w.Write((short)layer.Cells[r][c]);
+                if (chunkSize > 0)
+                    WriteChunkedCells(w, chunkSize);
+                else
+                    for (int r = 0; r < Height; ++r)
+                        for (int c = 0; c < Width; ++c)
+                            foreach (var layer in Layers)
+                                w.Write((short)layer.Cells[r][c]);
             }
             foreach (var ts in Tilesets)
             {
@@ -103,6 +124,76 @@ namespace Generator
             }
         }
 
+        /// <summary>
+        /// Write the map in native format: a fixed header with a byte order mark and
+        /// version, fixed-size tileset refs, then chunked cells starting at an aligned offset.
+        /// </summary>
+        private void SaveNative(int chunkSize)
+        {
+            const int headerSize = 48;
+            const int tilesetRefSize = 8 + FILENAME_LENGTH_LIMIT;
+            int refsEnd = headerSize + Tilesets.Count() * tilesetRefSize;
+            int cellDataOffset = (refsEnd + NATIVE_CELL_ALIGNMENT - 1)
+                / NATIVE_CELL_ALIGNMENT * NATIVE_CELL_ALIGNMENT;
+            using (var w = new NativeBinaryWriter(MapFilenameNewExt))
+            {
+                w.Write(Encoding.ASCII.GetBytes("WTMN"));
+                w.Write(NATIVE_BYTE_ORDER_MARK);
+                w.Write((uint)NATIVE_MAP_VERSION);
+                w.Write((uint)cellDataOffset);
+                w.Write(Width);
+                w.Write(Height);
+                w.Write(TileWidth);
+                w.Write(TileHeight);
+                w.Write(Tilesets.Count());
+                w.Write(Layers.Count());
+                w.Write(chunkSize);
+                w.Write(0); // reserved
+                foreach (var ts in Tilesets)
+                {
+                    w.Write(ts.FirstGid);
+                    w.Write(FILENAME_LENGTH_LIMIT, ts.TilesetFilenameNewExt);
+                }
+                for (int i = refsEnd; i < cellDataOffset; ++i)
+                    w.Write((byte)0);
+                WriteChunkedCells(w, chunkSize, planar: true);
+            }
+        }
+
+        /// <summary>
+        /// Write cells as full chunkSize x chunkSize blocks in row-major chunk order,
+        /// padding past the map edge with empty cells so every chunk has the same size.
+        /// If planar is set, each chunk holds one plane per layer; otherwise the layers
+        /// of each cell are written together.
+        /// </summary>
+        private void WriteChunkedCells(BinaryWriter w, int chunkSize, bool planar = false)
+        {
+            int chunkCols = (Width + chunkSize - 1) / chunkSize;
+            int chunkRows = (Height + chunkSize - 1) / chunkSize;
+            for (int chunkRow = 0; chunkRow < chunkRows; ++chunkRow)
+                for (int chunkCol = 0; chunkCol < chunkCols; ++chunkCol)
+                {
+                    if (planar)
+                        foreach (var layer in Layers)
+                            for (int y = 0; y < chunkSize; ++y)
+                                for (int x = 0; x < chunkSize; ++x)
+                                    WriteChunkCell(w, layer, chunkSize, chunkRow, chunkCol, y, x);
+                    else
+                        for (int y = 0; y < chunkSize; ++y)
+                            for (int x = 0; x < chunkSize; ++x)
+                                foreach (var layer in Layers)
+                                    WriteChunkCell(w, layer, chunkSize, chunkRow, chunkCol, y, x);
+                }
+        }
+
+        private void WriteChunkCell(BinaryWriter w, TiledLayer layer,
+            int chunkSize, int chunkRow, int chunkCol, int y, int x)
+        {
+            int r = chunkRow * chunkSize + y;
+            int c = chunkCol * chunkSize + x;
+            w.Write((short)(r < Height && c < Width ? layer.Cells[r][c] : 0));
+        }
+
         private int CheckCellValueLimit()
         {
             int[] cellValueLimits = new int[] { SByte.MaxValue, Int16.MaxValue, Int32.MaxValue };
@@ -0,0 +1,315 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Texture atlas.
+//
+// Every texture change splits a batch of sprites into another draw call, so
+// the tileset and sprite images are packed into as few textures (pages) as
+// possible at load time. Between Atlas_Begin and Atlas_Build, LoadImage
+// hands its surfaces to the atlas instead of making textures of them.
+// Atlas_Build packs them, largest first, with the skyline bottom-left
+// method: each page keeps the outline of the top edge of everything packed
+// so far, and an image goes wherever along it its top comes out lowest.
+// Images are then placed with Atlas_Place, which points them at their
+// region of a page.
+
+// Largest page, if the renderer allows it.
+static const int MAX_ATLAS_SIZE = 2048;
+#define MAX_ATLAS_PAGES 4
+// Empty texels between images, so that filtering doesn't pick up neighbours.
+static const int ATLAS_PADDING = 1;
+
+typedef struct AtlasEntry {
+  SDL_Surface* sfc;
+  int page; // -1 if it didn't fit and has a texture of its own
+  int x, y;
+  SDL_Texture* tex;
+} AtlasEntry;
+
+// A horizontal stretch of a page's skyline, at height y.
+typedef struct AtlasSegment {
+  int x, y, w;
+} AtlasSegment;
+
+typedef struct AtlasPage {
+  AtlasSegment* skyline; // left to right, covering the page's width
+  int nSegments;
+  int usedW, usedH; // the texture is cropped to this
+  SDL_Texture* tex;
+} AtlasPage;
+
+static struct Atlas {
+  int collecting; // between Atlas_Begin and Atlas_Build
+  int size; // width and height of a page
+  AtlasEntry* entries;
+  int nEntries, capacity;
+  AtlasPage pages[MAX_ATLAS_PAGES];
+  int nPages;
+} atlas;
+
+// Starts collecting images to pack.
+void Atlas_Begin()
+{
+  Atlas_Destroy();
+  atlas.collecting = 1;
+}
+
+int Atlas_IsCollecting()
+{
+  return atlas.collecting;
+}
+
+void Atlas_Add(SDL_Surface* sfc)
+{
+  assert(atlas.collecting);
+  if (atlas.nEntries == atlas.capacity)
+  {
+    int capacity = atlas.capacity ? 2 * atlas.capacity : 64;
+    AtlasEntry* entries = MallocOrDie(capacity * sizeof(AtlasEntry));
+    if (atlas.nEntries)
+      memcpy(entries, atlas.entries, atlas.nEntries * sizeof(AtlasEntry));
+    free(atlas.entries);
+    atlas.entries = entries;
+    atlas.capacity = capacity;
+  }
+  AtlasEntry* entry = &atlas.entries[atlas.nEntries++];
+  entry->sfc = sfc;
+  entry->page = -1;
+}
+
+// Finds where a w by h rectangle would go on the page's skyline: the
+// segment to put its left edge on, and its top. Returns -1 if it won't fit.
+static int Skyline_Find(AtlasPage* page, int w, int h, int* bestX, int* bestY)
+{
+  int best = -1, bestBottom = 0;
+  for (int i=0; i < page->nSegments; ++i)
+  {
+    int x = page->skyline[i].x;
+    if (x + w > atlas.size)
+      break;
+    // It rests on the highest segment under it.
+    int y = 0;
+    for (int j = i; j < page->nSegments && page->skyline[j].x < x + w; ++j)
+      if (page->skyline[j].y > y)
+        y = page->skyline[j].y;
+    if (y + h > atlas.size)
+      continue;
+    if (best < 0 || y + h < bestBottom)
+    {
+      best = i;
+      bestBottom = y + h;
+      *bestX = x;
+      *bestY = y;
+    }
+  }
+  return best;
+}
+
+// Raises the skyline over a rectangle put at segment i.
+static void Skyline_Add(AtlasPage* page, int i, int x, int y, int w, int h)
+{
+  AtlasSegment* skyline = page->skyline;
+  memmove(&skyline[i + 1], &skyline[i], (page->nSegments - i) * sizeof(AtlasSegment));
+  ++page->nSegments;
+  AtlasSegment top = { x, y + h, w };
+  skyline[i] = top;
+  // Cut back the segments it covers.
+  int j = i + 1;
+  while (j < page->nSegments && skyline[j].x < x + w)
+  {
+    int covered = x + w - skyline[j].x;
+    if (covered < skyline[j].w)
+    {
+      skyline[j].x += covered;
+      skyline[j].w -= covered;
+      break;
+    }
+    memmove(&skyline[j], &skyline[j + 1], (page->nSegments - j - 1) * sizeof(AtlasSegment));
+    --page->nSegments;
+  }
+  // Join neighbours at the same height.
+  for (j=0; j + 1 < page->nSegments; )
+  {
+    if (skyline[j].y == skyline[j + 1].y)
+    {
+      skyline[j].w += skyline[j + 1].w;
+      memmove(&skyline[j + 1], &skyline[j + 2],
+          (page->nSegments - j - 2) * sizeof(AtlasSegment));
+      --page->nSegments;
+    }
+    else
+      ++j;
+  }
+  if (x + w > page->usedW)
+    page->usedW = x + w;
+  if (y + h > page->usedH)
+    page->usedH = y + h;
+}
+
+static int CompareEntryHeights(const void* a, const void* b)
+{
+  const SDL_Surface* sa = atlas.entries[*(const int*)a].sfc;
+  const SDL_Surface* sb = atlas.entries[*(const int*)b].sfc;
+  if (sa->h != sb->h)
+    return sb->h - sa->h;
+  return sb->w - sa->w;
+}
+
+static int PackEntry(AtlasEntry* entry, int skylineCapacity)
+{
+  int w = entry->sfc->w + ATLAS_PADDING, h = entry->sfc->h + ATLAS_PADDING;
+  if (w > atlas.size || h > atlas.size)
+    return 0;
+  for (int p=0; p <= atlas.nPages && p < MAX_ATLAS_PAGES; ++p)
+  {
+    AtlasPage* page = &atlas.pages[p];
+    if (p == atlas.nPages)
+    {
+      page->skyline = MallocOrDie(skylineCapacity * sizeof(AtlasSegment));
+      AtlasSegment ground = { 0, 0, atlas.size };
+      page->skyline[0] = ground;
+      page->nSegments = 1;
+      ++atlas.nPages;
+    }
+    int x, y;
+    int i = Skyline_Find(page, w, h, &x, &y);
+    if (i >= 0)
+    {
+      Skyline_Add(page, i, x, y, w, h);
+      entry->page = p;
+      entry->x = x;
+      entry->y = y;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Copies a page's images into a surface and makes a texture of it.
+static int DrawPage(int p)
+{
+  AtlasPage* page = &atlas.pages[p];
+  SDL_Surface* sfc = SDL_CreateRGBSurfaceWithFormat(0, page->usedW, page->usedH,
+      32, SDL_PIXELFORMAT_ARGB8888);
+  if (!sfc)
+  {
+    fprintf(stderr, "Unable to create atlas surface. %s\n", SDL_GetError());
+    return 0;
+  }
+  SDL_FillRect(sfc, 0, 0);
+  for (int i=0; i < atlas.nEntries; ++i)
+  {
+    AtlasEntry* entry = &atlas.entries[i];
+    if (entry->page != p)
+      continue;
+    // Copy alpha as it is rather than blending onto the empty page.
+    SDL_BlendMode blendMode;
+    SDL_GetSurfaceBlendMode(entry->sfc, &blendMode);
+    SDL_SetSurfaceBlendMode(entry->sfc, SDL_BLENDMODE_NONE);
+    SDL_Rect dest = { entry->x, entry->y, entry->sfc->w, entry->sfc->h };
+    int failed = SDL_BlitSurface(entry->sfc, 0, sfc, &dest);
+    SDL_SetSurfaceBlendMode(entry->sfc, blendMode);
+    if (failed)
+    {
+      fprintf(stderr, "Unable to copy image into atlas. %s\n", SDL_GetError());
+      SDL_FreeSurface(sfc);
+      return 0;
+    }
+  }
+  page->tex = SurfaceToTexture(sfc, 1);
+  return page->tex != 0;
+}
+
+// Packs the images added since Atlas_Begin into pages and makes their
+// textures. Images too big for a page, or that don't fit in the pages
+// there are, get textures of their own. Does nothing if not collecting.
+int Atlas_Build()
+{
+  if (!atlas.collecting)
+    return 1;
+  atlas.collecting = 0;
+  atlas.size = MAX_ATLAS_SIZE;
+  int maxTextureSize = GetMaxTextureSize();
+  if (maxTextureSize > 0 && maxTextureSize < atlas.size)
+    atlas.size = maxTextureSize;
+  int* order = MallocOrDie((atlas.nEntries + 1) * sizeof(int));
+  for (int i=0; i < atlas.nEntries; ++i)
+    order[i] = i;
+  qsort(order, atlas.nEntries, sizeof(int), CompareEntryHeights);
+  // Each image adds at most one segment to the skyline of its page.
+  int skylineCapacity = atlas.nEntries + 2;
+  int nOwn = 0;
+  Uint64 packedArea = 0;
+  for (int i=0; i < atlas.nEntries; ++i)
+  {
+    AtlasEntry* entry = &atlas.entries[order[i]];
+    if (PackEntry(entry, skylineCapacity))
+    {
+      packedArea += (Uint64)entry->sfc->w * entry->sfc->h;
+      continue;
+    }
+    entry->tex = SurfaceToTexture(entry->sfc, 0);
+    if (!entry->tex)
+    {
+      free(order);
+      return 0;
+    }
+    ++nOwn;
+  }
+  free(order);
+  Uint64 pageArea = 0;
+  for (int p=0; p < atlas.nPages; ++p)
+  {
+    AtlasPage* page = &atlas.pages[p];
+    free(page->skyline);
+    page->skyline = 0;
+    if (!DrawPage(p))
+      return 0;
+    pageArea += (Uint64)page->usedW * page->usedH;
+    printf("ATLAS: PAGE %d: %dx%d\n", p, page->usedW, page->usedH);
+  }
+  for (int i=0; i < atlas.nEntries; ++i)
+  {
+    AtlasEntry* entry = &atlas.entries[i];
+    if (entry->page >= 0)
+      entry->tex = atlas.pages[entry->page].tex;
+  }
+  printf("ATLAS: IMAGES=%d, PAGES=%d, OWN TEXTURES=%d, FILLED=%.1f%%\n",
+      atlas.nEntries, atlas.nPages, nOwn,
+      pageArea ? 100.0 * packedArea / pageArea : 0.0);
+  return 1;
+}
+
+// Points an image at its place in the atlas. Returns 0, leaving the image
+// alone, if it wasn't packed.
+int Atlas_Place(struct Image* img)
+{
+  for (int i=0; i < atlas.nEntries; ++i)
+  {
+    AtlasEntry* entry = &atlas.entries[i];
+    if (entry->sfc != img->sfc || !entry->tex)
+      continue;
+    img->tex = entry->tex;
+    img->texX = entry->page >= 0 ? entry->x : 0;
+    img->texY = entry->page >= 0 ? entry->y : 0;
+    return 1;
+  }
+  return 0;
+}
+
+void Atlas_Destroy()
+{
+  for (int i=0; i < atlas.nEntries; ++i)
+    if (atlas.entries[i].page < 0 && atlas.entries[i].tex)
+      SDL_DestroyTexture(atlas.entries[i].tex);
+  for (int p=0; p < atlas.nPages; ++p)
+  {
+    free(atlas.pages[p].skyline);
+    if (atlas.pages[p].tex)
+      SDL_DestroyTexture(atlas.pages[p].tex);
+  }
+  free(atlas.entries);
+  memset(&atlas, 0, sizeof(atlas));
+}
@@ -0,0 +1,255 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Asset bundle.
+//
+// Decoding PNGs is most of the work of starting up, so images can be
+// decoded once, ahead of time, into a bundle file: a table of contents
+// followed by each image's pixels, already in the renderer's preferred
+// format. At startup the bundle is mapped and surfaces are made that point
+// straight into the mapping, so textures are uploaded from there with no
+// decoding or copying.
+//
+// The game writes the bundle itself (-makebundle): images are recorded as
+// they're loaded, the ordinary way, and written out at the end. Each entry
+// remembers the size and time of the file it came from, and if that file
+// has changed since, it's loaded from the file instead.
+
+#define BUNDLE_VERSION 1
+#define BUNDLE_BYTE_ORDER_MARK 0x01020304
+#define BUNDLE_PATH_LENGTH 120
+#define BUNDLE_PIXEL_ALIGNMENT 64
+
+typedef struct BundleHeader {
+  char marker[4]; // "WTBN"
+  Uint32 byteOrderMark, version, nImages;
+} BundleHeader;
+
+typedef struct BundleEntry {
+  char path[BUNDLE_PATH_LENGTH]; // as passed to LoadImage
+  Uint32 format;
+  Sint32 w, h, pitch;
+  Uint64 offset; // of the pixels, from the start of the file
+  Sint64 sourceSize, sourceModified; // of the image file it was made from
+} BundleEntry;
+
+typedef struct BundleRecord {
+  const char* path;
+  SDL_Surface* sfc;
+} BundleRecord;
+
+static struct Bundle {
+  char* data; // the mapped file, or 0
+  size_t dataLen;
+  BundleEntry* entries;
+  int nEntries;
+  // Images loaded so far, while recording.
+  int recording;
+  BundleRecord* records;
+  int nRecords, recordCapacity;
+  // Images can be loaded on any thread (see loader.c).
+  SDL_atomic_t loaded, stale, missed;
+} bundle;
+
+static int BundleError(const char* filename, const char* problem)
+{
+  fprintf(stderr, "Asset bundle '%s' %s.\n", filename, problem);
+  Bundle_Close();
+  return 0;
+}
+
+// Maps a bundle so that LoadImage will look there first.
+int Bundle_Open(const char* filename)
+{
+  Bundle_Close();
+  bundle.data = MapFile(filename, &bundle.dataLen);
+  if (!bundle.data)
+    return 0;
+  BundleHeader* header = (BundleHeader*)bundle.data;
+  if (bundle.dataLen < sizeof(BundleHeader) || memcmp(header->marker, "WTBN", 4))
+    return BundleError(filename, "is not an asset bundle");
+  if (header->byteOrderMark != BUNDLE_BYTE_ORDER_MARK)
+    return BundleError(filename, "was written for a different byte order");
+  if (header->version != BUNDLE_VERSION)
+    return BundleError(filename, "has an unsupported version");
+  if (header->nImages > (bundle.dataLen - sizeof(BundleHeader)) / sizeof(BundleEntry))
+    return BundleError(filename, "is truncated");
+  bundle.entries = (BundleEntry*)(bundle.data + sizeof(BundleHeader));
+  bundle.nEntries = header->nImages;
+  for (int i=0; i < bundle.nEntries; ++i)
+  {
+    BundleEntry* entry = &bundle.entries[i];
+    if (entry->w <= 0 || entry->h <= 0 || entry->pitch < entry->w * 4
+        || entry->offset % BUNDLE_PIXEL_ALIGNMENT
+        || entry->offset > bundle.dataLen
+        || (Uint64)entry->pitch * entry->h > bundle.dataLen - entry->offset
+        || !memchr(entry->path, '\0', BUNDLE_PATH_LENGTH))
+      return BundleError(filename, "has a bad table of contents");
+  }
+  return 1;
+}
+
+void Bundle_Close()
+{
+  if (bundle.data)
+    UnmapFile(bundle.data, bundle.dataLen);
+  bundle.data = 0;
+  bundle.dataLen = 0;
+  bundle.entries = 0;
+  bundle.nEntries = 0;
+}
+
+// Returns a surface over the image's pixels in the bundle, or 0 if it isn't
+// there or its file has changed since. The surface only lasts as long as
+// the bundle stays open, and mustn't be drawn on.
+SDL_Surface* Bundle_LoadSurface(const char* path)
+{
+  for (int i=0; i < bundle.nEntries; ++i)
+  {
+    BundleEntry* entry = &bundle.entries[i];
+    if (strcmp(entry->path, path))
+      continue;
+    // The bundle can be used without the files it was made from.
+    Sint64 size, modified;
+    if (GetFileStamp(path, &size, &modified)
+        && (size != entry->sourceSize || modified != entry->sourceModified))
+    {
+      SDL_AtomicIncRef(&bundle.stale);
+      break;
+    }
+    SDL_Surface* sfc = SDL_CreateRGBSurfaceWithFormatFrom(bundle.data + entry->offset,
+        entry->w, entry->h, 32, entry->pitch, entry->format);
+    if (!sfc)
+    {
+      fprintf(stderr, "Unable to use bundled image '%s'. %s\n", path, SDL_GetError());
+      break;
+    }
+    SDL_AtomicIncRef(&bundle.loaded);
+    return sfc;
+  }
+  SDL_AtomicIncRef(&bundle.missed);
+  return 0;
+}
+
+// Starts keeping track of the images loaded, for Bundle_Write.
+void Bundle_BeginRecording()
+{
+  bundle.recording = 1;
+  bundle.nRecords = 0;
+}
+
+// Called by LoadImage. The path and surface have to last until Bundle_Write.
+void Bundle_Record(const char* path, SDL_Surface* sfc)
+{
+  if (!bundle.recording)
+    return;
+  for (int i=0; i < bundle.nRecords; ++i)
+    if (!strcmp(bundle.records[i].path, path))
+      return;
+  if (bundle.nRecords == bundle.recordCapacity)
+  {
+    int capacity = bundle.recordCapacity ? 2 * bundle.recordCapacity : 64;
+    BundleRecord* records = MallocOrDie(capacity * sizeof(BundleRecord));
+    if (bundle.nRecords)
+      memcpy(records, bundle.records, bundle.nRecords * sizeof(BundleRecord));
+    free(bundle.records);
+    bundle.records = records;
+    bundle.recordCapacity = capacity;
+  }
+  BundleRecord record = { path, sfc };
+  bundle.records[bundle.nRecords++] = record;
+}
+
+static int WritePadding(FILE* file, long alignment)
+{
+  static const char zeros[BUNDLE_PIXEL_ALIGNMENT];
+  long position = ftell(file);
+  long padding = (alignment - position % alignment) % alignment;
+  return position >= 0 && fwrite(zeros, 1, padding, file) == (size_t)padding;
+}
+
+// Writes the recorded images to a bundle, converted to format (a 32-bit
+// SDL_PIXELFORMAT), and stops recording.
+int Bundle_Write(const char* filename, Uint32 format)
+{
+  bundle.recording = 0;
+  BundleHeader header = { { 'W', 'T', 'B', 'N' },
+    BUNDLE_BYTE_ORDER_MARK, BUNDLE_VERSION, bundle.nRecords };
+  BundleEntry* entries = MallocOrDie((bundle.nRecords + 1) * sizeof(BundleEntry));
+  SDL_Surface** converted = MallocOrDie((bundle.nRecords + 1) * sizeof(SDL_Surface*));
+  Uint64 offset = sizeof(BundleHeader) + bundle.nRecords * sizeof(BundleEntry);
+  int ok = 1;
+  for (int i=0; i < bundle.nRecords && ok; ++i)
+  {
+    BundleRecord* record = &bundle.records[i];
+    BundleEntry* entry = &entries[i];
+    if (strlen(record->path) >= BUNDLE_PATH_LENGTH)
+    {
+      fprintf(stderr, "Image path '%s' is too long for an asset bundle.\n", record->path);
+      ok = 0;
+      break;
+    }
+    converted[i] = SDL_ConvertSurfaceFormat(record->sfc, format, 0);
+    if (!converted[i])
+    {
+      fprintf(stderr, "Unable to convert image '%s'. %s\n", record->path, SDL_GetError());
+      ok = 0;
+      break;
+    }
+    strcpy(entry->path, record->path);
+    entry->format = format;
+    entry->w = converted[i]->w;
+    entry->h = converted[i]->h;
+    entry->pitch = 4 * converted[i]->w;
+    offset += (BUNDLE_PIXEL_ALIGNMENT - offset % BUNDLE_PIXEL_ALIGNMENT) % BUNDLE_PIXEL_ALIGNMENT;
+    entry->offset = offset;
+    offset += (Uint64)entry->pitch * entry->h;
+    if (!GetFileStamp(record->path, &entry->sourceSize, &entry->sourceModified))
+      entry->sourceSize = entry->sourceModified = -1;
+  }
+  FILE* file = ok ? fopen(filename, "wb") : 0;
+  if (ok && !file)
+  {
+    fprintf(stderr, "Unable to write asset bundle '%s'.\n", filename);
+    ok = 0;
+  }
+  if (ok)
+  {
+    ok = fwrite(&header, sizeof(header), 1, file) == 1
+      && (!bundle.nRecords
+        || fwrite(entries, sizeof(BundleEntry), bundle.nRecords, file) == (size_t)bundle.nRecords);
+    for (int i=0; i < bundle.nRecords && ok; ++i)
+    {
+      SDL_Surface* sfc = converted[i];
+      ok = WritePadding(file, BUNDLE_PIXEL_ALIGNMENT);
+      for (int y=0; y < sfc->h && ok; ++y)
+        ok = fwrite((char*)sfc->pixels + y * sfc->pitch, entries[i].pitch, 1, file) == 1;
+    }
+    if (fclose(file) || !ok)
+    {
+      fprintf(stderr, "Error writing asset bundle '%s'.\n", filename);
+      ok = 0;
+    }
+  }
+  for (int i=0; i < bundle.nRecords; ++i)
+    if (converted[i])
+      SDL_FreeSurface(converted[i]);
+  free(converted);
+  free(entries);
+  if (ok)
+    printf("BUNDLE: WROTE %d IMAGES TO %s (%u KB)\n",
+        bundle.nRecords, filename, (unsigned)(offset >> 10));
+  free(bundle.records);
+  bundle.records = 0;
+  bundle.nRecords = bundle.recordCapacity = 0;
+  return ok;
+}
+
+BundleStats Bundle_GetStats()
+{
+  BundleStats stats = { SDL_AtomicGet(&bundle.loaded), SDL_AtomicGet(&bundle.stale),
+    SDL_AtomicGet(&bundle.missed) };
+  return stats;
+}
@@ -0,0 +1,320 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Memory budget for resident chunks unless the game sets one.
+static const size_t DEFAULT_CHUNK_BUDGET = 16 << 20;
+// How many chunks beyond the view to load in the direction of movement.
+static const int CHUNK_PREFETCH_DISTANCE = 1;
+
+int TiledMap_InitChunks(TiledMap* map, int chunkSize, TiledChunkLoader loadChunk)
+{
+  assert(map);
+  assert(loadChunk);
+  int shift = 0;
+  while ((1 << shift) < chunkSize)
+    ++shift;
+  if (chunkSize <= 0 || (1 << shift) != chunkSize)
+  {
+    fprintf(stderr, "Chunk size must be a power of two (got %d).\n", chunkSize);
+    return 0;
+  }
+  map->chunkSize = chunkSize;
+  map->chunkShift = shift;
+  map->chunkCols = (map->width + chunkSize - 1) >> shift;
+  map->chunkRows = (map->height + chunkSize - 1) >> shift;
+  map->obstacleStride = (chunkSize + 63) >> 6;
+  map->opacityStride = (chunkSize + 1) >> 1;
+  int nChunks = map->chunkCols * map->chunkRows;
+  map->chunks = MallocOrDie(nChunks * sizeof(TiledChunk*));
+  map->residentChunks = MallocOrDie(nChunks * sizeof(TiledChunk*));
+  map->nResidentChunks = 0;
+  map->residentBytes = 0;
+  map->chunkBudget = DEFAULT_CHUNK_BUDGET;
+  map->chunkClock = 0;
+  map->loadChunk = loadChunk;
+  return 1;
+}
+
+void TiledMap_SetChunkBudget(TiledMap* map, size_t bytes)
+{
+  map->chunkBudget = bytes;
+}
+
+// Memory for a chunk's derived planes.
+static size_t FlagBytes(TiledMap* map)
+{
+  return map->chunkSize * (map->obstacleStride * sizeof(Uint64) + map->opacityStride);
+}
+
+// Folds the cell's layers into its obstacle bit and combined opacity, at
+// (x, y) within its chunk. Light is dimmed by each layer in turn, as if it
+// passed through them all, and the result rounded to one opacity level.
+static void DeriveCellFlags(TiledMap* map, TiledChunk* chunk, Sint16* cell, int x, int y)
+{
+  int obstacle = 0, brightness = MAX_LIGHT;
+  for (int layer=0; layer < map->nLayers; ++layer)
+  {
+    Sint16 gidIndex = TiledMap_GidIndex(map, cell[layer * map->cellLayerStride]);
+    TiledProperty* props = &map->gidProps[gidIndex * map->nTileProperties];
+    if (props[TILE_PROP_OBSTACLE])
+      obstacle = 1;
+    int layerOpacity = props[TILE_PROP_OPACITY];
+    if (layerOpacity)
+      brightness = ReduceBrightness(brightness,
+          layerOpacity < MAX_TILE_OPACITY ? layerOpacity : MAX_TILE_OPACITY);
+  }
+  int opacity = OpacityForBrightness(brightness);
+  Uint64* word = &chunk->obstacleBits[y * map->obstacleStride + (x >> 6)];
+  Uint64 bit = (Uint64)1 << (x & 63);
+  *word = obstacle ? (*word | bit) : (*word & ~bit);
+  Uint8* nibbles = &chunk->opacityNibbles[y * map->opacityStride + (x >> 1)];
+  int shift = (x & 1) << 2;
+  *nibbles = (*nibbles & ~(0xF << shift)) | (opacity << shift);
+}
+
+static void DeriveChunkFlags(TiledMap* map, TiledChunk* chunk)
+{
+  int endX = map->width - (chunk->col << map->chunkShift);
+  int endY = map->height - (chunk->row << map->chunkShift);
+  if (endX > map->chunkSize) endX = map->chunkSize;
+  if (endY > map->chunkSize) endY = map->chunkSize;
+  for (int y=0; y < endY; ++y)
+  {
+    Sint16* cell = chunk->gids + y * map->cellRowStride;
+    for (int x=0; x < endX; ++x, ++cell)
+      DeriveCellFlags(map, chunk, cell, x, y);
+  }
+}
+
+// Makes a chunk resident, if it isn't already, and derives its obstacle
+// and opacity planes. Returns 0 if it can't be loaded.
+TiledChunk* TiledMap_LoadChunk(TiledMap* map, int col, int row)
+{
+  TiledChunk** slot = &map->chunks[row * map->chunkCols + col];
+  if (*slot)
+    return *slot;
+  TiledChunk* chunk = MallocOrDie(sizeof(TiledChunk));
+  chunk->col = col;
+  chunk->row = row;
+  if (!map->loadChunk(map, chunk))
+  {
+    fprintf(stderr, "Failed to load map chunk (%d,%d).\n", col, row);
+    free(chunk);
+    return 0;
+  }
+  chunk->obstacleBits = MallocOrDie(FlagBytes(map));
+  chunk->opacityNibbles =
+    (Uint8*)(chunk->obstacleBits + map->chunkSize * map->obstacleStride);
+  DeriveChunkFlags(map, chunk);
+  chunk->lastUsed = map->chunkClock;
+  *slot = chunk;
+  map->residentChunks[map->nResidentChunks++] = chunk;
+  map->residentBytes += sizeof(TiledChunk) + chunk->bytes + FlagBytes(map);
+  return chunk;
+}
+
+static void EvictChunk(TiledMap* map, int residentIndex)
+{
+  TiledChunk* chunk = map->residentChunks[residentIndex];
+  map->residentChunks[residentIndex] = map->residentChunks[--map->nResidentChunks];
+  map->chunks[chunk->row * map->chunkCols + chunk->col] = 0;
+  map->residentBytes -= sizeof(TiledChunk) + chunk->bytes + FlagBytes(map);
+  if (chunk->bytes)
+    free(chunk->gids);
+  free(chunk->obstacleBits);
+  free(chunk);
+}
+
+// Evict least recently used chunks until we're under budget. Chunks touched
+// during the current clock tick are in use and are never evicted.
+static void EvictChunks(TiledMap* map)
+{
+  while (map->residentBytes > map->chunkBudget)
+  {
+    int oldest = -1;
+    for (int i=0; i < map->nResidentChunks; ++i)
+    {
+      TiledChunk* chunk = map->residentChunks[i];
+      if (chunk->lastUsed == map->chunkClock)
+        continue;
+      if (oldest < 0 || chunk->lastUsed < map->residentChunks[oldest]->lastUsed)
+        oldest = i;
+    }
+    if (oldest < 0)
+      break; // everything resident is in view; the budget is too small
+    EvictChunk(map, oldest);
+  }
+}
+
+// Returns the cell's GID in layer 0, or 0 if it's off the map. The cell's
+// GID in another layer is at [layer * map->cellLayerStride].
+Sint16* TiledMap_GetCell(TiledMap* map, int x, int y)
+{
+  if (x < 0 || x >= map->width || y < 0 || y >= map->height)
+    return 0;
+  int col = x >> map->chunkShift, row = y >> map->chunkShift;
+  TiledChunk* chunk = map->chunks[row * map->chunkCols + col];
+  if (!chunk)
+  {
+    chunk = TiledMap_LoadChunk(map, col, row);
+    if (!chunk) return 0;
+  }
+  chunk->lastUsed = map->chunkClock;
+  int chunkX = x & (map->chunkSize - 1), chunkY = y & (map->chunkSize - 1);
+  return chunk->gids + chunkY * map->cellRowStride + chunkX;
+}
+
+Sint16 TiledMap_GetGid(TiledMap* map, int x, int y, int layer)
+{
+  Sint16* cell = TiledMap_GetCell(map, x, y);
+  return cell ? cell[layer * map->cellLayerStride] : 0;
+}
+
+static void TouchChunks(TiledMap* map, int firstCol, int firstRow, int lastCol, int lastRow)
+{
+  if (firstCol < 0) firstCol = 0;
+  if (firstRow < 0) firstRow = 0;
+  if (lastCol >= map->chunkCols) lastCol = map->chunkCols - 1;
+  if (lastRow >= map->chunkRows) lastRow = map->chunkRows - 1;
+  for (int row = firstRow; row <= lastRow; ++row)
+  {
+    for (int col = firstCol; col <= lastCol; ++col)
+    {
+      TiledChunk* chunk = TiledMap_LoadChunk(map, col, row);
+      if (chunk)
+        chunk->lastUsed = map->chunkClock;
+    }
+  }
+}
+
+// Call once per frame with the part of the map in view (in pixels) and the
+// direction the viewer is moving. Makes sure everything in view is resident,
+// loads ahead in the direction of movement, and evicts down to the budget.
+void TiledMap_StreamChunks(TiledMap* map, SDL_Rect* viewRect, struct Coords mov)
+{
+  ++map->chunkClock;
+  int chunkW = map->tileWidth << map->chunkShift;
+  int chunkH = map->tileHeight << map->chunkShift;
+  // Round toward negative infinity so views hanging off the top/left work.
+  int firstCol = viewRect->x >= 0 ? viewRect->x / chunkW : -1;
+  int firstRow = viewRect->y >= 0 ? viewRect->y / chunkH : -1;
+  int lastCol = (viewRect->x + viewRect->w - 1) / chunkW;
+  int lastRow = (viewRect->y + viewRect->h - 1) / chunkH;
+  TouchChunks(map, firstCol, firstRow, lastCol, lastRow);
+  if (mov.x < 0)
+    TouchChunks(map, firstCol - CHUNK_PREFETCH_DISTANCE, firstRow, firstCol - 1, lastRow);
+  else if (mov.x > 0)
+    TouchChunks(map, lastCol + 1, firstRow, lastCol + CHUNK_PREFETCH_DISTANCE, lastRow);
+  if (mov.y < 0)
+    TouchChunks(map, firstCol, firstRow - CHUNK_PREFETCH_DISTANCE, lastCol, firstRow - 1);
+  else if (mov.y > 0)
+    TouchChunks(map, firstCol, lastRow + 1, lastCol, lastRow + CHUNK_PREFETCH_DISTANCE);
+  EvictChunks(map);
+}
+
+// Derives the planes of the resident chunks again. Call after changing the
+// tile properties; chunks loaded later derive their own.
+void TiledMap_DeriveCellFlags(TiledMap* map)
+{
+  for (int i=0; i < map->nResidentChunks; ++i)
+    DeriveChunkFlags(map, map->residentChunks[i]);
+}
+
+// Reads the opacity of n cells from (x, y) rightwards, a chunk at a time.
+// Cells off the map, or in chunks that won't load, are opaque.
+void TiledMap_ReadOpacityRow(TiledMap* map, int x, int y, int n, Uint8* out)
+{
+  int mask = map->chunkSize - 1;
+  for (int i=0; i < n; )
+  {
+    int cellX = x + i;
+    if (y < 0 || y >= map->height || cellX < 0 || cellX >= map->width)
+    {
+      out[i++] = MAX_TILE_OPACITY;
+      continue;
+    }
+    int run = map->chunkSize - (cellX & mask);
+    if (run > n - i) run = n - i;
+    if (run > map->width - cellX) run = map->width - cellX;
+    TiledChunk* chunk = TiledMap_ChunkAt(map, cellX, y);
+    if (!chunk)
+      memset(out + i, MAX_TILE_OPACITY, run);
+    else
+    {
+      const Uint8* nibbles = &chunk->opacityNibbles[(y & mask) * map->opacityStride];
+      for (int k=0, chunkX = cellX & mask; k < run; ++k, ++chunkX)
+        out[i + k] = nibbles[chunkX >> 1] >> ((chunkX & 1) << 2) & 0xF;
+    }
+    i += run;
+  }
+}
+
+// Copies the whole map's obstacle bits into bits, stride words per row, a
+// chunk at a time. Chunks that weren't resident are dropped again
+// afterwards. Cells in chunks that won't load are obstacles.
+void TiledMap_CopyObstacles(TiledMap* map, Uint64* bits, int stride)
+{
+  for (int row=0; row < map->chunkRows; ++row)
+  {
+    for (int col=0; col < map->chunkCols; ++col)
+    {
+      int wasResident = map->chunks[row * map->chunkCols + col] != 0;
+      TiledChunk* chunk = TiledMap_LoadChunk(map, col, row);
+      int firstX = col << map->chunkShift, firstY = row << map->chunkShift;
+      int endX = firstX + map->chunkSize, endY = firstY + map->chunkSize;
+      if (endX > map->width) endX = map->width;
+      if (endY > map->height) endY = map->height;
+      for (int y = firstY; y < endY; ++y)
+      {
+        const Uint64* from = chunk
+          ? &chunk->obstacleBits[(y - firstY) * map->obstacleStride] : 0;
+        for (int x = firstX; x < endX; ++x)
+        {
+          int chunkX = x - firstX;
+          Uint64 bit = (Uint64)1 << (x & 63);
+          if (!from || from[chunkX >> 6] >> (chunkX & 63) & 1)
+            bits[y * stride + (x >> 6)] |= bit;
+          else
+            bits[y * stride + (x >> 6)] &= ~bit;
+        }
+      }
+      if (chunk && !wasResident)
+      {
+        int i = 0;
+        while (map->residentChunks[i] != chunk)
+          ++i;
+        EvictChunk(map, i);
+      }
+    }
+  }
+}
+
+// Call after changing a cell's GIDs.
+void TiledMap_UpdateCellFlags(TiledMap* map, int x, int y)
+{
+  Sint16* cell = TiledMap_GetCell(map, x, y);
+  if (cell)
+    DeriveCellFlags(map, TiledMap_ChunkAt(map, x, y), cell,
+        x & (map->chunkSize - 1), y & (map->chunkSize - 1));
+}
+
+// True if any cell under the rectangle (in map pixels) is an obstacle.
+// Everything off the map is an obstacle.
+int TiledMap_RectHitsObstacle(TiledMap* map, SDL_Rect* rect)
+{
+  if (rect->w <= 0 || rect->h <= 0)
+    return 0;
+  if (rect->x < 0 || rect->y < 0)
+    return 1;
+  int firstX = rect->x / map->tileWidth, lastX = (rect->x + rect->w - 1) / map->tileWidth;
+  int firstY = rect->y / map->tileHeight, lastY = (rect->y + rect->h - 1) / map->tileHeight;
+  if (lastX >= map->width || lastY >= map->height)
+    return 1;
+  for (int y = firstY; y <= lastY; ++y)
+    for (int x = firstX; x <= lastX; ++x)
+      if (TiledMap_IsObstacle(map, x, y))
+        return 1;
+  return 0;
+}
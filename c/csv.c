@@ -0,0 +1,315 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CSV_X86 1
+#endif
+
+// CSV grid parser, for the tile layers that map tools export: one row of
+// comma-separated integers per line.
+//
+// The rows are found first (memchr is quick at that), then parsed in
+// ranges on the job threads, straight into the grid. Within a row, SIMD
+// picks out the commas and checks that a block holds nothing but digits,
+// commas and minus signs; each number in the block is then converted from
+// the 8 bytes at its start in a few multiplies. Anything else, such as the
+// end of a row, goes through the plain C parser, which is also what reports
+// errors.
+
+// Rows parsed per job.
+static const int CSV_ROW_GRAIN = 64;
+
+static int simdLevel = -1; // not yet chosen
+
+typedef struct CsvError {
+  int row, col; // -1 if there's no error
+  const char* problem;
+} CsvError;
+
+typedef struct CsvParse {
+  const char* text;
+  const char* textEnd;
+  const char** rowStarts; // nRows + 1, the last being the end of the text
+  Sint16* cells;
+  int nCols;
+  CsvError* errors; // first error in each chunk of rows
+} CsvParse;
+
+// Uses SIMD up to the given level, or as far as the CPU goes. Returns the
+// level in use.
+int Csv_SetSimd(int level)
+{
+  simdLevel = Simd_Limit(level);
+  return simdLevel;
+}
+
+int Csv_GetSimd()
+{
+  if (simdLevel < 0)
+    Csv_SetSimd(SIMD_AVX2);
+  return simdLevel;
+}
+
+static int RowError(CsvError* error, int col, const char* problem)
+{
+  error->col = col;
+  error->problem = problem;
+  return 0;
+}
+
+// Parses columns firstCol on from p to the end of the row.
+static int ParseRowScalar(const char* p, const char* rowEnd, Sint16* cells,
+    int firstCol, int nCols, CsvError* error)
+{
+  for (int c = firstCol; c < nCols; ++c)
+  {
+    int negative = p < rowEnd && *p == '-';
+    p += negative;
+    const char* digits = p;
+    int value = 0;
+    while (p < rowEnd && (unsigned)(*p - '0') < 10)
+    {
+      value = value * 10 + (*p++ - '0');
+      if (value > 32768)
+        return RowError(error, c, "number out of range");
+    }
+    if (p == digits)
+      return RowError(error, c, "expected a number");
+    value = negative ? -value : value;
+    if (value > SDL_MAX_SINT16)
+      return RowError(error, c, "number out of range");
+    cells[c] = (Sint16)value;
+    if (c < nCols - 1)
+    {
+      if (p == rowEnd)
+        return RowError(error, c + 1, "too few values");
+      if (*p++ != ',')
+        return RowError(error, c, "expected a comma");
+    }
+  }
+  if (p != rowEnd)
+    return RowError(error, nCols - 1, *p == ',' ? "too many values" : "expected a comma");
+  return 1;
+}
+
+#ifdef CSV_X86
+// Converts 1 to 8 digits, starting at digits, with 8 bytes readable there.
+static inline Uint32 ConvertDigits(const char* digits, int nDigits)
+{
+  Uint64 chunk;
+  memcpy(&chunk, digits, 8);
+  // The first digit is in the low byte. Anything borrowed by bytes past the
+  // end is carried upwards, out of the digits, and shifted away here.
+  chunk = (chunk - 0x3030303030303030ull) << (8 * (8 - nDigits));
+  chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FFull;
+  chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFFull;
+  return (Uint32)((chunk * 10000 + (chunk >> 32)) & 0xFFFFFFFF);
+}
+
+// Converts the numbers ending at the commas in a block of all digits,
+// commas and minus signs. Returns the columns converted; it stops at a bad
+// number, leaving it to the scalar parser to report.
+static inline int ConvertBlock(const char* p, Uint32 commas, Uint32 minuses,
+    Sint16* cells, int c, int lastCol, int* consumed)
+{
+  int first = c;
+  int start = 0;
+  while (commas && c < lastCol)
+  {
+    int end = __builtin_ctz(commas);
+    commas &= commas - 1;
+    int negative = p[start] == '-';
+    int nDigits = end - start - negative;
+    // A minus sign only goes at the front, and a number has to fit.
+    Uint32 fieldBits = (Uint32)((1ull << end) - (1ull << (start + negative)));
+    if (nDigits <= 0 || nDigits > 5 || (minuses & fieldBits))
+      break;
+    int value = (int)ConvertDigits(p + start + negative, nDigits);
+    value = negative ? -value : value;
+    if (value > SDL_MAX_SINT16 || value < SDL_MIN_SINT16)
+      break;
+    cells[c++] = (Sint16)value;
+    start = end + 1;
+  }
+  *consumed = start;
+  return c - first;
+}
+
+static int ParseRowSSE2(const char* p, const char* rowEnd, const char* textEnd,
+    Sint16* cells, int nCols, CsvError* error)
+{
+  int c = 0;
+  // Blocks need 8 bytes beyond them for the conversion.
+  while (rowEnd - p >= 16 && textEnd - p >= 16 + 8)
+  {
+    __m128i block = _mm_loadu_si128((const __m128i*)p);
+    __m128i offset = _mm_sub_epi8(block, _mm_set1_epi8('0'));
+    __m128i isDigit = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(9)), offset);
+    Uint32 commas = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8(',')));
+    Uint32 minuses = _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('-')));
+    if ((_mm_movemask_epi8(isDigit) | commas | minuses) != 0xFFFF || !commas)
+      break;
+    int consumed;
+    int converted = ConvertBlock(p, commas, minuses, cells, c, nCols - 1, &consumed);
+    c += converted;
+    p += consumed;
+    if (!converted)
+      break;
+  }
+  return ParseRowScalar(p, rowEnd, cells, c, nCols, error);
+}
+
+__attribute__((target("avx2")))
+static int ParseRowAVX2(const char* p, const char* rowEnd, const char* textEnd,
+    Sint16* cells, int nCols, CsvError* error)
+{
+  int c = 0;
+  while (rowEnd - p >= 32 && textEnd - p >= 32 + 8)
+  {
+    __m256i block = _mm256_loadu_si256((const __m256i*)p);
+    __m256i offset = _mm256_sub_epi8(block, _mm256_set1_epi8('0'));
+    __m256i isDigit = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(9)), offset);
+    Uint32 commas = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(',')));
+    Uint32 minuses = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('-')));
+    if ((_mm256_movemask_epi8(isDigit) | commas | minuses) != 0xFFFFFFFF || !commas)
+      break;
+    int consumed;
+    int converted = ConvertBlock(p, commas, minuses, cells, c, nCols - 1, &consumed);
+    c += converted;
+    p += consumed;
+    if (!converted)
+      break;
+  }
+  return ParseRowScalar(p, rowEnd, cells, c, nCols, error);
+}
+#endif
+
+static void ParseRowsJob(void* data, int chunk, int first, int end)
+{
+  CsvParse* parse = data;
+  CsvError* error = &parse->errors[chunk];
+  int simd = Csv_GetSimd();
+  for (int r = first; r < end; ++r)
+  {
+    const char* p = parse->rowStarts[r];
+    const char* rowEnd = parse->rowStarts[r + 1];
+    // Take off the line ending.
+    if (rowEnd > p && rowEnd[-1] == '\n')
+      --rowEnd;
+    if (rowEnd > p && rowEnd[-1] == '\r')
+      --rowEnd;
+    Sint16* cells = parse->cells + (size_t)r * parse->nCols;
+    int ok;
+    switch (simd)
+    {
+#ifdef CSV_X86
+      case SIMD_AVX2:
+        ok = ParseRowAVX2(p, rowEnd, parse->textEnd, cells, parse->nCols, error);
+        break;
+      case SIMD_SSE2:
+        ok = ParseRowSSE2(p, rowEnd, parse->textEnd, cells, parse->nCols, error);
+        break;
+#endif
+      default:
+        ok = ParseRowScalar(p, rowEnd, cells, 0, parse->nCols, error);
+        break;
+    }
+    if (!ok)
+    {
+      error->row = r;
+      return;
+    }
+  }
+}
+
+// Parses a grid of integers from CSV text, one row per line. nRows and
+// nCols are what's expected, or 0 to take them from the text. Prints an
+// error naming the line and value and returns 0 if the text is malformed.
+// name is what to call the text in errors.
+struct IntGrid* Csv_ParseGrid(const char* text, size_t len, int nRows, int nCols,
+    const char* name)
+{
+  // Find the rows. A last line with no line ending still counts.
+  int nLines = 0, capacity = nRows > 0 ? nRows + 1 : 1024;
+  const char** rowStarts = MallocOrDie(capacity * sizeof(const char*));
+  const char* p = text;
+  const char* end = text + len;
+  while (p < end)
+  {
+    if (nLines + 1 == capacity)
+    {
+      const char** starts = MallocOrDie(2 * capacity * sizeof(const char*));
+      memcpy(starts, rowStarts, nLines * sizeof(const char*));
+      free(rowStarts);
+      rowStarts = starts;
+      capacity *= 2;
+    }
+    rowStarts[nLines++] = p;
+    const char* newline = memchr(p, '\n', end - p);
+    p = newline ? newline + 1 : end;
+  }
+  rowStarts[nLines] = end;
+  if (nRows <= 0)
+    nRows = nLines;
+  if (nLines == 0 || nLines != nRows || nRows > UINT16_MAX)
+  {
+    if (nLines == 0)
+      fprintf(stderr, "Grid '%s' is empty.\n", name);
+    else if (nLines != nRows)
+      fprintf(stderr, "Grid '%s' has %d rows, expected %d.\n", name, nLines, nRows);
+    else
+      fprintf(stderr, "Grid '%s' has more than %d rows.\n", name, UINT16_MAX);
+    free(rowStarts);
+    return 0;
+  }
+  if (nCols <= 0)
+  {
+    nCols = 1;
+    for (const char* q = rowStarts[0]; q < rowStarts[1]; ++q)
+      nCols += *q == ',';
+  }
+  if (nCols > UINT16_MAX)
+  {
+    fprintf(stderr, "Grid '%s' has more than %d columns.\n", name, UINT16_MAX);
+    free(rowStarts);
+    return 0;
+  }
+  struct IntGrid* grid = MallocOrDie(sizeof(struct IntGrid));
+  grid->rows = nRows;
+  grid->cols = nCols;
+  grid->cells = MallocOrDie((size_t)nRows * nCols * sizeof(*grid->cells));
+  int nChunks = Job_ChunkCount(nRows, CSV_ROW_GRAIN);
+  CsvParse parse = { text, end, rowStarts, grid->cells, nCols,
+    MallocOrDie((nChunks + 1) * sizeof(CsvError)) };
+  for (int i=0; i < nChunks; ++i)
+    parse.errors[i].row = -1;
+  Job_ParallelFor(ParseRowsJob, &parse, nRows, CSV_ROW_GRAIN);
+  // Report the first error, as a line number and value number from 1.
+  CsvError* error = 0;
+  for (int i=0; i < nChunks && !error; ++i)
+    if (parse.errors[i].row >= 0)
+      error = &parse.errors[i];
+  if (error)
+  {
+    fprintf(stderr, "Grid '%s', line %d, value %d: %s.\n",
+        name, error->row + 1, error->col + 1, error->problem);
+    FreeIntGrid(grid);
+    grid = 0;
+  }
+  free(parse.errors);
+  free(rowStarts);
+  return grid;
+}
+
+// Reads a CSV grid file (see Csv_ParseGrid).
+struct IntGrid* ReadGridFile(const char* filename, int nRows, int nCols)
+{
+  size_t len;
+  char* text = MapFile(filename, &len);
+  if (!text) return 0;
+  struct IntGrid* grid = Csv_ParseGrid(text, len, nRows, nCols, filename);
+  UnmapFile(text, len);
+  return grid;
+}
@@ -0,0 +1,119 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Converts CSV layer exports (one file per layer, as Tiled's CSV export
+// writes them) into a native-format map.
+//
+// The values in the files are tile IDs in the first tileset, -1 for empty,
+// unless -gids is given, in which case they're already GIDs.
+
+#define MAX_TILESETS 16
+#define MAX_LAYERS 16
+
+static int Usage()
+{
+  fprintf(stderr, "Usage: csv2wtm [-tile WIDTH HEIGHT] [-chunk SIZE] [-threads N] [-gids] [-compress]\n"
+      "    -tileset FILE.wts FIRSTGID [-tileset ...] OUT.wtm LAYER.csv [LAYER.csv ...]\n");
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  int tileWidth = 32, tileHeight = 32, chunkSize = 32, threads = 0, valuesAreGids = 0;
+  int compressed = 0;
+  int nTilesets = 0;
+  Sint32 firstGids[MAX_TILESETS];
+  const char* tilesetFilenames[MAX_TILESETS];
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i)
+  {
+    if (!strcmp(argv[i], "-tile") && i + 2 < argc)
+    {
+      tileWidth = atoi(argv[++i]);
+      tileHeight = atoi(argv[++i]);
+    }
+    else if (!strcmp(argv[i], "-chunk") && i + 1 < argc)
+      chunkSize = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+      threads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-gids"))
+      valuesAreGids = 1;
+    else if (!strcmp(argv[i], "-compress"))
+      compressed = 1;
+    else if (!strcmp(argv[i], "-tileset") && i + 2 < argc
+        && nTilesets < MAX_TILESETS)
+    {
+      tilesetFilenames[nTilesets] = argv[++i];
+      firstGids[nTilesets++] = atoi(argv[++i]);
+    }
+    else
+      return Usage();
+  }
+  int nLayers = argc - i - 1;
+  if (!nTilesets || nLayers < 1 || nLayers > MAX_LAYERS)
+    return Usage();
+  const char* outFilename = argv[i++];
+  if (!Job_Init(threads))
+    return 1;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  struct IntGrid* grids[MAX_LAYERS];
+  const Sint16* layers[MAX_LAYERS];
+  size_t totalBytes = 0;
+  int ok = 1, nRead = 0;
+  for (; nRead < nLayers && ok; ++nRead)
+  {
+    const char* filename = argv[i + nRead];
+    Sint64 size, modified;
+    if (GetFileStamp(filename, &size, &modified))
+      totalBytes += size;
+    // Every layer has to be the size of the first.
+    grids[nRead] = ReadGridFile(filename,
+        nRead ? grids[0]->rows : 0, nRead ? grids[0]->cols : 0);
+    if (!(ok = grids[nRead] != 0))
+      break;
+    if (!valuesAreGids)
+    {
+      Sint16* cells = grids[nRead]->cells;
+      int nCols = grids[nRead]->cols;
+      size_t nCells = (size_t)grids[nRead]->rows * nCols;
+      for (size_t c=0; c < nCells && ok; ++c)
+      {
+        if (cells[c] < 0)
+          cells[c] = 0;
+        else if (cells[c] + firstGids[0] > SDL_MAX_SINT16)
+        {
+          fprintf(stderr, "Grid '%s', line %d, value %d: GID %d is too large.\n",
+              filename, (int)(c / nCols) + 1, (int)(c % nCols) + 1,
+              cells[c] + firstGids[0]);
+          ok = 0;
+        }
+        else
+          cells[c] += firstGids[0];
+      }
+      if (!ok)
+      {
+        FreeIntGrid(grids[nRead]);
+        break;
+      }
+    }
+    layers[nRead] = grids[nRead]->cells;
+  }
+  double parseSeconds = (double)(SDL_GetPerformanceCounter() - startTime)
+    / SDL_GetPerformanceFrequency();
+  if (ok)
+  {
+    TiledNativeSpec spec = { grids[0]->cols, grids[0]->rows, tileWidth, tileHeight,
+      chunkSize, nTilesets, firstGids, tilesetFilenames, nLayers, layers, compressed };
+    ok = TiledMap_WriteNative(outFilename, &spec);
+  }
+  if (ok)
+    printf("CSV2WTM: WROTE %s: %dx%d, %d LAYERS; READ %.1f MB IN %.3f S (%.0f MB/S)\n",
+        outFilename, grids[0]->cols, grids[0]->rows, nLayers,
+        totalBytes / 1e6, parseSeconds, totalBytes / 1e6 / parseSeconds);
+  for (int l=0; l < nRead; ++l)
+    FreeIntGrid(grids[l]);
+  Job_Destroy();
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,310 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DIST_X86 1
+#endif
+
+// Batch distance kernels: distances from one origin to many points, giving
+// exactly what the matching Coords_*Dist function gives for each point.
+// Points are in structure-of-arrays form, like the entity store's
+// positions. There are SSE2 and AVX2 versions, picked at run time by what
+// the CPU has, and plain C for everything else.
+//
+// As with the one-point functions, coordinate differences have to be under
+// 32768 so that squares don't overflow.
+
+enum { DIST_SIMPLE, DIST_APPROX, DIST_EXACT };
+
+static int simdLevel = -1; // not yet chosen
+
+// The given SIMD level, or the highest below it that the CPU has. SIMD
+// code (here and in csv.c) is only built for x86 with GCC or Clang, so it's
+// scalar everywhere else.
+int Simd_Limit(int level)
+{
+  int best = SIMD_SCALAR;
+#ifdef DIST_X86
+  if (SDL_HasAVX2())
+    best = SIMD_AVX2;
+  else if (SDL_HasSSE2())
+    best = SIMD_SSE2;
+#endif
+  return level < best ? level : best;
+}
+
+// Uses SIMD up to the given level, or as far as the CPU goes. Returns the
+// level in use.
+int Coords_SetBatchSimd(int level)
+{
+  simdLevel = Simd_Limit(level);
+  return simdLevel;
+}
+
+int Coords_GetBatchSimd()
+{
+  if (simdLevel < 0)
+    Coords_SetBatchSimd(SIMD_AVX2);
+  return simdLevel;
+}
+
+const char* Coords_BatchSimdName(int level)
+{
+  switch (level)
+  {
+    case SIMD_SSE2: return "SSE2";
+    case SIMD_AVX2: return "AVX2";
+    default: return "Scalar";
+  }
+}
+
+static inline Sint32 Dist1(int kind, Sint32 dx, Sint32 dy)
+{
+  if (dx < 0) dx = -dx;
+  if (dy < 0) dy = -dy;
+  Sint32 max = dx > dy ? dx : dy, min = dx > dy ? dy : dx;
+  switch (kind)
+  {
+    case DIST_SIMPLE: return max;
+    case DIST_APPROX: return (max >> 1) < min ? max + (max >> 2) : max;
+    default: return IntSqrt(dx * dx + dy * dy);
+  }
+}
+
+static void BatchScalar(int kind, struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int first, int n, Sint32* out)
+{
+  for (int i = first; i < n; ++i)
+    out[i] = Dist1(kind, xs[i] - origin.x, ys[i] - origin.y);
+}
+
+#ifdef DIST_X86
+
+// SSE2 has no 32-bit abs, min or max.
+static inline __m128i Abs_SSE2(__m128i v)
+{
+  __m128i sign = _mm_srai_epi32(v, 31);
+  return _mm_sub_epi32(_mm_xor_si128(v, sign), sign);
+}
+
+static inline __m128i Select_SSE2(__m128i mask, __m128i a, __m128i b)
+{
+  return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// floor(sqrt(dx*dx + dy*dy)) in doubles, two lanes at a time; exact for
+// anything that fits in 31 bits.
+static inline __m128i Sqrt2_SSE2(__m128i dx, __m128i dy)
+{
+  __m128d x = _mm_cvtepi32_pd(dx), y = _mm_cvtepi32_pd(dy);
+  __m128d root = _mm_sqrt_pd(_mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)));
+  return _mm_cvttpd_epi32(root);
+}
+
+static void BatchSSE2(int kind, struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out)
+{
+  __m128i ox = _mm_set1_epi32(origin.x), oy = _mm_set1_epi32(origin.y);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i dx = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)&xs[i]), ox);
+    __m128i dy = _mm_sub_epi32(_mm_loadu_si128((const __m128i*)&ys[i]), oy);
+    __m128i result;
+    if (kind == DIST_EXACT)
+    {
+      __m128i low = Sqrt2_SSE2(dx, dy);
+      __m128i high = Sqrt2_SSE2(_mm_unpackhi_epi64(dx, dx), _mm_unpackhi_epi64(dy, dy));
+      result = _mm_unpacklo_epi64(low, high);
+    }
+    else
+    {
+      dx = Abs_SSE2(dx);
+      dy = Abs_SSE2(dy);
+      __m128i xBigger = _mm_cmpgt_epi32(dx, dy);
+      __m128i max = Select_SSE2(xBigger, dx, dy);
+      result = max;
+      if (kind == DIST_APPROX)
+      {
+        __m128i min = Select_SSE2(xBigger, dy, dx);
+        __m128i diagonal = _mm_cmpgt_epi32(min, _mm_srai_epi32(max, 1));
+        result = _mm_add_epi32(max, _mm_and_si128(diagonal, _mm_srai_epi32(max, 2)));
+      }
+    }
+    _mm_storeu_si128((__m128i*)&out[i], result);
+  }
+  BatchScalar(kind, origin, xs, ys, i, n, out);
+}
+
+// floor(sqrt(dx*dx + dy*dy)): a single-precision root, which can be one out
+// either way, then corrected by checking its square and the next one's.
+__attribute__((target("avx2")))
+static inline __m256i Sqrt8_AVX2(__m256i dx, __m256i dy)
+{
+  __m256i squared = _mm256_add_epi32(_mm256_mullo_epi32(dx, dx), _mm256_mullo_epi32(dy, dy));
+  __m256i root = _mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(squared)));
+  // Comparisons give -1 where true.
+  root = _mm256_add_epi32(root, _mm256_cmpgt_epi32(_mm256_mullo_epi32(root, root), squared));
+  __m256i rest = _mm256_sub_epi32(squared, _mm256_mullo_epi32(root, root));
+  return _mm256_sub_epi32(root, _mm256_cmpgt_epi32(rest, _mm256_add_epi32(root, root)));
+}
+
+__attribute__((target("avx2")))
+static void BatchAVX2(int kind, struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out)
+{
+  __m256i ox = _mm256_set1_epi32(origin.x), oy = _mm256_set1_epi32(origin.y);
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i dx = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)&xs[i]), ox);
+    __m256i dy = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)&ys[i]), oy);
+    __m256i result;
+    if (kind == DIST_EXACT)
+      result = Sqrt8_AVX2(dx, dy);
+    else
+    {
+      dx = _mm256_abs_epi32(dx);
+      dy = _mm256_abs_epi32(dy);
+      __m256i max = _mm256_max_epi32(dx, dy);
+      result = max;
+      if (kind == DIST_APPROX)
+      {
+        __m256i min = _mm256_min_epi32(dx, dy);
+        __m256i diagonal = _mm256_cmpgt_epi32(min, _mm256_srai_epi32(max, 1));
+        result = _mm256_add_epi32(max, _mm256_and_si256(diagonal, _mm256_srai_epi32(max, 2)));
+      }
+    }
+    _mm256_storeu_si256((__m256i*)&out[i], result);
+  }
+  BatchScalar(kind, origin, xs, ys, i, n, out);
+}
+
+#endif
+
+static void Batch(int kind, struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out)
+{
+  switch (Coords_GetBatchSimd())
+  {
+#ifdef DIST_X86
+    case SIMD_AVX2: BatchAVX2(kind, origin, xs, ys, n, out); break;
+    case SIMD_SSE2: BatchSSE2(kind, origin, xs, ys, n, out); break;
+#endif
+    default: BatchScalar(kind, origin, xs, ys, 0, n, out); break;
+  }
+}
+
+void Coords_BatchSimpleApproxDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out)
+{
+  Batch(DIST_SIMPLE, origin, xs, ys, n, out);
+}
+
+void Coords_BatchApproxDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out)
+{
+  Batch(DIST_APPROX, origin, xs, ys, n, out);
+}
+
+// Coords_ExactDist and Coords_FloatDist agree wherever squares fit, so
+// they share a kernel.
+void Coords_BatchExactDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out)
+{
+  Batch(DIST_EXACT, origin, xs, ys, n, out);
+}
+
+void Coords_BatchFloatDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out)
+{
+  Batch(DIST_EXACT, origin, xs, ys, n, out);
+}
+
+static int WithinRadiusScalar(struct Coords origin, const Sint32* xs, const Sint32* ys,
+    int first, int n, int radius, int* indexes, int nFound)
+{
+  Sint64 radiusSquared = (Sint64)radius * radius;
+  for (int i = first; i < n; ++i)
+  {
+    Sint64 dx = xs[i] - origin.x, dy = ys[i] - origin.y;
+    if (dx * dx + dy * dy <= radiusSquared)
+      indexes[nFound++] = i;
+  }
+  return nFound;
+}
+
+#ifdef DIST_X86
+
+// The squares are summed with one multiply-add of 16-bit halves, so
+// differences are clamped to 32767 first; that's further than any radius
+// allowed, so it can't change the answer.
+static int WithinRadiusSSE2(struct Coords origin, const Sint32* xs, const Sint32* ys,
+    int n, int radius, int* indexes)
+{
+  __m128i ox = _mm_set1_epi32(origin.x), oy = _mm_set1_epi32(origin.y);
+  __m128i limit = _mm_set1_epi32(radius * radius + 1);
+  int nFound = 0, i = 0;
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i dx = Abs_SSE2(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)&xs[i]), ox));
+    __m128i dy = Abs_SSE2(_mm_sub_epi32(_mm_loadu_si128((const __m128i*)&ys[i]), oy));
+    __m128i packed = _mm_packs_epi32(dx, dy); // dx0..dx3, dy0..dy3
+    __m128i pairs = _mm_unpacklo_epi16(packed, _mm_unpackhi_epi64(packed, packed));
+    __m128i squares = _mm_madd_epi16(pairs, pairs);
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(squares, limit)));
+    while (mask)
+    {
+      indexes[nFound++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+  return WithinRadiusScalar(origin, xs, ys, i, n, radius, indexes, nFound);
+}
+
+__attribute__((target("avx2")))
+static int WithinRadiusAVX2(struct Coords origin, const Sint32* xs, const Sint32* ys,
+    int n, int radius, int* indexes)
+{
+  __m256i ox = _mm256_set1_epi32(origin.x), oy = _mm256_set1_epi32(origin.y);
+  __m256i limit = _mm256_set1_epi32(radius * radius + 1);
+  __m256i clamp = _mm256_set1_epi32(32767);
+  int nFound = 0, i = 0;
+  for (; i + 8 <= n; i += 8)
+  {
+    __m256i dx = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)&xs[i]), ox));
+    __m256i dy = _mm256_abs_epi32(_mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)&ys[i]), oy));
+    // dy in the high half of each lane, so one multiply-add sums the squares.
+    __m256i pairs = _mm256_or_si256(_mm256_min_epu32(dx, clamp),
+        _mm256_slli_epi32(_mm256_min_epu32(dy, clamp), 16));
+    __m256i squares = _mm256_madd_epi16(pairs, pairs);
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(limit, squares)));
+    while (mask)
+    {
+      indexes[nFound++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+  return WithinRadiusScalar(origin, xs, ys, i, n, radius, indexes, nFound);
+}
+
+#endif
+
+// Stores the indexes of the points no further than radius (under 32767)
+// from origin, in order, and returns how many there are. indexes needs
+// room for n.
+int Coords_BatchWithinRadius(struct Coords origin, const Sint32* xs, const Sint32* ys,
+    int n, int radius, int* indexes)
+{
+  assert(radius >= 0 && radius < 32767);
+  switch (Coords_GetBatchSimd())
+  {
+#ifdef DIST_X86
+    case SIMD_AVX2: return WithinRadiusAVX2(origin, xs, ys, n, radius, indexes);
+    case SIMD_SSE2: return WithinRadiusSSE2(origin, xs, ys, n, radius, indexes);
+#endif
+    default: return WithinRadiusScalar(origin, xs, ys, 0, n, radius, indexes, 0);
+  }
+}
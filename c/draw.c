@@ -24,7 +24,11 @@ static const int VIEW_LIGHT_THRESHOLD = 0x20;
 // the necessary size of the view on the screen.
 static int VIEW_DIAMETER;
 static int VIEW_CENTER;
-static const int MAX_LIGHT = 0xFF;
+
+// Size (in tiles) of the square map regions pre-rendered into textures.
+static const int RENDER_CHUNK_TILES = 16;
+// Video memory for pre-rendered regions unless the game sets a budget.
+static const size_t DEFAULT_RENDER_CHUNK_BUDGET = 32 << 20;
 
 // Determines whether game displays fullscreen. TODO: Make configurable.
 static const int FULLSCREEN = 0;
@@ -33,11 +37,70 @@ static struct Display {
   SDL_Window* window;
   SDL_Surface* screen;
   SDL_Renderer* renderer;
-  TiledTile** tileCache;
-  int* tileLighting;
+  // GID indexes, one VIEW_DIAMETER^2 plane per layer. The planes wrap
+  // around: map cell (x,y) lives at (x mod VIEW_DIAMETER, y mod VIEW_DIAMETER),
+  // so scrolling by a tile only needs the newly exposed row or column.
+  Sint16* tileCache;
+  int tileCacheValid;
+  Coords tileCacheCenter;
+  // Brightness of each view tile, row by row, from Light_Compute.
+  const Uint8* tileLighting;
+  // One texel per view tile, black with alpha for darkness, stretched over
+  // the map with linear filtering. Updated when tileLighting changes.
+  SDL_Texture* lightmap;
+  Uint32* lightmapPixels;
+  int lightmapDirty;
   Coords tileCacheMapPos;
 } display;
 
+static struct TileCacheStats {
+  int cellsRefreshed; // during the last frame
+  Uint32 frames, framesRefreshed, fullRebuilds;
+  Uint64 totalCellsRefreshed;
+} tileCacheStats;
+
+static struct SpriteBatch {
+  SDL_Texture* tex;
+  float texScaleX, texScaleY; // texels to texture coordinates
+  SDL_Rect mapView, clipRect;
+  SDL_Vertex* vertices; // four per sprite
+  int* indices; // six per sprite, always the same pattern
+  int nSprites, capacity;
+} batch;
+
+// The map's layers never change during play except through InvalidateMapCell,
+// so they're rendered once per NxN tile region into target textures and the
+// view is drawn with a few blits. Regions are rendered when first seen and
+// evicted least recently used first to stay within the budget.
+typedef struct RenderChunk {
+  SDL_Texture* tex; // 0 unless resident
+  int valid; // texture contents are up to date
+  Uint32 lastUsed;
+} RenderChunk;
+
+static struct RenderChunkCache {
+  int enabled; // false if the renderer can't render to textures
+  TiledMap* map;
+  int cols, rows;
+  int pixelW, pixelH; // size of a region in pixels
+  RenderChunk* chunks;
+  RenderChunk** resident;
+  int nResident;
+  size_t residentBytes, budget;
+  Uint32 clock;
+  Uint32 renders, evictions;
+} renderChunks;
+
+// Draw calls for the map, lighting and characters, and how many times they
+// switched to a different texture.
+static struct RenderStats {
+  int drawCalls, binds; // so far this frame
+  int lastFrameDrawCalls, lastFrameBinds;
+  Uint32 frames;
+  Uint64 totalDrawCalls, totalBinds;
+  SDL_Texture* boundTex; // used by the last draw call
+} renderStats;
+
 static struct Layout {
   int isHorizontal;
   SDL_Rect mapDisplayRect, uiDisplayRect;
@@ -47,6 +110,7 @@ static struct Layout {
 } layout;
 
 static SDL_Texture* quarterCircle;
+static SDL_Texture* placeholder; // drawn for images still loading
 
 #define RGB_TO_RGBA(COLOR) (((COLOR) << 8) | 0xFF)
 
@@ -55,7 +119,9 @@ const Uint32 COLOR_UI_PANE = 0x202040;
 const Uint32 COLOR_BLACK = 0;
 
 // PROTOTYPES
-void CalculateLight(int tileX, int tileY, Coords tileShift, TiledMap* map);
+void InitRenderChunks(TiledMap* map);
+static void FreeRenderChunks();
+Sint16* GetTile(TiledMap* map, int x, int y);
 
 void SetColor(Uint32 color)
 {
@@ -68,6 +134,17 @@ void SetColor(Uint32 color)
 void DestroyDisplay()
 {
   // TODO: Destroy textures and surfaces
+  Atlas_Destroy();
+  if (placeholder)
+    SDL_DestroyTexture(placeholder);
+  placeholder = 0;
+  Light_Destroy();
+  FreeRenderChunks();
+  if (display.lightmap)
+    SDL_DestroyTexture(display.lightmap);
+  free(display.lightmapPixels);
+  display.lightmap = 0;
+  display.lightmapPixels = 0;
   SDL_DestroyRenderer(display.renderer);
   SDL_DestroyWindow(display.window);
 }
@@ -82,6 +159,60 @@ SDL_Texture* SurfaceToTexture(SDL_Surface* surface, int freeSurfaceWhenDone)
   return texture;
 }
 
+// Largest texture the renderer can make, or 0 if it doesn't say.
+int GetMaxTextureSize()
+{
+  SDL_RendererInfo info;
+  if (!display.renderer || SDL_GetRendererInfo(display.renderer, &info))
+    return 0;
+  return info.max_texture_width < info.max_texture_height
+    ? info.max_texture_width : info.max_texture_height;
+}
+
+// The renderer's favourite 32-bit format with alpha, which its textures can
+// be made from without conversion. ARGB8888 if there's no renderer.
+Uint32 GetPreferredTextureFormat()
+{
+  SDL_RendererInfo info;
+  if (display.renderer && !SDL_GetRendererInfo(display.renderer, &info))
+  {
+    for (Uint32 i=0; i < info.num_texture_formats; ++i)
+    {
+      Uint32 format = info.texture_formats[i];
+      if (!SDL_ISPIXELFORMAT_FOURCC(format) && SDL_BYTESPERPIXEL(format) == 4
+          && SDL_ISPIXELFORMAT_ALPHA(format))
+        return format;
+    }
+  }
+  return SDL_PIXELFORMAT_ARGB8888;
+}
+
+int HasRenderer()
+{
+  return display.renderer != 0;
+}
+
+// A grey box with a lighter edge.
+static SDL_Texture* CreatePlaceholder()
+{
+  SDL_Surface* sfc = SDL_CreateRGBSurfaceWithFormat(0, PLACEHOLDER_SIZE, PLACEHOLDER_SIZE,
+      32, SDL_PIXELFORMAT_ARGB8888);
+  if (!sfc)
+    return 0;
+  SDL_FillRect(sfc, 0, 0xC0A0A0A0);
+  SDL_Rect inside = { 2, 2, PLACEHOLDER_SIZE - 4, PLACEHOLDER_SIZE - 4 };
+  SDL_FillRect(sfc, &inside, 0x80606060);
+  return SurfaceToTexture(sfc, 1);
+}
+
+static void CountBind(SDL_Texture* tex)
+{
+  if (tex == renderStats.boundTex)
+    return;
+  renderStats.boundTex = tex;
+  ++renderStats.binds;
+}
+
 int InitDisplay(
     const char* windowName, int screenW, int screenH,
     int minFrameRateCap, int* frameRateCap)
@@ -102,6 +233,8 @@ int InitDisplay(
     return 0;
   }
   int vsync;
+  if (displayMode.refresh_rate <= 0) // unknown, as with the dummy driver
+    displayMode.refresh_rate = minFrameRateCap;
   if (displayMode.refresh_rate >= minFrameRateCap)
   {
     *frameRateCap = 0;
@@ -116,6 +249,9 @@ int InitDisplay(
   }
   display.renderer = SDL_CreateRenderer(display.window, -1,
       SDL_RENDERER_ACCELERATED | (vsync * SDL_RENDERER_PRESENTVSYNC));
+  // Offscreen video drivers only have the software renderer.
+  if (!display.renderer)
+    display.renderer = SDL_CreateRenderer(display.window, -1, SDL_RENDERER_SOFTWARE);
   if (!display.renderer)
   {
     fprintf(stderr, "Create renderer failed: %s\n", SDL_GetError());
@@ -128,6 +264,12 @@ int InitDisplay(
     fprintf(stderr, "Failed to convert circle surface to texture.\n");
     return 0;
   }
+  placeholder = CreatePlaceholder();
+  if (!placeholder)
+  {
+    fprintf(stderr, "Unable to create placeholder texture.\n");
+    return 0;
+  }
   VIEW_DIAMETER = 2 * VIEW_END_DISTANCE + 1;
   VIEW_CENTER = VIEW_DIAMETER / 2;
   return 1;
@@ -149,23 +291,49 @@ int InitTileCache(TiledMap* map)
 {
   assert(map);
   int cacheSize = 2 * VIEW_END_DISTANCE + 1;
-  display.tileCache = MallocOrDie(cacheSize * map->nLayers * sizeof(TiledTile**));
-  display.tileLighting = MallocOrDie(cacheSize * sizeof(int));
+  display.tileCache = MallocOrDie(cacheSize * cacheSize * map->nLayers * sizeof(Sint16));
+  display.tileCacheValid = 0;
+  display.tileLighting = 0;
+  Light_Init(VIEW_END_DISTANCE, VIEW_DROPOFF_DISTANCE, VIEW_LIGHT_THRESHOLD);
+  if (!display.lightmap)
+  {
+    display.lightmap = SDL_CreateTexture(display.renderer, SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_STREAMING, cacheSize, cacheSize);
+    if (!display.lightmap)
+    {
+      fprintf(stderr, "Unable to create lightmap texture. %s\n", SDL_GetError());
+      return 0;
+    }
+    SDL_SetTextureBlendMode(display.lightmap, SDL_BLENDMODE_BLEND);
+    SDL_SetTextureScaleMode(display.lightmap, SDL_ScaleModeLinear);
+    display.lightmapPixels = MallocOrDie(cacheSize * cacheSize * sizeof(Uint32));
+  }
+  display.lightmapDirty = 1;
+  InitRenderChunks(map);
   return 1;
 }
 
+// Loads an image's surface and, if asked, its texture. Without a renderer
+// (running headless), only the surface is loaded. While the atlas is being
+// collected, the texture is left for Atlas_Build to make. Images in the
+// asset bundle are taken from there rather than decoded.
 int LoadImage(struct Image* img, int createTexture)
 {
   assert(img);
   assert(img->path);
-  SDL_Surface* loadedSurface = IMG_Load(img->path);
+  SDL_Surface* loadedSurface = Bundle_LoadSurface(img->path);
+  if (!loadedSurface)
+    loadedSurface = IMG_Load(img->path);
   if (!loadedSurface)
   {
     fprintf(stderr, "Failed to load image '%s'. %s\n", img->path, IMG_GetError());
     return 0;
   }
   img->sfc = loadedSurface;
-  if (createTexture)
+  Bundle_Record(img->path, img->sfc);
+  if (createTexture && display.renderer && Atlas_IsCollecting())
+    Atlas_Add(img->sfc);
+  else if (createTexture && display.renderer)
   {
     img->tex = SurfaceToTexture(img->sfc, 0);
     if (!img->tex)
@@ -177,228 +345,526 @@ int LoadImage(struct Image* img, int createTexture)
   return 1;
 }
 
-int DrawTextureWithOffset(SDL_Rect* mapViewRect, SDL_Texture* texture,
-    SDL_Rect* textureRect, int textureOffsetX, int textureOffsetY)
+// Sprites are drawn through a batch: quads are collected per texture and
+// submitted with one SDL_RenderGeometry call when the texture changes or
+// the batch ends. Instead of cutting each sprite down to the viewport, the
+// whole batch is clipped by the renderer.
+static void Batch_Flush()
+{
+  if (batch.nSprites == 0)
+    return;
+  SDL_RenderSetClipRect(display.renderer, &batch.clipRect);
+  CountBind(batch.tex);
+  SDL_RenderGeometry(display.renderer, batch.tex, batch.vertices, 4 * batch.nSprites,
+      batch.indices, 6 * batch.nSprites);
+  SDL_RenderSetClipRect(display.renderer, 0);
+  ++renderStats.drawCalls;
+  batch.nSprites = 0;
+}
+
+static void Batch_Grow()
 {
-  SDL_Rect intersectRect;
-  int intersects =
-    (SDL_TRUE == SDL_IntersectRect(mapViewRect, textureRect, &intersectRect));
-  if (intersects)
+  int capacity = batch.capacity ? 2 * batch.capacity : 1024;
+  SDL_Vertex* vertices = MallocOrDie(4 * capacity * sizeof(SDL_Vertex));
+  int* indices = MallocOrDie(6 * capacity * sizeof(int));
+  if (batch.nSprites)
+    memcpy(vertices, batch.vertices, 4 * batch.nSprites * sizeof(SDL_Vertex));
+  for (int i=0; i < capacity; ++i)
   {
-    SDL_Rect sourceRect = {
-      intersectRect.x - textureRect->x + textureOffsetX,
-      intersectRect.y - textureRect->y + textureOffsetY,
-      intersectRect.w, intersectRect.h };
-    SDL_Rect screenDestRect = {
-      intersectRect.x - mapViewRect->x,
-      intersectRect.y - mapViewRect->y,
-      intersectRect.w, intersectRect.h };
-    SDL_RenderCopy(display.renderer, texture, &sourceRect, &screenDestRect);
+    // Two triangles per quad: top-left, top-right, bottom-right, bottom-left.
+    int* quad = &indices[6 * i];
+    quad[0] = 4 * i; quad[1] = 4 * i + 1; quad[2] = 4 * i + 2;
+    quad[3] = 4 * i; quad[4] = 4 * i + 2; quad[5] = 4 * i + 3;
   }
-  return intersects;
+  free(batch.vertices);
+  free(batch.indices);
+  batch.vertices = vertices;
+  batch.indices = indices;
+  batch.capacity = capacity;
 }
 
-// Arguments:
-// - mapViewRect is the position of the screen (viewport) relative to the map.
-// - texture is the texture to draw.
-// - textureRect is the position/size of the texture relative to the map.
-// Summary:
-// Finds the intersection of the viewport with the texture and draws the visible part.
-int DrawTexture(SDL_Rect* mapViewRect, SDL_Texture* texture, SDL_Rect* textureRect)
+// Starts a batch of sprites positioned on the map. mapViewRect is the
+// position of the screen (viewport) relative to the map.
+void Batch_Begin(SDL_Rect* mapViewRect)
 {
-  return DrawTextureWithOffset(mapViewRect, texture, textureRect, 0, 0);
+  batch.mapView = *mapViewRect;
+  batch.clipRect.x = 0;
+  batch.clipRect.y = 0;
+  batch.clipRect.w = mapViewRect->w;
+  batch.clipRect.h = mapViewRect->h;
+  batch.nSprites = 0;
+  batch.tex = 0;
 }
 
-int ReduceBrightness(int brightness, int tileOpacity)
+// Adds a sprite. textureRect is its position and size on the map, and
+// (textureX, textureY) is where it starts within the texture.
+void Batch_Add(SDL_Texture* texture, SDL_Rect* textureRect, int textureX, int textureY)
 {
-  switch (tileOpacity)
+  SDL_Rect* view = &batch.mapView;
+  if (textureRect->x >= view->x + view->w || textureRect->x + textureRect->w <= view->x
+      || textureRect->y >= view->y + view->h || textureRect->y + textureRect->h <= view->y)
+    return; // entirely out of view
+  if (texture != batch.tex)
   {
-    case 0: break;
-    case 1: brightness -= brightness >> 3; break;
-    case 2: brightness -= brightness >> 2; break;
-    case 3: brightness >>= 2; break;
-    case 4: brightness >>= 3; break;
-    case 5: brightness >>= 4; break;
-    case 6: brightness >>= 5; break;
-    case 7: brightness = 0; break;
-    default: fprintf(stderr, "Invalid opacity level: %d\n", tileOpacity); break;
+    Batch_Flush();
+    batch.tex = texture;
+    int w, h;
+    SDL_QueryTexture(texture, 0, 0, &w, &h);
+    batch.texScaleX = 1.0f / w;
+    batch.texScaleY = 1.0f / h;
   }
-  return brightness;
+  if (batch.nSprites == batch.capacity)
+    Batch_Grow();
+  float x0 = textureRect->x - view->x, y0 = textureRect->y - view->y;
+  float x1 = x0 + textureRect->w, y1 = y0 + textureRect->h;
+  float u0 = textureX * batch.texScaleX, v0 = textureY * batch.texScaleY;
+  float u1 = (textureX + textureRect->w) * batch.texScaleX;
+  float v1 = (textureY + textureRect->h) * batch.texScaleY;
+  SDL_Color white = { 0xFF, 0xFF, 0xFF, 0xFF };
+  SDL_Vertex* v = &batch.vertices[4 * batch.nSprites++];
+  v[0] = (SDL_Vertex){ { x0, y0 }, white, { u0, v0 } };
+  v[1] = (SDL_Vertex){ { x1, y0 }, white, { u1, v0 } };
+  v[2] = (SDL_Vertex){ { x1, y1 }, white, { u1, v1 } };
+  v[3] = (SDL_Vertex){ { x0, y1 }, white, { u0, v1 } };
+}
+
+void Batch_End()
+{
+  Batch_Flush();
+  batch.tex = 0;
+}
+
+void PrintRenderStats()
+{
+  double frames = renderStats.frames ? renderStats.frames : 1;
+  printf("RENDER: last frame=%d map draw calls, %d texture binds;"
+      " %.1f and %.1f per frame on average\n",
+      renderStats.lastFrameDrawCalls, renderStats.lastFrameBinds,
+      renderStats.totalDrawCalls / frames, renderStats.totalBinds / frames);
+  if (renderChunks.enabled)
+    printf("MAP TEXTURES: %d resident (%u KB of %u KB); %u rendered, %u evicted\n",
+        renderChunks.nResident, (unsigned)(renderChunks.residentBytes >> 10),
+        (unsigned)(renderChunks.budget >> 10), renderChunks.renders, renderChunks.evictions);
+}
+
+// Position of a map row or column in the wrapped-around tile cache.
+static int WrapToView(int n)
+{
+  int wrapped = n % VIEW_DIAMETER;
+  return wrapped < 0 ? wrapped + VIEW_DIAMETER : wrapped;
 }
 
+static void RefreshTileCacheCell(TiledMap* map, int mapCol, int mapRow)
+{
+  int cachePlaneSize = VIEW_DIAMETER * VIEW_DIAMETER;
+  Sint16* cachePtr = display.tileCache
+    + WrapToView(mapRow) * VIEW_DIAMETER + WrapToView(mapCol);
+  // Off the edge of the map there's no cell.
+  Sint16* cell = GetTile(map, mapCol, mapRow);
+  for (int layer=0; layer < map->nLayers; ++layer)
+  {
+    cachePtr[layer * cachePlaneSize] = cell
+      ? TiledMap_GidIndex(map, cell[layer * map->cellLayerStride]) : 0;
+  }
+  ++tileCacheStats.cellsRefreshed;
+}
+
+// Brings the tile cache up to date for the view. Does nothing unless the
+// view has moved to a different center tile, and then only fetches the
+// rows and columns that scrolled into view.
 void BuildTileCache(TiledMap* map, SDL_Rect* mapViewRect)
 {
+  ++tileCacheStats.frames;
+  tileCacheStats.cellsRefreshed = 0;
   Coords mapViewCenter = {
     mapViewRect->x + mapViewRect->w / 2, mapViewRect->y + mapViewRect->h / 2 };
   Coords centerTile = { mapViewCenter.x / map->tileWidth, mapViewCenter.y / map->tileHeight };
-  Coords cacheCenterPoint = {
-    centerTile.x * map->tileWidth + map->tileWidth / 2,
-    centerTile.y * map->tileHeight + map->tileHeight / 2 };
-  Coords tileShift = Coords_Sub(mapViewCenter, cacheCenterPoint);
+  if (display.tileCacheValid
+      && centerTile.x == display.tileCacheCenter.x
+      && centerTile.y == display.tileCacheCenter.y)
+    return;
   int firstVisibleRow = centerTile.y - VIEW_END_DISTANCE;
   int firstVisibleCol = centerTile.x - VIEW_END_DISTANCE;
   display.tileCacheMapPos.x = firstVisibleCol * map->tileWidth;
   display.tileCacheMapPos.y = firstVisibleRow * map->tileHeight;
-  int nVisibleRows = 2 * VIEW_END_DISTANCE + 1;
-  int nVisibleCols = nVisibleRows;
-  int nTilesInRow = map->nLayers * map->width;
-  int firstTileOffset = nTilesInRow * firstVisibleRow + map->nLayers * firstVisibleCol;
-  TiledTile** nextRowFirstTile = map->layerTiles + firstTileOffset;
-  TiledTile** tileCachePtr = display.tileCache;
-  for (int r=0;
-      r < 2 * VIEW_END_DISTANCE + 1;
-      ++r)
-  {
-    TiledTile** tile = nextRowFirstTile;
-    nextRowFirstTile += nTilesInRow;
-    int mapRow = firstVisibleRow + r;
-    for (int c=0;
-        c < 2 * VIEW_END_DISTANCE + 1;
-        ++c)
+  int dx = centerTile.x - display.tileCacheCenter.x;
+  int dy = centerTile.y - display.tileCacheCenter.y;
+  if (!display.tileCacheValid || Abs(dx) >= VIEW_DIAMETER || Abs(dy) >= VIEW_DIAMETER)
+  {
+    for (int r=0; r < VIEW_DIAMETER; ++r)
+      for (int c=0; c < VIEW_DIAMETER; ++c)
+        RefreshTileCacheCell(map, firstVisibleCol + c, firstVisibleRow + r);
+    ++tileCacheStats.fullRebuilds;
+  }
+  else
+  {
+    // Columns that scrolled into view, over all rows.
+    int firstNewCol = dx > 0 ? firstVisibleCol + VIEW_DIAMETER - dx : firstVisibleCol;
+    int endNewCol = firstNewCol + Abs(dx);
+    for (int r=0; r < VIEW_DIAMETER; ++r)
+      for (int mapCol = firstNewCol; mapCol < endNewCol; ++mapCol)
+        RefreshTileCacheCell(map, mapCol, firstVisibleRow + r);
+    // Rows that scrolled into view, skipping the columns already done.
+    int firstNewRow = dy > 0 ? firstVisibleRow + VIEW_DIAMETER - dy : firstVisibleRow;
+    int endNewRow = firstNewRow + Abs(dy);
+    for (int mapRow = firstNewRow; mapRow < endNewRow; ++mapRow)
     {
-      int mapCol = firstVisibleCol + nVisibleCols;
-      for (int layer=0;
-          layer < map->nLayers;
-          ++layer, ++tile, ++tileCachePtr)
+      for (int c=0; c < VIEW_DIAMETER; ++c)
       {
-        if (mapRow < 0 || mapRow >= map->height
-            || mapCol < 0 || mapCol >= map->width)
-        {
-          *tileCachePtr = 0;
-        }
-        else
-        {
-          *tileCachePtr = *tile;
-        }
+        int mapCol = firstVisibleCol + c;
+        if (mapCol < firstNewCol || mapCol >= endNewCol)
+          RefreshTileCacheCell(map, mapCol, mapRow);
       }
     }
   }
-  // The tile that the player is standing on is always fully lit.
-  display.tileLighting[VIEW_DIAMETER * VIEW_CENTER + VIEW_CENTER] = MAX_LIGHT;
-  for (int radius=1; radius <= VIEW_END_DISTANCE; ++radius)
+  display.tileCacheCenter = centerTile;
+  display.tileCacheValid = 1;
+  ++tileCacheStats.framesRefreshed;
+  tileCacheStats.totalCellsRefreshed += tileCacheStats.cellsRefreshed;
+  // Lighting is relative to the center tile, so it only changes with it.
+  display.tileLighting = Light_Compute(map, centerTile.x, centerTile.y);
+  display.lightmapDirty = 1;
+}
+
+void PrintTileCacheStats()
+{
+  printf("TILE CACHE: last frame=%d cells; %u of %u frames refreshed"
+      " (%u full rebuilds); %.1f cells per refresh\n",
+      tileCacheStats.cellsRefreshed, tileCacheStats.framesRefreshed,
+      tileCacheStats.frames, tileCacheStats.fullRebuilds,
+      tileCacheStats.framesRefreshed
+        ? (double)tileCacheStats.totalCellsRefreshed / tileCacheStats.framesRefreshed : 0.0);
+  LightStats lightStats = Light_GetStats();
+  printf("LIGHT: %u lookups, %u cache hits, %u computed; %.1f cells per compute\n",
+      lightStats.lookups, lightStats.hits, lightStats.computes,
+      lightStats.computes ? (double)lightStats.cellsProcessed / lightStats.computes : 0.0);
+}
+
+Sint16* GetTile(TiledMap* map, int x, int y)
+{
+  return TiledMap_GetCell(map, x, y);
+}
+
+static void FreeRenderChunk(RenderChunk* chunk)
+{
+  SDL_DestroyTexture(chunk->tex);
+  chunk->tex = 0;
+  chunk->valid = 0;
+  renderChunks.residentBytes -= (size_t)renderChunks.pixelW * renderChunks.pixelH * 4;
+}
+
+static void FreeRenderChunks()
+{
+  for (int i=0; i < renderChunks.nResident; ++i)
+    FreeRenderChunk(renderChunks.resident[i]);
+  renderChunks.nResident = 0;
+  free(renderChunks.chunks);
+  free(renderChunks.resident);
+  renderChunks.chunks = 0;
+  renderChunks.resident = 0;
+}
+
+void InitRenderChunks(TiledMap* map)
+{
+  FreeRenderChunks();
+  renderChunks.enabled = SDL_RenderTargetSupported(display.renderer);
+  if (!renderChunks.enabled)
   {
-    for (int t=0; t <= radius; ++t)
-    {
-      CalculateLight(centerTile.x + t, centerTile.y + radius, tileShift, map);
-      CalculateLight(centerTile.x + radius, centerTile.y + t, tileShift, map);
-      CalculateLight(centerTile.x - t, centerTile.y - radius, tileShift, map);
-      CalculateLight(centerTile.x - radius, centerTile.y - t, tileShift, map);
-    }
+    fprintf(stderr, "Renderer can't render to textures; drawing the map tile by tile.\n");
+    return;
   }
+  renderChunks.map = map;
+  renderChunks.cols = (map->width + RENDER_CHUNK_TILES - 1) / RENDER_CHUNK_TILES;
+  renderChunks.rows = (map->height + RENDER_CHUNK_TILES - 1) / RENDER_CHUNK_TILES;
+  renderChunks.pixelW = RENDER_CHUNK_TILES * map->tileWidth;
+  renderChunks.pixelH = RENDER_CHUNK_TILES * map->tileHeight;
+  int nChunks = renderChunks.cols * renderChunks.rows;
+  renderChunks.chunks = MallocOrDie(nChunks * sizeof(RenderChunk));
+  renderChunks.resident = MallocOrDie(nChunks * sizeof(RenderChunk*));
+  renderChunks.residentBytes = 0;
+  if (!renderChunks.budget)
+    renderChunks.budget = DEFAULT_RENDER_CHUNK_BUDGET;
 }
 
-TiledTile** GetTile(TiledMap* map, int x, int y)
+void SetRenderChunkBudget(size_t bytes)
 {
-  int tileOffset = (y * map->width + x) * map->nLayers;
-  TiledTile** tile = map->layerTiles + tileOffset;
-  return tile;
+  renderChunks.budget = bytes;
 }
 
-void CalculateLight(int tileX, int tileY, Coords tileShift, TiledMap* map)
+// Call after changing the map cell at (x, y): redraws it from the map next
+// frame, and updates its collision, the lighting around it and the path
+// clusters it's in.
+void InvalidateMapCell(TiledMap* map, int x, int y)
 {
-  int dx = (VIEW_CENTER - tileX) * map->tileWidth + tileShift.x;
-  int dy = (VIEW_CENTER - tileY) * map->tileHeight + tileShift.y;
-  int dxSquare = dx * dx;
-  int dySquare = dy * dy;
-  int distance = (int)sqrt(dxSquare + dySquare);
-  int nextTileX, nextTileY;
-  if (dxSquare > dySquare)
+  if (renderChunks.enabled && x >= 0 && x < map->width && y >= 0 && y < map->height)
   {
-    nextTileX = tileX - SigNum(dx);
-    nextTileY = tileY;
+    int col = x / RENDER_CHUNK_TILES, row = y / RENDER_CHUNK_TILES;
+    renderChunks.chunks[row * renderChunks.cols + col].valid = 0;
   }
-  else
+  TiledMap_UpdateCellFlags(map, x, y);
+  Light_InvalidateTile(x, y);
+  Path_InvalidateTile(x, y);
+  if (display.tileCacheValid
+      && Abs(x - display.tileCacheCenter.x) <= VIEW_END_DISTANCE
+      && Abs(y - display.tileCacheCenter.y) <= VIEW_END_DISTANCE)
+  {
+    RefreshTileCacheCell(map, x, y);
+    display.tileLighting =
+      Light_Compute(map, display.tileCacheCenter.x, display.tileCacheCenter.y);
+    display.lightmapDirty = 1;
+  }
+}
+
+// Render targets can be lost when the window is resized or the device is
+// reset, so everything has to be drawn again.
+void InvalidateRenderChunks()
+{
+  for (int i=0; i < renderChunks.nResident; ++i)
+    renderChunks.resident[i]->valid = 0;
+}
+
+static void RenderChunkContents(TiledMap* map, int col, int row, SDL_Texture* tex)
+{
+  SDL_SetRenderTarget(display.renderer, tex);
+  SDL_SetRenderDrawColor(display.renderer, 0, 0, 0, 0);
+  SDL_RenderClear(display.renderer);
+  SDL_Rect chunkRect = {
+    col * renderChunks.pixelW, row * renderChunks.pixelH,
+    renderChunks.pixelW, renderChunks.pixelH };
+  Batch_Begin(&chunkRect);
+  int firstX = col * RENDER_CHUNK_TILES, firstY = row * RENDER_CHUNK_TILES;
+  for (int layer=0; layer < map->nLayers; ++layer)
+  {
+    for (int y = firstY; y < firstY + RENDER_CHUNK_TILES; ++y)
+    {
+      for (int x = firstX; x < firstX + RENDER_CHUNK_TILES; ++x)
+      {
+        Sint16* cell = TiledMap_GetCell(map, x, y);
+        if (!cell)
+          continue;
+        Sint16 gidIndex = TiledMap_GidIndex(map, cell[layer * map->cellLayerStride]);
+        SDL_Texture* tileTex = map->gidTex[gidIndex];
+        if (!tileTex)
+          continue;
+        SDL_Rect tileRect = {
+          x * map->tileWidth, y * map->tileHeight, map->tileWidth, map->tileHeight };
+        SDL_Point atlasPos = map->gidAtlasPos[gidIndex];
+        Batch_Add(tileTex, &tileRect, atlasPos.x, atlasPos.y);
+      }
+    }
+  }
+  Batch_End();
+  SDL_SetRenderTarget(display.renderer, 0);
+  ++renderChunks.renders;
+}
+
+// Returns the region's texture, rendering it first if needed, or 0 on failure.
+static SDL_Texture* GetRenderChunk(TiledMap* map, int col, int row)
+{
+  RenderChunk* chunk = &renderChunks.chunks[row * renderChunks.cols + col];
+  chunk->lastUsed = renderChunks.clock;
+  if (chunk->tex && chunk->valid)
+    return chunk->tex;
+  if (!chunk->tex)
   {
-    nextTileX = tileX;
-    nextTileY = tileY - SigNum(dy);
+    chunk->tex = SDL_CreateTexture(display.renderer, SDL_PIXELFORMAT_ARGB8888,
+        SDL_TEXTUREACCESS_TARGET, renderChunks.pixelW, renderChunks.pixelH);
+    if (!chunk->tex)
+    {
+      fprintf(stderr, "Unable to create map chunk texture. %s\n", SDL_GetError());
+      return 0;
+    }
+    SDL_SetTextureBlendMode(chunk->tex, SDL_BLENDMODE_BLEND);
+    renderChunks.resident[renderChunks.nResident++] = chunk;
+    renderChunks.residentBytes += (size_t)renderChunks.pixelW * renderChunks.pixelH * 4;
   }
-  int brightness = MAX_LIGHT;
-  TiledTile** tile = GetTile(map, nextTileX, nextTileY);
-  for (int layer=0; layer < map->nLayers; ++layer, ++tile)
+  RenderChunkContents(map, col, row, chunk->tex);
+  chunk->valid = 1;
+  return chunk->tex;
+}
+
+// Evicts least recently used regions until we're under budget, keeping the
+// ones drawn this frame.
+static void EvictRenderChunks()
+{
+  while (renderChunks.residentBytes > renderChunks.budget)
   {
-    if (*tile)
+    int oldest = -1;
+    for (int i=0; i < renderChunks.nResident; ++i)
     {
-      TiledProperty tileOpacity = (*tile)->props[TILE_PROP_OPACITY];
-      brightness = ReduceBrightness(brightness, tileOpacity);
+      RenderChunk* chunk = renderChunks.resident[i];
+      if (chunk->lastUsed == renderChunks.clock)
+        continue;
+      if (oldest < 0 || chunk->lastUsed < renderChunks.resident[oldest]->lastUsed)
+        oldest = i;
     }
+    if (oldest < 0)
+      break;
+    FreeRenderChunk(renderChunks.resident[oldest]);
+    renderChunks.resident[oldest] = renderChunks.resident[--renderChunks.nResident];
+    ++renderChunks.evictions;
   }
-  int slope = 256 / (VIEW_END_DISTANCE - VIEW_DROPOFF_DISTANCE);
-  if (distance > VIEW_DROPOFF_DISTANCE)
+}
+
+// Draws the part of the map inside visibleRect (in map pixels) from the
+// pre-rendered regions.
+static void DrawRenderChunks(TiledMap* map, SDL_Rect* mapViewRect, SDL_Rect* visibleRect)
+{
+  ++renderChunks.clock;
+  int firstCol = visibleRect->x >= 0 ? visibleRect->x / renderChunks.pixelW : 0;
+  int firstRow = visibleRect->y >= 0 ? visibleRect->y / renderChunks.pixelH : 0;
+  int lastCol = (visibleRect->x + visibleRect->w - 1) / renderChunks.pixelW;
+  int lastRow = (visibleRect->y + visibleRect->h - 1) / renderChunks.pixelH;
+  if (lastCol >= renderChunks.cols) lastCol = renderChunks.cols - 1;
+  if (lastRow >= renderChunks.rows) lastRow = renderChunks.rows - 1;
+  for (int row = firstRow; row <= lastRow; ++row)
   {
-    brightness = (brightness + slope * VIEW_DROPOFF_DISTANCE)
-      - (slope * distance / map->tileWidth);
+    for (int col = firstCol; col <= lastCol; ++col)
+    {
+      SDL_Texture* tex = GetRenderChunk(map, col, row);
+      SDL_Rect chunkRect = {
+        col * renderChunks.pixelW, row * renderChunks.pixelH,
+        renderChunks.pixelW, renderChunks.pixelH };
+      SDL_Rect drawRect;
+      if (!tex || SDL_TRUE != SDL_IntersectRect(visibleRect, &chunkRect, &drawRect))
+        continue;
+      SDL_Rect sourceRect = {
+        drawRect.x - chunkRect.x, drawRect.y - chunkRect.y, drawRect.w, drawRect.h };
+      SDL_Rect screenDestRect = {
+        drawRect.x - mapViewRect->x, drawRect.y - mapViewRect->y, drawRect.w, drawRect.h };
+      CountBind(tex);
+      SDL_RenderCopy(display.renderer, tex, &sourceRect, &screenDestRect);
+      ++renderStats.drawCalls;
+    }
   }
-  if (brightness < VIEW_LIGHT_THRESHOLD)
-    brightness = 0;
-  display.tileLighting[VIEW_DIAMETER * tileX + tileY] = brightness;
+  EvictRenderChunks();
+}
+
+// Shades the view with the lightmap texture, refreshing it first if the
+// lighting changed. Texel centers line up with tile centers, so the linear
+// filtering blends light smoothly from tile to tile.
+static void DrawLightmap(SDL_Rect* mapViewRect, SDL_Rect* firstTileRect)
+{
+  if (display.lightmapDirty)
+  {
+    int nTexels = VIEW_DIAMETER * VIEW_DIAMETER;
+    for (int i=0; i < nTexels; ++i)
+      display.lightmapPixels[i] = (Uint32)(255 - display.tileLighting[i]) << 24;
+    SDL_UpdateTexture(display.lightmap, 0, display.lightmapPixels,
+        VIEW_DIAMETER * sizeof(Uint32));
+    display.lightmapDirty = 0;
+  }
+  SDL_Rect lightRect = {
+    firstTileRect->x - mapViewRect->x, firstTileRect->y - mapViewRect->y,
+    firstTileRect->w * VIEW_DIAMETER, firstTileRect->h * VIEW_DIAMETER };
+  SDL_RenderSetClipRect(display.renderer, &layout.mapDisplayRect);
+  CountBind(display.lightmap);
+  SDL_RenderCopy(display.renderer, display.lightmap, 0, &lightRect);
+  ++renderStats.drawCalls;
+  SDL_RenderSetClipRect(display.renderer, 0);
 }
 
 void TiledMap_Draw(TiledMap* map, SDL_Rect* mapViewRect)
 {
-  // TODO: Rebuild tile cache only when necessary.
   BuildTileCache(map, mapViewRect);
   // TODO: Draw some default tile for areas off the map edge.
-  TiledTile** tile = display.tileCache;
   SDL_Rect tileRectStart = {
     display.tileCacheMapPos.x, display.tileCacheMapPos.y,
     map->tileWidth, map->tileHeight
   };
-  SDL_Rect tileRect = tileRectStart;
-  int* tileBrightness = display.tileLighting;
-  for (int r=0; r < VIEW_DIAMETER; ++r, tileRect.y += map->tileHeight)
+  if (renderChunks.enabled)
+  {
+    // Only the tiles covered by the lightmap are visible.
+    SDL_Rect litRect = {
+      tileRectStart.x, tileRectStart.y,
+      VIEW_DIAMETER * map->tileWidth, VIEW_DIAMETER * map->tileHeight };
+    SDL_Rect visibleRect;
+    if (SDL_TRUE == SDL_IntersectRect(mapViewRect, &litRect, &visibleRect))
+      DrawRenderChunks(map, mapViewRect, &visibleRect);
+    DrawLightmap(mapViewRect, &tileRectStart);
+    return;
+  }
+  int firstCacheRow = WrapToView(display.tileCacheCenter.y - VIEW_END_DISTANCE);
+  int firstCacheCol = WrapToView(display.tileCacheCenter.x - VIEW_END_DISTANCE);
+  int cachePlaneSize = VIEW_DIAMETER * VIEW_DIAMETER;
+  Batch_Begin(mapViewRect);
+  // Draw a layer at a time. Tiles don't overlap their neighbours, so this
+  // looks the same as drawing a cell at a time.
+  for (int layer=0; layer < map->nLayers; ++layer)
   {
-    tileRect.x = tileRectStart.x;
-    for (int c=0; c < VIEW_DIAMETER; ++c, tileRect.x += map->tileWidth, ++tileBrightness)
+    Sint16* plane = display.tileCache + layer * cachePlaneSize;
+    SDL_Rect tileRect = tileRectStart;
+    const Uint8* tileBrightness = display.tileLighting;
+    for (int r=0; r < VIEW_DIAMETER; ++r, tileRect.y += map->tileHeight)
     {
-      int brightness = *tileBrightness;
-      if (brightness == 0)
+      Sint16* cacheRow = plane + WrapToView(firstCacheRow + r) * VIEW_DIAMETER;
+      int cacheCol = firstCacheCol;
+      tileRect.x = tileRectStart.x;
+      for (int c=0; c < VIEW_DIAMETER; ++c, tileRect.x += map->tileWidth, ++tileBrightness)
       {
-        tile += 2;
-        continue;
-      }
-      for (int layer=0; layer < map->nLayers; ++layer, ++tile)
-      {
-        if (*tile && brightness > 0)
+        Sint16 gidIndex = cacheRow[cacheCol];
+        if (++cacheCol == VIEW_DIAMETER)
+          cacheCol = 0;
+        SDL_Texture* tex = map->gidTex[gidIndex];
+        if (tex && *tileBrightness > 0)
         {
-          DrawTextureWithOffset(mapViewRect,
-              (*tile)->tex, &tileRect, (*tile)->x, (*tile)->y);
+          SDL_Point atlasPos = map->gidAtlasPos[gidIndex];
+          Batch_Add(tex, &tileRect, atlasPos.x, atlasPos.y);
         }
       }
-      if (brightness < 255)
-      {
-        // These both return 0 on success and negative on error.
-        SDL_SetRenderDrawColor(display.renderer, 0, 0, 0, 255 - brightness);
-        SDL_Rect shadeRect = {
-          tileRect.x - mapViewRect->x, tileRect.y - mapViewRect->y,
-          tileRect.w, tileRect.h };
-        SDL_Rect clipRect;
-        if (SDL_TRUE == SDL_IntersectRect(&layout.mapDisplayRect, &shadeRect, &clipRect))
-          SDL_RenderFillRect(display.renderer, &clipRect);
-      }
     }
   }
+  Batch_End();
+  DrawLightmap(mapViewRect, &tileRectStart);
 }
 
-void DrawChar(SDL_Rect* mapViewRect, struct CharBase* c, int phase)
+// Adds a sprite that's moving from pos by mov to the current batch, or a
+// placeholder if its image hasn't loaded.
+static void DrawSprite(struct Image* img, int posX, int posY, int movX, int movY, int phase)
 {
-  int dx = c->mov.x * phase / PHASE_GRAIN,
-      dy = c->mov.y * phase / PHASE_GRAIN;
-  SDL_Rect charRect = {
-    c->pos.x + dx, c->pos.y + dy,
-    c->img.sfc->w, c->img.sfc->h };
-  DrawTexture(mapViewRect, c->img.tex, &charRect);
+  SDL_Rect spriteRect = {
+    posX + movX * phase / PHASE_GRAIN, posY + movY * phase / PHASE_GRAIN,
+    PLACEHOLDER_SIZE, PLACEHOLDER_SIZE };
+  if (!Loader_Poll(img) || !img->tex)
+  {
+    Batch_Add(placeholder, &spriteRect, 0, 0);
+    return;
+  }
+  spriteRect.w = img->sfc->w;
+  spriteRect.h = img->sfc->h;
+  Batch_Add(img->tex, &spriteRect, img->texX, img->texY);
 }
 
-void DrawPlayer(SDL_Rect* mapViewRect, int phase, struct Player* player)
+void DrawPlayer(int phase, struct Player* player)
 {
-  DrawChar(mapViewRect, &player->c, phase);
+  struct CharBase* c = &player->c;
+  DrawSprite(&c->img, c->pos.x, c->pos.y, c->mov.x, c->mov.y, phase);
 }
 
-void DrawNpcs(SDL_Rect* mapViewRect, int phase, struct Npc* npcs, int npcCount)
+// Adds the NPCs near the view, found through the grid, to the batch.
+void DrawNpcs(SDL_Rect* mapViewRect, int phase, EntityStore* npcs)
 {
-  for (int i=0; i < npcCount; ++i)
-    if (npcs[i].id)
-      DrawChar(mapViewRect, &npcs[i].c, phase);
+  static int* visible;
+  static int visibleCapacity;
+  SpatialGrid* grid = npcs->grid;
+  // Widen the view by a tile on each side for NPCs partway through a move.
+  SDL_Rect searchRect = {
+    mapViewRect->x - grid->cellW, mapViewRect->y - grid->cellH,
+    mapViewRect->w + 2 * grid->cellW, mapViewRect->h + 2 * grid->cellH };
+  int nVisible = SpatialGrid_QueryRect(grid, &searchRect, visible, visibleCapacity);
+  if (nVisible > visibleCapacity)
+  {
+    free(visible);
+    visibleCapacity = 2 * nVisible;
+    visible = MallocOrDie(visibleCapacity * sizeof(int));
+    nVisible = SpatialGrid_QueryRect(grid, &searchRect, visible, visibleCapacity);
+  }
+  for (int i=0; i < nVisible; ++i)
+  {
+    int slot = npcs->indexSlot[visible[i]];
+    DrawSprite(&npcs->sprites[npcs->sprite[slot]], npcs->posX[slot], npcs->posY[slot],
+        npcs->movX[slot], npcs->movY[slot], phase);
+  }
 }
 
 void DrawUi()
@@ -481,7 +947,7 @@ void DrawLayout()
       0, 0, SDL_FLIP_NONE);
 }
 
-void Draw(int phase, TiledMap* map, struct Player* player, struct Npc* npcs, int npcCount)
+void Draw(int phase, TiledMap* map, struct Player* player, EntityStore* npcs)
 {
   SDL_SetRenderDrawColor(display.renderer, 0x00, 0x00, 0x00, 0xFF);
   SDL_RenderClear(display.renderer);
@@ -496,10 +962,23 @@ void Draw(int phase, TiledMap* map, struct Player* player, struct Npc* npcs, int
     + player->c.mov.x * phase / PHASE_GRAIN;
   mapViewRect.y = player->c.pos.y - mapViewRect.h / 2
     + player->c.mov.y * phase / PHASE_GRAIN;
+  TiledMap_StreamChunks(map, &mapViewRect, player->c.mov);
   TiledMap_Draw(map, &mapViewRect);
-  DrawPlayer(&mapViewRect, phase, player);
-  DrawNpcs(&mapViewRect, phase, npcs, npcCount);
+  // The characters share a batch, so with their images in the atlas they
+  // take one draw call.
+  Batch_Begin(&mapViewRect);
+  DrawPlayer(phase, player);
+  DrawNpcs(&mapViewRect, phase, npcs);
+  Batch_End();
   DrawUi();
   SDL_RenderPresent(display.renderer);
+  renderStats.lastFrameDrawCalls = renderStats.drawCalls;
+  renderStats.totalDrawCalls += renderStats.drawCalls;
+  ++renderStats.frames;
+  renderStats.drawCalls = 0;
+  renderStats.lastFrameBinds = renderStats.binds;
+  renderStats.totalBinds += renderStats.binds;
+  renderStats.binds = 0;
+  renderStats.boundTex = 0;
 }
 
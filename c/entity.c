@@ -0,0 +1,281 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Entity store.
+//
+// Component data for live entities is packed into parallel arrays (slots
+// 0 to count-1), so loops over entities only touch live ones and each loop
+// only touches the fields it uses. Removing an entity moves the last one
+// into its slot. Entities are referred to by handles, which stay valid
+// across such moves: a handle is an index into a table giving the entity's
+// current slot, plus a generation that's bumped whenever the index is
+// reused, so stale handles are detected. Unused indexes are kept on a free
+// list.
+
+#define ENTITY_INDEX_BITS 22
+#define ENTITY_INDEX_MASK ((1u << ENTITY_INDEX_BITS) - 1)
+#define ENTITY_GENERATION_MASK ((1u << (32 - ENTITY_INDEX_BITS)) - 1)
+
+static const int NO_SLOT = -1;
+// Entities per job when moving them on the job threads.
+static const int MOVE_GRAIN = 16384;
+// Entities checked at a time by EntityStore_QueryRadius.
+#define RADIUS_BLOCK 256
+
+static Entity MakeHandle(int index, Uint32 generation)
+{
+  return (generation << ENTITY_INDEX_BITS) | (Uint32)index;
+}
+
+EntityStore* EntityStore_Create(int initialCapacity, SpatialGrid* grid)
+{
+  EntityStore* store = MallocOrDie(sizeof(EntityStore));
+  store->grid = grid;
+  store->freeIndex = NO_SLOT;
+  EntityStore_Reserve(store, initialCapacity > 0 ? initialCapacity : 16);
+  return store;
+}
+
+void EntityStore_Destroy(EntityStore* store)
+{
+  if (!store)
+    return;
+  free(store->posX); free(store->posY);
+  free(store->movX); free(store->movY);
+  free(store->hpCur); free(store->hpMax);
+  free(store->sprite);
+  free(store->name);
+  free(store->slotIndex);
+  free(store->indexSlot);
+  free(store->generation);
+  free(store->sprites);
+  free(store->spritePlaced);
+  free(store);
+}
+
+// Copies the first n elements of *array into a new array of the given
+// capacity, and frees the old one.
+static void GrowArray(void** array, size_t elementSize, int n, int capacity)
+{
+  void* grown = MallocOrDie(capacity * elementSize);
+  if (n)
+    memcpy(grown, *array, n * elementSize);
+  free(*array);
+  *array = grown;
+}
+
+// Makes room for at least capacity entities.
+void EntityStore_Reserve(EntityStore* store, int capacity)
+{
+  if (capacity <= store->capacity)
+    return;
+  assert(capacity <= (int)ENTITY_INDEX_MASK);
+  int n = store->capacity;
+  GrowArray((void**)&store->posX, sizeof(Sint32), n, capacity);
+  GrowArray((void**)&store->posY, sizeof(Sint32), n, capacity);
+  GrowArray((void**)&store->movX, sizeof(Sint32), n, capacity);
+  GrowArray((void**)&store->movY, sizeof(Sint32), n, capacity);
+  GrowArray((void**)&store->hpCur, sizeof(Sint32), n, capacity);
+  GrowArray((void**)&store->hpMax, sizeof(Sint32), n, capacity);
+  GrowArray((void**)&store->sprite, sizeof(Uint16), n, capacity);
+  GrowArray((void**)&store->name, sizeof(const char*), n, capacity);
+  GrowArray((void**)&store->slotIndex, sizeof(int), n, capacity);
+  // Handle table. Free entries are chained through indexSlot.
+  GrowArray((void**)&store->indexSlot, sizeof(int), n, capacity);
+  GrowArray((void**)&store->generation, sizeof(Uint32), n, capacity);
+  for (int index = capacity - 1; index >= n; --index)
+  {
+    store->generation[index] = 1;
+    store->indexSlot[index] = store->freeIndex;
+    store->freeIndex = index;
+  }
+  store->capacity = capacity;
+}
+
+// Starts loading an image for entities to use in the background (see
+// loader.c). Returns its sprite number.
+int EntityStore_AddSprite(EntityStore* store, const char* path)
+{
+  struct Image* sprites = MallocOrDie((store->nSprites + 1) * sizeof(struct Image));
+  if (store->nSprites)
+    memcpy(sprites, store->sprites, store->nSprites * sizeof(struct Image));
+  free(store->sprites);
+  store->sprites = sprites;
+  GrowArray((void**)&store->spritePlaced, sizeof(Uint8), store->nSprites, store->nSprites + 1);
+  struct Image* img = &sprites[store->nSprites];
+  img->path = path;
+  Loader_LoadImage(img);
+  return store->nSprites++;
+}
+
+// Points the sprites that have loaded since the last call at their places
+// in the atlas, and resizes the grid rects of the entities using them, which
+// were the size of the placeholder until then. Call again while sprites are
+// still loading.
+void EntityStore_PlaceSprites(EntityStore* store)
+{
+  for (int i=0; i < store->nSprites; ++i)
+  {
+    if (store->spritePlaced[i] || !Loader_Poll(&store->sprites[i]))
+      continue;
+    store->spritePlaced[i] = 1;
+    Atlas_Place(&store->sprites[i]);
+    if (!store->grid)
+      continue;
+    for (int slot=0; slot < store->count; ++slot)
+    {
+      if (store->sprite[slot] != i)
+        continue;
+      SDL_Rect rect = EntityStore_GetRect(store, slot);
+      SpatialGrid_Insert(store->grid, store->slotIndex[slot], &rect);
+    }
+  }
+}
+
+Entity EntityStore_Spawn(EntityStore* store, const char* name, int sprite,
+    struct Coords pos, int hp)
+{
+  assert(sprite >= 0 && sprite < store->nSprites);
+  if (store->freeIndex == NO_SLOT)
+    EntityStore_Reserve(store, 2 * store->capacity);
+  int index = store->freeIndex;
+  store->freeIndex = store->indexSlot[index];
+  int slot = store->count++;
+  store->indexSlot[index] = slot;
+  store->slotIndex[slot] = index;
+  store->posX[slot] = pos.x;
+  store->posY[slot] = pos.y;
+  store->movX[slot] = 0;
+  store->movY[slot] = 0;
+  store->hpCur[slot] = hp;
+  store->hpMax[slot] = hp;
+  store->sprite[slot] = sprite;
+  store->name[slot] = name;
+  if (store->grid)
+  {
+    SDL_Rect rect = EntityStore_GetRect(store, slot);
+    SpatialGrid_Insert(store->grid, index, &rect);
+  }
+  return MakeHandle(index, store->generation[index]);
+}
+
+// Returns the entity's slot, or -1 if the handle is stale or null. A free
+// index keeps its generation and chains the free list through indexSlot, so
+// the slot must also lead back to the index.
+int EntityStore_Slot(EntityStore* store, Entity e)
+{
+  int index = e & ENTITY_INDEX_MASK;
+  if (e == 0 || index >= store->capacity
+      || store->generation[index] != e >> ENTITY_INDEX_BITS)
+    return NO_SLOT;
+  int slot = store->indexSlot[index];
+  if (slot < 0 || slot >= store->count || store->slotIndex[slot] != index)
+    return NO_SLOT;
+  return slot;
+}
+
+// Returns the handle of the entity in a slot.
+Entity EntityStore_Handle(EntityStore* store, int slot)
+{
+  int index = store->slotIndex[slot];
+  return MakeHandle(index, store->generation[index]);
+}
+
+void EntityStore_Despawn(EntityStore* store, Entity e)
+{
+  int slot = EntityStore_Slot(store, e);
+  if (slot == NO_SLOT)
+    return;
+  int index = store->slotIndex[slot];
+  if (store->grid)
+    SpatialGrid_Remove(store->grid, index);
+  // Move the last entity into the hole.
+  int last = --store->count;
+  if (slot != last)
+  {
+    store->posX[slot] = store->posX[last];
+    store->posY[slot] = store->posY[last];
+    store->movX[slot] = store->movX[last];
+    store->movY[slot] = store->movY[last];
+    store->hpCur[slot] = store->hpCur[last];
+    store->hpMax[slot] = store->hpMax[last];
+    store->sprite[slot] = store->sprite[last];
+    store->name[slot] = store->name[last];
+    store->slotIndex[slot] = store->slotIndex[last];
+    store->indexSlot[store->slotIndex[slot]] = slot;
+  }
+  // Retire the handle. Generation 0 is never used, so null handles stay invalid.
+  Uint32 generation = (store->generation[index] + 1) & ENTITY_GENERATION_MASK;
+  store->generation[index] = generation ? generation : 1;
+  store->indexSlot[index] = store->freeIndex;
+  store->freeIndex = index;
+}
+
+// Until its sprite has loaded, an entity is the size of the placeholder.
+SDL_Rect EntityStore_GetRect(EntityStore* store, int slot)
+{
+  SDL_Surface* sfc = store->sprites[store->sprite[slot]].sfc;
+  SDL_Rect r = { store->posX[slot], store->posY[slot],
+    sfc ? sfc->w : PLACEHOLDER_SIZE, sfc ? sfc->h : PLACEHOLDER_SIZE };
+  return r;
+}
+
+// Finds the entities positioned within radius of center by checking them
+// all, a block at a time, without the grid; for checks against most of the
+// store, or stores without one. Returns the number found, and stores up to
+// maxSlots of their slots.
+int EntityStore_QueryRadius(EntityStore* store, struct Coords center, int radius,
+    int* slots, int maxSlots)
+{
+  int found[RADIUS_BLOCK];
+  int nFound = 0;
+  for (int first=0; first < store->count; first += RADIUS_BLOCK)
+  {
+    int n = store->count - first < RADIUS_BLOCK ? store->count - first : RADIUS_BLOCK;
+    int nBlock = Coords_BatchWithinRadius(center, &store->posX[first], &store->posY[first],
+        n, radius, found);
+    for (int i=0; i < nBlock; ++i, ++nFound)
+      if (nFound < maxSlots)
+        slots[nFound] = first + found[i];
+  }
+  return nFound;
+}
+
+static void ApplyMovesJob(void* data, int chunk, int first, int end)
+{
+  (void)chunk;
+  EntityStore* store = data;
+  Sint32* restrict posX = store->posX;
+  Sint32* restrict posY = store->posY;
+  const Sint32* restrict movX = store->movX;
+  const Sint32* restrict movY = store->movY;
+  for (int i = first; i < end; ++i)
+  {
+    posX[i] += movX[i];
+    posY[i] += movY[i];
+  }
+}
+
+// Applies every entity's move for the tick. The grid isn't thread safe, so
+// it's updated afterwards on this thread.
+void EntityStore_ApplyMoves(EntityStore* store)
+{
+  int n = store->count;
+  Job_ParallelFor(ApplyMovesJob, store, n, MOVE_GRAIN);
+  if (!store->grid)
+    return;
+  const Sint32* posX = store->posX;
+  const Sint32* posY = store->posY;
+  const Sint32* movX = store->movX;
+  const Sint32* movY = store->movY;
+  for (int i=0; i < n; ++i)
+  {
+    if (movX[i] | movY[i])
+    {
+      struct Coords pos = { posX[i], posY[i] };
+      SpatialGrid_Move(store->grid, store->slotIndex[i], pos);
+    }
+  }
+}
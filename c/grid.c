@@ -0,0 +1,219 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Uniform grid of map cells for finding characters near a place.
+//
+// Items are small integers chosen by the caller (e.g. NPC slots). Each item
+// is filed under the cell holding the top-left corner of its rectangle, in a
+// doubly linked list threaded through per-item arrays, so moving an item is
+// constant time and usually doesn't touch the lists at all. Queries widen
+// their search by the largest item size so that items overlapping into the
+// area from neighbouring cells are found.
+
+static const int NO_ITEM = -1;
+
+SpatialGrid* SpatialGrid_Create(int cols, int rows, int cellW, int cellH)
+{
+  assert(cols > 0 && rows > 0 && cellW > 0 && cellH > 0);
+  SpatialGrid* grid = MallocOrDie(sizeof(SpatialGrid));
+  grid->cols = cols;
+  grid->rows = rows;
+  grid->cellW = cellW;
+  grid->cellH = cellH;
+  grid->cellHeads = MallocOrDie(cols * rows * sizeof(int));
+  for (int i=0; i < cols * rows; ++i)
+    grid->cellHeads[i] = NO_ITEM;
+  return grid;
+}
+
+void SpatialGrid_Destroy(SpatialGrid* grid)
+{
+  if (!grid)
+    return;
+  free(grid->cellHeads);
+  free(grid->next);
+  free(grid->prev);
+  free(grid->itemCell);
+  free(grid->rects);
+  free(grid);
+}
+
+static void Grow(SpatialGrid* grid, int minCapacity)
+{
+  int capacity = grid->capacity ? grid->capacity : 64;
+  while (capacity < minCapacity)
+    capacity *= 2;
+  int* next = MallocOrDie(capacity * sizeof(int));
+  int* prev = MallocOrDie(capacity * sizeof(int));
+  int* itemCell = MallocOrDie(capacity * sizeof(int));
+  SDL_Rect* rects = MallocOrDie(capacity * sizeof(SDL_Rect));
+  if (grid->capacity)
+  {
+    memcpy(next, grid->next, grid->capacity * sizeof(int));
+    memcpy(prev, grid->prev, grid->capacity * sizeof(int));
+    memcpy(itemCell, grid->itemCell, grid->capacity * sizeof(int));
+    memcpy(rects, grid->rects, grid->capacity * sizeof(SDL_Rect));
+  }
+  for (int i = grid->capacity; i < capacity; ++i)
+    itemCell[i] = NO_ITEM;
+  free(grid->next);
+  free(grid->prev);
+  free(grid->itemCell);
+  free(grid->rects);
+  grid->next = next;
+  grid->prev = prev;
+  grid->itemCell = itemCell;
+  grid->rects = rects;
+  grid->capacity = capacity;
+}
+
+// Cell column/row for a map position, clamped so that characters off the
+// edge of the map are filed in the edge cells.
+static int CellCol(SpatialGrid* grid, int x)
+{
+  int col = x >= 0 ? x / grid->cellW : 0;
+  return col < grid->cols ? col : grid->cols - 1;
+}
+
+static int CellRow(SpatialGrid* grid, int y)
+{
+  int row = y >= 0 ? y / grid->cellH : 0;
+  return row < grid->rows ? row : grid->rows - 1;
+}
+
+static void Link(SpatialGrid* grid, int item, int cell)
+{
+  int head = grid->cellHeads[cell];
+  grid->next[item] = head;
+  grid->prev[item] = NO_ITEM;
+  if (head != NO_ITEM)
+    grid->prev[head] = item;
+  grid->cellHeads[cell] = item;
+  grid->itemCell[item] = cell;
+}
+
+static void Unlink(SpatialGrid* grid, int item)
+{
+  int cell = grid->itemCell[item];
+  int next = grid->next[item], prev = grid->prev[item];
+  if (prev != NO_ITEM)
+    grid->next[prev] = next;
+  else
+    grid->cellHeads[cell] = next;
+  if (next != NO_ITEM)
+    grid->prev[next] = prev;
+  grid->itemCell[item] = NO_ITEM;
+}
+
+// Adds an item, or moves it if it's already in the grid.
+void SpatialGrid_Insert(SpatialGrid* grid, int item, SDL_Rect* rect)
+{
+  assert(item >= 0);
+  if (item >= grid->capacity)
+    Grow(grid, item + 1);
+  if (rect->w > grid->maxItemW) grid->maxItemW = rect->w;
+  if (rect->h > grid->maxItemH) grid->maxItemH = rect->h;
+  int cell = CellRow(grid, rect->y) * grid->cols + CellCol(grid, rect->x);
+  grid->rects[item] = *rect;
+  if (grid->itemCell[item] == cell)
+    return;
+  if (grid->itemCell[item] != NO_ITEM)
+    Unlink(grid, item);
+  else
+    ++grid->nItems;
+  Link(grid, item, cell);
+}
+
+void SpatialGrid_Remove(SpatialGrid* grid, int item)
+{
+  if (item < 0 || item >= grid->capacity || grid->itemCell[item] == NO_ITEM)
+    return;
+  Unlink(grid, item);
+  --grid->nItems;
+}
+
+// Call when an item moves. Only changes its cell's list if it crossed into
+// another cell.
+void SpatialGrid_Move(SpatialGrid* grid, int item, struct Coords pos)
+{
+  assert(item >= 0 && item < grid->capacity && grid->itemCell[item] != NO_ITEM);
+  SDL_Rect* rect = &grid->rects[item];
+  rect->x = pos.x;
+  rect->y = pos.y;
+  int cell = CellRow(grid, pos.y) * grid->cols + CellCol(grid, pos.x);
+  if (cell != grid->itemCell[item])
+  {
+    Unlink(grid, item);
+    Link(grid, item, cell);
+  }
+}
+
+static int Overlaps(SDL_Rect* a, SDL_Rect* b)
+{
+  return a->x < b->x + b->w && b->x < a->x + a->w
+    && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+// Finds the items whose rectangles overlap rect. Writes up to maxItems of them
+// to items and returns how many there are in all.
+int SpatialGrid_QueryRect(SpatialGrid* grid, SDL_Rect* rect, int* items, int maxItems)
+{
+  int firstCol = CellCol(grid, rect->x - grid->maxItemW + 1);
+  int firstRow = CellRow(grid, rect->y - grid->maxItemH + 1);
+  int lastCol = CellCol(grid, rect->x + rect->w - 1);
+  int lastRow = CellRow(grid, rect->y + rect->h - 1);
+  int nFound = 0;
+  for (int row = firstRow; row <= lastRow; ++row)
+  {
+    for (int col = firstCol; col <= lastCol; ++col)
+    {
+      for (int item = grid->cellHeads[row * grid->cols + col]; item != NO_ITEM;
+          item = grid->next[item])
+      {
+        if (!Overlaps(rect, &grid->rects[item]))
+          continue;
+        if (nFound < maxItems)
+          items[nFound] = item;
+        ++nFound;
+      }
+    }
+  }
+  return nFound;
+}
+
+// Finds the items with some part of their rectangle within radius of center.
+// Results are returned as for SpatialGrid_QueryRect.
+int SpatialGrid_QueryRadius(SpatialGrid* grid, struct Coords center, int radius,
+    int* items, int maxItems)
+{
+  int firstCol = CellCol(grid, center.x - radius - grid->maxItemW + 1);
+  int firstRow = CellRow(grid, center.y - radius - grid->maxItemH + 1);
+  int lastCol = CellCol(grid, center.x + radius);
+  int lastRow = CellRow(grid, center.y + radius);
+  long radiusSquared = (long)radius * radius;
+  int nFound = 0;
+  for (int row = firstRow; row <= lastRow; ++row)
+  {
+    for (int col = firstCol; col <= lastCol; ++col)
+    {
+      for (int item = grid->cellHeads[row * grid->cols + col]; item != NO_ITEM;
+          item = grid->next[item])
+      {
+        // Distance to the nearest point of the rectangle.
+        SDL_Rect* r = &grid->rects[item];
+        int dx = center.x < r->x ? r->x - center.x
+          : center.x >= r->x + r->w ? center.x - (r->x + r->w - 1) : 0;
+        int dy = center.y < r->y ? r->y - center.y
+          : center.y >= r->y + r->h ? center.y - (r->y + r->h - 1) : 0;
+        if ((long)dx * dx + (long)dy * dy > radiusSquared)
+          continue;
+        if (nFound < maxItems)
+          items[nFound] = item;
+        ++nFound;
+      }
+    }
+  }
+  return nFound;
+}
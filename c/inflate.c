@@ -0,0 +1,500 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Streaming inflate (RFC 1951), with zlib (RFC 1950) and gzip (RFC 1952)
+// wrappers, for the compressed layer data in map files.
+//
+// Input is pulled through a reader into a small buffer and output goes to a
+// writer half a window at a time, so memory use doesn't depend on the size
+// of the data. Codes are decoded with a lookup on the next FAST_BITS bits,
+// falling back to walking the code lengths for longer ones.
+
+#define INFLATE_WINDOW 65536 // twice the furthest a match can reach
+#define INFLATE_WINDOW_MASK (INFLATE_WINDOW - 1)
+#define INFLATE_FLUSH 32768
+#define INFLATE_INPUT 16384
+#define INFLATE_MAX_BITS 15
+#define INFLATE_FAST_BITS 10
+#define INFLATE_LITERALS 288
+#define INFLATE_DISTANCES 30
+
+typedef struct Huffman {
+  Uint16 counts[INFLATE_MAX_BITS + 1]; // codes of each length
+  Uint16 symbols[INFLATE_LITERALS]; // in code order
+  Uint16 fast[1 << INFLATE_FAST_BITS]; // symbol | length << 9, or 0 if longer
+} Huffman;
+
+typedef struct Inflater {
+  InflateReader read;
+  InflateWriter write;
+  void* data;
+  int format;
+  const char* error;
+  int stopped; // by the writer
+  Uint8 input[INFLATE_INPUT];
+  size_t inPos, inLen;
+  Uint64 bits; // next bits of input, first in the low bit
+  int nBits;
+  int inputEnded;
+  Uint8 window[INFLATE_WINDOW];
+  Uint64 outPos, flushedPos;
+  Uint32 adler, crc;
+  Huffman literals, distances;
+} Inflater;
+
+static const Uint16 LENGTH_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+  35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const Uint8 LENGTH_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+  3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const Uint16 DISTANCE_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129,
+  193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const Uint8 DISTANCE_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+  6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const Uint8 CODE_LENGTH_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4,
+  12, 3, 13, 2, 14, 1, 15 };
+
+static Uint32 crcTable[256];
+
+static int Fail(Inflater* z, const char* problem)
+{
+  if (!z->error)
+    z->error = problem;
+  return -1;
+}
+
+// Tops up the bit buffer to at least n bits, if there's that much input
+// left. Returns 0 if there isn't.
+static int FillBits(Inflater* z, int n)
+{
+  while (z->nBits < n)
+  {
+    if (z->inPos == z->inLen)
+    {
+      if (z->inputEnded)
+        return 0;
+      z->inLen = z->read(z->data, z->input, INFLATE_INPUT);
+      z->inPos = 0;
+      if (!z->inLen)
+      {
+        z->inputEnded = 1;
+        return 0;
+      }
+    }
+    z->bits |= (Uint64)z->input[z->inPos++] << z->nBits;
+    z->nBits += 8;
+  }
+  return 1;
+}
+
+static int GetBits(Inflater* z, int n)
+{
+  if (!FillBits(z, n))
+    return Fail(z, "data ends early");
+  int value = (int)(z->bits & ((1u << n) - 1));
+  z->bits >>= n;
+  z->nBits -= n;
+  return value;
+}
+
+// Only the checksum the format has is kept.
+static void UpdateChecksum(Inflater* z, const Uint8* bytes, size_t n)
+{
+  if (z->format == INFLATE_ZLIB)
+  {
+    Uint32 a = z->adler & 0xFFFF, b = z->adler >> 16;
+    while (n)
+    {
+      // The sums can't overflow in this many bytes.
+      size_t block = n < 5552 ? n : 5552;
+      n -= block;
+      for (; block; --block)
+      {
+        a += *bytes++;
+        b += a;
+      }
+      a %= 65521;
+      b %= 65521;
+    }
+    z->adler = a | b << 16;
+  }
+  else if (z->format == INFLATE_GZIP)
+  {
+    Uint32 crc = ~z->crc;
+    for (; n; --n)
+      crc = crcTable[(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    z->crc = ~crc;
+  }
+}
+
+// Passes what's been output since the last flush to the writer. Flushes
+// happen every INFLATE_FLUSH bytes, so it's always in one piece.
+static int Flush(Inflater* z)
+{
+  size_t n = z->outPos - z->flushedPos;
+  if (!n)
+    return 0;
+  const Uint8* bytes = z->window + (z->flushedPos & INFLATE_WINDOW_MASK);
+  UpdateChecksum(z, bytes, n);
+  z->flushedPos = z->outPos;
+  if (!z->write(z->data, bytes, n))
+  {
+    z->stopped = 1;
+    return -1;
+  }
+  return 0;
+}
+
+static inline int Put(Inflater* z, Uint8 byte)
+{
+  z->window[z->outPos++ & INFLATE_WINDOW_MASK] = byte;
+  return z->outPos % INFLATE_FLUSH ? 0 : Flush(z);
+}
+
+// Builds the decoding tables for a code with the given lengths, as in
+// section 3.2.2 of the RFC. Codes may be incomplete, but not oversubscribed.
+static int BuildHuffman(Inflater* z, Huffman* h, const Uint8* lengths, int n)
+{
+  memset(h->counts, 0, sizeof(h->counts));
+  memset(h->fast, 0, sizeof(h->fast));
+  for (int i=0; i < n; ++i)
+    ++h->counts[lengths[i]];
+  h->counts[0] = 0;
+  int left = 1;
+  Uint16 offsets[INFLATE_MAX_BITS + 2];
+  offsets[1] = 0;
+  for (int len=1; len <= INFLATE_MAX_BITS; ++len)
+  {
+    left = 2 * left - h->counts[len];
+    if (left < 0)
+      return Fail(z, "bad Huffman code");
+    offsets[len + 1] = offsets[len] + h->counts[len];
+  }
+  // Codes of each length are consecutive, in symbol order.
+  int code = 0;
+  Uint16 nextCode[INFLATE_MAX_BITS + 1];
+  for (int len=1; len <= INFLATE_MAX_BITS; ++len)
+  {
+    code = (code + h->counts[len - 1]) << 1;
+    nextCode[len] = code;
+  }
+  for (int symbol=0; symbol < n; ++symbol)
+  {
+    int len = lengths[symbol];
+    if (!len)
+      continue;
+    h->symbols[offsets[len]++] = symbol;
+    if (len > INFLATE_FAST_BITS)
+      continue;
+    // Codes are sent starting from their high bit.
+    int reversed = 0, c = nextCode[len]++;
+    for (int i=0; i < len; ++i, c >>= 1)
+      reversed = reversed << 1 | (c & 1);
+    for (int i = reversed; i < (1 << INFLATE_FAST_BITS); i += 1 << len)
+      h->fast[i] = symbol | len << 9;
+  }
+  return 0;
+}
+
+static int DecodeSymbol(Inflater* z, const Huffman* h)
+{
+  // Near the end of the data, there may be fewer bits left than a code can
+  // take, but enough for this one.
+  FillBits(z, INFLATE_MAX_BITS);
+  int entry = h->fast[z->bits & ((1 << INFLATE_FAST_BITS) - 1)];
+  if (entry && (entry >> 9) <= z->nBits)
+  {
+    z->bits >>= entry >> 9;
+    z->nBits -= entry >> 9;
+    return entry & 0x1FF;
+  }
+  // Walk the lengths: the codes of each length follow on from the last.
+  int code = 0, first = 0, index = 0;
+  for (int len=1; len <= INFLATE_MAX_BITS && len <= z->nBits; ++len)
+  {
+    code |= (z->bits >> (len - 1)) & 1;
+    int count = h->counts[len];
+    if (code - count < first)
+    {
+      z->bits >>= len;
+      z->nBits -= len;
+      return h->symbols[index + code - first];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  return Fail(z, z->nBits < INFLATE_MAX_BITS ? "data ends early" : "bad Huffman code");
+}
+
+static int InflateStored(Inflater* z)
+{
+  // Stored blocks start on a byte boundary.
+  GetBits(z, z->nBits % 8);
+  int len = GetBits(z, 16);
+  int check = GetBits(z, 16);
+  if (len < 0 || check < 0)
+    return -1;
+  if (len != (~check & 0xFFFF))
+    return Fail(z, "bad stored block length");
+  for (int i=0; i < len; ++i)
+  {
+    int byte = GetBits(z, 8);
+    if (byte < 0 || Put(z, byte) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int InflateCodes(Inflater* z)
+{
+  for (;;)
+  {
+    int symbol = DecodeSymbol(z, &z->literals);
+    if (symbol < 0)
+      return -1;
+    if (symbol < 256)
+    {
+      if (Put(z, symbol) < 0)
+        return -1;
+      continue;
+    }
+    if (symbol == 256)
+      return 0;
+    symbol -= 257;
+    if (symbol >= 29)
+      return Fail(z, "bad length code");
+    int extra = GetBits(z, LENGTH_EXTRA[symbol]);
+    int distSymbol = DecodeSymbol(z, &z->distances);
+    if (extra < 0 || distSymbol < 0)
+      return -1;
+    if (distSymbol >= INFLATE_DISTANCES)
+      return Fail(z, "bad distance code");
+    int len = LENGTH_BASE[symbol] + extra;
+    int distExtra = GetBits(z, DISTANCE_EXTRA[distSymbol]);
+    if (distExtra < 0)
+      return -1;
+    Uint64 dist = DISTANCE_BASE[distSymbol] + distExtra;
+    if (dist > z->outPos)
+      return Fail(z, "distance too far back");
+    // Copy up to each flush, a byte at a time, as the match may overlap
+    // what it's making.
+    Uint8* window = z->window;
+    while (len)
+    {
+      int room = INFLATE_FLUSH - z->outPos % INFLATE_FLUSH;
+      int n = len < room ? len : room;
+      Uint64 to = z->outPos, from = to - dist;
+      for (int i=0; i < n; ++i)
+        window[(to + i) & INFLATE_WINDOW_MASK] = window[(from + i) & INFLATE_WINDOW_MASK];
+      z->outPos += n;
+      len -= n;
+      if (n == room && Flush(z) < 0)
+        return -1;
+    }
+  }
+}
+
+static int InflateFixed(Inflater* z)
+{
+  Uint8 lengths[INFLATE_LITERALS];
+  int i = 0;
+  for (; i < 144; ++i) lengths[i] = 8;
+  for (; i < 256; ++i) lengths[i] = 9;
+  for (; i < 280; ++i) lengths[i] = 7;
+  for (; i < INFLATE_LITERALS; ++i) lengths[i] = 8;
+  if (BuildHuffman(z, &z->literals, lengths, INFLATE_LITERALS) < 0)
+    return -1;
+  memset(lengths, 5, INFLATE_DISTANCES);
+  if (BuildHuffman(z, &z->distances, lengths, INFLATE_DISTANCES) < 0)
+    return -1;
+  return InflateCodes(z);
+}
+
+static int InflateDynamic(Inflater* z)
+{
+  int nLiterals = GetBits(z, 5) + 257;
+  int nDistances = GetBits(z, 5) + 1;
+  int nCodeLengths = GetBits(z, 4) + 4;
+  if (z->error)
+    return -1;
+  if (nLiterals > 286 || nDistances > INFLATE_DISTANCES)
+    return Fail(z, "bad code counts");
+  Uint8 lengths[INFLATE_LITERALS + INFLATE_DISTANCES];
+  memset(lengths, 0, 19);
+  for (int i=0; i < nCodeLengths; ++i)
+  {
+    int len = GetBits(z, 3);
+    if (len < 0)
+      return -1;
+    lengths[CODE_LENGTH_ORDER[i]] = len;
+  }
+  // The literal and distance code lengths are themselves Huffman coded,
+  // with run lengths.
+  if (BuildHuffman(z, &z->literals, lengths, 19) < 0)
+    return -1;
+  int n = nLiterals + nDistances;
+  for (int i=0; i < n; )
+  {
+    int symbol = DecodeSymbol(z, &z->literals);
+    if (symbol < 0)
+      return -1;
+    if (symbol < 16)
+    {
+      lengths[i++] = symbol;
+      continue;
+    }
+    int len = 0, repeat;
+    if (symbol == 16)
+    {
+      if (i == 0)
+        return Fail(z, "repeat with no length");
+      len = lengths[i - 1];
+      repeat = 3 + GetBits(z, 2);
+    }
+    else if (symbol == 17)
+      repeat = 3 + GetBits(z, 3);
+    else
+      repeat = 11 + GetBits(z, 7);
+    if (z->error)
+      return -1;
+    if (i + repeat > n)
+      return Fail(z, "too many code lengths");
+    while (repeat--)
+      lengths[i++] = len;
+  }
+  if (!lengths[256])
+    return Fail(z, "no end of block code");
+  if (BuildHuffman(z, &z->literals, lengths, nLiterals) < 0
+      || BuildHuffman(z, &z->distances, lengths + nLiterals, nDistances) < 0)
+    return -1;
+  return InflateCodes(z);
+}
+
+static int InflateBlocks(Inflater* z)
+{
+  int last;
+  do
+  {
+    last = GetBits(z, 1);
+    int type = GetBits(z, 2);
+    if (z->error)
+      return -1;
+    int result = type == 0 ? InflateStored(z)
+      : type == 1 ? InflateFixed(z)
+      : type == 2 ? InflateDynamic(z)
+      : Fail(z, "bad block type");
+    if (result < 0)
+      return -1;
+  } while (!last);
+  return Flush(z);
+}
+
+static int SkipGzipString(Inflater* z)
+{
+  int byte;
+  while ((byte = GetBits(z, 8)) > 0)
+    ;
+  return byte;
+}
+
+static int ReadHeader(Inflater* z, int format)
+{
+  if (format == INFLATE_ZLIB)
+  {
+    int cmf = GetBits(z, 8), flags = GetBits(z, 8);
+    if (z->error)
+      return -1;
+    if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || (cmf << 8 | flags) % 31)
+      return Fail(z, "bad zlib header");
+    if (flags & 0x20)
+      return Fail(z, "zlib preset dictionaries aren't supported");
+  }
+  else if (format == INFLATE_GZIP)
+  {
+    int id1 = GetBits(z, 8), id2 = GetBits(z, 8), method = GetBits(z, 8);
+    int flags = GetBits(z, 8);
+    for (int i=0; i < 6; ++i)
+      GetBits(z, 8); // time, extra flags, OS
+    if (z->error)
+      return -1;
+    if (id1 != 0x1F || id2 != 0x8B || method != 8)
+      return Fail(z, "bad gzip header");
+    if (flags & 4)
+    {
+      int len = GetBits(z, 16);
+      for (int i=0; i < len; ++i)
+        GetBits(z, 8);
+    }
+    if (flags & 8)
+      SkipGzipString(z);
+    if (flags & 16)
+      SkipGzipString(z);
+    if (flags & 2)
+      GetBits(z, 16);
+    if (z->error)
+      return -1;
+  }
+  return 0;
+}
+
+// Checks the checksum (and for gzip, the length) after the data.
+static int ReadTrailer(Inflater* z, int format)
+{
+  GetBits(z, z->nBits % 8);
+  if (format == INFLATE_ZLIB)
+  {
+    Uint32 adler = 0;
+    for (int i=0; i < 4; ++i)
+      adler = adler << 8 | GetBits(z, 8);
+    if (z->error)
+      return -1;
+    if (adler != z->adler)
+      return Fail(z, "zlib checksum mismatch");
+  }
+  else if (format == INFLATE_GZIP)
+  {
+    Uint32 crc = 0, size = 0;
+    for (int i=0; i < 4; ++i)
+      crc |= (Uint32)GetBits(z, 8) << (8 * i);
+    for (int i=0; i < 4; ++i)
+      size |= (Uint32)GetBits(z, 8) << (8 * i);
+    if (z->error)
+      return -1;
+    if (crc != z->crc || size != (Uint32)z->outPos)
+      return Fail(z, "gzip checksum mismatch");
+  }
+  return 0;
+}
+
+// Decompresses data in the given format (INFLATE_RAW, _ZLIB or _GZIP),
+// reading it with read and passing the output to write, a piece at a time.
+// Returns the size of the output, or -1 if the writer stopped it or after
+// printing what's wrong with the data.
+Sint64 Inflate(int format, InflateReader read, InflateWriter write, void* data)
+{
+  if (!crcTable[1])
+  {
+    for (Uint32 i=0; i < 256; ++i)
+    {
+      Uint32 c = i;
+      for (int k=0; k < 8; ++k)
+        c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      crcTable[i] = c;
+    }
+  }
+  Inflater* z = MallocOrDie(sizeof(Inflater));
+  z->read = read;
+  z->write = write;
+  z->data = data;
+  z->format = format;
+  z->adler = 1;
+  Sint64 size = -1;
+  if (ReadHeader(z, format) == 0 && InflateBlocks(z) == 0 && ReadTrailer(z, format) == 0)
+    size = z->outPos;
+  else if (!z->stopped)
+    fprintf(stderr, "Unable to decompress: %s.\n", z->error);
+  free(z);
+  return size;
+}
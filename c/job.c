@@ -0,0 +1,342 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+#include <stdatomic.h>
+
+// Job system.
+//
+// Thread 0 is the main thread, and there's a worker thread for each other
+// core. Every thread has a deque of jobs: it pushes and pops jobs at the
+// bottom of its own, and when that's empty, steals from the top of someone
+// else's (the Chase-Lev scheme), so work spreads out from whichever thread
+// created it. Job_ParallelFor splits a range into jobs and helps to run them
+// until they're all done. Jobs can start jobs of their own.
+//
+// In deterministic mode, ranges are always split at multiples of the grain,
+// however many threads there are. Jobs that keep per-chunk results, to be
+// combined in chunk order afterwards, then get the same answers as they
+// would on one thread.
+//
+// The deque's top and bottom are C11 atomics with the orderings from Le et
+// al., "Correct and Efficient Work-Stealing for Weak Memory Models": a
+// release fence publishes a pushed job before the new bottom, and a full
+// fence between storing bottom and loading top (on both sides) keeps the
+// owner and a thief from both taking the last job.
+
+// Jobs each deque can hold. Must be a power of two.
+#define JOB_DEQUE_SIZE 1024
+// Outside of deterministic mode, ranges are split into about this many
+// jobs per thread, so that there's something left to steal.
+static const int JOBS_PER_THREAD = 4;
+// Failed attempts to find a job before a waiting thread yields its core.
+static const int SPINS_BEFORE_YIELD = 64;
+
+typedef struct JobBatch {
+  SDL_atomic_t remaining;
+} JobBatch;
+
+typedef struct Job {
+  JobFunction function;
+  void* data;
+  int chunk, first, end;
+  JobBatch* batch;
+} Job;
+
+typedef struct JobDeque {
+  atomic_int top; // thieves take jobs from here
+  char topPadding[64 - sizeof(atomic_int)];
+  atomic_int bottom; // the owner pushes and pops here
+  char bottomPadding[64 - sizeof(atomic_int)];
+  Uint32 jobsRun, jobsStolen; // by the owner
+  Job jobs[JOB_DEQUE_SIZE];
+} JobDeque;
+
+static struct JobSystem {
+  int nThreads; // 0 until Job_Init
+  int deterministic;
+  JobDeque* deques;
+  SDL_Thread** threads;
+  SDL_mutex* lock;
+  SDL_cond* wake; // signalled when jobs are pushed
+  SDL_atomic_t queued; // jobs pushed and not yet taken
+  SDL_atomic_t quitting;
+} jobs;
+
+static _Thread_local int threadIndex;
+static _Thread_local Uint32 stealSeed;
+
+// Adds a job at the bottom of the deque. Returns 0 if it's full.
+static int Deque_Push(JobDeque* deque, const Job* job)
+{
+  int bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+  int top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  if (bottom - top >= JOB_DEQUE_SIZE)
+    return 0;
+  deque->jobs[bottom & (JOB_DEQUE_SIZE - 1)] = *job;
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  return 1;
+}
+
+// Takes the job at the bottom of the owner's deque. Returns 0 if it's empty.
+static int Deque_Pop(JobDeque* deque, Job* job)
+{
+  int bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+  atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+  int top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+  if (top > bottom)
+  {
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+  }
+  *job = deque->jobs[bottom & (JOB_DEQUE_SIZE - 1)];
+  if (top < bottom)
+    return 1;
+  // Last job: race any thieves for it.
+  int won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+      memory_order_seq_cst, memory_order_relaxed);
+  atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+  return won;
+}
+
+// Takes the job at the top of someone else's deque. Returns 0 if it's empty
+// or another thread got there first.
+static int Deque_Steal(JobDeque* deque, Job* job)
+{
+  int top = atomic_load_explicit(&deque->top, memory_order_acquire);
+  atomic_thread_fence(memory_order_seq_cst);
+  int bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+  if (top >= bottom)
+    return 0;
+  *job = deque->jobs[top & (JOB_DEQUE_SIZE - 1)];
+  return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+      memory_order_seq_cst, memory_order_relaxed);
+}
+
+static int FindJob(Job* job)
+{
+  JobDeque* own = &jobs.deques[threadIndex];
+  if (!Deque_Pop(own, job))
+  {
+    // Start with a random victim so that thieves spread out.
+    stealSeed = stealSeed * 1664525 + 1013904223;
+    int first = (stealSeed >> 16) % jobs.nThreads;
+    int i = 0;
+    for (; i < jobs.nThreads; ++i)
+    {
+      int victim = (first + i) % jobs.nThreads;
+      if (victim != threadIndex && Deque_Steal(&jobs.deques[victim], job))
+        break;
+    }
+    if (i == jobs.nThreads)
+      return 0;
+    ++own->jobsStolen;
+  }
+  SDL_AtomicAdd(&jobs.queued, -1);
+  return 1;
+}
+
+static void RunJob(Job* job)
+{
+  job->function(job->data, job->chunk, job->first, job->end);
+  ++jobs.deques[threadIndex].jobsRun;
+  // The batch belongs to whoever is waiting on it, and may be gone as soon
+  // as this reaches 0.
+  SDL_AtomicAdd(&job->batch->remaining, -1);
+}
+
+static int WorkerMain(void* data)
+{
+  threadIndex = (int)(intptr_t)data;
+  stealSeed = threadIndex;
+  Job job;
+  while (!SDL_AtomicGet(&jobs.quitting))
+  {
+    if (FindJob(&job))
+    {
+      RunJob(&job);
+      continue;
+    }
+    SDL_LockMutex(jobs.lock);
+    while (SDL_AtomicGet(&jobs.queued) <= 0 && !SDL_AtomicGet(&jobs.quitting))
+      SDL_CondWait(jobs.wake, jobs.lock);
+    SDL_UnlockMutex(jobs.lock);
+  }
+  return 0;
+}
+
+// Starts the job system with nThreads threads in all, counting the main
+// thread, or one per core if nThreads is 0.
+int Job_Init(int nThreads)
+{
+  Job_Destroy();
+  if (nThreads <= 0)
+    nThreads = SDL_GetCPUCount();
+  if (nThreads > MAX_JOB_THREADS)
+    nThreads = MAX_JOB_THREADS;
+  jobs.deques = MallocOrDie(nThreads * sizeof(JobDeque));
+  for (int i=0; i < nThreads; ++i)
+  {
+    atomic_init(&jobs.deques[i].top, 0);
+    atomic_init(&jobs.deques[i].bottom, 0);
+  }
+  jobs.threads = MallocOrDie(nThreads * sizeof(SDL_Thread*));
+  jobs.lock = SDL_CreateMutex();
+  jobs.wake = SDL_CreateCond();
+  if (!jobs.lock || !jobs.wake)
+  {
+    fprintf(stderr, "Unable to create job system lock: %s\n", SDL_GetError());
+    Job_Destroy();
+    return 0;
+  }
+  SDL_AtomicSet(&jobs.queued, 0);
+  SDL_AtomicSet(&jobs.quitting, 0);
+  threadIndex = 0;
+  // Workers look at every deque, so they all need to exist up front.
+  jobs.nThreads = nThreads;
+  for (int i=1; i < nThreads; ++i)
+  {
+    jobs.threads[i] = SDL_CreateThread(WorkerMain, "job", (void*)(intptr_t)i);
+    if (!jobs.threads[i])
+    {
+      fprintf(stderr, "Unable to create job thread: %s\n", SDL_GetError());
+      Job_Destroy();
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void Job_Destroy()
+{
+  if (jobs.lock)
+  {
+    SDL_LockMutex(jobs.lock);
+    SDL_AtomicSet(&jobs.quitting, 1);
+    SDL_CondBroadcast(jobs.wake);
+    SDL_UnlockMutex(jobs.lock);
+  }
+  for (int i=1; i < jobs.nThreads; ++i)
+    if (jobs.threads[i])
+      SDL_WaitThread(jobs.threads[i], 0);
+  if (jobs.wake)
+    SDL_DestroyCond(jobs.wake);
+  if (jobs.lock)
+    SDL_DestroyMutex(jobs.lock);
+  free(jobs.deques);
+  free(jobs.threads);
+  int deterministic = jobs.deterministic;
+  memset(&jobs, 0, sizeof(jobs));
+  jobs.deterministic = deterministic;
+}
+
+void Job_SetDeterministic(int deterministic)
+{
+  jobs.deterministic = deterministic;
+}
+
+int Job_IsDeterministic()
+{
+  return jobs.deterministic;
+}
+
+// Number of threads that run jobs, including the main thread. Per-thread
+// data used by jobs can be indexed by Job_ThreadIndex.
+int Job_ThreadCount()
+{
+  return jobs.nThreads ? jobs.nThreads : 1;
+}
+
+int Job_ThreadIndex()
+{
+  return threadIndex;
+}
+
+static int ChunkSize(int count, int grain)
+{
+  int size = grain > 0 ? grain : 1;
+  if (!jobs.deterministic)
+  {
+    int balanced = count / (Job_ThreadCount() * JOBS_PER_THREAD);
+    if (balanced > size)
+      size = balanced;
+  }
+  return size;
+}
+
+// Number of chunks that Job_ParallelFor will split count items into.
+int Job_ChunkCount(int count, int grain)
+{
+  int size = ChunkSize(count, grain);
+  return (count + size - 1) / size;
+}
+
+// Calls function(data, chunk, first, end) for consecutive ranges of at
+// least grain items covering 0 to count-1, on whichever threads are free,
+// and returns when they're all done. Only call this from the main thread or
+// from jobs.
+void Job_ParallelFor(JobFunction function, void* data, int count, int grain)
+{
+  if (count <= 0)
+    return;
+  int size = ChunkSize(count, grain);
+  int nChunks = (count + size - 1) / size;
+  if (jobs.nThreads <= 1 || nChunks == 1)
+  {
+    for (int chunk=0; chunk < nChunks; ++chunk)
+    {
+      int first = chunk * size;
+      function(data, chunk, first, first + size < count ? first + size : count);
+    }
+    return;
+  }
+  JobBatch batch;
+  SDL_AtomicSet(&batch.remaining, nChunks);
+  // Push the last chunk first, so that this thread works forward from the
+  // start while thieves take from the end.
+  JobDeque* own = &jobs.deques[threadIndex];
+  int nPushed = 0;
+  for (int chunk = nChunks - 1; chunk >= 0; --chunk)
+  {
+    int first = chunk * size;
+    Job job = { function, data, chunk, first,
+      first + size < count ? first + size : count, &batch };
+    if (Deque_Push(own, &job))
+      ++nPushed;
+    else
+      RunJob(&job);
+  }
+  SDL_AtomicAdd(&jobs.queued, nPushed);
+  SDL_LockMutex(jobs.lock);
+  SDL_CondBroadcast(jobs.wake);
+  SDL_UnlockMutex(jobs.lock);
+  // Help out until the batch is done.
+  int spins = 0;
+  while (SDL_AtomicGet(&batch.remaining) > 0)
+  {
+    Job job;
+    if (FindJob(&job))
+    {
+      RunJob(&job);
+      spins = 0;
+    }
+    else if (++spins >= SPINS_BEFORE_YIELD)
+    {
+      SDL_Delay(0);
+      spins = 0;
+    }
+  }
+}
+
+JobStats Job_GetStats()
+{
+  JobStats stats = { 0, 0 };
+  for (int i=0; i < jobs.nThreads; ++i)
+  {
+    stats.jobsRun += jobs.deques[i].jobsRun;
+    stats.jobsStolen += jobs.deques[i].jobsStolen;
+  }
+  return stats;
+}
@@ -0,0 +1,335 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Lighting and field of view.
+//
+// Visibility comes from recursive shadowcasting over the eight octants
+// around the viewer, with fully opaque tiles casting shadows. Tiles that are
+// only partly opaque dim the light passing through them: the light arriving
+// at a tile is what left its parent, the previous tile on the line back to
+// the viewer, after ReduceBrightness with the parent's opacity. Past the
+// dropoff distance, light also fades linearly to nothing at the radius.
+//
+// Results are cached per viewer tile, and only thrown out when something
+// changes the opacity of a tile within the radius (see Light_InvalidateTile).
+
+// Number of viewer tiles whose results are kept.
+#define LIGHT_CACHE_SIZE 16
+// Distances are kept in sixteenths of a tile.
+#define DISTANCE_SCALE 16
+
+typedef struct LightCacheEntry {
+  Coords viewer;
+  int valid;
+  Uint32 lastUsed;
+  Uint8* brightness;
+} LightCacheEntry;
+
+// Slope of a line from the viewer, as a fraction with a positive denominator.
+typedef struct Slope { int n, d; } Slope;
+
+// Maps octant coordinates (a across, b out from the viewer, 0 <= a <= b) to
+// view offsets: x = a*xa + b*xb, y = a*ya + b*yb.
+static const int OCTANTS[8][4] = {
+  {  1,  0,  0,  1 }, {  0,  1,  1,  0 }, { -1,  0,  0,  1 }, {  0, -1,  1,  0 },
+  {  1,  0,  0, -1 }, {  0,  1, -1,  0 }, { -1,  0,  0, -1 }, {  0, -1, -1,  0 },
+};
+
+static struct LightEngine {
+  int radius, diameter, center, threshold;
+  // Per view cell: brightness lost to distance, or -1 past the radius.
+  int* falloff;
+  // Column of the parent of octant cell (a, b), at [b * (radius + 1) + a].
+  int* parentColumn;
+  // Scratch space for the computation in progress.
+  Uint8* opacity;
+  Sint16* received; // -1 until computed
+  Uint8* brightness;
+  LightCacheEntry cache[LIGHT_CACHE_SIZE];
+  TiledMap* map;
+  Uint32 clock;
+  LightStats stats;
+} light;
+
+int ReduceBrightness(int brightness, int tileOpacity)
+{
+  switch (tileOpacity)
+  {
+    case 0: break;
+    case 1: brightness -= brightness >> 3; break;
+    case 2: brightness -= brightness >> 2; break;
+    case 3: brightness >>= 2; break;
+    case 4: brightness >>= 3; break;
+    case 5: brightness >>= 4; break;
+    case 6: brightness >>= 5; break;
+    case 7: brightness = 0; break;
+    default: fprintf(stderr, "Invalid opacity level: %d\n", tileOpacity); break;
+  }
+  return brightness;
+}
+
+// The opacity level that dims full light closest to brightness, darker on
+// a tie. Used to store the combined opacity of a cell's layers in one level.
+// Looked up in a table made on first use.
+int OpacityForBrightness(int brightness)
+{
+  static Uint8 levels[MAX_LIGHT + 1];
+  static int built;
+  if (!built)
+  {
+    for (int b=0; b <= MAX_LIGHT; ++b)
+    {
+      int best = 0, bestError = abs(MAX_LIGHT - b);
+      for (int level=1; level <= MAX_TILE_OPACITY; ++level)
+      {
+        int error = abs(ReduceBrightness(MAX_LIGHT, level) - b);
+        if (error <= bestError)
+        {
+          best = level;
+          bestError = error;
+        }
+      }
+      levels[b] = best;
+    }
+    built = 1;
+  }
+  return levels[brightness];
+}
+
+void Light_Init(int radius, int dropoffDistance, int threshold)
+{
+  assert(radius > 0);
+  assert(dropoffDistance >= 0 && dropoffDistance <= radius);
+  light.radius = radius;
+  light.diameter = 2 * radius + 1;
+  light.center = radius;
+  light.threshold = threshold;
+  int nCells = light.diameter * light.diameter;
+  Light_Destroy();
+  light.falloff = MallocOrDie(nCells * sizeof(int));
+  light.opacity = MallocOrDie(nCells * sizeof(Uint8));
+  light.received = MallocOrDie(nCells * sizeof(Sint16));
+  // Distance table, a row at a time.
+  int slope = radius > dropoffDistance ? 256 / (radius - dropoffDistance) : 0;
+  struct Coords origin = { 0, 0 };
+  Sint32* xs = MallocOrDie(light.diameter * sizeof(Sint32));
+  Sint32* ys = MallocOrDie(light.diameter * sizeof(Sint32));
+  Sint32* distances = MallocOrDie(light.diameter * sizeof(Sint32));
+  for (int x=0; x < light.diameter; ++x)
+    xs[x] = (x - light.center) * DISTANCE_SCALE;
+  for (int y=0; y < light.diameter; ++y)
+  {
+    for (int x=0; x < light.diameter; ++x)
+      ys[x] = (y - light.center) * DISTANCE_SCALE;
+    Coords_BatchExactDist(origin, xs, ys, light.diameter, distances);
+    for (int x=0; x < light.diameter; ++x)
+    {
+      int distance = distances[x];
+      int* falloff = &light.falloff[y * light.diameter + x];
+      if (distance > radius * DISTANCE_SCALE)
+        *falloff = -1;
+      else if (distance > dropoffDistance * DISTANCE_SCALE)
+        *falloff = slope * (distance - dropoffDistance * DISTANCE_SCALE) / DISTANCE_SCALE;
+      else
+        *falloff = 0;
+    }
+  }
+  free(xs);
+  free(ys);
+  free(distances);
+  // Parent table. The parent of (a, b) is the tile in row b-1 nearest the
+  // line from the viewer through (a, b).
+  light.parentColumn = MallocOrDie((radius + 1) * (radius + 1) * sizeof(int));
+  for (int b=1; b <= radius; ++b)
+    for (int a=0; a <= b; ++a)
+      light.parentColumn[b * (radius + 1) + a] = (a * (b - 1) + b / 2) / b;
+  for (int i=0; i < LIGHT_CACHE_SIZE; ++i)
+  {
+    light.cache[i].valid = 0;
+    light.cache[i].brightness = MallocOrDie(nCells * sizeof(Uint8));
+  }
+}
+
+void Light_Destroy()
+{
+  free(light.falloff);
+  free(light.parentColumn);
+  free(light.opacity);
+  free(light.received);
+  for (int i=0; i < LIGHT_CACHE_SIZE; ++i)
+  {
+    free(light.cache[i].brightness);
+    light.cache[i].brightness = 0;
+    light.cache[i].valid = 0;
+  }
+  light.falloff = 0;
+  light.parentColumn = 0;
+  light.opacity = 0;
+  light.received = 0;
+  light.map = 0;
+}
+
+static int ViewIndex(int a, int b, const int* octant)
+{
+  int x = light.center + a * octant[0] + b * octant[1];
+  int y = light.center + a * octant[2] + b * octant[3];
+  return y * light.diameter + x;
+}
+
+static int SlopeLess(Slope p, Slope q)
+{
+  return p.n * q.d < q.n * p.d;
+}
+
+// Light arriving at octant cell (a, b), following parents back to the viewer.
+static int Received(int a, int b, const int* octant)
+{
+  int index = ViewIndex(a, b, octant);
+  if (light.received[index] >= 0)
+    return light.received[index];
+  int received;
+  if (b == 1)
+  {
+    received = MAX_LIGHT; // the viewer's own tile doesn't dim its light
+  }
+  else
+  {
+    int parentA = light.parentColumn[b * (light.radius + 1) + a];
+    int parentReceived = Received(parentA, b - 1, octant);
+    received = ReduceBrightness(parentReceived,
+        light.opacity[ViewIndex(parentA, b - 1, octant)]);
+  }
+  light.received[index] = received;
+  return received;
+}
+
+static void LightCell(int a, int b, const int* octant)
+{
+  int index = ViewIndex(a, b, octant);
+  ++light.stats.cellsProcessed;
+  if (light.falloff[index] < 0)
+    return; // past the radius
+  int brightness = Received(a, b, octant) - light.falloff[index];
+  if (brightness < light.threshold)
+    brightness = 0;
+  light.brightness[index] = brightness;
+}
+
+// Recursive shadowcasting over one octant, from row 'row' outward, between
+// the lines from the viewer with slopes start >= end.
+static void CastLight(int row, Slope start, Slope end, const int* octant)
+{
+  if (SlopeLess(start, end))
+    return;
+  Slope newStart = start;
+  for (int b = row; b <= light.radius; ++b)
+  {
+    int blocked = 0;
+    for (int a = b; a >= 0; --a)
+    {
+      // Slopes of the lines through the tile's outer and inner corners.
+      Slope left = { 2 * a + 1, 2 * b - 1 };
+      Slope right = { 2 * a - 1, 2 * b + 1 };
+      if (SlopeLess(start, right))
+        continue;
+      if (SlopeLess(left, end))
+        break;
+      LightCell(a, b, octant);
+      int opaque = light.opacity[ViewIndex(a, b, octant)] >= MAX_TILE_OPACITY;
+      if (blocked)
+      {
+        if (opaque)
+        {
+          newStart = right;
+          continue;
+        }
+        blocked = 0;
+        start = newStart;
+      }
+      else if (opaque && b < light.radius)
+      {
+        blocked = 1;
+        CastLight(b + 1, start, left, octant);
+        newStart = right;
+      }
+    }
+    if (blocked)
+      break;
+  }
+}
+
+static void ComputeLight(TiledMap* map, int viewerX, int viewerY, Uint8* brightness)
+{
+  ++light.stats.computes;
+  int nCells = light.diameter * light.diameter;
+  for (int y=0; y < light.diameter; ++y)
+    TiledMap_ReadOpacityRow(map, viewerX - light.center, viewerY + y - light.center,
+        light.diameter, &light.opacity[y * light.diameter]);
+  memset(light.received, 0xFF, nCells * sizeof(Sint16));
+  memset(brightness, 0, nCells);
+  light.brightness = brightness;
+  // The tile that the viewer is standing on is always fully lit.
+  brightness[light.center * light.diameter + light.center] = MAX_LIGHT;
+  ++light.stats.cellsProcessed;
+  Slope start = { 1, 1 }, end = { 0, 1 };
+  for (int o=0; o < 8; ++o)
+    CastLight(1, start, end, OCTANTS[o]);
+}
+
+// Returns the brightness of each tile in the (2 * radius + 1)^2 square
+// centered on the viewer, row by row. The result stays valid until the next
+// call.
+const Uint8* Light_Compute(TiledMap* map, int viewerX, int viewerY)
+{
+  ++light.clock;
+  ++light.stats.lookups;
+  if (map != light.map)
+  {
+    Light_InvalidateAll();
+    light.map = map;
+  }
+  LightCacheEntry* entry = 0;
+  for (int i=0; i < LIGHT_CACHE_SIZE; ++i)
+  {
+    LightCacheEntry* e = &light.cache[i];
+    if (e->valid && e->viewer.x == viewerX && e->viewer.y == viewerY)
+    {
+      e->lastUsed = light.clock;
+      ++light.stats.hits;
+      return e->brightness;
+    }
+    // Reuse an empty entry if there is one, otherwise the least recently used.
+    if (!entry || (entry->valid && (!e->valid || e->lastUsed < entry->lastUsed)))
+      entry = e;
+  }
+  ComputeLight(map, viewerX, viewerY, entry->brightness);
+  entry->viewer.x = viewerX;
+  entry->viewer.y = viewerY;
+  entry->valid = 1;
+  entry->lastUsed = light.clock;
+  return entry->brightness;
+}
+
+// Call when the opacity of map tile (x, y) changes.
+void Light_InvalidateTile(int x, int y)
+{
+  for (int i=0; i < LIGHT_CACHE_SIZE; ++i)
+  {
+    LightCacheEntry* e = &light.cache[i];
+    if (Abs(e->viewer.x - x) <= light.radius && Abs(e->viewer.y - y) <= light.radius)
+      e->valid = 0;
+  }
+}
+
+void Light_InvalidateAll()
+{
+  for (int i=0; i < LIGHT_CACHE_SIZE; ++i)
+    light.cache[i].valid = 0;
+}
+
+LightStats Light_GetStats()
+{
+  return light.stats;
+}
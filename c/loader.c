@@ -0,0 +1,308 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+#include <SDL_image.h>
+
+// Asset loader.
+//
+// Images can be loaded without holding up the game. Loader_Request queues
+// an image and returns a ticket; loader threads read and decode it into a
+// surface, and Loader_Upload, called once a frame on the main thread, makes
+// textures of the finished surfaces for as long as its time budget allows
+// (textures can only be made on the thread that draws). Until then, the
+// image is drawn as a placeholder.
+//
+// While the atlas is being collected, finished surfaces go to the atlas
+// instead, and without a renderer they're ready as soon as they're decoded.
+// They're recorded for the asset bundle as they're uploaded.
+
+#define LOADER_THREADS 2
+
+typedef enum LoadState {
+  LOAD_QUEUED, LOAD_DECODING, LOAD_DECODED, LOAD_DONE
+} LoadState;
+
+typedef struct LoadRequest {
+  const char* path;
+  LoadState state;
+  int status; // LOAD_PENDING until done
+  SDL_Surface* sfc;
+  SDL_Texture* tex;
+  Uint64 requestTime;
+} LoadRequest;
+
+static struct Loader {
+  SDL_Thread* threads[LOADER_THREADS];
+  int nThreads;
+  SDL_mutex* lock;
+  SDL_cond* wake; // signalled when requests are queued or on quitting
+  SDL_cond* decoded; // signalled when a request is decoded
+  int quitting;
+  // Tickets are indexes into requests, plus one. Requests are decoded in
+  // the order they're made, so the ones from nextToDecode on are queued.
+  LoadRequest* requests;
+  int nRequests, capacity;
+  int nextToDecode, nDecoding;
+  int* uploadQueue; // decoded, in the order they finished
+  int uploadHead, uploadLength, uploadCapacity;
+  int peakQueueDepth;
+  Uint32 nLoaded, nFailed;
+  TimeSamples latency; // from request to done
+} loader;
+
+static int LoaderMain(void* data)
+{
+  (void)data;
+  SDL_LockMutex(loader.lock);
+  while (!loader.quitting)
+  {
+    if (loader.nextToDecode == loader.nRequests)
+    {
+      SDL_CondWait(loader.wake, loader.lock);
+      continue;
+    }
+    int index = loader.nextToDecode++;
+    loader.requests[index].state = LOAD_DECODING;
+    ++loader.nDecoding;
+    const char* path = loader.requests[index].path;
+    SDL_UnlockMutex(loader.lock);
+    SDL_Surface* sfc = Bundle_LoadSurface(path);
+    if (!sfc)
+      sfc = IMG_Load(path);
+    if (!sfc)
+      fprintf(stderr, "Failed to load image '%s'. %s\n", path, IMG_GetError());
+    SDL_LockMutex(loader.lock);
+    // The requests may have moved while the lock was released.
+    LoadRequest* request = &loader.requests[index];
+    request->sfc = sfc;
+    request->state = LOAD_DECODED;
+    --loader.nDecoding;
+    if (loader.uploadLength == loader.uploadCapacity)
+    {
+      int capacity = loader.uploadCapacity ? 2 * loader.uploadCapacity : 64;
+      int* queue = MallocOrDie(capacity * sizeof(int));
+      for (int i=0; i < loader.uploadLength; ++i)
+        queue[i] = loader.uploadQueue[(loader.uploadHead + i) % loader.uploadCapacity];
+      free(loader.uploadQueue);
+      loader.uploadQueue = queue;
+      loader.uploadHead = 0;
+      loader.uploadCapacity = capacity;
+    }
+    loader.uploadQueue[(loader.uploadHead + loader.uploadLength++) % loader.uploadCapacity] = index;
+    SDL_CondBroadcast(loader.decoded);
+  }
+  SDL_UnlockMutex(loader.lock);
+  return 0;
+}
+
+int Loader_Init()
+{
+  Loader_Destroy();
+  loader.lock = SDL_CreateMutex();
+  loader.wake = SDL_CreateCond();
+  loader.decoded = SDL_CreateCond();
+  if (!loader.lock || !loader.wake || !loader.decoded)
+  {
+    fprintf(stderr, "Unable to create asset loader lock: %s\n", SDL_GetError());
+    Loader_Destroy();
+    return 0;
+  }
+  for (int i=0; i < LOADER_THREADS; ++i)
+  {
+    loader.threads[i] = SDL_CreateThread(LoaderMain, "loader", 0);
+    if (!loader.threads[i])
+    {
+      fprintf(stderr, "Unable to create asset loader thread: %s\n", SDL_GetError());
+      Loader_Destroy();
+      return 0;
+    }
+    ++loader.nThreads;
+  }
+  return 1;
+}
+
+// Stops the loader threads. Images that were loaded stay loaded.
+void Loader_Destroy()
+{
+  if (loader.lock)
+  {
+    SDL_LockMutex(loader.lock);
+    loader.quitting = 1;
+    SDL_CondBroadcast(loader.wake);
+    SDL_UnlockMutex(loader.lock);
+  }
+  for (int i=0; i < loader.nThreads; ++i)
+    SDL_WaitThread(loader.threads[i], 0);
+  // Surfaces never handed out.
+  for (int i=0; i < loader.nRequests; ++i)
+    if (loader.requests[i].state == LOAD_DECODED && loader.requests[i].sfc)
+      SDL_FreeSurface(loader.requests[i].sfc);
+  if (loader.decoded)
+    SDL_DestroyCond(loader.decoded);
+  if (loader.wake)
+    SDL_DestroyCond(loader.wake);
+  if (loader.lock)
+    SDL_DestroyMutex(loader.lock);
+  free(loader.requests);
+  free(loader.uploadQueue);
+  TimeSamples_Free(&loader.latency);
+  memset(&loader, 0, sizeof(loader));
+}
+
+// Queues an image to load. Returns a ticket for Loader_GetResult. The path
+// has to last until the image is loaded.
+int Loader_Request(const char* path)
+{
+  assert(loader.lock);
+  SDL_LockMutex(loader.lock);
+  if (loader.nRequests == loader.capacity)
+  {
+    int capacity = loader.capacity ? 2 * loader.capacity : 64;
+    LoadRequest* requests = MallocOrDie(capacity * sizeof(LoadRequest));
+    if (loader.nRequests)
+      memcpy(requests, loader.requests, loader.nRequests * sizeof(LoadRequest));
+    free(loader.requests);
+    loader.requests = requests;
+    loader.capacity = capacity;
+  }
+  LoadRequest* request = &loader.requests[loader.nRequests++];
+  request->path = path;
+  request->state = LOAD_QUEUED;
+  request->status = LOAD_PENDING;
+  request->requestTime = SDL_GetPerformanceCounter();
+  int queueDepth = loader.nRequests - loader.nextToDecode;
+  if (queueDepth > loader.peakQueueDepth)
+    loader.peakQueueDepth = queueDepth;
+  int ticket = loader.nRequests;
+  SDL_CondSignal(loader.wake);
+  SDL_UnlockMutex(loader.lock);
+  return ticket;
+}
+
+// Waits until every image requested so far has been decoded.
+void Loader_Finish()
+{
+  SDL_LockMutex(loader.lock);
+  while (loader.nextToDecode < loader.nRequests || loader.nDecoding)
+    SDL_CondWait(loader.decoded, loader.lock);
+  SDL_UnlockMutex(loader.lock);
+}
+
+// Makes textures of decoded images until budgetUs is used up, or of all of
+// them if budgetUs is 0. At least one is done each time, so loading always
+// gets somewhere. Call from the thread that draws.
+void Loader_Upload(Uint32 budgetUs)
+{
+  if (!loader.lock)
+    return;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  Uint64 budget = (Uint64)budgetUs * SDL_GetPerformanceFrequency() / 1000000;
+  for (;;)
+  {
+    SDL_LockMutex(loader.lock);
+    if (!loader.uploadLength)
+    {
+      SDL_UnlockMutex(loader.lock);
+      break;
+    }
+    int index = loader.uploadQueue[loader.uploadHead];
+    loader.uploadHead = (loader.uploadHead + 1) % loader.uploadCapacity;
+    --loader.uploadLength;
+    LoadRequest request = loader.requests[index];
+    SDL_UnlockMutex(loader.lock);
+    // Only this thread changes requests once they're decoded.
+    request.status = request.sfc ? LOAD_READY : LOAD_FAILED;
+    // Recorded here rather than on the loader threads, like LoadImage does
+    // when the images are loaded one at a time.
+    if (request.sfc)
+      Bundle_Record(request.path, request.sfc);
+    if (request.sfc && HasRenderer())
+    {
+      if (Atlas_IsCollecting())
+        Atlas_Add(request.sfc);
+      else if (!(request.tex = SurfaceToTexture(request.sfc, 0)))
+        request.status = LOAD_FAILED;
+    }
+    Uint64 now = SDL_GetPerformanceCounter();
+    TimeSamples_Add(&loader.latency, now - request.requestTime);
+    if (request.status == LOAD_READY)
+      ++loader.nLoaded;
+    else
+      ++loader.nFailed;
+    SDL_LockMutex(loader.lock);
+    request.state = LOAD_DONE;
+    loader.requests[index] = request;
+    SDL_UnlockMutex(loader.lock);
+    if (budgetUs && now - startTime >= budget)
+      break;
+  }
+}
+
+// Returns LOAD_PENDING, LOAD_READY or LOAD_FAILED. Once it's ready, the
+// image's surface and texture are filled in. The texture is 0 if there's no
+// renderer or the image went to the atlas.
+int Loader_GetResult(int ticket, SDL_Surface** sfc, SDL_Texture** tex)
+{
+  SDL_LockMutex(loader.lock);
+  assert(ticket > 0 && ticket <= loader.nRequests);
+  LoadRequest* request = &loader.requests[ticket - 1];
+  int status = request->state == LOAD_DONE ? request->status : LOAD_PENDING;
+  *sfc = request->sfc;
+  *tex = request->tex;
+  SDL_UnlockMutex(loader.lock);
+  return status;
+}
+
+// Starts loading an image in the background. Until Loader_Poll finds it
+// done, the image has no surface or texture.
+void Loader_LoadImage(struct Image* img)
+{
+  img->sfc = 0;
+  img->tex = 0;
+  img->texX = img->texY = 0;
+  img->loadTicket = Loader_Request(img->path);
+}
+
+// Fills in the image if it has finished loading. Returns 1 once it has a
+// surface.
+int Loader_Poll(struct Image* img)
+{
+  if (!img->loadTicket)
+    return img->sfc != 0;
+  SDL_Surface* sfc;
+  SDL_Texture* tex;
+  int status = Loader_GetResult(img->loadTicket, &sfc, &tex);
+  if (status == LOAD_PENDING)
+    return 0;
+  img->loadTicket = 0;
+  img->sfc = sfc;
+  img->tex = tex;
+  return sfc != 0;
+}
+
+LoaderStats Loader_GetStats()
+{
+  LoaderStats stats = { 0 };
+  if (!loader.lock)
+    return stats;
+  SDL_LockMutex(loader.lock);
+  stats.queued = loader.nRequests - loader.nextToDecode;
+  stats.decoding = loader.nDecoding;
+  stats.awaitingUpload = loader.uploadLength;
+  stats.peakQueueDepth = loader.peakQueueDepth;
+  stats.loaded = loader.nLoaded;
+  stats.failed = loader.nFailed;
+  SDL_UnlockMutex(loader.lock);
+  return stats;
+}
+
+void Loader_PrintStats()
+{
+  LoaderStats stats = Loader_GetStats();
+  printf("LOADER: QUEUED=%d, DECODING=%d, AWAITING UPLOAD=%d, PEAK QUEUE=%d,"
+      " LOADED=%u, FAILED=%u\n",
+      stats.queued, stats.decoding, stats.awaitingUpload, stats.peakQueueDepth,
+      stats.loaded, stats.failed);
+  TimeSamples_Print(&loader.latency, "LOADER: LATENCY");
+}
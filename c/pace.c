@@ -0,0 +1,183 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+#include <math.h>
+#include <time.h>
+
+// Frame pacing on the performance counter.
+//
+// Tick and frame deadlines are counted in slots from a fixed origin, so
+// rounding never builds up however long the game runs. When the logic falls
+// behind, at most maxCatchUp ticks are run in one go; the rest are dropped,
+// which slows game time down instead of sending each frame further behind.
+//
+// Waiting is done by sleeping in SDL_Delay(1) steps while there's more time
+// left than a sleep is likely to take (from a running mean and variance of
+// how long they do take), then spinning on the counter for the rest.
+//
+// Frame times and lateness go in fixed-size histograms rather than sample
+// lists, so a game left running doesn't grow without bound.
+
+// First guess at how long SDL_Delay(1) takes, in milliseconds.
+static const double FIRST_SLEEP_GUESS_MS = 2;
+// Weight of each new sleep in the running estimate.
+static const double SLEEP_ESTIMATE_WEIGHT = 1.0 / 16;
+
+static Uint64 SlotTime(Pacer* pacer, Uint32 slot, Uint32 rate)
+{
+  return pacer->origin + (Uint64)slot * pacer->frequency / rate;
+}
+
+// Sets up a pacer starting now. frameRate is 0 to draw as often as the
+// renderer will (when it waits for vsync, say).
+void Pacer_Init(Pacer* pacer, Uint32 tickRate, Uint32 frameRate, int maxCatchUp)
+{
+  memset(pacer, 0, sizeof(*pacer));
+  pacer->frequency = SDL_GetPerformanceFrequency();
+  pacer->tickRate = tickRate;
+  pacer->frameRate = frameRate;
+  pacer->maxCatchUp = maxCatchUp > 0 ? maxCatchUp : 1;
+  pacer->origin = SDL_GetPerformanceCounter();
+  pacer->lastFrame = pacer->origin;
+  pacer->sleepMean = FIRST_SLEEP_GUESS_MS * pacer->frequency / 1000;
+  pacer->sleepVariance = pacer->sleepMean * pacer->sleepMean;
+  pacer->cpuStart = clock();
+}
+
+// Returns how many logic ticks to run now: those whose deadlines have
+// passed, up to maxCatchUp. Any more are dropped.
+int Pacer_TicksDue(Pacer* pacer)
+{
+  Uint64 now = SDL_GetPerformanceCounter();
+  if (now < pacer->origin)
+    return 0;
+  // The last slot that's due, rounded down and then corrected.
+  Uint32 last = (Uint32)((now - pacer->origin) * pacer->tickRate / pacer->frequency);
+  while (SlotTime(pacer, last + 1, pacer->tickRate) <= now)
+    ++last;
+  if (last < pacer->tickSlot)
+    return 0;
+  int due = last + 1 - pacer->tickSlot;
+  if (due > pacer->maxCatchUp)
+  {
+    pacer->ticksDropped += due - pacer->maxCatchUp;
+    pacer->tickSlot += due - pacer->maxCatchUp;
+    due = pacer->maxCatchUp;
+  }
+  for (int i=0; i < due; ++i)
+    TimeHistogram_Add(&pacer->tickLateness,
+        now - SlotTime(pacer, pacer->tickSlot + i, pacer->tickRate));
+  pacer->tickSlot += due;
+  pacer->ticksRun += due;
+  if (due > pacer->mostCaughtUp)
+    pacer->mostCaughtUp = due;
+  return due;
+}
+
+Uint64 Pacer_NextTick(Pacer* pacer)
+{
+  return SlotTime(pacer, pacer->tickSlot, pacer->tickRate);
+}
+
+// How far it is now from the last tick to the next, out of grain.
+int Pacer_Phase(Pacer* pacer, int grain)
+{
+  if (pacer->tickSlot == 0)
+    return 0;
+  Uint64 now = SDL_GetPerformanceCounter();
+  Uint64 next = Pacer_NextTick(pacer);
+  if (now >= next)
+    return grain;
+  Uint64 duration = next - SlotTime(pacer, pacer->tickSlot - 1, pacer->tickRate);
+  Uint64 left = next - now;
+  return left >= duration ? 0 : grain - (int)(left * grain / duration);
+}
+
+// True if it's time to draw a frame.
+int Pacer_FrameDue(Pacer* pacer)
+{
+  pacer->frameStart = SDL_GetPerformanceCounter();
+  return !pacer->frameRate
+    || pacer->frameStart >= SlotTime(pacer, pacer->frameSlot, pacer->frameRate);
+}
+
+// Call after drawing a frame.
+void Pacer_EndFrame(Pacer* pacer)
+{
+  TimeHistogram_Add(&pacer->frameTimes, pacer->frameStart - pacer->lastFrame);
+  pacer->lastFrame = pacer->frameStart;
+  ++pacer->framesDrawn;
+  if (!pacer->frameRate)
+    return;
+  Uint64 deadline = SlotTime(pacer, pacer->frameSlot, pacer->frameRate);
+  TimeHistogram_Add(&pacer->frameLateness, pacer->frameStart - deadline);
+  // After a slow frame, skip the slots it missed rather than drawing a
+  // burst of frames to make them up.
+  Uint64 now = SDL_GetPerformanceCounter();
+  Uint32 current = (Uint32)((now - pacer->origin) * pacer->frameRate / pacer->frequency);
+  pacer->frameSlot = current > pacer->frameSlot + 1 ? current : pacer->frameSlot + 1;
+}
+
+// Waits until deadline (a performance counter value).
+void Pacer_SleepUntil(Pacer* pacer, Uint64 deadline)
+{
+  Uint64 now = SDL_GetPerformanceCounter();
+  while (!pacer->spin && now < deadline
+      && deadline - now > pacer->sleepMean + sqrt(pacer->sleepVariance))
+  {
+    SDL_Delay(1);
+    Uint64 woke = SDL_GetPerformanceCounter();
+    double delta = (double)(woke - now) - pacer->sleepMean;
+    pacer->sleepMean += SLEEP_ESTIMATE_WEIGHT * delta;
+    pacer->sleepVariance = (1 - SLEEP_ESTIMATE_WEIGHT)
+      * (pacer->sleepVariance + SLEEP_ESTIMATE_WEIGHT * delta * delta);
+    pacer->asleep += woke - now;
+    now = woke;
+  }
+  while (now < deadline)
+  {
+    if (pacer->spin)
+      SDL_Delay(0);
+    now = SDL_GetPerformanceCounter();
+  }
+}
+
+// Waits for the next tick or frame, whichever is first. Doesn't wait if
+// the frame rate isn't capped.
+void Pacer_Wait(Pacer* pacer)
+{
+  if (!pacer->frameRate)
+    return;
+  Uint64 nextTick = Pacer_NextTick(pacer);
+  Uint64 nextFrame = SlotTime(pacer, pacer->frameSlot, pacer->frameRate);
+  Pacer_SleepUntil(pacer, nextTick < nextFrame ? nextTick : nextFrame);
+}
+
+// Prints the rates, the share of the time spent asleep and on the CPU (by
+// every thread, so it can pass 100%; where clock() measures wall time, as
+// on Windows, it's meaningless), and the spread of frame times and of how
+// late ticks and frames started.
+void Pacer_Print(Pacer* pacer, const char* name)
+{
+  double seconds = (double)(SDL_GetPerformanceCounter() - pacer->origin) / pacer->frequency;
+  double cpuSeconds = (double)(clock() - pacer->cpuStart) / CLOCKS_PER_SEC;
+  printf("%s: SECONDS=%.3f, TICKS=%u, DROPPED=%u, MOST CAUGHT UP=%d, FRAMES=%u, FPS=%.1f,"
+      " CPU=%.1f%%, ASLEEP=%.1f%%\n", name, seconds, pacer->ticksRun, pacer->ticksDropped,
+      pacer->mostCaughtUp, pacer->framesDrawn, seconds > 0 ? pacer->framesDrawn / seconds : 0,
+      seconds > 0 ? 100 * cpuSeconds / seconds : 0,
+      seconds > 0 ? 100.0 * pacer->asleep / pacer->frequency / seconds : 0);
+  char label[64];
+  if (pacer->framesDrawn)
+  {
+    snprintf(label, sizeof(label), "%s: FRAME", name);
+    TimeHistogram_Print(&pacer->frameTimes, label);
+  }
+  if (pacer->frameRate)
+  {
+    snprintf(label, sizeof(label), "%s: FRAME LATE", name);
+    TimeHistogram_Print(&pacer->frameLateness, label);
+  }
+  snprintf(label, sizeof(label), "%s: TICK LATE", name);
+  TimeHistogram_Print(&pacer->tickLateness, label);
+}
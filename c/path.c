@@ -0,0 +1,1028 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Pathfinding over the map's obstacle plane.
+//
+// Movement is in eight directions, without cutting corners: a diagonal step
+// needs both of the cells beside it to be open. Short paths are found with
+// jump point search. Long ones go through an abstract graph (HPA*): the map
+// is split into square clusters, each border between two clusters gets a
+// portal for every open stretch, and each cluster caches the costs between
+// its own portals. The abstract path is then refined a leg at a time with
+// jump point search. Clusters are built when a search first reaches them
+// and rebuilt after Path_InvalidateTile.
+//
+// Every open tile is also labelled with its connected area, so that
+// requests for unreachable goals fail without searching. The labels are
+// redone on the next request after a tile changes.
+//
+// The map loads chunks as their cells are read, which only the main thread
+// may do, so the searches use a copy of the obstacle plane for the whole
+// map. It's made with the first labels and kept up by Path_InvalidateTile.
+//
+// NPCs queue requests with Path_Request, and Path_Update resolves as many
+// as fit in the tick's time budget, spread over the job threads. Each
+// thread has its own search state; the cluster cache is shared.
+
+// Cost of a straight and a diagonal step.
+#define STRAIGHT_COST 10
+#define DIAGONAL_COST 14
+// Size (in tiles) of the clusters unless Path_Init is given one.
+static const int DEFAULT_CLUSTER_SIZE = 32;
+// Paths shorter than this (in tiles) are searched directly, first within a
+// window around the start and goal this much larger on each side.
+static const int SHORT_PATH_DISTANCE = 48;
+static const int SHORT_PATH_MARGIN = 16;
+// Open stretches of border at least this long get a portal at each end
+// instead of one in the middle.
+static const int WIDE_ENTRANCE = 6;
+// Requests resolved in each batch per job thread.
+static const int REQUESTS_PER_THREAD = 4;
+// Requests resolved by each Path_Update in deterministic mode.
+static const int DETERMINISTIC_REQUESTS = 16;
+
+static const int DIRECTIONS[8][2] = {
+  { 1, 0 }, { -1, 0 }, { 0, 1 }, { 0, -1 }, { 1, 1 }, { 1, -1 }, { -1, 1 }, { -1, -1 },
+};
+
+// Min-heap of cells keyed on f = g + h, packed into one 64-bit key so
+// that ties compare by cell. Stale entries are skipped when popped.
+typedef struct PathHeap {
+  Uint64* items;
+  int n, capacity;
+} PathHeap;
+
+typedef struct PathEdge { int to, cost; } PathEdge;
+
+// A cluster's portals and the paths between them.
+typedef struct PathCluster {
+  SDL_atomic_t valid;
+  int nNodes, capacity;
+  int* cells; // map cell of each portal on this cluster's side
+  int* across; // the cell facing it in the neighbouring cluster
+  // Node i's edges within the cluster are edges[firstEdge[i]] up to
+  // edges[firstEdge[i + 1]].
+  int* firstEdge;
+  PathEdge* edges;
+} PathCluster;
+
+// Search state of a tile, valid where the stamps match the search's. Kept
+// together so that a visit touches one cache line.
+typedef struct SearchNode {
+  Sint32 g, parent;
+  Uint32 seen, closed;
+} SearchNode;
+
+typedef struct PathRequest {
+  int inUse, status;
+  int queued; // its index is in the queue, so it can't be reused yet
+  Coords start, goal;
+  Path path;
+} PathRequest;
+
+// Everything a search changes. Each job thread has its own, allocated
+// when it first searches.
+typedef struct PathSearch {
+  SDL_Rect window; // tiles outside are treated as obstacles
+  // Search state for the whole map.
+  SearchNode* nodes;
+  Uint32 stamp;
+  PathHeap heap;
+  // Search state within one cluster, indexed relative to its corner.
+  Sint32* localG;
+  Uint32 *localSeen, *localClosed;
+  Uint32 localStamp;
+  PathHeap localHeap;
+  // Scratch lists.
+  int *scratchCells, *startCosts, *goalCosts;
+  int scratchCapacity, costsCapacity;
+  PathStats stats;
+} PathSearch;
+
+static struct Pathfinder {
+  TiledMap* map;
+  SDL_Rect mapRect;
+  int clusterSize, clusterCols, clusterRows;
+  PathCluster* clusters;
+  SDL_mutex* clusterLock; // held while building a cluster
+  // Copy of the map's obstacle bits, a row of obstacleStride words at a
+  // time, or 0 until it's made.
+  Uint64* obstacles;
+  int obstacleStride;
+  // Connected area of each tile, 0 for obstacles.
+  Sint32* areas;
+  int areasValid;
+  PathSearch searches[MAX_JOB_THREADS];
+  // Requests, and the queue of pending ones as a ring of request indexes.
+  // Each request is allocated on its own, so results don't move when the
+  // table grows.
+  PathRequest** requests;
+  int nRequests;
+  int* queue;
+  int queueHead, queueLength, queueCapacity;
+  // Requests being resolved by Path_Update.
+  int* batch;
+  int batchCapacity;
+  Uint32 nRequested;
+} pf;
+
+static void Heap_Push(PathHeap* heap, Uint32 f, int cell)
+{
+  if (heap->n == heap->capacity)
+  {
+    int capacity = heap->capacity ? 2 * heap->capacity : 1024;
+    Uint64* items = MallocOrDie(capacity * sizeof(Uint64));
+    if (heap->n)
+      memcpy(items, heap->items, heap->n * sizeof(Uint64));
+    free(heap->items);
+    heap->items = items;
+    heap->capacity = capacity;
+  }
+  Uint64 item = ((Uint64)f << 32) | (Uint32)cell;
+  int i = heap->n++;
+  while (i > 0 && heap->items[(i - 1) / 2] > item)
+  {
+    heap->items[i] = heap->items[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap->items[i] = item;
+}
+
+// Returns the cell with the lowest f, or -1 if the heap is empty.
+static int Heap_Pop(PathHeap* heap)
+{
+  if (heap->n == 0)
+    return -1;
+  int cell = (int)(Uint32)heap->items[0];
+  Uint64 last = heap->items[--heap->n];
+  int i = 0;
+  for (;;)
+  {
+    int child = 2 * i + 1;
+    if (child >= heap->n)
+      break;
+    if (child + 1 < heap->n && heap->items[child + 1] < heap->items[child])
+      ++child;
+    if (heap->items[child] >= last)
+      break;
+    heap->items[i] = heap->items[child];
+    i = child;
+  }
+  heap->items[i] = last;
+  return cell;
+}
+
+static inline int IsObstacle(int x, int y)
+{
+  if (x < 0 || y < 0 || x >= pf.mapRect.w || y >= pf.mapRect.h)
+    return 1;
+  return pf.obstacles[y * pf.obstacleStride + (x >> 6)] >> (x & 63) & 1;
+}
+
+static void CopyObstacle(int x, int y)
+{
+  Uint64* word = &pf.obstacles[y * pf.obstacleStride + (x >> 6)];
+  Uint64 bit = (Uint64)1 << (x & 63);
+  *word = TiledMap_IsObstacle(pf.map, x, y) ? (*word | bit) : (*word & ~bit);
+}
+
+static int Walkable(PathSearch* s, int x, int y)
+{
+  return x >= s->window.x && y >= s->window.y
+    && x < s->window.x + s->window.w && y < s->window.y + s->window.h
+    && !IsObstacle(x, y);
+}
+
+// The rectangle from (x0, y0) to (x1, y1) inclusive, widened by margin and
+// clipped to the map.
+static SDL_Rect Window(int x0, int y0, int x1, int y1, int margin)
+{
+  SDL_Rect window;
+  window.x = (x0 < x1 ? x0 : x1) - margin;
+  window.y = (y0 < y1 ? y0 : y1) - margin;
+  x1 = (x0 > x1 ? x0 : x1) + margin + 1;
+  y1 = (y0 > y1 ? y0 : y1) + margin + 1;
+  if (window.x < 0) window.x = 0;
+  if (window.y < 0) window.y = 0;
+  window.w = (x1 < pf.map->width ? x1 : pf.map->width) - window.x;
+  window.h = (y1 < pf.map->height ? y1 : pf.map->height) - window.y;
+  return window;
+}
+
+// True if a step from (x, y) by (dx, dy) is allowed.
+static int CanStep(PathSearch* s, int x, int y, int dx, int dy)
+{
+  return Walkable(s, x + dx, y + dy)
+    && (!dx || !dy || (Walkable(s, x + dx, y) && Walkable(s, x, y + dy)));
+}
+
+// Cost of the cheapest unobstructed path across the given offset.
+static int Octile(int dx, int dy)
+{
+  dx = Abs(dx);
+  dy = Abs(dy);
+  return dx < dy
+    ? DIAGONAL_COST * dx + STRAIGHT_COST * (dy - dx)
+    : DIAGONAL_COST * dy + STRAIGHT_COST * (dx - dy);
+}
+
+static void EnsureScratch(PathSearch* s, int n)
+{
+  if (n <= s->scratchCapacity)
+    return;
+  free(s->scratchCells);
+  s->scratchCapacity = 2 * n;
+  s->scratchCells = MallocOrDie(s->scratchCapacity * sizeof(int));
+}
+
+static void EnsureCostLists(PathSearch* s, int n)
+{
+  if (n <= s->costsCapacity)
+    return;
+  free(s->startCosts);
+  free(s->goalCosts);
+  s->costsCapacity = 2 * n;
+  s->startCosts = MallocOrDie(s->costsCapacity * sizeof(int));
+  s->goalCosts = MallocOrDie(s->costsCapacity * sizeof(int));
+}
+
+static void Path_Append(Path* path, int x, int y)
+{
+  if (path->nWaypoints == path->capacity)
+  {
+    int capacity = path->capacity ? 2 * path->capacity : 16;
+    Coords* waypoints = MallocOrDie(capacity * sizeof(Coords));
+    if (path->nWaypoints)
+      memcpy(waypoints, path->waypoints, path->nWaypoints * sizeof(Coords));
+    free(path->waypoints);
+    path->waypoints = waypoints;
+    path->capacity = capacity;
+  }
+  path->waypoints[path->nWaypoints].x = x;
+  path->waypoints[path->nWaypoints].y = y;
+  ++path->nWaypoints;
+}
+
+void Path_Init(TiledMap* map, int clusterSize)
+{
+  Path_Destroy();
+  pf.map = map;
+  pf.mapRect.w = map->width;
+  pf.mapRect.h = map->height;
+  pf.clusterSize = clusterSize > 0 ? clusterSize : DEFAULT_CLUSTER_SIZE;
+  pf.clusterCols = (map->width + pf.clusterSize - 1) / pf.clusterSize;
+  pf.clusterRows = (map->height + pf.clusterSize - 1) / pf.clusterSize;
+  pf.clusters = MallocOrDie(pf.clusterCols * pf.clusterRows * sizeof(PathCluster));
+  size_t nCells = (size_t)map->width * map->height;
+  pf.areas = MallocOrDie(nCells * sizeof(Sint32));
+  pf.clusterLock = SDL_CreateMutex();
+  if (!pf.clusterLock)
+    fprintf(stderr, "Unable to create path cluster lock: %s\n", SDL_GetError());
+}
+
+// The calling job thread's search state.
+static PathSearch* GetSearch()
+{
+  PathSearch* s = &pf.searches[Job_ThreadIndex()];
+  if (!s->nodes)
+  {
+    s->window = pf.mapRect;
+    s->nodes = MallocOrDie((size_t)pf.map->width * pf.map->height * sizeof(SearchNode));
+    int nLocalCells = pf.clusterSize * pf.clusterSize;
+    s->localG = MallocOrDie(nLocalCells * sizeof(Sint32));
+    s->localSeen = MallocOrDie(nLocalCells * sizeof(Uint32));
+    s->localClosed = MallocOrDie(nLocalCells * sizeof(Uint32));
+  }
+  return s;
+}
+
+void Path_Destroy()
+{
+  if (pf.clusters)
+  {
+    for (int i=0; i < pf.clusterCols * pf.clusterRows; ++i)
+    {
+      free(pf.clusters[i].cells);
+      free(pf.clusters[i].across);
+      free(pf.clusters[i].firstEdge);
+      free(pf.clusters[i].edges);
+    }
+  }
+  for (int i=0; i < pf.nRequests; ++i)
+  {
+    free(pf.requests[i]->path.waypoints);
+    free(pf.requests[i]);
+  }
+  for (int i=0; i < MAX_JOB_THREADS; ++i)
+  {
+    PathSearch* s = &pf.searches[i];
+    free(s->nodes);
+    free(s->localG); free(s->localSeen); free(s->localClosed);
+    free(s->heap.items); free(s->localHeap.items);
+    free(s->scratchCells); free(s->startCosts); free(s->goalCosts);
+  }
+  if (pf.clusterLock)
+    SDL_DestroyMutex(pf.clusterLock);
+  free(pf.clusters);
+  free(pf.obstacles);
+  free(pf.areas);
+  free(pf.requests); free(pf.queue); free(pf.batch);
+  memset(&pf, 0, sizeof(pf));
+}
+
+static int ClusterOf(int x, int y)
+{
+  return (y / pf.clusterSize) * pf.clusterCols + x / pf.clusterSize;
+}
+
+// The cluster's cells, clipped to the map, with exclusive ends.
+static void ClusterBounds(int cluster, int* x0, int* y0, int* x1, int* y1)
+{
+  *x0 = (cluster % pf.clusterCols) * pf.clusterSize;
+  *y0 = (cluster / pf.clusterCols) * pf.clusterSize;
+  *x1 = *x0 + pf.clusterSize < pf.map->width ? *x0 + pf.clusterSize : pf.map->width;
+  *y1 = *y0 + pf.clusterSize < pf.map->height ? *y0 + pf.clusterSize : pf.map->height;
+}
+
+// Dijkstra's algorithm from (startX, startY) without leaving the given
+// bounds. Read the results with LocalCost.
+static void LocalSearch(PathSearch* s, int startX, int startY, int x0, int y0, int x1, int y1)
+{
+  int w = pf.clusterSize;
+  Uint32 stamp = ++s->localStamp;
+  s->localHeap.n = 0;
+  int start = (startY - y0) * w + (startX - x0);
+  s->localG[start] = 0;
+  s->localSeen[start] = stamp;
+  Heap_Push(&s->localHeap, 0, start);
+  int local;
+  while ((local = Heap_Pop(&s->localHeap)) >= 0)
+  {
+    if (s->localClosed[local] == stamp)
+      continue;
+    s->localClosed[local] = stamp;
+    int x = x0 + local % w, y = y0 + local / w;
+    for (int d=0; d < 8; ++d)
+    {
+      int dx = DIRECTIONS[d][0], dy = DIRECTIONS[d][1];
+      int nx = x + dx, ny = y + dy;
+      if (nx < x0 || nx >= x1 || ny < y0 || ny >= y1 || !CanStep(s, x, y, dx, dy))
+        continue;
+      int next = (ny - y0) * w + (nx - x0);
+      int g = s->localG[local] + (dx && dy ? DIAGONAL_COST : STRAIGHT_COST);
+      if (s->localSeen[next] == stamp && s->localG[next] <= g)
+        continue;
+      s->localSeen[next] = stamp;
+      s->localG[next] = g;
+      Heap_Push(&s->localHeap, g, next);
+    }
+  }
+}
+
+static int LocalCost(PathSearch* s, int cell, int x0, int y0)
+{
+  int x = cell % pf.map->width, y = cell / pf.map->width;
+  int local = (y - y0) * pf.clusterSize + (x - x0);
+  return s->localClosed[local] == s->localStamp ? s->localG[local] : -1;
+}
+
+static void AddNode(PathCluster* cluster, int cell, int across)
+{
+  if (cluster->nNodes == cluster->capacity)
+  {
+    int capacity = cluster->capacity ? 2 * cluster->capacity : 8;
+    int* cells = MallocOrDie(capacity * sizeof(int));
+    int* acrossCells = MallocOrDie(capacity * sizeof(int));
+    if (cluster->nNodes)
+    {
+      memcpy(cells, cluster->cells, cluster->nNodes * sizeof(int));
+      memcpy(acrossCells, cluster->across, cluster->nNodes * sizeof(int));
+    }
+    free(cluster->cells);
+    free(cluster->across);
+    cluster->cells = cells;
+    cluster->across = acrossCells;
+    cluster->capacity = capacity;
+  }
+  cluster->cells[cluster->nNodes] = cell;
+  cluster->across[cluster->nNodes] = across;
+  ++cluster->nNodes;
+}
+
+// Scans a border of length n from (x, y) in direction (stepX, stepY), where
+// the facing cells are offset by (outX, outY), adding a portal for each open
+// stretch. Both clusters scan their shared border the same way, so they
+// agree on where the portals are.
+static void AddEntrances(PathSearch* s, PathCluster* cluster, int x, int y, int stepX, int stepY,
+    int outX, int outY, int n)
+{
+  int runStart = -1;
+  for (int i=0; i <= n; ++i)
+  {
+    int cx = x + i * stepX, cy = y + i * stepY;
+    int open = i < n && Walkable(s, cx, cy) && Walkable(s, cx + outX, cy + outY);
+    if (open && runStart < 0)
+      runStart = i;
+    if (open || runStart < 0)
+      continue;
+    int length = i - runStart;
+    int ends[2] = { runStart + length / 2, -1 };
+    if (length >= WIDE_ENTRANCE)
+    {
+      ends[0] = runStart;
+      ends[1] = i - 1;
+    }
+    for (int e=0; e < 2 && ends[e] >= 0; ++e)
+    {
+      int px = x + ends[e] * stepX, py = y + ends[e] * stepY;
+      AddNode(cluster, py * pf.map->width + px,
+          (py + outY) * pf.map->width + (px + outX));
+    }
+    runStart = -1;
+  }
+}
+
+static void BuildCluster(PathSearch* s, PathCluster* cluster, int index)
+{
+  ++s->stats.clusterBuilds;
+  int x0, y0, x1, y1;
+  ClusterBounds(index, &x0, &y0, &x1, &y1);
+  int col = index % pf.clusterCols, row = index / pf.clusterCols;
+  cluster->nNodes = 0;
+  if (col > 0)
+    AddEntrances(s, cluster, x0, y0, 0, 1, -1, 0, y1 - y0);
+  if (col + 1 < pf.clusterCols)
+    AddEntrances(s, cluster, x1 - 1, y0, 0, 1, 1, 0, y1 - y0);
+  if (row > 0)
+    AddEntrances(s, cluster, x0, y0, 1, 0, 0, -1, x1 - x0);
+  if (row + 1 < pf.clusterRows)
+    AddEntrances(s, cluster, x0, y1 - 1, 1, 0, 0, 1, x1 - x0);
+  int n = cluster->nNodes;
+  int* costs = MallocOrDie((n ? n * n : 1) * sizeof(int));
+  for (int i=0; i < n; ++i)
+  {
+    int cell = cluster->cells[i];
+    LocalSearch(s, cell % pf.map->width, cell / pf.map->width, x0, y0, x1, y1);
+    for (int j=0; j < n; ++j)
+      costs[i * n + j] = LocalCost(s, cluster->cells[j], x0, y0);
+  }
+  // Leave out edges that are no shorter than going through another portal
+  // on the way, which is most of them for portals along the same border.
+  // Both legs of the detour have to be shorter than the edge, so that two
+  // edges can't stand in for each other.
+  free(cluster->firstEdge);
+  free(cluster->edges);
+  cluster->firstEdge = MallocOrDie((n + 1) * sizeof(int));
+  cluster->edges = MallocOrDie((n ? n * n : 1) * sizeof(PathEdge));
+  int nEdges = 0;
+  for (int i=0; i < n; ++i)
+  {
+    cluster->firstEdge[i] = nEdges;
+    for (int j=0; j < n; ++j)
+    {
+      int cost = costs[i * n + j];
+      if (j == i || cost < 0)
+        continue;
+      int k = 0;
+      for (; k < n; ++k)
+      {
+        int first = costs[i * n + k], second = costs[k * n + j];
+        if (first > 0 && second > 0 && first + second <= cost)
+          break;
+      }
+      if (k < n)
+        continue;
+      cluster->edges[nEdges].to = j;
+      cluster->edges[nEdges].cost = cost;
+      ++nEdges;
+    }
+  }
+  cluster->firstEdge[n] = nEdges;
+  free(costs);
+}
+
+// Returns the cluster, building it first if need be. Clusters can be built
+// by any job thread, one at a time; valid ones aren't changed until
+// Path_InvalidateTile, which is never called during a search.
+static PathCluster* EnsureCluster(PathSearch* s, int index)
+{
+  PathCluster* cluster = &pf.clusters[index];
+  if (SDL_AtomicGet(&cluster->valid))
+    return cluster;
+  SDL_LockMutex(pf.clusterLock);
+  if (!SDL_AtomicGet(&cluster->valid))
+  {
+    BuildCluster(s, cluster, index);
+    SDL_AtomicSet(&cluster->valid, 1);
+  }
+  SDL_UnlockMutex(pf.clusterLock);
+  return cluster;
+}
+
+// Call when the obstacle bit of map cell (x, y) changes.
+void Path_InvalidateTile(int x, int y)
+{
+  if (!pf.clusters || x < 0 || y < 0 || x >= pf.map->width || y >= pf.map->height)
+    return;
+  if (pf.obstacles)
+    CopyObstacle(x, y);
+  pf.areasValid = 0;
+  // Portals on a border depend on cells on both sides of it.
+  for (int dy = -1; dy <= 1; ++dy)
+  {
+    for (int dx = -1; dx <= 1; ++dx)
+    {
+      int nx = x + dx, ny = y + dy;
+      if (nx >= 0 && ny >= 0 && nx < pf.map->width && ny < pf.map->height)
+        SDL_AtomicSet(&pf.clusters[ClusterOf(nx, ny)].valid, 0);
+    }
+  }
+}
+
+// Labels connected areas by flood fill. Diagonal steps need both cells
+// beside them to be open, so areas are joined the same way with or without
+// them and only straight steps need following.
+static void LabelAreas()
+{
+  int width = pf.map->width, nCells = width * pf.map->height;
+  if (!pf.obstacles)
+  {
+    pf.obstacleStride = (width + 63) >> 6;
+    pf.obstacles = MallocOrDie((size_t)pf.map->height * pf.obstacleStride * sizeof(Uint64));
+    TiledMap_CopyObstacles(pf.map, pf.obstacles, pf.obstacleStride);
+  }
+  memset(pf.areas, 0, nCells * sizeof(Sint32));
+  int* stack = MallocOrDie(nCells * sizeof(int));
+  int nAreas = 0;
+  for (int first=0; first < nCells; ++first)
+  {
+    if (pf.areas[first] || IsObstacle(first % width, first / width))
+      continue;
+    pf.areas[first] = ++nAreas;
+    int n = 0;
+    stack[n++] = first;
+    while (n)
+    {
+      int cell = stack[--n];
+      int x = cell % width, y = cell / width;
+      for (int d=0; d < 4; ++d)
+      {
+        int nx = x + DIRECTIONS[d][0], ny = y + DIRECTIONS[d][1];
+        int next = ny * width + nx;
+        if (!IsObstacle(nx, ny) && !pf.areas[next])
+        {
+          pf.areas[next] = nAreas;
+          stack[n++] = next;
+        }
+      }
+    }
+  }
+  free(stack);
+  pf.areasValid = 1;
+}
+
+static void NewSearch(PathSearch* s)
+{
+  ++s->stamp;
+  s->heap.n = 0;
+}
+
+// Records a route to cell at cost g through parent, if it's the best so far.
+static void Relax(PathSearch* s, int cell, int g, int parent, int goalX, int goalY)
+{
+  SearchNode* node = &s->nodes[cell];
+  if (node->closed == s->stamp || (node->seen == s->stamp && node->g <= g))
+    return;
+  node->seen = s->stamp;
+  node->g = g;
+  node->parent = parent;
+  int x = cell % pf.map->width, y = cell / pf.map->width;
+  Heap_Push(&s->heap, g + Octile(goalX - x, goalY - y), cell);
+}
+
+// Follows parents back from cell into s->scratchCells, start first.
+// Returns how many there are.
+static int TraceBack(PathSearch* s, int cell)
+{
+  int n = 0;
+  for (int c = cell; c >= 0; c = s->nodes[c].parent)
+    ++n;
+  EnsureScratch(s, n);
+  int i = n;
+  for (int c = cell; c >= 0; c = s->nodes[c].parent)
+    s->scratchCells[--i] = c;
+  return n;
+}
+
+// From (x, y), reached by the step (dx, dy), keeps going in that direction
+// until something interesting happens: the goal, a forced neighbour (a
+// cell that can only be reached optimally through this one), or for
+// diagonal moves, a jump point along either straight component. Returns
+// that cell, or -1 if the way is blocked first.
+static int Jump(PathSearch* s, int x, int y, int dx, int dy, int goalX, int goalY)
+{
+  for (;;)
+  {
+    if (!Walkable(s, x, y))
+      return -1;
+    if (x == goalX && y == goalY)
+      break;
+    if (dx && dy)
+    {
+      if (Jump(s, x + dx, y, dx, 0, goalX, goalY) >= 0
+          || Jump(s, x, y + dy, 0, dy, goalX, goalY) >= 0)
+        break;
+      if (!Walkable(s, x + dx, y) || !Walkable(s, x, y + dy))
+        return -1;
+    }
+    else if (dx)
+    {
+      if ((Walkable(s, x, y - 1) && !Walkable(s, x - dx, y - 1))
+          || (Walkable(s, x, y + 1) && !Walkable(s, x - dx, y + 1)))
+        break;
+    }
+    else
+    {
+      if ((Walkable(s, x - 1, y) && !Walkable(s, x - 1, y - dy))
+          || (Walkable(s, x + 1, y) && !Walkable(s, x + 1, y - dy)))
+        break;
+    }
+    x += dx;
+    y += dy;
+  }
+  return y * pf.map->width + x;
+}
+
+// Directions worth searching from (x, y) when arriving by (dx, dy). Only
+// the natural and forced neighbours need to be looked at.
+static int PrunedDirections(PathSearch* s, int x, int y, int dx, int dy, int dirs[8][2])
+{
+  int n = 0;
+#define ADD_DIRECTION(DX, DY) (dirs[n][0] = (DX), dirs[n][1] = (DY), ++n)
+  if (dx && dy)
+  {
+    int vertical = Walkable(s, x, y + dy), horizontal = Walkable(s, x + dx, y);
+    if (vertical) ADD_DIRECTION(0, dy);
+    if (horizontal) ADD_DIRECTION(dx, 0);
+    if (vertical && horizontal) ADD_DIRECTION(dx, dy);
+  }
+  else if (dx)
+  {
+    int next = Walkable(s, x + dx, y), down = Walkable(s, x, y + 1), up = Walkable(s, x, y - 1);
+    if (next)
+    {
+      ADD_DIRECTION(dx, 0);
+      if (down) ADD_DIRECTION(dx, 1);
+      if (up) ADD_DIRECTION(dx, -1);
+    }
+    if (down) ADD_DIRECTION(0, 1);
+    if (up) ADD_DIRECTION(0, -1);
+  }
+  else
+  {
+    int next = Walkable(s, x, y + dy), right = Walkable(s, x + 1, y), left = Walkable(s, x - 1, y);
+    if (next)
+    {
+      ADD_DIRECTION(0, dy);
+      if (right) ADD_DIRECTION(1, dy);
+      if (left) ADD_DIRECTION(-1, dy);
+    }
+    if (right) ADD_DIRECTION(1, 0);
+    if (left) ADD_DIRECTION(-1, 0);
+  }
+#undef ADD_DIRECTION
+  return n;
+}
+
+static int SearchJumpPoints(PathSearch* s, int startX, int startY, int goalX, int goalY,
+    Path* path, int skipStart)
+{
+  if (!Walkable(s, startX, startY) || !Walkable(s, goalX, goalY))
+    return -1;
+  NewSearch(s);
+  int start = startY * pf.map->width + startX, goal = goalY * pf.map->width + goalX;
+  Relax(s, start, 0, -1, goalX, goalY);
+  int cell;
+  while ((cell = Heap_Pop(&s->heap)) >= 0)
+  {
+    if (s->nodes[cell].closed == s->stamp)
+      continue;
+    s->nodes[cell].closed = s->stamp;
+    ++s->stats.nodesExpanded;
+    if (cell == goal)
+    {
+      int n = TraceBack(s, goal);
+      for (int i = skipStart ? 1 : 0; i < n; ++i)
+        Path_Append(path, s->scratchCells[i] % pf.map->width,
+            s->scratchCells[i] / pf.map->width);
+      return s->nodes[goal].g;
+    }
+    int x = cell % pf.map->width, y = cell / pf.map->width;
+    int dirs[8][2], nDirs;
+    if (s->nodes[cell].parent < 0)
+    {
+      nDirs = 0;
+      for (int d=0; d < 8; ++d)
+      {
+        if (!CanStep(s, x, y, DIRECTIONS[d][0], DIRECTIONS[d][1]))
+          continue;
+        dirs[nDirs][0] = DIRECTIONS[d][0];
+        dirs[nDirs][1] = DIRECTIONS[d][1];
+        ++nDirs;
+      }
+    }
+    else
+    {
+      int parentX = s->nodes[cell].parent % pf.map->width, parentY = s->nodes[cell].parent / pf.map->width;
+      nDirs = PrunedDirections(s, x, y, SigNum(x - parentX), SigNum(y - parentY), dirs);
+    }
+    for (int d=0; d < nDirs; ++d)
+    {
+      int jumpPoint = Jump(s, x + dirs[d][0], y + dirs[d][1], dirs[d][0], dirs[d][1], goalX, goalY);
+      if (jumpPoint < 0)
+        continue;
+      int jx = jumpPoint % pf.map->width, jy = jumpPoint / pf.map->width;
+      Relax(s, jumpPoint, s->nodes[cell].g + Octile(jx - x, jy - y), cell, goalX, goalY);
+    }
+  }
+  return -1;
+}
+
+// Jump point search within the window. Appends the path's jump points to
+// path, except the start if skipStart is set, and returns its cost or -1.
+static int JumpPointSearch(PathSearch* s, int startX, int startY, int goalX, int goalY,
+    SDL_Rect window, Path* path, int skipStart)
+{
+  s->window = window;
+  int cost = SearchJumpPoints(s, startX, startY, goalX, goalY, path, skipStart);
+  s->window = pf.mapRect;
+  return cost;
+}
+
+// HPA*: searches the cluster graph with the start and goal connected to the
+// portals of their clusters, then refines each leg with jump point search.
+static int HierarchicalSearch(PathSearch* s, int startX, int startY, int goalX, int goalY, Path* path)
+{
+  if (!Walkable(s, startX, startY) || !Walkable(s, goalX, goalY))
+    return -1;
+  int width = pf.map->width;
+  int start = startY * width + startX, goal = goalY * width + goalX;
+  int startClusterIndex = ClusterOf(startX, startY), goalClusterIndex = ClusterOf(goalX, goalY);
+  PathCluster* startCluster = EnsureCluster(s, startClusterIndex);
+  PathCluster* goalCluster = EnsureCluster(s, goalClusterIndex);
+  EnsureCostLists(s, startCluster->nNodes > goalCluster->nNodes
+      ? startCluster->nNodes : goalCluster->nNodes);
+  int x0, y0, x1, y1;
+  ClusterBounds(startClusterIndex, &x0, &y0, &x1, &y1);
+  LocalSearch(s, startX, startY, x0, y0, x1, y1);
+  for (int i=0; i < startCluster->nNodes; ++i)
+    s->startCosts[i] = LocalCost(s, startCluster->cells[i], x0, y0);
+  int directCost = startClusterIndex == goalClusterIndex ? LocalCost(s, goal, x0, y0) : -1;
+  ClusterBounds(goalClusterIndex, &x0, &y0, &x1, &y1);
+  LocalSearch(s, goalX, goalY, x0, y0, x1, y1);
+  for (int i=0; i < goalCluster->nNodes; ++i)
+    s->goalCosts[i] = LocalCost(s, goalCluster->cells[i], x0, y0);
+
+  NewSearch(s);
+  Relax(s, start, 0, -1, goalX, goalY);
+  int cell, found = 0;
+  while ((cell = Heap_Pop(&s->heap)) >= 0)
+  {
+    if (s->nodes[cell].closed == s->stamp)
+      continue;
+    s->nodes[cell].closed = s->stamp;
+    ++s->stats.nodesExpanded;
+    if (cell == goal)
+    {
+      found = 1;
+      break;
+    }
+    int g = s->nodes[cell].g;
+    if (cell == start)
+    {
+      for (int i=0; i < startCluster->nNodes; ++i)
+        if (s->startCosts[i] >= 0)
+          Relax(s, startCluster->cells[i], g + s->startCosts[i], cell, goalX, goalY);
+      if (directCost >= 0)
+        Relax(s, goal, directCost, cell, goalX, goalY);
+    }
+    int clusterIndex = ClusterOf(cell % width, cell / width);
+    PathCluster* cluster = EnsureCluster(s, clusterIndex);
+    int n = cluster->nNodes;
+    for (int i=0; i < n; ++i)
+    {
+      if (cluster->cells[i] != cell)
+        continue;
+      Relax(s, cluster->across[i], g + STRAIGHT_COST, cell, goalX, goalY);
+      for (int e = cluster->firstEdge[i]; e < cluster->firstEdge[i + 1]; ++e)
+        Relax(s, cluster->cells[cluster->edges[e].to], g + cluster->edges[e].cost,
+            cell, goalX, goalY);
+      if (clusterIndex == goalClusterIndex && s->goalCosts[i] >= 0)
+        Relax(s, goal, g + s->goalCosts[i], cell, goalX, goalY);
+    }
+  }
+  if (!found)
+    return -1;
+  // Refine. The legs' searches reuse the search state, so copy the
+  // abstract path out first.
+  int nLegs = TraceBack(s, goal) - 1;
+  int* legs = MallocOrDie((nLegs + 1) * sizeof(int));
+  memcpy(legs, s->scratchCells, (nLegs + 1) * sizeof(int));
+  // Each leg stays within the clusters of its ends.
+  int cost = 0;
+  for (int i=0; i < nLegs && cost >= 0; ++i)
+  {
+    int fromX = legs[i] % width, fromY = legs[i] / width;
+    int toX = legs[i + 1] % width, toY = legs[i + 1] / width;
+    int size = pf.clusterSize;
+    SDL_Rect window = Window(
+        (fromX < toX ? fromX : toX) / size * size,
+        (fromY < toY ? fromY : toY) / size * size,
+        ((fromX > toX ? fromX : toX) / size + 1) * size - 1,
+        ((fromY > toY ? fromY : toY) / size + 1) * size - 1, 0);
+    int legCost = JumpPointSearch(s, fromX, fromY, toX, toY, window, path, i > 0);
+    cost = legCost >= 0 ? cost + legCost : -1;
+  }
+  free(legs);
+  return cost;
+}
+
+static int FindPath(PathSearch* s, Coords start, Coords goal, Path* path)
+{
+  path->nWaypoints = 0;
+  path->cost = -1;
+  if (start.x < 0 || start.y < 0 || start.x >= pf.map->width || start.y >= pf.map->height
+      || goal.x < 0 || goal.y < 0 || goal.x >= pf.map->width || goal.y >= pf.map->height)
+    return 0;
+  int width = pf.map->width;
+  int startArea = pf.areas[start.y * width + start.x];
+  if (!startArea || startArea != pf.areas[goal.y * width + goal.x])
+  {
+    ++s->stats.failures;
+    return 0;
+  }
+  if (Octile(goal.x - start.x, goal.y - start.y) <= SHORT_PATH_DISTANCE * STRAIGHT_COST)
+  {
+    ++s->stats.shortSearches;
+    SDL_Rect window = Window(start.x, start.y, goal.x, goal.y, SHORT_PATH_MARGIN);
+    path->cost = JumpPointSearch(s, start.x, start.y, goal.x, goal.y, window, path, 0);
+    // The goal is reachable, so the way round must leave the window.
+    if (path->cost < 0)
+      path->cost = JumpPointSearch(s, start.x, start.y, goal.x, goal.y, pf.mapRect, path, 0);
+  }
+  else
+  {
+    ++s->stats.longSearches;
+    path->cost = HierarchicalSearch(s, start.x, start.y, goal.x, goal.y, path);
+  }
+  if (path->cost < 0)
+  {
+    ++s->stats.failures;
+    path->nWaypoints = 0;
+    return 0;
+  }
+  return 1;
+}
+
+// Finds a path right away. Returns 1 if there is one. Call this from the
+// main thread; jobs should queue requests instead.
+int Path_Find(Coords start, Coords goal, Path* path)
+{
+  if (!pf.areasValid)
+    LabelAreas();
+  return FindPath(GetSearch(), start, goal, path);
+}
+
+// Queues a request. Returns a ticket for Path_GetResult.
+int Path_Request(Coords start, Coords goal)
+{
+  // Released requests still in the queue are skipped when they come out of
+  // it; until then their slots aren't reused, or they'd be resolved twice.
+  int index = 0;
+  while (index < pf.nRequests && (pf.requests[index]->inUse || pf.requests[index]->queued))
+    ++index;
+  if (index == pf.nRequests)
+  {
+    int n = pf.nRequests ? 2 * pf.nRequests : 64;
+    PathRequest** requests = MallocOrDie(n * sizeof(PathRequest*));
+    if (pf.nRequests)
+      memcpy(requests, pf.requests, pf.nRequests * sizeof(PathRequest*));
+    for (int i = pf.nRequests; i < n; ++i)
+      requests[i] = MallocOrDie(sizeof(PathRequest));
+    free(pf.requests);
+    pf.requests = requests;
+    pf.nRequests = n;
+  }
+  if (pf.queueLength == pf.queueCapacity)
+  {
+    int capacity = pf.queueCapacity ? 2 * pf.queueCapacity : 64;
+    int* queue = MallocOrDie(capacity * sizeof(int));
+    for (int i=0; i < pf.queueLength; ++i)
+      queue[i] = pf.queue[(pf.queueHead + i) % pf.queueCapacity];
+    free(pf.queue);
+    pf.queue = queue;
+    pf.queueHead = 0;
+    pf.queueCapacity = capacity;
+  }
+  PathRequest* request = pf.requests[index];
+  request->inUse = 1;
+  request->queued = 1;
+  request->status = PATH_PENDING;
+  request->start = start;
+  request->goal = goal;
+  pf.queue[(pf.queueHead + pf.queueLength++) % pf.queueCapacity] = index;
+  ++pf.nRequested;
+  return index + 1;
+}
+
+// Returns the request's status, and the path once it's been found. The
+// path stays where it is until the ticket is released.
+int Path_GetResult(int ticket, const Path** path)
+{
+  assert(ticket > 0 && ticket <= pf.nRequests && pf.requests[ticket - 1]->inUse);
+  PathRequest* request = pf.requests[ticket - 1];
+  if (path)
+    *path = &request->path;
+  return request->status;
+}
+
+// Frees the ticket. Pending requests are dropped.
+void Path_Release(int ticket)
+{
+  assert(ticket > 0 && ticket <= pf.nRequests);
+  pf.requests[ticket - 1]->inUse = 0;
+}
+
+static void ResolveRequests(void* data, int chunk, int first, int end)
+{
+  (void)data; (void)chunk;
+  PathSearch* s = GetSearch();
+  for (int i = first; i < end; ++i)
+  {
+    PathRequest* request = pf.requests[pf.batch[i]];
+    request->status = FindPath(s, request->start, request->goal, &request->path)
+      ? PATH_FOUND : PATH_NOT_FOUND;
+  }
+}
+
+// Resolves queued requests in order, a batch at a time spread over the job
+// threads, until the budget (in microseconds) is used up. At least one
+// batch is always resolved. In deterministic mode the budget is ignored and
+// a fixed number are resolved, so that the results don't depend on how
+// fast the machine is. Returns how many were resolved.
+int Path_Update(Uint32 budgetUs)
+{
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  Uint64 budget = (Uint64)budgetUs * SDL_GetPerformanceFrequency() / 1000000;
+  int deterministic = Job_IsDeterministic();
+  if (!pf.areasValid)
+    LabelAreas();
+  int resolved = 0;
+  while (pf.queueLength > 0)
+  {
+    int batchSize = deterministic ? DETERMINISTIC_REQUESTS - resolved
+      : Job_ThreadCount() * REQUESTS_PER_THREAD;
+    if (batchSize <= 0)
+      break;
+    if (batchSize > pf.batchCapacity)
+    {
+      free(pf.batch);
+      pf.batchCapacity = batchSize;
+      pf.batch = MallocOrDie(batchSize * sizeof(int));
+    }
+    int n = 0;
+    while (n < batchSize && pf.queueLength > 0)
+    {
+      int index = pf.queue[pf.queueHead];
+      pf.queueHead = (pf.queueHead + 1) % pf.queueCapacity;
+      --pf.queueLength;
+      pf.requests[index]->queued = 0;
+      if (pf.requests[index]->inUse) // otherwise released while queued
+        pf.batch[n++] = index;
+    }
+    Job_ParallelFor(ResolveRequests, 0, n, 1);
+    resolved += n;
+    if (!deterministic && SDL_GetPerformanceCounter() - startTime >= budget)
+      break;
+  }
+  return resolved;
+}
+
+PathStats Path_GetStats()
+{
+  PathStats stats = { 0 };
+  for (int i=0; i < MAX_JOB_THREADS; ++i)
+  {
+    PathStats* s = &pf.searches[i].stats;
+    stats.shortSearches += s->shortSearches;
+    stats.longSearches += s->longSearches;
+    stats.failures += s->failures;
+    stats.clusterBuilds += s->clusterBuilds;
+    stats.nodesExpanded += s->nodesExpanded;
+  }
+  stats.requests = pf.nRequested;
+  stats.queueLength = pf.queueLength;
+  return stats;
+}
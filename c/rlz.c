@@ -0,0 +1,234 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Run-length and LZ coding of cell planes, for compressed map chunks.
+//
+// Tile layers are mostly runs of one tile and rows that repeat the row
+// above, so the coder works in cells rather than bytes and always tries the
+// row above as well as the last place a hash of the next three cells was
+// seen. Packed data is a series of tokens. Each starts with a byte holding
+// its kind in the top two bits and its length less the shortest allowed in
+// the rest; RLZ_LONG there means a varint with the remainder follows.
+//   literal: that many cells follow, as they are
+//   run:     one cell follows, repeated that many times
+//   match:   a varint follows, the distance back less one, to copy cells from
+// Cells are stored in the machine's byte order, like the rest of a native
+// map. Decoding is a loop of memcpy and fills, with checks on every length.
+
+enum { RLZ_LITERAL, RLZ_RUN, RLZ_MATCH };
+
+#define RLZ_LONG 63
+#define RLZ_MIN_LENGTH 3 // for runs and matches
+#define RLZ_HASH_BITS 10
+#define RLZ_BLOCK 8 // cells copied at once when decoding
+
+// Room needed to pack nCells cells, whatever they are.
+size_t Rlz_Bound(size_t nCells)
+{
+  return nCells * 3 + 16;
+}
+
+static Uint8* WriteVarint(Uint8* out, size_t value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = (Uint8)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (Uint8)value;
+  return out;
+}
+
+static Uint8* WriteToken(Uint8* out, int kind, size_t length)
+{
+  size_t field = length - (kind == RLZ_LITERAL ? 1 : RLZ_MIN_LENGTH);
+  if (field < RLZ_LONG)
+  {
+    *out++ = (Uint8)(kind << 6 | field);
+    return out;
+  }
+  *out++ = (Uint8)(kind << 6 | RLZ_LONG);
+  return WriteVarint(out, field - RLZ_LONG);
+}
+
+static Uint8* WriteLiterals(Uint8* out, const Sint16* cells, size_t n)
+{
+  if (!n)
+    return out;
+  out = WriteToken(out, RLZ_LITERAL, n);
+  memcpy(out, cells, n * sizeof(Sint16));
+  return out + n * sizeof(Sint16);
+}
+
+static inline Uint32 HashCells(const Sint16* cells)
+{
+  Uint32 key = (Uint16)cells[0] | (Uint32)(Uint16)cells[1] << 16;
+  key = key * 2654435761u ^ (Uint16)cells[2] * 40503u;
+  return key >> (32 - RLZ_HASH_BITS);
+}
+
+static inline size_t MatchLength(const Sint16* cells, size_t i, size_t from, size_t n)
+{
+  size_t length = 0;
+  while (i + length < n && cells[from + length] == cells[i + length])
+    ++length;
+  return length;
+}
+
+// Packs cells into out, which needs Rlz_Bound(nCells) bytes. rowLength is
+// the width of the plane, for matching against the row above. Returns the
+// packed size.
+size_t Rlz_Compress(const Sint16* cells, size_t nCells, size_t rowLength, Uint8* out)
+{
+  Sint32 lastSeen[1 << RLZ_HASH_BITS];
+  memset(lastSeen, -1, sizeof(lastSeen));
+  Uint8* start = out;
+  size_t literalStart = 0, i = 0;
+  while (i < nCells)
+  {
+    size_t run = 1;
+    while (i + run < nCells && cells[i + run] == cells[i])
+      ++run;
+    size_t matchLength = 0, distance = 0;
+    if (i >= rowLength && rowLength)
+    {
+      matchLength = MatchLength(cells, i, i - rowLength, nCells);
+      distance = rowLength;
+    }
+    if (i + RLZ_MIN_LENGTH <= nCells)
+    {
+      Uint32 hash = HashCells(cells + i);
+      Sint32 seen = lastSeen[hash];
+      lastSeen[hash] = (Sint32)i;
+      if (seen >= 0 && i - seen != distance)
+      {
+        size_t length = MatchLength(cells, i, seen, nCells);
+        if (length > matchLength)
+        {
+          matchLength = length;
+          distance = i - seen;
+        }
+      }
+    }
+    if (run < RLZ_MIN_LENGTH && matchLength < RLZ_MIN_LENGTH)
+    {
+      ++i;
+      continue;
+    }
+    out = WriteLiterals(out, cells + literalStart, i - literalStart);
+    // Runs are preferred when they're as long, since they decode quicker.
+    if (run >= matchLength)
+    {
+      out = WriteToken(out, RLZ_RUN, run);
+      memcpy(out, cells + i, sizeof(Sint16));
+      out += sizeof(Sint16);
+      i += run;
+    }
+    else
+    {
+      out = WriteToken(out, RLZ_MATCH, matchLength);
+      out = WriteVarint(out, distance - 1);
+      i += matchLength;
+    }
+    literalStart = i;
+  }
+  out = WriteLiterals(out, cells + literalStart, nCells - literalStart);
+  return out - start;
+}
+
+static int ReadVarint(const Uint8** in, const Uint8* end, size_t* value)
+{
+  size_t v = 0;
+  for (int shift=0; shift < 35; shift += 7)
+  {
+    if (*in == end)
+      return 0;
+    Uint8 byte = *(*in)++;
+    v |= (size_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80))
+    {
+      *value = v;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Unpacks exactly nCells cells. Returns 0 if the packed data is malformed
+// or doesn't make that many.
+int Rlz_Decompress(const Uint8* packed, size_t len, Sint16* cells, size_t nCells)
+{
+  const Uint8* in = packed;
+  const Uint8* end = packed + len;
+  size_t i = 0;
+  while (in < end)
+  {
+    int kind = *in >> 6;
+    size_t length = *in++ & RLZ_LONG;
+    if (length == RLZ_LONG)
+    {
+      size_t more;
+      if (!ReadVarint(&in, end, &more) || more > nCells)
+        return 0;
+      length += more;
+    }
+    length += kind == RLZ_LITERAL ? 1 : RLZ_MIN_LENGTH;
+    if (length > nCells - i)
+      return 0;
+    Sint16* out = cells + i;
+    // Short tokens are most of them. Where there's room, copy whole blocks,
+    // writing past the token into cells that later tokens will overwrite.
+    int roomToSpare = nCells - i - length >= RLZ_BLOCK;
+    switch (kind)
+    {
+      case RLZ_LITERAL:
+        if ((size_t)(end - in) < length * sizeof(Sint16))
+          return 0;
+        if (roomToSpare && (size_t)(end - in) >= RLZ_BLOCK * sizeof(Sint16)
+            && length <= RLZ_BLOCK)
+          memcpy(out, in, RLZ_BLOCK * sizeof(Sint16));
+        else
+          memcpy(out, in, length * sizeof(Sint16));
+        in += length * sizeof(Sint16);
+        break;
+      case RLZ_RUN:
+      {
+        if (end - in < (ptrdiff_t)sizeof(Sint16))
+          return 0;
+        Sint16 value;
+        memcpy(&value, in, sizeof(Sint16));
+        in += sizeof(Sint16);
+        size_t fill = roomToSpare && length <= RLZ_BLOCK ? RLZ_BLOCK : length;
+        for (size_t k=0; k < fill; ++k)
+          out[k] = value;
+        break;
+      }
+      case RLZ_MATCH:
+      {
+        size_t distance;
+        if (!ReadVarint(&in, end, &distance) || distance >= i)
+          return 0;
+        ++distance;
+        if (roomToSpare && distance >= RLZ_BLOCK)
+        {
+          for (size_t k=0; k < length; k += RLZ_BLOCK)
+            memcpy(out + k, out + k - distance, RLZ_BLOCK * sizeof(Sint16));
+          break;
+        }
+        // Copy a distance at a time, so no copy overlaps what it reads.
+        for (size_t k=0; k < length; k += distance)
+        {
+          size_t n = length - k < distance ? length - k : distance;
+          memcpy(out + k, out + k - distance, n * sizeof(Sint16));
+        }
+        break;
+      }
+      default:
+        return 0;
+    }
+    i += length;
+  }
+  return i == nCells;
+}
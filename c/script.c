@@ -0,0 +1,172 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Scripted input, so that the game can be driven without a keyboard.
+//
+// A script is a text file with one command per line, in tick order:
+//
+//   # comment
+//   <tick> move <dx> <dy>   hold the arrow keys for direction dx,dy (-1..1)
+//   <tick> quit             stop the game
+//
+// A move holds until the next one. Input can also be recorded in the same
+// form, to be replayed exactly: commands are by logic tick, not time.
+
+typedef enum ScriptCommand { SCRIPT_MOVE, SCRIPT_QUIT } ScriptCommand;
+
+typedef struct ScriptEvent {
+  Uint32 tick;
+  ScriptCommand command;
+  struct Coords move;
+} ScriptEvent;
+
+struct InputScript {
+  ScriptEvent* events;
+  int nEvents, capacity;
+  int next; // first event not yet reached
+  struct Coords move;
+};
+
+static const int MAX_SCRIPT_LINE = 256;
+
+static ScriptEvent* AddEvent(InputScript* script)
+{
+  if (script->nEvents == script->capacity)
+  {
+    int capacity = script->capacity ? 2 * script->capacity : 64;
+    ScriptEvent* events = MallocOrDie(capacity * sizeof(ScriptEvent));
+    if (script->nEvents)
+      memcpy(events, script->events, script->nEvents * sizeof(ScriptEvent));
+    free(script->events);
+    script->events = events;
+    script->capacity = capacity;
+  }
+  return &script->events[script->nEvents++];
+}
+
+static int ParseLine(InputScript* script, const char* line)
+{
+  char command[16];
+  unsigned tick;
+  int consumed;
+  if (sscanf(line, " %u %15s %n", &tick, command, &consumed) < 2)
+    return 0;
+  if (script->nEvents && tick < script->events[script->nEvents - 1].tick)
+    return 0;
+  ScriptEvent event = { tick, SCRIPT_QUIT, { 0, 0 } };
+  if (!strcmp(command, "move"))
+  {
+    event.command = SCRIPT_MOVE;
+    if (sscanf(line + consumed, "%d %d", &event.move.x, &event.move.y) != 2)
+      return 0;
+    if (event.move.x < -1 || event.move.x > 1 || event.move.y < -1 || event.move.y > 1)
+      return 0;
+  }
+  else if (strcmp(command, "quit"))
+    return 0;
+  *AddEvent(script) = event;
+  return 1;
+}
+
+InputScript* InputScript_Create()
+{
+  return MallocOrDie(sizeof(InputScript));
+}
+
+// Records the arrow keys held during a tick. Only changes are kept.
+void InputScript_RecordMove(InputScript* script, Uint32 tick, struct Coords move)
+{
+  if (move.x == script->move.x && move.y == script->move.y)
+    return;
+  ScriptEvent event = { tick, SCRIPT_MOVE, move };
+  *AddEvent(script) = event;
+  script->move = move;
+}
+
+void InputScript_RecordQuit(InputScript* script, Uint32 tick)
+{
+  ScriptEvent event = { tick, SCRIPT_QUIT, { 0, 0 } };
+  *AddEvent(script) = event;
+}
+
+int InputScript_Save(InputScript* script, const char* filename)
+{
+  FILE* file = fopen(filename, "w");
+  if (!file)
+  {
+    fprintf(stderr, "Unable to write input script '%s'.\n", filename);
+    return 0;
+  }
+  for (int i=0; i < script->nEvents; ++i)
+  {
+    ScriptEvent* event = &script->events[i];
+    if (event->command == SCRIPT_MOVE)
+      fprintf(file, "%u move %d %d\n", event->tick, event->move.x, event->move.y);
+    else
+      fprintf(file, "%u quit\n", event->tick);
+  }
+  int ok = !ferror(file);
+  if (fclose(file) || !ok)
+  {
+    fprintf(stderr, "Error writing input script '%s'.\n", filename);
+    return 0;
+  }
+  return 1;
+}
+
+InputScript* InputScript_Load(const char* filename)
+{
+  FILE* file = fopen(filename, "r");
+  if (!file)
+  {
+    fprintf(stderr, "Unable to open input script '%s'.\n", filename);
+    return 0;
+  }
+  InputScript* script = MallocOrDie(sizeof(InputScript));
+  char line[MAX_SCRIPT_LINE];
+  int lineNumber = 0;
+  while (fgets(line, sizeof(line), file))
+  {
+    ++lineNumber;
+    const char* p = line;
+    while (*p == ' ' || *p == '\t')
+      ++p;
+    if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+      continue;
+    if (!ParseLine(script, p))
+    {
+      fprintf(stderr, "Bad command in input script '%s', line %d.\n", filename, lineNumber);
+      fclose(file);
+      InputScript_Destroy(script);
+      return 0;
+    }
+  }
+  fclose(file);
+  return script;
+}
+
+void InputScript_Destroy(InputScript* script)
+{
+  if (!script)
+    return;
+  free(script->events);
+  free(script);
+}
+
+// Runs the commands for a tick and sets the arrow keys held during it.
+// Returns 0 once the script quits.
+int InputScript_Next(InputScript* script, Uint32 tick, struct Coords* move)
+{
+  while (script->next < script->nEvents && script->events[script->next].tick <= tick)
+  {
+    ScriptEvent* event = &script->events[script->next];
+    if (event->command == SCRIPT_QUIT)
+      return 0;
+    script->move = event->move;
+    ++script->next;
+  }
+  *move = script->move;
+  return 1;
+}
@@ -85,6 +85,7 @@ static TiledTileset* LoadTileset(const char* filename, int tileWidth, int tileHe
   tileset->columns = input.columns;
   char* filenameCopy = MallocOrDie(strlen(filename) + 1);
   strcpy(filenameCopy, filename);
+  tileset->sourceFilename = filenameCopy;
   char imageFilename[input.imageFilenameLength + 1];
   RWread(rw, imageFilename, 1, input.imageFilenameLength);
   imageFilename[input.imageFilenameLength] = '\0';
@@ -148,53 +149,616 @@ static int LoadTilesetRef(SDL_RWops* rw, TiledTilesetRef* tilesetRef,
   return 1;
 }
 
-static TiledTile* TiledMap_FindTile(TiledMap* map, Sint16 gid)
+// Build the table that resolves a GID to its tile with a single indexed read.
+// Tilesets are applied in order of firstGid, so where ranges overlap the
+// tileset with the highest firstGid wins, as in Tiled.
+int TiledMap_BuildGidTable(TiledMap* map)
 {
-  if (gid == 0)
-    return 0; // space has no tile in this layer
-  for (int ts = map->nTilesets - 1; ts >= 0; --ts)
+  Sint32 nGids = 1; // GID 0 is always empty
+  for (int ts=0; ts < map->nTilesets; ++ts)
   {
     TiledTilesetRef* ref = &map->tilesetRefs[ts];
-    TiledTileset* tileset = ref->tileset;
-    int tileIndex = gid - ref->firstGid;
-    //printf("%p\n", tileset); fflush(stdout);
-    if (tileIndex < tileset->tileCount)
+    if (ref->firstGid <= 0)
     {
-      TiledTile* tile = &tileset->tiles[tileIndex];
-      //printf("Found tile: %d (%d,%d)\n", tileIndex, tile->x, tile->y);
-      return tile;
+      fprintf(stderr, "Invalid first GID %d for tileset %d.\n", ref->firstGid, ts);
+      return 0;
+    }
+    Sint32 end = ref->firstGid + ref->tileset->tileCount;
+    if (end > nGids)
+      nGids = end;
+  }
+  if (nGids > SDL_MAX_SINT16 + 1)
+    nGids = SDL_MAX_SINT16 + 1; // GIDs past this can't be stored in a cell
+  // Always leave room for the properties the game knows about, so lookups
+  // don't need to check what each tileset provides.
+  Sint32 nProperties = TILE_PROP_COUNT;
+  for (int ts=0; ts < map->nTilesets; ++ts)
+    if (map->tilesetRefs[ts].tileset->nProperties > nProperties)
+      nProperties = map->tilesetRefs[ts].tileset->nProperties;
+  free(map->gidTiles);
+  free(map->gidTex);
+  free(map->gidAtlasPos);
+  free(map->gidProps);
+  map->gidTiles = MallocOrDie(nGids * sizeof(TiledTile*));
+  map->gidTex = MallocOrDie(nGids * sizeof(SDL_Texture*));
+  map->gidAtlasPos = MallocOrDie(nGids * sizeof(SDL_Point));
+  map->gidProps = MallocOrDie(nGids * nProperties * sizeof(TiledProperty));
+  map->nGids = nGids;
+  map->nTileProperties = nProperties;
+  int applied = 0;
+  Sint32 lastFirstGid = 0;
+  while (applied < map->nTilesets)
+  {
+    // Apply the tileset with the next-lowest firstGid.
+    TiledTilesetRef* next = 0;
+    for (int ts=0; ts < map->nTilesets; ++ts)
+    {
+      TiledTilesetRef* ref = &map->tilesetRefs[ts];
+      if (ref->firstGid > lastFirstGid && (!next || ref->firstGid < next->firstGid))
+        next = ref;
+    }
+    if (!next)
+    {
+      fprintf(stderr, "Tilesets share a first GID.\n");
+      return 0;
+    }
+    TiledTileset* tileset = next->tileset;
+    for (Sint32 t=0; t < tileset->tileCount && next->firstGid + t < nGids; ++t)
+    {
+      Sint32 gid = next->firstGid + t;
+      TiledTile* tile = &tileset->tiles[t];
+      map->gidTiles[gid] = tile;
+      map->gidTex[gid] = tile->tex;
+      map->gidAtlasPos[gid].x = tile->x;
+      map->gidAtlasPos[gid].y = tile->y;
+      TiledProperty* props = &map->gidProps[gid * nProperties];
+      memset(props, 0, nProperties * sizeof(TiledProperty));
+      if (tileset->nProperties)
+        memcpy(props, tile->props, tileset->nProperties * sizeof(TiledProperty));
     }
+    lastFirstGid = next->firstGid;
+    ++applied;
+  }
+  return 1;
+}
+
+// Moves the tiles of the map's tilesets to where their images were packed
+// in the atlas, and rebuilds the GID table to match.
+int TiledMap_PlaceTilesets(TiledMap* map)
+{
+  for (int ts=0; ts < map->nTilesets; ++ts)
+  {
+    TiledTileset* tileset = map->tilesetRefs[ts].tileset;
+    // Tilesets shared by several refs are only moved once.
+    if (tileset->image.tex || !Atlas_Place(&tileset->image))
+      continue;
+    for (int t=0; t < tileset->tileCount; ++t)
+    {
+      TiledTile* tile = &tileset->tiles[t];
+      tile->x += tileset->image.texX;
+      tile->y += tileset->image.texY;
+      tile->tex = tileset->image.tex;
+    }
+  }
+  return TiledMap_BuildGidTable(map);
+}
+
+// Files store the layers of each cell together. Split them out into one
+// plane per layer.
+static void SplitLayers(Sint16* planes, const Sint16* cells,
+    size_t nCells, int nLayers)
+{
+  for (int layer=0; layer < nLayers; ++layer)
+  {
+    Sint16* plane = planes + layer * nCells;
+    const Sint16* cell = cells + layer;
+    for (size_t i=0; i < nCells; ++i, cell += nLayers)
+      plane[i] = *cell;
   }
-  fprintf(stderr, "Tile not found for GID %d.\n", gid);
+}
+
+// Chunks of old-format maps point straight into the fully loaded map.
+static int LoadChunkView(TiledMap* map, TiledChunk* chunk)
+{
+  int x = chunk->col << map->chunkShift, y = chunk->row << map->chunkShift;
+  chunk->gids = map->cells + y * map->width + x;
+  chunk->bytes = 0;
+  return 1;
+}
+
+// Chunks of chunked maps are read from the file as they're needed. Each chunk
+// is stored as a full chunkSize x chunkSize block (padded with zeroes past the
+// map edge), so its position in the file can be computed directly.
+static int LoadChunkFromFile(TiledMap* map, TiledChunk* chunk)
+{
+  size_t cellCount = map->chunkSize * map->chunkSize * map->nLayers;
+  Sint64 offset = map->chunkDataOffset
+    + (Sint64)(chunk->row * map->chunkCols + chunk->col) * cellCount * sizeof(Sint16);
+  if (SDL_RWseek(map->chunkSource, offset, RW_SEEK_SET) < 0)
+  {
+    fprintf(stderr, "Error seeking in map file: %s\n", SDL_GetError());
+    return 0;
+  }
+  Sint16* cells = MallocOrDie(cellCount * sizeof(Sint16));
+  if (!ReadInts16(map->chunkSource, cells, cellCount))
+  {
+    free(cells);
+    return 0;
+  }
+  Sint16* gids = MallocOrDie(cellCount * sizeof(Sint16));
+  SplitLayers(gids, cells, map->chunkSize * map->chunkSize, map->nLayers);
+  free(cells);
+  chunk->gids = gids;
+  chunk->bytes = cellCount * sizeof(Sint16);
+  return 1;
+}
+
+// Chunks of native-format maps are used in place in the mapped file. The OS
+// pages them in on first touch, so there's nothing to read or convert.
+static int LoadChunkInPlace(TiledMap* map, TiledChunk* chunk)
+{
+  size_t cellCount = map->chunkSize * map->chunkSize * map->nLayers;
+  Sint16* cells = (Sint16*)((char*)map->mappedFile + map->chunkDataOffset);
+  chunk->gids = cells + (chunk->row * map->chunkCols + chunk->col) * cellCount;
+  chunk->bytes = 0;
+  return 1;
+}
+
+// Default chunk size for maps that don't specify one.
+static const int DEFAULT_CHUNK_SIZE = 32;
+// Limit on the chunk size declared in chunked map files.
+static const int MAX_CHUNK_SIZE = 256;
+
+// Native-format maps are written in the byte order of the machine that will
+// load them, with the cells aligned so they can be used straight out of a
+// memory-mapped file. The header is followed by the tileset refs, then
+// padding up to cellDataOffset, then the chunks in the same order as in
+// chunked maps. Since version 2, each chunk holds one plane per layer, the
+// same as in memory.
+//
+// Compressed maps ("WTMZ") have the same header and tileset refs. At
+// cellDataOffset there's instead an index with the place and size of each
+// chunk's planes, in chunk order, and the planes follow it, each packed on
+// its own (see rlz.c), so any chunk can be unpacked without the others.
+#define NATIVE_MAP_VERSION 2
+#define NATIVE_BYTE_ORDER_MARK 0x01020304
+#define NATIVE_FILENAME_LENGTH 28
+#define NATIVE_CELL_ALIGNMENT 64
+typedef struct TiledNativeHeader {
+  char marker[4]; // "WTMN", or "WTMZ" if compressed
+  Uint32 byteOrderMark, version, cellDataOffset;
+  Sint32 width, height, tileWidth, tileHeight, nTilesets, nLayers, chunkSize, reserved;
+} TiledNativeHeader;
+typedef struct TiledNativeTilesetRef {
+  Sint32 firstGid, filenameLength;
+  char filename[NATIVE_FILENAME_LENGTH];
+} TiledNativeTilesetRef;
+typedef struct TiledPackedPlane {
+  Uint64 offset; // from the start of the file
+  Uint32 length, reserved;
+} TiledPackedPlane;
+
+// Chunks of compressed maps are unpacked from the mapped file as they're
+// needed, a plane at a time, and count against the chunk budget like chunks
+// read from a file.
+static int LoadChunkPacked(TiledMap* map, TiledChunk* chunk)
+{
+  size_t planeCells = map->chunkSize * map->chunkSize;
+  size_t cellCount = planeCells * map->nLayers;
+  const TiledPackedPlane* index =
+    (const TiledPackedPlane*)((char*)map->mappedFile + map->chunkDataOffset);
+  const TiledPackedPlane* plane =
+    index + (chunk->row * map->chunkCols + chunk->col) * map->nLayers;
+  Sint16* gids = MallocOrDie(cellCount * sizeof(Sint16));
+  for (int layer=0; layer < map->nLayers; ++layer, ++plane)
+  {
+    const Uint8* packed = (const Uint8*)map->mappedFile + plane->offset;
+    if (!Rlz_Decompress(packed, plane->length, gids + layer * planeCells, planeCells))
+    {
+      fprintf(stderr, "Corrupt cell data in map file.\n");
+      free(gids);
+      return 0;
+    }
+  }
+  chunk->gids = gids;
+  chunk->bytes = cellCount * sizeof(Sint16);
+  return 1;
+}
+
+// Sets *product to a * b. Returns 0 if that doesn't fit.
+static int MultiplySize(size_t a, size_t b, size_t* product)
+{
+  if (b && a > SIZE_MAX / b)
+    return 0;
+  *product = a * b;
+  return 1;
+}
+
+static TiledMap* LoadMappedMap(const char* filename)
+{
+  size_t fileLen;
+  char* data = MapFile(filename, &fileLen);
+  if (!data) return 0;
+  TiledMap* map = 0;
+  TiledNativeHeader* header = (TiledNativeHeader*)data;
+  if (fileLen < sizeof(TiledNativeHeader))
+  {
+    fprintf(stderr, "Map file '%s' is truncated.\n", filename);
+    goto fail;
+  }
+  if (header->byteOrderMark != NATIVE_BYTE_ORDER_MARK)
+  {
+    fprintf(stderr, "Map file '%s' was written for a different byte order.\n", filename);
+    goto fail;
+  }
+  if (header->version != NATIVE_MAP_VERSION)
+  {
+    fprintf(stderr, "Map file '%s' has unsupported version %u (expected %d).\n",
+        filename, header->version, NATIVE_MAP_VERSION);
+    goto fail;
+  }
+  map = MallocOrDie(sizeof(TiledMap));
+  map->width = header->width;
+  map->height = header->height;
+  map->tileWidth = header->tileWidth;
+  map->tileHeight = header->tileHeight;
+  map->nTilesets = header->nTilesets;
+  map->nLayers = header->nLayers;
+  map->mappedFile = data;
+  map->mappedFileLen = fileLen;
+  map->chunkDataOffset = header->cellDataOffset;
+  printf("Read values: w=%d, h=%d,"
+      " tw=%d, th=%d, nt=%d, nl=%d, chunk=%d (mapped)\n",
+      map->width, map->height,
+      map->tileWidth, map->tileHeight, map->nTilesets, map->nLayers,
+      header->chunkSize);
+  if (header->chunkSize <= 0 || header->chunkSize > MAX_CHUNK_SIZE
+      || map->width <= 0 || map->height <= 0 || map->nLayers <= 0
+      || map->nTilesets <= 0 || map->nTilesets > MAX_LOADED_TILESETS)
+  {
+    fprintf(stderr, "Invalid header in map file '%s'.\n", filename);
+    goto fail;
+  }
+  size_t refsEnd = sizeof(TiledNativeHeader)
+    + map->nTilesets * sizeof(TiledNativeTilesetRef);
+  size_t chunkCols = (map->width + (size_t)header->chunkSize - 1) / header->chunkSize;
+  size_t chunkRows = (map->height + (size_t)header->chunkSize - 1) / header->chunkSize;
+  int compressed = !memcmp(header->marker, "WTMZ", 4);
+  // The sizes come from the file, so check every product.
+  size_t nChunks, nPlanes, cellDataLen;
+  int sized = MultiplySize(chunkCols, chunkRows, &nChunks)
+    && MultiplySize(nChunks, map->nLayers, &nPlanes);
+  if (sized && compressed)
+    sized = MultiplySize(nPlanes, sizeof(TiledPackedPlane), &cellDataLen);
+  else if (sized)
+    sized = MultiplySize(nPlanes, header->chunkSize * header->chunkSize * sizeof(Sint16),
+        &cellDataLen);
+  if (!sized || nChunks > INT_MAX
+      || header->cellDataOffset < refsEnd
+      || header->cellDataOffset % NATIVE_CELL_ALIGNMENT != 0
+      || header->cellDataOffset > fileLen
+      || cellDataLen > fileLen - header->cellDataOffset)
+  {
+    fprintf(stderr, "Invalid cell data layout in map file '%s'.\n", filename);
+    goto fail;
+  }
+  if (compressed)
+  {
+    // Check the index once, so chunks can be unpacked without checking it.
+    const TiledPackedPlane* index = (const TiledPackedPlane*)(data + header->cellDataOffset);
+    size_t packedStart = header->cellDataOffset + cellDataLen;
+    for (size_t i=0; i < nPlanes; ++i)
+    {
+      if (index[i].offset < packedStart || index[i].offset > fileLen
+          || index[i].length > fileLen - index[i].offset)
+      {
+        fprintf(stderr, "Invalid chunk index in map file '%s'.\n", filename);
+        goto fail;
+      }
+    }
+  }
+  map->tilesetRefs = MallocOrDie(map->nTilesets * sizeof(TiledTilesetRef));
+  TiledNativeTilesetRef* refs = (TiledNativeTilesetRef*)(header + 1);
+  for (int i=0; i < map->nTilesets; ++i)
+  {
+    Sint32 filenameLength = refs[i].filenameLength;
+    assert(filenameLength > 0); // defend against rogue input
+    assert(filenameLength <= NATIVE_FILENAME_LENGTH); // defend against rogue input
+    char tilesetFilename[filenameLength + 1];
+    memcpy(tilesetFilename, refs[i].filename, filenameLength);
+    tilesetFilename[filenameLength] = '\0';
+    map->tilesetRefs[i].firstGid = refs[i].firstGid;
+    map->tilesetRefs[i].tileset =
+      LoadTileset(tilesetFilename, map->tileWidth, map->tileHeight);
+    if (!map->tilesetRefs[i].tileset) goto fail;
+  }
+  if (!TiledMap_BuildGidTable(map)) goto fail;
+  if (!TiledMap_InitChunks(map, header->chunkSize,
+        compressed ? LoadChunkPacked : LoadChunkInPlace)) goto fail;
+  map->cellRowStride = map->chunkSize;
+  map->cellLayerStride = map->chunkSize * map->chunkSize;
+  return map;
+
+fail:
+  // Tilesets that were loaded are kept; nothing frees tilesets.
+  if (map)
+  {
+    free(map->tilesetRefs);
+    free(map->gidTiles);
+    free(map->gidTex);
+    free(map->gidAtlasPos);
+    free(map->gidProps);
+    free(map);
+  }
+  UnmapFile(data, fileLen);
   return 0;
 }
 
+// Writing a native-format map a row at a time. Only a band of chunkSize
+// rows of one layer is held at once, laid out as chunk planes; when it's
+// full, each plane is written to its place in the file. Packed planes go
+// one after another instead, and the index is written at the end.
+struct TiledNativeWriter {
+  SDL_RWops* rw;
+  int width, height, nLayers, chunkSize, chunkCols;
+  Uint32 cellDataOffset;
+  Sint16* band; // chunkCols planes of chunkSize x chunkSize
+  int layer, row; // of the next row
+  int ok;
+  TiledPackedPlane* index; // 0 unless compressed
+  size_t nPlanes;
+  Uint8* packed; // room for one packed plane
+  Uint64 packedEnd; // where the next packed plane goes
+};
+
+static int WritePlane(TiledNativeWriter* writer, Sint64 chunk, const Sint16* cells,
+    size_t planeCells)
+{
+  size_t planeIndex = chunk * writer->nLayers + writer->layer;
+  if (!writer->index)
+  {
+    Sint64 offset = writer->cellDataOffset + planeIndex * planeCells * sizeof(Sint16);
+    return SDL_RWseek(writer->rw, offset, RW_SEEK_SET) >= 0
+      && SDL_RWwrite(writer->rw, cells, sizeof(Sint16), planeCells) == planeCells;
+  }
+  size_t len = Rlz_Compress(cells, planeCells, writer->chunkSize, writer->packed);
+  writer->index[planeIndex].offset = writer->packedEnd;
+  writer->index[planeIndex].length = len;
+  writer->packedEnd += len;
+  return SDL_RWwrite(writer->rw, writer->packed, 1, len) == len;
+}
+
+static int FlushBand(TiledNativeWriter* writer)
+{
+  int chunkRow = (writer->row - 1) / writer->chunkSize;
+  size_t planeCells = (size_t)writer->chunkSize * writer->chunkSize;
+  for (int chunkCol=0; chunkCol < writer->chunkCols && writer->ok; ++chunkCol)
+  {
+    Sint64 chunk = (Sint64)chunkRow * writer->chunkCols + chunkCol;
+    writer->ok = WritePlane(writer, chunk, writer->band + chunkCol * planeCells, planeCells);
+  }
+  // Past the map edge, cells are zero.
+  memset(writer->band, 0, writer->chunkCols * planeCells * sizeof(Sint16));
+  return writer->ok;
+}
+
+// Starts writing a native-format map. The layers in the spec are ignored;
+// they're written with TiledMap_WriteNativeRow instead.
+TiledNativeWriter* TiledMap_BeginNative(const char* filename, const TiledNativeSpec* spec)
+{
+  if (spec->chunkSize <= 0 || spec->chunkSize > MAX_CHUNK_SIZE
+      || (spec->chunkSize & (spec->chunkSize - 1))
+      || spec->width <= 0 || spec->height <= 0 || spec->nLayers <= 0
+      || spec->nTilesets <= 0 || spec->nTilesets > MAX_LOADED_TILESETS)
+  {
+    fprintf(stderr, "Invalid dimensions for map file '%s'.\n", filename);
+    return 0;
+  }
+  TiledNativeHeader header = { { 'W', 'T', 'M', spec->compressed ? 'Z' : 'N' },
+    NATIVE_BYTE_ORDER_MARK,
+    NATIVE_MAP_VERSION, 0, spec->width, spec->height, spec->tileWidth,
+    spec->tileHeight, spec->nTilesets, spec->nLayers, spec->chunkSize, 0 };
+  size_t refsEnd = sizeof(TiledNativeHeader)
+    + spec->nTilesets * sizeof(TiledNativeTilesetRef);
+  header.cellDataOffset = (refsEnd + NATIVE_CELL_ALIGNMENT - 1)
+    / NATIVE_CELL_ALIGNMENT * NATIVE_CELL_ALIGNMENT;
+  TiledNativeTilesetRef refs[MAX_LOADED_TILESETS];
+  memset(refs, 0, sizeof(refs));
+  for (int i=0; i < spec->nTilesets; ++i)
+  {
+    size_t filenameLength = strlen(spec->tilesetFilenames[i]);
+    if (filenameLength == 0 || filenameLength > NATIVE_FILENAME_LENGTH)
+    {
+      fprintf(stderr, "Tileset filename '%s' is too long for a map file.\n",
+          spec->tilesetFilenames[i]);
+      return 0;
+    }
+    refs[i].firstGid = spec->firstGids[i];
+    refs[i].filenameLength = filenameLength;
+    memcpy(refs[i].filename, spec->tilesetFilenames[i], filenameLength);
+  }
+  SDL_RWops* rw = SDL_RWFromFile(filename, "wb");
+  if (!rw)
+  {
+    fprintf(stderr, "Unable to write map file '%s': %s\n", filename, SDL_GetError());
+    return 0;
+  }
+  static const char zeros[NATIVE_CELL_ALIGNMENT];
+  size_t padding = header.cellDataOffset - refsEnd;
+  if (SDL_RWwrite(rw, &header, sizeof(header), 1) != 1
+      || SDL_RWwrite(rw, refs, sizeof(TiledNativeTilesetRef), spec->nTilesets)
+        != (size_t)spec->nTilesets
+      || (padding && SDL_RWwrite(rw, zeros, 1, padding) != padding))
+  {
+    fprintf(stderr, "Error writing map file '%s'.\n", filename);
+    SDL_RWclose(rw);
+    return 0;
+  }
+  TiledNativeWriter* writer = MallocOrDie(sizeof(TiledNativeWriter));
+  writer->rw = rw;
+  writer->width = spec->width;
+  writer->height = spec->height;
+  writer->nLayers = spec->nLayers;
+  writer->chunkSize = spec->chunkSize;
+  writer->chunkCols = (spec->width + spec->chunkSize - 1) / spec->chunkSize;
+  writer->cellDataOffset = header.cellDataOffset;
+  size_t planeCells = (size_t)spec->chunkSize * spec->chunkSize;
+  writer->band = MallocOrDie(writer->chunkCols * planeCells * sizeof(Sint16));
+  writer->ok = 1;
+  if (spec->compressed)
+  {
+    // The index is filled in as planes are written, and written last.
+    int chunkRows = (spec->height + spec->chunkSize - 1) / spec->chunkSize;
+    writer->nPlanes = (size_t)writer->chunkCols * chunkRows * spec->nLayers;
+    writer->index = MallocOrDie(writer->nPlanes * sizeof(TiledPackedPlane));
+    writer->packed = MallocOrDie(Rlz_Bound(planeCells));
+    writer->packedEnd = header.cellDataOffset + writer->nPlanes * sizeof(TiledPackedPlane);
+    writer->ok = SDL_RWseek(rw, writer->packedEnd, RW_SEEK_SET) >= 0;
+  }
+  return writer;
+}
+
+// Adds the next row of GIDs: the rows of the first layer from the top, then
+// those of the next, and so on.
+int TiledMap_WriteNativeRow(TiledNativeWriter* writer, const Sint16* gids)
+{
+  if (!writer->ok || writer->layer == writer->nLayers)
+    return writer->ok = 0;
+  int chunkSize = writer->chunkSize;
+  int y = writer->row % chunkSize;
+  for (int chunkCol=0; chunkCol < writer->chunkCols; ++chunkCol)
+  {
+    int x = chunkCol * chunkSize;
+    int w = writer->width - x < chunkSize ? writer->width - x : chunkSize;
+    memcpy(writer->band + ((size_t)chunkCol * chunkSize + y) * chunkSize, gids + x,
+        w * sizeof(Sint16));
+  }
+  ++writer->row;
+  if (y == chunkSize - 1 || writer->row == writer->height)
+    FlushBand(writer);
+  if (writer->row == writer->height)
+  {
+    writer->row = 0;
+    ++writer->layer;
+  }
+  return writer->ok;
+}
+
+// Finishes the file and frees the writer. Returns 0 if anything went wrong,
+// including not being given every row.
+int TiledMap_EndNative(TiledNativeWriter* writer, const char* filename)
+{
+  int ok = writer->ok;
+  if (ok && writer->index && writer->layer == writer->nLayers)
+    ok = SDL_RWseek(writer->rw, writer->cellDataOffset, RW_SEEK_SET) >= 0
+      && SDL_RWwrite(writer->rw, writer->index, sizeof(TiledPackedPlane), writer->nPlanes)
+        == writer->nPlanes;
+  if (SDL_RWclose(writer->rw) < 0)
+    ok = 0;
+  if (!ok)
+    fprintf(stderr, "Error writing map file '%s'.\n", filename);
+  else if (writer->layer != writer->nLayers)
+  {
+    fprintf(stderr, "Map file '%s' is incomplete.\n", filename);
+    ok = 0;
+  }
+  free(writer->band);
+  free(writer->index);
+  free(writer->packed);
+  free(writer);
+  return ok;
+}
+
+// Writes a native-format map. Returns 0 on failure.
+int TiledMap_WriteNative(const char* filename, const TiledNativeSpec* spec)
+{
+  TiledNativeWriter* writer = TiledMap_BeginNative(filename, spec);
+  if (!writer)
+    return 0;
+  for (int layer=0; layer < spec->nLayers; ++layer)
+    for (int y=0; y < spec->height; ++y)
+      TiledMap_WriteNativeRow(writer, spec->layers[layer] + (size_t)y * spec->width);
+  return TiledMap_EndNative(writer, filename);
+}
+
+// Creates an empty in-memory map with no tilesets. Cells can be written
+// through TiledMap_GetCell. Used for generated maps and tests.
+TiledMap* TiledMap_Create(int width, int height, int nLayers, int tileWidth, int tileHeight)
+{
+  TiledMap* map = MallocOrDie(sizeof(TiledMap));
+  map->width = width;
+  map->height = height;
+  map->tileWidth = tileWidth;
+  map->tileHeight = tileHeight;
+  map->nLayers = nLayers;
+  size_t singleLayerCellCount = (size_t)width * height;
+  map->cells = MallocOrDie(nLayers * singleLayerCellCount * sizeof(Sint16));
+  if (!TiledMap_BuildGidTable(map)) return 0;
+  if (!TiledMap_InitChunks(map, DEFAULT_CHUNK_SIZE, LoadChunkView)) return 0;
+  map->cellRowStride = width;
+  map->cellLayerStride = singleLayerCellCount;
+  return map;
+}
+
+// Chunks, and their obstacle and opacity planes, are loaded as they're
+// needed, so opening a map takes about as long whatever its size.
 TiledMap* TiledMap_Load(const char* filename)
 {
   SDL_RWops* rw = RWopenRead(filename);
   if (!rw) return 0;
+  // Newer maps start with a marker. Old-format maps start with the width.
+  char markerBuf[4];
+  if (!RWread(rw, markerBuf, 1, 4)) return 0;
+  if (!memcmp(markerBuf, "WTMN", 4) || !memcmp(markerBuf, "WTMZ", 4))
+  {
+    SDL_RWclose(rw);
+    return LoadMappedMap(filename);
+  }
+  int isChunked = !memcmp(markerBuf, "WTMC", 4);
+  if (!isChunked)
+    SDL_RWseek(rw, 0, RW_SEEK_SET);
   TiledMap* map = MallocOrDie(sizeof(TiledMap));
   ReadInts32(rw, (Sint32*)map, 6);
+  Sint32 chunkSize = DEFAULT_CHUNK_SIZE;
+  if (isChunked)
+  {
+    ReadInts32(rw, &chunkSize, 1);
+    if (chunkSize <= 0 || chunkSize > MAX_CHUNK_SIZE)
+    {
+      fprintf(stderr, "Invalid chunk size in map file: %d\n", chunkSize);
+      return 0;
+    }
+  }
   printf("Read values: w=%d, h=%d,"
-      " tw=%d, th=%d, nt=%d, nl=%d\n",
+      " tw=%d, th=%d, nt=%d, nl=%d, chunk=%d%s\n",
       map->width, map->height,
-      map->tileWidth, map->tileHeight, map->nTilesets, map->nLayers);
+      map->tileWidth, map->tileHeight, map->nTilesets, map->nLayers,
+      chunkSize, isChunked ? " (streamed)" : "");
   map->tilesetRefs = MallocOrDie(map->nTilesets * sizeof(TiledTilesetRef));
   for (int i=0; i < map->nTilesets; ++i)
     if (!LoadTilesetRef(rw, &map->tilesetRefs[i], map->tileWidth, map->tileHeight))
       return 0;
-  size_t singleLayerCellCount = map->width * map->height;
-  size_t totalCellCount = map->nLayers * singleLayerCellCount;
-  Sint16* tileGids = MallocOrDie(totalCellCount * sizeof(Sint16));
-  if (!ReadInts16(rw, tileGids, totalCellCount)) return 0;
-  TiledTile** tiles = MallocOrDie(totalCellCount * sizeof(TiledTile**));
-  for (size_t t=0; t < totalCellCount; ++t)
+  if (!TiledMap_BuildGidTable(map)) return 0;
+  if (isChunked)
   {
-    int gid = tileGids[t];
-    tiles[t] = TiledMap_FindTile(map, gid);
+    // Leave the file open; chunks are read on demand.
+    map->chunkSource = rw;
+    map->chunkDataOffset = SDL_RWtell(rw);
+    if (!TiledMap_InitChunks(map, chunkSize, LoadChunkFromFile)) return 0;
+    map->cellRowStride = map->chunkSize;
+    map->cellLayerStride = map->chunkSize * map->chunkSize;
+    return map;
   }
-  free(tileGids);
-  map->layerTiles = tiles;
+  size_t singleLayerCellCount = map->width * map->height;
+  size_t totalCellCount = map->nLayers * singleLayerCellCount;
+  Sint16* cells = MallocOrDie(totalCellCount * sizeof(Sint16));
+  if (!ReadInts16(rw, cells, totalCellCount)) return 0;
+  SDL_RWclose(rw);
+  map->cells = MallocOrDie(totalCellCount * sizeof(Sint16));
+  SplitLayers(map->cells, cells, singleLayerCellCount, map->nLayers);
+  free(cells);
+  if (!TiledMap_InitChunks(map, chunkSize, LoadChunkView)) return 0;
+  map->cellRowStride = map->width;
+  map->cellLayerStride = singleLayerCellCount;
   return map;
 }
-
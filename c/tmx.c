@@ -0,0 +1,415 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// TMX map conversion.
+//
+// Converts Tiled's .tmx maps to native-format maps without building a
+// document. The file is mapped and read with the XML pull parser, and each
+// layer's data is decoded straight into rows for the native map writer, so
+// memory use stays the same however big the map is. The header has to be
+// written first, so a quick first pass over the tags, which skips the data,
+// finds the tilesets and counts the layers.
+//
+// Layer data can be CSV, base64 (uncompressed, zlib or gzip) or <tile>
+// elements. Infinite maps and embedded tilesets aren't supported. As in the
+// C# exporter, tileset refs name the .wts files made from the .tsx files.
+
+#define TMX_MAX_TILESETS 16
+#define TMX_NAME_LENGTH 64
+#define TMX_BUFFER_SIZE 16384
+
+typedef struct TmxMap {
+  const char* name;
+  int width, height, tileWidth, tileHeight, nLayers, nTilesets;
+  Sint32 firstGids[TMX_MAX_TILESETS];
+  char tilesetFilenames[TMX_MAX_TILESETS][TMX_NAME_LENGTH];
+  const char* tilesetNames[TMX_MAX_TILESETS];
+} TmxMap;
+
+// A layer being decoded.
+typedef struct TmxLayer {
+  const TmxMap* map;
+  TiledNativeWriter* writer;
+  char name[TMX_NAME_LENGTH];
+  Sint16* row;
+  int x; // of the next cell in the row
+  size_t nCells, maxCells;
+  const char* error;
+  // Base64 text still to decode, and bits left over from the last read.
+  const char* in;
+  const char* inEnd;
+  Uint32 bits;
+  int nBits;
+  // Bytes of a GID split between writes.
+  Uint8 partial[4];
+  int nPartial;
+} TmxLayer;
+
+static Sint8 base64Values[256];
+
+static int MapError(const TmxMap* map, XmlParser* p, const char* problem)
+{
+  fprintf(stderr, "Map '%s', line %d: %s.\n", map->name, Xml_Line(p), problem);
+  return 0;
+}
+
+static int LayerError(TmxLayer* layer, const char* problem)
+{
+  if (!layer->error)
+    layer->error = problem;
+  return 0;
+}
+
+static inline int AddGid(TmxLayer* layer, Uint32 gid)
+{
+  if (gid > SDL_MAX_SINT16)
+    return LayerError(layer, gid & 0xF0000000 ? "has flipped tiles, which aren't supported"
+        : "has GIDs over 32767");
+  if (layer->nCells == layer->maxCells)
+    return LayerError(layer, "has too many cells");
+  ++layer->nCells;
+  layer->row[layer->x++] = gid;
+  if (layer->x == layer->map->width)
+  {
+    layer->x = 0;
+    if (!TiledMap_WriteNativeRow(layer->writer, layer->row))
+      return LayerError(layer, "couldn't be written");
+  }
+  return 1;
+}
+
+static int IsSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Values are separated by commas, with line breaks after the commas at the
+// end of each row.
+static int DecodeCsv(TmxLayer* layer, XmlSlice text)
+{
+  const char* p = text.text;
+  const char* end = p + text.len;
+  int needValue = 1;
+  while (p < end)
+  {
+    if ((unsigned)(*p - '0') < 10)
+    {
+      if (!needValue)
+        return LayerError(layer, "has a missing comma in its CSV data");
+      Uint64 gid = 0;
+      while (p < end && (unsigned)(*p - '0') < 10 && gid <= UINT32_MAX)
+        gid = gid * 10 + (*p++ - '0');
+      if (gid > UINT32_MAX || !AddGid(layer, (Uint32)gid))
+        return LayerError(layer, "has a GID out of range");
+      needValue = 0;
+    }
+    else if (*p == ',' && !needValue)
+    {
+      needValue = 1;
+      ++p;
+    }
+    else if (IsSpace(*p))
+      ++p;
+    else
+      return LayerError(layer, "has bad CSV data");
+  }
+  return 1;
+}
+
+// An InflateReader: decodes base64 text into up to size bytes.
+static size_t ReadBase64(void* data, Uint8* buf, size_t size)
+{
+  TmxLayer* layer = data;
+  size_t n = 0;
+  while (n + 3 <= size && layer->in < layer->inEnd)
+  {
+    Uint8 c = *layer->in++;
+    if (c == '=')
+    {
+      // Padding: the end.
+      layer->in = layer->inEnd;
+      break;
+    }
+    int value = base64Values[c];
+    if (value < 0)
+    {
+      if (IsSpace(c))
+        continue;
+      LayerError(layer, "has bad base64 data");
+      return 0;
+    }
+    layer->bits = layer->bits << 6 | value;
+    layer->nBits += 6;
+    if (layer->nBits == 24)
+    {
+      buf[n++] = layer->bits >> 16;
+      buf[n++] = layer->bits >> 8;
+      buf[n++] = layer->bits;
+      layer->bits = 0;
+      layer->nBits = 0;
+    }
+  }
+  if (layer->in == layer->inEnd && n + 2 <= size)
+  {
+    // The last group may hold one or two bytes.
+    for (; layer->nBits >= 8; layer->nBits -= 8)
+      buf[n++] = layer->bits >> (layer->nBits - 8);
+    layer->nBits = 0;
+  }
+  return n;
+}
+
+// An InflateWriter: takes decoded bytes, four little-endian bytes to a GID.
+static int WriteGidBytes(void* data, const Uint8* bytes, size_t n)
+{
+  TmxLayer* layer = data;
+  while (n && layer->nPartial)
+  {
+    layer->partial[layer->nPartial++] = *bytes++;
+    --n;
+    if (layer->nPartial == 4)
+    {
+      layer->nPartial = 0;
+      Uint8* b = layer->partial;
+      if (!AddGid(layer, b[0] | b[1] << 8 | b[2] << 16 | (Uint32)b[3] << 24))
+        return 0;
+    }
+  }
+  for (; n >= 4; n -= 4, bytes += 4)
+  {
+    Uint32 gid = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (Uint32)bytes[3] << 24;
+    if (!AddGid(layer, gid))
+      return 0;
+  }
+  for (; n; --n)
+    layer->partial[layer->nPartial++] = *bytes++;
+  return 1;
+}
+
+static int DecodeBase64(TmxLayer* layer, XmlSlice text, int compression)
+{
+  layer->in = text.text;
+  layer->inEnd = text.text + text.len;
+  if (compression >= 0)
+  {
+    if (Inflate(compression, ReadBase64, WriteGidBytes, layer) < 0)
+      return LayerError(layer, "has bad compressed data");
+    return !layer->error;
+  }
+  Uint8 buf[TMX_BUFFER_SIZE];
+  size_t n;
+  while ((n = ReadBase64(layer, buf, sizeof(buf))) > 0)
+    if (!WriteGidBytes(layer, buf, n))
+      return 0;
+  return !layer->error;
+}
+
+static void CopyName(XmlSlice slice, char* buf)
+{
+  if (!Xml_Unescape(slice, buf, TMX_NAME_LENGTH))
+    strcpy(buf, "?");
+}
+
+// Decodes a <layer> (the parser is at its start) into the writer.
+static int ConvertLayer(TmxMap* map, XmlParser* p, TiledNativeWriter* writer, Sint16* row)
+{
+  TmxLayer layer = { 0 };
+  layer.map = map;
+  layer.writer = writer;
+  layer.row = row;
+  layer.maxCells = (size_t)map->width * map->height;
+  XmlSlice value;
+  strcpy(layer.name, "?");
+  if (Xml_Attribute(p, "name", &value))
+    CopyName(value, layer.name);
+  int layerDepth = p->depth;
+  int encoding = 0; // 'c'sv, 'b'ase64, or 0 for <tile> elements
+  int compression = -1;
+  int event;
+  while ((event = Xml_Next(p)) != XML_ERROR && p->depth >= layerDepth && !layer.error)
+  {
+    if (event == XML_START && Xml_SliceIs(p->name, "data"))
+    {
+      encoding = 0;
+      compression = -1;
+      if (Xml_Attribute(p, "encoding", &value))
+      {
+        if (Xml_SliceIs(value, "csv"))
+          encoding = 'c';
+        else if (Xml_SliceIs(value, "base64"))
+          encoding = 'b';
+        else
+          return MapError(map, p, "unknown layer data encoding");
+      }
+      if (Xml_Attribute(p, "compression", &value))
+      {
+        if (Xml_SliceIs(value, "zlib"))
+          compression = INFLATE_ZLIB;
+        else if (Xml_SliceIs(value, "gzip"))
+          compression = INFLATE_GZIP;
+        else
+          return MapError(map, p, "unsupported layer data compression");
+      }
+    }
+    else if (event == XML_START && Xml_SliceIs(p->name, "chunk"))
+      return MapError(map, p, "infinite maps aren't supported");
+    else if (event == XML_START && Xml_SliceIs(p->name, "tile") && !encoding)
+    {
+      long gid = 0;
+      if (Xml_Attribute(p, "gid", &value) && (!Xml_SliceToInt(value, &gid) || gid < 0))
+        return MapError(map, p, "bad tile GID");
+      AddGid(&layer, (Uint32)gid);
+    }
+    else if (event == XML_TEXT && encoding == 'c')
+      DecodeCsv(&layer, p->text);
+    else if (event == XML_TEXT && encoding == 'b')
+      DecodeBase64(&layer, p->text, compression);
+    else if (event == XML_TEXT)
+      return MapError(map, p, "unexpected text in layer");
+  }
+  if (p->event == XML_ERROR)
+    return MapError(map, p, p->error);
+  if (!layer.error && (layer.nCells != layer.maxCells || layer.nPartial))
+    layer.error = "has too few cells";
+  if (layer.error)
+  {
+    fprintf(stderr, "Map '%s', layer '%s' %s.\n", map->name, layer.name, layer.error);
+    return 0;
+  }
+  return 1;
+}
+
+static int GetIntAttribute(TmxMap* map, XmlParser* p, const char* name, int* value)
+{
+  XmlSlice slice;
+  long n;
+  if (!Xml_Attribute(p, name, &slice) || !Xml_SliceToInt(slice, &n) || n < 0 || n > INT_MAX)
+  {
+    char problem[80];
+    snprintf(problem, sizeof(problem), "missing or bad '%s' attribute", name);
+    return MapError(map, p, problem);
+  }
+  *value = (int)n;
+  return 1;
+}
+
+// Reads the map's attributes, tileset refs and layer count, without
+// looking at the layer data.
+static int ScanMap(TmxMap* map, const char* xml, size_t len)
+{
+  XmlParser p;
+  Xml_Init(&p, xml, len);
+  if (Xml_Next(&p) != XML_START || !Xml_SliceIs(p.name, "map"))
+    return MapError(map, &p, p.error ? p.error : "expected a <map> element");
+  XmlSlice value;
+  if (Xml_Attribute(&p, "orientation", &value) && !Xml_SliceIs(value, "orthogonal"))
+    return MapError(map, &p, "only orthogonal maps are supported");
+  if (Xml_Attribute(&p, "renderorder", &value) && !Xml_SliceIs(value, "right-down"))
+    return MapError(map, &p, "only the right-down render order is supported");
+  if (Xml_Attribute(&p, "infinite", &value) && Xml_SliceIs(value, "1"))
+    return MapError(map, &p, "infinite maps aren't supported");
+  if (!GetIntAttribute(map, &p, "width", &map->width)
+      || !GetIntAttribute(map, &p, "height", &map->height)
+      || !GetIntAttribute(map, &p, "tilewidth", &map->tileWidth)
+      || !GetIntAttribute(map, &p, "tileheight", &map->tileHeight))
+    return 0;
+  int event;
+  while ((event = Xml_Next(&p)) != XML_EOF)
+  {
+    if (event == XML_ERROR)
+      return MapError(map, &p, p.error);
+    if (event != XML_START || p.depth != 2)
+      continue;
+    if (Xml_SliceIs(p.name, "tileset"))
+    {
+      if (map->nTilesets == TMX_MAX_TILESETS)
+        return MapError(map, &p, "too many tilesets");
+      int firstGid;
+      if (!GetIntAttribute(map, &p, "firstgid", &firstGid))
+        return 0;
+      if (!Xml_Attribute(&p, "source", &value))
+        return MapError(map, &p, "embedded tilesets aren't supported");
+      // foo.tsx becomes foo.wts.
+      char* filename = map->tilesetFilenames[map->nTilesets];
+      CopyName(value, filename);
+      char* dot = strrchr(filename, '.');
+      if (!dot || strchr(dot, '/') || strchr(dot, '\\'))
+        dot = filename + strlen(filename);
+      if (dot + 4 - filename >= TMX_NAME_LENGTH)
+        return MapError(map, &p, "tileset filename too long");
+      strcpy(dot, ".wts");
+      map->firstGids[map->nTilesets] = firstGid;
+      map->tilesetNames[map->nTilesets] = filename;
+      ++map->nTilesets;
+    }
+    else if (Xml_SliceIs(p.name, "layer"))
+    {
+      int width, height;
+      if (!GetIntAttribute(map, &p, "width", &width)
+          || !GetIntAttribute(map, &p, "height", &height))
+        return 0;
+      if (width != map->width || height != map->height)
+        return MapError(map, &p, "layer isn't the size of the map");
+      ++map->nLayers;
+    }
+  }
+  if (!map->nTilesets || !map->nLayers)
+    return MapError(map, &p, "map has no tilesets or no layers");
+  return 1;
+}
+
+// Converts TMX text to a native-format map with the given chunk size,
+// compressed or not. name is what to call the map in errors.
+int Tmx_ConvertText(const char* xml, size_t len, const char* name,
+    const char* wtmFilename, int chunkSize, int compressed)
+{
+  if (!base64Values['A' + 1])
+  {
+    static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    memset(base64Values, -1, sizeof(base64Values));
+    for (int i=0; i < 64; ++i)
+      base64Values[(Uint8)digits[i]] = i;
+  }
+  TmxMap map = { 0 };
+  map.name = name;
+  if (!ScanMap(&map, xml, len))
+    return 0;
+  TiledNativeSpec spec = { map.width, map.height, map.tileWidth, map.tileHeight, chunkSize,
+    map.nTilesets, map.firstGids, map.tilesetNames, map.nLayers, 0, compressed };
+  TiledNativeWriter* writer = TiledMap_BeginNative(wtmFilename, &spec);
+  if (!writer)
+    return 0;
+  Sint16* row = MallocOrDie(map.width * sizeof(Sint16));
+  XmlParser p;
+  Xml_Init(&p, xml, len);
+  int ok = 1, event;
+  while (ok && (event = Xml_Next(&p)) != XML_EOF)
+  {
+    if (event == XML_ERROR)
+      ok = MapError(&map, &p, p.error);
+    else if (event == XML_START && p.depth == 2 && Xml_SliceIs(p.name, "layer"))
+      ok = ConvertLayer(&map, &p, writer, row);
+  }
+  free(row);
+  if (!TiledMap_EndNative(writer, wtmFilename))
+    ok = 0;
+  if (!ok)
+    remove(wtmFilename);
+  return ok;
+}
+
+// Converts a .tmx file to a native-format map.
+int Tmx_Convert(const char* tmxFilename, const char* wtmFilename, int chunkSize,
+    int compressed)
+{
+  size_t len;
+  char* xml = MapFile(tmxFilename, &len);
+  if (!xml)
+    return 0;
+  int ok = Tmx_ConvertText(xml, len, tmxFilename, wtmFilename, chunkSize, compressed);
+  UnmapFile(xml, len);
+  return ok;
+}
@@ -0,0 +1,57 @@
+/* vim: nu et ai ts=2 sts=2 sw=2
+*/
+
+#include "wandrix.h"
+
+// Converts a Tiled .tmx map into a native-format map (see tmx.c).
+
+#define MAX_FILENAME_LENGTH 260
+
+static int Usage()
+{
+  fprintf(stderr, "Usage: tmx2wtm [-chunk SIZE] [-compress] MAP.tmx [OUT.wtm]\n");
+  return 1;
+}
+
+int main(int argc, char** argv)
+{
+  int chunkSize = 32, compressed = 0;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i)
+  {
+    if (!strcmp(argv[i], "-chunk") && i + 1 < argc)
+      chunkSize = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-compress"))
+      compressed = 1;
+    else
+      return Usage();
+  }
+  if (argc - i < 1 || argc - i > 2)
+    return Usage();
+  const char* tmxFilename = argv[i];
+  // By default, MAP.tmx becomes MAP.wtm.
+  char wtmFilename[MAX_FILENAME_LENGTH];
+  if (argc - i == 2)
+    snprintf(wtmFilename, sizeof(wtmFilename), "%s", argv[i + 1]);
+  else
+  {
+    const char* dot = strrchr(tmxFilename, '.');
+    int baseLength = dot ? (int)(dot - tmxFilename) : (int)strlen(tmxFilename);
+    snprintf(wtmFilename, sizeof(wtmFilename), "%.*s.wtm", baseLength, tmxFilename);
+  }
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  if (!Tmx_Convert(tmxFilename, wtmFilename, chunkSize, compressed))
+    return 1;
+  double seconds = (double)(SDL_GetPerformanceCounter() - startTime)
+    / SDL_GetPerformanceFrequency();
+  // Compressed maps read little and write a lot.
+  Sint64 inSize, outSize, modified;
+  if (!GetFileStamp(tmxFilename, &inSize, &modified))
+    inSize = 0;
+  if (!GetFileStamp(wtmFilename, &outSize, &modified))
+    outSize = 0;
+  printf("TMX2WTM: WROTE %s IN %.3f S; READ %.1f MB (%.0f MB/S), WROTE %.1f MB (%.0f MB/S)\n",
+      wtmFilename, seconds, inSize / 1e6, inSize / 1e6 / seconds,
+      outSize / 1e6, outSize / 1e6 / seconds);
+  return 0;
+}
@@ -2,8 +2,15 @@
 */
 
 #include "wandrix.h"
-
-static int IntSqrt(int n);
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 struct Coords Coords_Scale(int scalar, struct Coords s)
 {
@@ -112,6 +119,118 @@ void* MallocOrDie(size_t size)
   return mem;
 }
 
+void TimeSamples_Add(TimeSamples* times, Uint64 duration)
+{
+  if (times->count == times->capacity)
+  {
+    int capacity = times->capacity ? 2 * times->capacity : 1024;
+    Uint64* samples = MallocOrDie(capacity * sizeof(Uint64));
+    if (times->count)
+      memcpy(samples, times->samples, times->count * sizeof(Uint64));
+    free(times->samples);
+    times->samples = samples;
+    times->capacity = capacity;
+  }
+  times->samples[times->count++] = duration;
+  times->sorted = 0;
+}
+
+static int CompareUint64(const void* a, const void* b)
+{
+  Uint64 x = *(const Uint64*)a, y = *(const Uint64*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile, 0 to 100.
+Uint64 TimeSamples_Percentile(TimeSamples* times, int percent)
+{
+  if (times->count == 0)
+    return 0;
+  if (!times->sorted)
+  {
+    qsort(times->samples, times->count, sizeof(Uint64), CompareUint64);
+    times->sorted = 1;
+  }
+  int rank = (int)(((Sint64)percent * times->count + 99) / 100);
+  return times->samples[rank > 0 ? rank - 1 : 0];
+}
+
+// Prints the count and the p50, p99 and max in microseconds.
+void TimeSamples_Print(TimeSamples* times, const char* name)
+{
+  double usPerCount = 1e6 / SDL_GetPerformanceFrequency();
+  printf("%s: N=%d, P50=%.1fus, P99=%.1fus, MAX=%.1fus\n", name, times->count,
+      TimeSamples_Percentile(times, 50) * usPerCount,
+      TimeSamples_Percentile(times, 99) * usPerCount,
+      TimeSamples_Percentile(times, 100) * usPerCount);
+}
+
+void TimeSamples_Free(TimeSamples* times)
+{
+  free(times->samples);
+  memset(times, 0, sizeof(*times));
+}
+
+// Durations below 1 << TIME_HISTOGRAM_SUBBITS have a bucket each; above
+// that, each power of two is split into 1 << TIME_HISTOGRAM_SUBBITS.
+static int TimeHistogram_Bucket(Uint64 duration)
+{
+  if (duration < (1 << TIME_HISTOGRAM_SUBBITS))
+    return (int)duration;
+  int shift = 63 - __builtin_clzll(duration) - TIME_HISTOGRAM_SUBBITS;
+  return ((shift + 1) << TIME_HISTOGRAM_SUBBITS) + (int)(duration >> shift)
+    - (1 << TIME_HISTOGRAM_SUBBITS);
+}
+
+// The largest duration that falls in a bucket.
+static Uint64 TimeHistogram_BucketTop(int bucket)
+{
+  if (bucket < (1 << TIME_HISTOGRAM_SUBBITS))
+    return bucket;
+  int shift = (bucket >> TIME_HISTOGRAM_SUBBITS) - 1;
+  Uint64 start = (Uint64)((bucket & ((1 << TIME_HISTOGRAM_SUBBITS) - 1))
+      + (1 << TIME_HISTOGRAM_SUBBITS)) << shift;
+  return start + ((Uint64)1 << shift) - 1;
+}
+
+void TimeHistogram_Add(TimeHistogram* times, Uint64 duration)
+{
+  ++times->counts[TimeHistogram_Bucket(duration)];
+  ++times->count;
+  if (duration > times->max)
+    times->max = duration;
+}
+
+// Nearest-rank percentile, 0 to 100, as the top of the bucket it falls in
+// (so up to an eighth high), but never above the largest duration added.
+Uint64 TimeHistogram_Percentile(TimeHistogram* times, int percent)
+{
+  if (times->count == 0)
+    return 0;
+  Uint64 rank = ((Uint64)percent * times->count + 99) / 100;
+  Uint64 seen = 0;
+  for (int i=0; i < TIME_HISTOGRAM_BUCKETS; ++i)
+  {
+    seen += times->counts[i];
+    if (seen >= rank && seen > 0)
+    {
+      Uint64 top = TimeHistogram_BucketTop(i);
+      return top < times->max ? top : times->max;
+    }
+  }
+  return times->max;
+}
+
+// Prints the count and the p50, p99 and max in microseconds.
+void TimeHistogram_Print(TimeHistogram* times, const char* name)
+{
+  double usPerCount = 1e6 / SDL_GetPerformanceFrequency();
+  printf("%s: N=%u, P50=%.1fus, P99=%.1fus, MAX=%.1fus\n", name, times->count,
+      TimeHistogram_Percentile(times, 50) * usPerCount,
+      TimeHistogram_Percentile(times, 99) * usPerCount,
+      times->max * usPerCount);
+}
+
 int ReadBinFile(const char* filename, char** filePtr, long* fileLen)
 {
   *filePtr = 0;
@@ -143,6 +262,98 @@ int ReadBinFile(const char* filename, char** filePtr, long* fileLen)
   return 1;
 }
 
+// Map a whole file read-only into memory. Returns 0 on failure.
+void* MapFile(const char* filename, size_t* fileLen)
+{
+  *fileLen = 0;
+#ifdef _WIN32
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, 0,
+      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+  if (file == INVALID_HANDLE_VALUE)
+  {
+    fprintf(stderr, "Error opening file '%s' (error %lu).\n", filename, GetLastError());
+    return 0;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+  {
+    fprintf(stderr, "Unable to map empty or unreadable file '%s'.\n", filename);
+    CloseHandle(file);
+    return 0;
+  }
+  HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+  CloseHandle(file);
+  if (!mapping)
+  {
+    fprintf(stderr, "Error mapping file '%s' (error %lu).\n", filename, GetLastError());
+    return 0;
+  }
+  void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  CloseHandle(mapping);
+  if (!data)
+  {
+    fprintf(stderr, "Error mapping file '%s' (error %lu).\n", filename, GetLastError());
+    return 0;
+  }
+  *fileLen = (size_t)size.QuadPart;
+  return data;
+#else
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Error opening file '%s': %s\n", filename, strerror(errno));
+    return 0;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    fprintf(stderr, "Unable to map empty or unreadable file '%s'.\n", filename);
+    close(fd);
+    return 0;
+  }
+  void* data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    fprintf(stderr, "Error mapping file '%s': %s\n", filename, strerror(errno));
+    return 0;
+  }
+  *fileLen = st.st_size;
+  return data;
+#endif
+}
+
+void UnmapFile(void* data, size_t fileLen)
+{
+#ifdef _WIN32
+  (void)fileLen;
+  UnmapViewOfFile(data);
+#else
+  munmap(data, fileLen);
+#endif
+}
+
+// Gets a file's size and modification time, to tell whether it has changed.
+// Returns 0 if the file can't be found.
+int GetFileStamp(const char* filename, Sint64* size, Sint64* modified)
+{
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetFileAttributesExA(filename, GetFileExInfoStandard, &attributes))
+    return 0;
+  *size = ((Sint64)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+  *modified = ((Sint64)attributes.ftLastWriteTime.dwHighDateTime << 32)
+    | attributes.ftLastWriteTime.dwLowDateTime;
+#else
+  struct stat st;
+  if (stat(filename, &st) != 0)
+    return 0;
+  *size = st.st_size;
+  *modified = st.st_mtime;
+#endif
+  return 1;
+}
+
 struct TextFile* ReadTextFile(const char* filename)
 {
   char* buf;
@@ -180,33 +391,6 @@ void FreeTextFile(struct TextFile* textFile)
   free(textFile);
 }
 
-struct IntGrid* ReadGridFile(const char* filename, int nRows, int nCols)
-{
-  struct TextFile* file = ReadTextFile(filename);
-  if (!file) return 0;
-  struct IntGrid* grid = MallocOrDie(sizeof(struct IntGrid));
-  grid->rows = nRows;
-  grid->cols = nCols;
-  grid->cells = MallocOrDie(nRows * nCols * sizeof(*grid->cells));
-  for (int r=0; r < nRows; ++r)
-  {
-    char* p = file->lines[r];
-    assert(p);
-    char* e;
-    for (int c=0; c < nCols; ++c)
-    {
-      long n = strtol(p, &e, 10);
-      if (c < nCols-1)
-        assert(*e == ',');
-      else
-        assert(*e == '\0');
-      p = e + 1;
-      grid->cells[r * nCols + c] = n;
-    }
-  }
-  return grid;
-}
-
 void FreeIntGrid(struct IntGrid* grid)
 {
   free(grid->cells);
@@ -267,31 +451,14 @@ int IntLog2(int n)
   return i;
 }
 
-static int IntSqrt(int n)
+// floor(sqrt(n)). A double holds any int exactly and its square root is
+// correctly rounded, which can't carry it up to the next integer below
+// 2^52, so truncating it is exact: no correction step needed. (The AVX2
+// distance kernel uses single precision for twice the lanes, and corrects.)
+int IntSqrt(int n)
 {
-  // TODO: Find a faster way to do this.
   assert(n >= 0);
-  if (n == 0) return 0;
-  // Find the highest power of four <= n.
-  // Start with the high bit and shift down.
-  int bit = 1 << (sizeof(int) * 8 - 2);
-  while (bit > n)
-    bit >>= 2;
-  // Now compute the square root.
-  int result = 0;
-  while (bit != 0) {
-    if (n >= result + bit)
-    {
-      n -= result + bit;
-      result = (result >> 1) + bit;
-    }
-    else
-    {
-      result >>= 1;
-    }
-    bit >>= 2;
-  }
-  return result;
+  return (int)sqrt((double)n);
 }
 
 Sint32 SignExtend(Sint32 n)
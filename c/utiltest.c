@@ -1,5 +1,6 @@
 
 #include "wandrix.h"
+#include <SDL_image.h>
 
 #define RANDOM_RANGE 4096
 #define RANDOM_END ((RAND_MAX / RANDOM_RANGE) * RANDOM_RANGE)
@@ -13,76 +14,2031 @@ int randomInt()
   return r % RANDOM_RANGE;
 }
 
-#define N_SAMPLES 100000000
+// Distances are checked over a cache-sized set of points, many times over,
+// so that the timings are of the arithmetic rather than of memory.
+#define DIST_BENCH_POINTS (1 << 16)
+#define DIST_BENCH_PASSES 1500 // about 100M distances per variant
+#define DIST_BENCH_RADIUS 1500
 
-Coords origin = { RANDOM_RANGE / 2, RANDOM_RANGE / 2 };
-Coords samplePoint[N_SAMPLES];
-int sampleDistance[N_SAMPLES];
-int sampleRealDistance[N_SAMPLES];
+static Coords origin = { RANDOM_RANGE / 2, RANDOM_RANGE / 2 };
+static Coords* samplePoint;
+static Sint32 *sampleX, *sampleY;
+static double* sampleRealDistance;
+static Sint32 *sampleDistance, *batchDistance;
+static int distFailures;
 
+typedef void (*BatchDistanceFunction)(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out);
+
+static double NsPerDistance(Uint64 elapsed)
+{
+  return elapsed * 1e9 / SDL_GetPerformanceFrequency()
+    / ((double)DIST_BENCH_PASSES * DIST_BENCH_POINTS);
+}
+
+// Times the one-point function and the batch version at each SIMD level the
+// CPU has, checks that they agree, and measures the error against the true
+// distance.
 static void TestDistanceFunction(const char* functionName,
-    Coords_DistanceFunction distanceFunction)
+    Coords_DistanceFunction distanceFunction, BatchDistanceFunction batchFunction)
 {
-  double sum = 0, sumOfErrors = 0, sumOfSquaredErrors = 0;
-  Uint32 startTime = SDL_GetTicks();
-  for (int i=0; i < N_SAMPLES; ++i)
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int pass=0; pass < DIST_BENCH_PASSES; ++pass)
+    for (int i=0; i < DIST_BENCH_POINTS; ++i)
+      sampleDistance[i] = distanceFunction(origin, samplePoint[i]);
+  double scalarNs = NsPerDistance(SDL_GetPerformanceCounter() - startTime);
+  double sumOfErrors = 0, maxRelativeError = 0;
+  for (int i=0; i < DIST_BENCH_POINTS; ++i)
   {
-    sampleDistance[i] = distanceFunction(origin, samplePoint[i]);
-    sum += sampleDistance[i];
-    double error = abs(sampleDistance[i] - sampleRealDistance[i]);
+    double error = fabs(sampleDistance[i] - sampleRealDistance[i]);
     sumOfErrors += error;
-    sumOfSquaredErrors += error * error;
-  }
-  Uint32 endTime = SDL_GetTicks();
-  double mean = sum / N_SAMPLES;
-  double meanError = sumOfErrors / N_SAMPLES;
-  double standardError = sqrt(sumOfSquaredErrors / (N_SAMPLES-1));
-  double sumOfSquaredDeviations = 0;
-  double sumOfDeviations = 0;
-  for (int i=0; i < N_SAMPLES; ++i)
-  {
-    double sampleDeviation = abs(sampleDistance[i] - mean);
-    sumOfSquaredDeviations += sampleDeviation * sampleDeviation;
-    sumOfDeviations += sampleDeviation;
-  }
-  double standardDeviation = sqrt(sumOfSquaredDeviations / (N_SAMPLES-1));
-  double meanDeviation = sumOfDeviations / N_SAMPLES;
-  printf("%s: TimeMs=%d; Mean=%g; SD=%g; MeanDev=%g; SE=%g; MeanErr=%g\n",
-      functionName,
-      (int)(endTime - startTime), mean,
-      standardDeviation, meanDeviation,
-      standardError, meanError);
+    if (sampleRealDistance[i] > 0 && error / sampleRealDistance[i] > maxRelativeError)
+      maxRelativeError = error / sampleRealDistance[i];
+  }
+  printf("Dist: %s: Kernel=PerPoint; NsPerElem=%.3f; MeanErr=%.3f; MaxRelErr=%.2f%%\n",
+      functionName, scalarNs, sumOfErrors / DIST_BENCH_POINTS, 100 * maxRelativeError);
+  int maxLevel = Coords_SetBatchSimd(SIMD_AVX2);
+  for (int level = SIMD_SCALAR; level <= maxLevel; ++level)
+  {
+    Coords_SetBatchSimd(level);
+    startTime = SDL_GetPerformanceCounter();
+    for (int pass=0; pass < DIST_BENCH_PASSES; ++pass)
+      batchFunction(origin, sampleX, sampleY, DIST_BENCH_POINTS, batchDistance);
+    double batchNs = NsPerDistance(SDL_GetPerformanceCounter() - startTime);
+    int mismatches = 0;
+    for (int i=0; i < DIST_BENCH_POINTS; ++i)
+      mismatches += batchDistance[i] != sampleDistance[i];
+    printf("Dist: %s: Kernel=%s; NsPerElem=%.3f; Speedup=%.2f; Mismatches=%d\n",
+        functionName, Coords_BatchSimdName(level), batchNs, scalarNs / batchNs, mismatches);
+    distFailures += mismatches;
+  }
+  fflush(stdout);
+}
+
+// Radius checks, against a plain loop over the points.
+static void TestWithinRadius()
+{
+  int* expected = MallocOrDie(DIST_BENCH_POINTS * sizeof(int));
+  int* found = MallocOrDie(DIST_BENCH_POINTS * sizeof(int));
+  long radiusSquared = (long)DIST_BENCH_RADIUS * DIST_BENCH_RADIUS;
+  int nExpected = 0;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int pass=0; pass < DIST_BENCH_PASSES; ++pass)
+  {
+    nExpected = 0;
+    for (int i=0; i < DIST_BENCH_POINTS; ++i)
+    {
+      long dx = sampleX[i] - origin.x, dy = sampleY[i] - origin.y;
+      if (dx * dx + dy * dy <= radiusSquared)
+        expected[nExpected++] = i;
+    }
+  }
+  double scalarNs = NsPerDistance(SDL_GetPerformanceCounter() - startTime);
+  printf("Dist: WithinRadius: Kernel=PerPoint; NsPerElem=%.3f; Inside=%d\n",
+      scalarNs, nExpected);
+  int maxLevel = Coords_SetBatchSimd(SIMD_AVX2);
+  for (int level = SIMD_SCALAR; level <= maxLevel; ++level)
+  {
+    Coords_SetBatchSimd(level);
+    int nFound = 0;
+    startTime = SDL_GetPerformanceCounter();
+    for (int pass=0; pass < DIST_BENCH_PASSES; ++pass)
+      nFound = Coords_BatchWithinRadius(origin, sampleX, sampleY, DIST_BENCH_POINTS,
+          DIST_BENCH_RADIUS, found);
+    double batchNs = NsPerDistance(SDL_GetPerformanceCounter() - startTime);
+    int mismatches = nFound != nExpected;
+    for (int i=0; i < nFound && !mismatches; ++i)
+      mismatches += found[i] != expected[i];
+    printf("Dist: WithinRadius: Kernel=%s; NsPerElem=%.3f; Speedup=%.2f; Mismatches=%d\n",
+        Coords_BatchSimdName(level), batchNs, scalarNs / batchNs, mismatches);
+    distFailures += mismatches;
+  }
   fflush(stdout);
+  free(expected);
+  free(found);
 }
 
 void TestDistanceFunctions()
 {
-  for (int i=0; i < N_SAMPLES; ++i)
+  samplePoint = MallocOrDie(DIST_BENCH_POINTS * sizeof(Coords));
+  sampleX = MallocOrDie(DIST_BENCH_POINTS * sizeof(Sint32));
+  sampleY = MallocOrDie(DIST_BENCH_POINTS * sizeof(Sint32));
+  sampleRealDistance = MallocOrDie(DIST_BENCH_POINTS * sizeof(double));
+  sampleDistance = MallocOrDie(DIST_BENCH_POINTS * sizeof(Sint32));
+  batchDistance = MallocOrDie(DIST_BENCH_POINTS * sizeof(Sint32));
+  for (int i=0; i < DIST_BENCH_POINTS; ++i)
   {
     Coords randomPoint = { randomInt(), randomInt() };
     samplePoint[i] = randomPoint;
-    sampleRealDistance[i] = Coords_FloatDist(origin, randomPoint);
-    if (i < 10)
-      printf("(%d,%d) ", randomPoint.x, randomPoint.y);
-    if (i < 10 && (i+1) % 5 == 0)
-      printf("\n");
-  }
-  TestDistanceFunction("Simple", Coords_SimpleApproxDist);
-  TestDistanceFunction("Simple", Coords_SimpleApproxDist);
-  TestDistanceFunction("Approx", Coords_ApproxDist);
-  TestDistanceFunction("Approx", Coords_ApproxDist);
-  TestDistanceFunction("Exact", Coords_ExactDist);
-  TestDistanceFunction("Exact", Coords_ExactDist);
-  TestDistanceFunction("Float", Coords_FloatDist);
-  TestDistanceFunction("Float", Coords_FloatDist);
-}
-
-#pragma GCC diagnostic ignored "-Wunused-parameter"
+    sampleX[i] = randomPoint.x;
+    sampleY[i] = randomPoint.y;
+    double dx = randomPoint.x - origin.x, dy = randomPoint.y - origin.y;
+    sampleRealDistance[i] = sqrt(dx * dx + dy * dy);
+  }
+  TestDistanceFunction("Simple", Coords_SimpleApproxDist, Coords_BatchSimpleApproxDist);
+  TestDistanceFunction("Approx", Coords_ApproxDist, Coords_BatchApproxDist);
+  TestDistanceFunction("Exact", Coords_ExactDist, Coords_BatchExactDist);
+  TestDistanceFunction("Float", Coords_FloatDist, Coords_BatchFloatDist);
+  TestWithinRadius();
+  Coords_SetBatchSimd(SIMD_AVX2);
+  free(samplePoint);
+  free(sampleX);
+  free(sampleY);
+  free(sampleRealDistance);
+  free(sampleDistance);
+  free(batchDistance);
+}
+
+#define SQRT_BENCH_INPUTS (1 << 16)
+#define SQRT_BENCH_PASSES 1500
+
+static int sqrtFailures;
+
+// The bit-by-bit loop that IntSqrt used to be, for comparison.
+static int BitwiseIntSqrt(int n)
+{
+  if (n == 0) return 0;
+  int bit = 1 << (sizeof(int) * 8 - 2);
+  while (bit > n)
+    bit >>= 2;
+  int result = 0;
+  while (bit != 0) {
+    if (n >= result + bit)
+    {
+      n -= result + bit;
+      result = (result >> 1) + bit;
+    }
+    else
+    {
+      result >>= 1;
+    }
+    bit >>= 2;
+  }
+  return result;
+}
+
+static int DoubleIntSqrt(int n)
+{
+  return (int)sqrt(n);
+}
+
+static void TimeSqrt(const char* name, int (*sqrtFunction)(int), const int* inputs)
+{
+  Uint64 sum = 0;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int pass=0; pass < SQRT_BENCH_PASSES; ++pass)
+    for (int i=0; i < SQRT_BENCH_INPUTS; ++i)
+      sum += sqrtFunction(inputs[i]);
+  Uint64 elapsed = SDL_GetPerformanceCounter() - startTime;
+  printf("Sqrt: %s: NsPerCall=%.3f; Checksum=%llu\n", name,
+      elapsed * 1e9 / SDL_GetPerformanceFrequency()
+        / ((double)SQRT_BENCH_PASSES * SQRT_BENCH_INPUTS),
+      (unsigned long long)sum);
+}
+
+// Checks IntSqrt against the definition for every non-negative int, which
+// covers the squares of any distance under 32768, and times it against the
+// old loop and a double-precision root.
+void TestIntSqrt()
+{
+  int errors = 0;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (Sint64 n=0; n <= INT_MAX; ++n)
+  {
+    Sint64 root = IntSqrt((int)n);
+    if (root * root > n || (root + 1) * (root + 1) <= n)
+      if (errors++ < 10)
+        printf("Sqrt: IntSqrt(%lld) = %lld\n", (long long)n, (long long)root);
+  }
+  double seconds = (double)(SDL_GetPerformanceCounter() - startTime)
+    / SDL_GetPerformanceFrequency();
+  printf("Sqrt: Exhaustive: Inputs=%lld; Seconds=%.1f; Errors=%d\n",
+      (long long)INT_MAX + 1, seconds, errors);
+  sqrtFailures += errors;
+  int* inputs = MallocOrDie(SQRT_BENCH_INPUTS * sizeof(int));
+  for (int i=0; i < SQRT_BENCH_INPUTS; ++i)
+  {
+    // Squared distances between points on a RANDOM_RANGE square.
+    int dx = randomInt(), dy = randomInt();
+    inputs[i] = dx * dx + dy * dy;
+  }
+  TimeSqrt("Bitwise", BitwiseIntSqrt, inputs);
+  TimeSqrt("Double", DoubleIntSqrt, inputs);
+  TimeSqrt("IntSqrt", IntSqrt, inputs);
+  fflush(stdout);
+  free(inputs);
+}
+
+#define GID_BENCH_TILESETS 64
+#define GID_BENCH_TILESET_SIZE 256
+#define GID_BENCH_MAP_SIZE 1000
+#define GID_BENCH_LAYERS 2
+
+static int gidFailures;
+
+// The per-cell tileset scan that the GID table replaces.
+static TiledTile* LinearFindTile(TiledMap* map, Sint16 gid)
+{
+  if (gid == 0)
+    return 0;
+  for (int ts = map->nTilesets - 1; ts >= 0; --ts)
+  {
+    TiledTilesetRef* ref = &map->tilesetRefs[ts];
+    int tileIndex = gid - ref->firstGid;
+    if (tileIndex >= 0 && tileIndex < ref->tileset->tileCount)
+      return &ref->tileset->tiles[tileIndex];
+  }
+  return 0;
+}
+
+// Resolves every cell of a synthetic map with many tilesets, once by scanning
+// the tilesets and once through the GID table, and checks they agree.
+void TestGidResolution()
+{
+  TiledMap map = {
+    .width = GID_BENCH_MAP_SIZE, .height = GID_BENCH_MAP_SIZE,
+    .nTilesets = GID_BENCH_TILESETS, .nLayers = GID_BENCH_LAYERS };
+  map.tilesetRefs = MallocOrDie(GID_BENCH_TILESETS * sizeof(TiledTilesetRef));
+  for (int ts=0; ts < GID_BENCH_TILESETS; ++ts)
+  {
+    TiledTileset* tileset = MallocOrDie(sizeof(TiledTileset));
+    tileset->tileCount = GID_BENCH_TILESET_SIZE;
+    tileset->tiles = MallocOrDie(GID_BENCH_TILESET_SIZE * sizeof(TiledTile));
+    for (int t=0; t < GID_BENCH_TILESET_SIZE; ++t)
+      tileset->tiles[t].id = t;
+    map.tilesetRefs[ts].firstGid = 1 + ts * GID_BENCH_TILESET_SIZE;
+    map.tilesetRefs[ts].tileset = tileset;
+  }
+  size_t nCells = (size_t)GID_BENCH_MAP_SIZE * GID_BENCH_MAP_SIZE * GID_BENCH_LAYERS;
+  Sint16* gids = MallocOrDie(nCells * sizeof(Sint16));
+  for (size_t i=0; i < nCells; ++i)
+    gids[i] = (rand() % (GID_BENCH_TILESETS * GID_BENCH_TILESET_SIZE + 1));
+  TiledTile** linearTiles = MallocOrDie(nCells * sizeof(TiledTile*));
+  TiledTile** tableTiles = MallocOrDie(nCells * sizeof(TiledTile*));
+  Uint32 startTime = SDL_GetTicks();
+  for (size_t i=0; i < nCells; ++i)
+    linearTiles[i] = LinearFindTile(&map, gids[i]);
+  Uint32 linearTime = SDL_GetTicks() - startTime;
+  startTime = SDL_GetTicks();
+  if (!TiledMap_BuildGidTable(&map))
+  {
+    printf("GidTable: failed to build table\n");
+    ++gidFailures;
+    return;
+  }
+  for (size_t i=0; i < nCells; ++i)
+    tableTiles[i] = TiledMap_FindTile(&map, gids[i]);
+  Uint32 tableTime = SDL_GetTicks() - startTime;
+  size_t mismatches = 0;
+  for (size_t i=0; i < nCells; ++i)
+    if (linearTiles[i] != tableTiles[i])
+      ++mismatches;
+  printf("GidTable: Tilesets=%d; Cells=%d; LinearMs=%d; TableMs=%d; Mismatches=%d\n",
+      GID_BENCH_TILESETS, (int)nCells, (int)linearTime, (int)tableTime, (int)mismatches);
+  fflush(stdout);
+  if (mismatches)
+    ++gidFailures;
+  free(gids);
+  free(linearTiles);
+  free(tableTiles);
+}
+
+#define LAYOUT_BENCH_MAP_SIZE 1024
+#define LAYOUT_BENCH_LAYERS 2
+#define LAYOUT_BENCH_TILES 120
+#define LAYOUT_BENCH_VIEW 21
+#define LAYOUT_BENCH_FRAMES 20000
+
+static int layoutFailures;
+
+// Compares the memory used by, and the cost of reading a view's worth of
+// tiles from, the old interleaved TiledTile* cells and the per-layer GID
+// planes with dense side tables. Each frame reads what BuildTileCache,
+// the lighting pass and TiledMap_Draw need: texture, atlas position, opacity.
+void TestCellLayouts()
+{
+  TiledTileset tileset = { .tileCount = LAYOUT_BENCH_TILES, .nProperties = TILE_PROP_COUNT };
+  tileset.tiles = MallocOrDie(LAYOUT_BENCH_TILES * sizeof(TiledTile));
+  tileset.tileProperties = MallocOrDie(LAYOUT_BENCH_TILES * TILE_PROP_COUNT);
+  for (int t=0; t < LAYOUT_BENCH_TILES; ++t)
+  {
+    tileset.tiles[t].id = t;
+    tileset.tiles[t].x = (t % 8) * 32;
+    tileset.tiles[t].y = (t / 8) * 32;
+    tileset.tiles[t].tex = (SDL_Texture*)&tileset; // any non-null texture
+    tileset.tiles[t].props = &tileset.tileProperties[t * TILE_PROP_COUNT];
+    tileset.tiles[t].props[TILE_PROP_OPACITY] = t % 8;
+  }
+  TiledTilesetRef ref = { 1, &tileset };
+  TiledMap map = {
+    .width = LAYOUT_BENCH_MAP_SIZE, .height = LAYOUT_BENCH_MAP_SIZE,
+    .nTilesets = 1, .nLayers = LAYOUT_BENCH_LAYERS, .tilesetRefs = &ref };
+  TiledMap_BuildGidTable(&map);
+  size_t planeSize = (size_t)LAYOUT_BENCH_MAP_SIZE * LAYOUT_BENCH_MAP_SIZE;
+  size_t nCells = planeSize * LAYOUT_BENCH_LAYERS;
+  TiledTile** pointerCells = MallocOrDie(nCells * sizeof(TiledTile*));
+  Sint16* planes = MallocOrDie(nCells * sizeof(Sint16));
+  for (size_t i=0; i < planeSize; ++i)
+  {
+    for (int layer=0; layer < LAYOUT_BENCH_LAYERS; ++layer)
+    {
+      // Upper layers are mostly empty, as in real maps.
+      Sint16 gid = (layer == 0 || rand() % 4 == 0) ? 1 + rand() % LAYOUT_BENCH_TILES : 0;
+      pointerCells[i * LAYOUT_BENCH_LAYERS + layer] = TiledMap_FindTile(&map, gid);
+      planes[layer * planeSize + i] = gid;
+    }
+  }
+  size_t pointerBytes = nCells * sizeof(TiledTile*);
+  size_t planeBytes = nCells * sizeof(Sint16) + map.nGids
+    * (sizeof(SDL_Texture*) + sizeof(SDL_Point) + map.nTileProperties);
+  int* viewX = MallocOrDie(LAYOUT_BENCH_FRAMES * sizeof(int));
+  int* viewY = MallocOrDie(LAYOUT_BENCH_FRAMES * sizeof(int));
+  for (int f=0; f < LAYOUT_BENCH_FRAMES; ++f)
+  {
+    viewX[f] = rand() % (LAYOUT_BENCH_MAP_SIZE - LAYOUT_BENCH_VIEW);
+    viewY[f] = rand() % (LAYOUT_BENCH_MAP_SIZE - LAYOUT_BENCH_VIEW);
+  }
+  long pointerSum = 0, planeSum = 0;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int f=0; f < LAYOUT_BENCH_FRAMES; ++f)
+  {
+    for (int r=0; r < LAYOUT_BENCH_VIEW; ++r)
+    {
+      TiledTile** cell = pointerCells
+        + ((viewY[f] + r) * LAYOUT_BENCH_MAP_SIZE + viewX[f]) * LAYOUT_BENCH_LAYERS;
+      for (int c=0; c < LAYOUT_BENCH_VIEW * LAYOUT_BENCH_LAYERS; ++c)
+      {
+        TiledTile* tile = cell[c];
+        if (tile && tile->tex)
+          pointerSum += tile->x + tile->y + tile->props[TILE_PROP_OPACITY];
+      }
+    }
+  }
+  Uint64 pointerTime = SDL_GetPerformanceCounter() - startTime;
+  startTime = SDL_GetPerformanceCounter();
+  for (int f=0; f < LAYOUT_BENCH_FRAMES; ++f)
+  {
+    for (int layer=0; layer < LAYOUT_BENCH_LAYERS; ++layer)
+    {
+      for (int r=0; r < LAYOUT_BENCH_VIEW; ++r)
+      {
+        Sint16* gid = planes + layer * planeSize
+          + (viewY[f] + r) * LAYOUT_BENCH_MAP_SIZE + viewX[f];
+        for (int c=0; c < LAYOUT_BENCH_VIEW; ++c)
+        {
+          Sint16 index = TiledMap_GidIndex(&map, gid[c]);
+          if (map.gidTex[index])
+            planeSum += map.gidAtlasPos[index].x + map.gidAtlasPos[index].y
+              + map.gidProps[index * map.nTileProperties + TILE_PROP_OPACITY];
+        }
+      }
+    }
+  }
+  Uint64 planeTime = SDL_GetPerformanceCounter() - startTime;
+  double nsPerTick = 1e9 / SDL_GetPerformanceFrequency();
+  printf("CellLayout: Cells=%d; PointerKB=%d; PlaneKB=%d;"
+      " PointerNsPerFrame=%g; PlaneNsPerFrame=%g; Match=%s\n",
+      (int)nCells, (int)(pointerBytes / 1024), (int)(planeBytes / 1024),
+      pointerTime * nsPerTick / LAYOUT_BENCH_FRAMES,
+      planeTime * nsPerTick / LAYOUT_BENCH_FRAMES,
+      pointerSum == planeSum ? "yes" : "NO");
+  fflush(stdout);
+  if (pointerSum != planeSum)
+    ++layoutFailures;
+  free(pointerCells);
+  free(planes);
+  free(viewX);
+  free(viewY);
+}
+
+#define LIGHT_TEST_RADIUS 10
+#define LIGHT_TEST_DROPOFF 6
+#define LIGHT_TEST_THRESHOLD 0x20
+#define LIGHT_TEST_DIAMETER (2 * LIGHT_TEST_RADIUS + 1)
+#define LIGHT_BENCH_MAP_SIZE 256
+#define LIGHT_BENCH_VIEWS 20000
+
+static int lightFailures;
+
+static void CheckLight(int ok, const char* what)
+{
+  printf("Light: %s: %s\n", what, ok ? "PASS" : "FAIL");
+  if (!ok)
+    ++lightFailures;
+}
+
+// Brightness of the tile at offset (dx, dy) from the viewer.
+static int LightAt(const Uint8* brightness, int dx, int dy)
+{
+  return brightness[(dy + LIGHT_TEST_RADIUS) * LIGHT_TEST_DIAMETER + dx + LIGHT_TEST_RADIUS];
+}
+
+// Makes a one-layer map whose GID n is a tile with opacity n-1. The fully
+// opaque tile is also an obstacle.
+static TiledMap* CreateLightTestMap(int size)
+{
+  static TiledTileset tileset = { .tileCount = 8, .nProperties = TILE_PROP_COUNT };
+  static TiledTilesetRef ref = { 1, &tileset };
+  if (!tileset.tiles)
+  {
+    tileset.tiles = MallocOrDie(8 * sizeof(TiledTile));
+    tileset.tileProperties = MallocOrDie(8 * TILE_PROP_COUNT);
+    for (int t=0; t < 8; ++t)
+    {
+      tileset.tiles[t].id = t;
+      tileset.tiles[t].props = &tileset.tileProperties[t * TILE_PROP_COUNT];
+      tileset.tiles[t].props[TILE_PROP_OPACITY] = t;
+      tileset.tiles[t].props[TILE_PROP_OBSTACLE] = t == 7;
+    }
+  }
+  TiledMap* map = TiledMap_Create(size, size, 1, 32, 32);
+  map->nTilesets = 1;
+  map->tilesetRefs = &ref;
+  TiledMap_BuildGidTable(map);
+  TiledMap_DeriveCellFlags(map);
+  return map;
+}
+
+static void SetOpacity(TiledMap* map, int x, int y, int opacity)
+{
+  *TiledMap_GetCell(map, x, y) = 1 + opacity;
+  TiledMap_UpdateCellFlags(map, x, y);
+}
+
+// Unit tests for the shadowcasting, attenuation and cache invalidation, and
+// a benchmark of how many cells per microsecond a computation covers.
+void TestLighting()
+{
+  Light_Init(LIGHT_TEST_RADIUS, LIGHT_TEST_DROPOFF, LIGHT_TEST_THRESHOLD);
+  int c = 2 * LIGHT_TEST_RADIUS;
+  TiledMap* map = CreateLightTestMap(2 * c + 1);
+  const Uint8* b = Light_Compute(map, c, c);
+  CheckLight(LightAt(b, 0, 0) == 255 && LightAt(b, LIGHT_TEST_DROPOFF, 0) == 255,
+      "open ground is fully lit up to the dropoff");
+  int symmetric = 1, inRange = 1;
+  for (int dy = -LIGHT_TEST_RADIUS; dy <= LIGHT_TEST_RADIUS; ++dy)
+  {
+    for (int dx = -LIGHT_TEST_RADIUS; dx <= LIGHT_TEST_RADIUS; ++dx)
+    {
+      int v = LightAt(b, dx, dy);
+      symmetric = symmetric && v == LightAt(b, -dx, dy) && v == LightAt(b, dx, -dy)
+        && v == LightAt(b, dy, dx);
+      if (dx * dx + dy * dy > LIGHT_TEST_RADIUS * LIGHT_TEST_RADIUS)
+        inRange = inRange && v == 0;
+      else if (dx * dx + dy * dy < LIGHT_TEST_DROPOFF * LIGHT_TEST_DROPOFF)
+        inRange = inRange && v == 255;
+    }
+  }
+  CheckLight(symmetric, "open ground is lit symmetrically");
+  CheckLight(inRange, "light fades out by the view radius");
+  CheckLight(LightAt(b, 9, 0) < LightAt(b, 7, 0), "light dims past the dropoff");
+
+  SetOpacity(map, c + 2, c, 7);
+  Light_InvalidateTile(c + 2, c);
+  b = Light_Compute(map, c, c);
+  CheckLight(LightAt(b, 2, 0) == 255, "a wall is lit");
+  CheckLight(LightAt(b, 3, 0) == 0 && LightAt(b, 5, 0) == 0, "a wall casts a shadow");
+  CheckLight(LightAt(b, -3, 0) == 255 && LightAt(b, 3, 3) == 255,
+      "a wall doesn't shadow other directions");
+
+  SetOpacity(map, c + 2, c, 2);
+  Light_InvalidateTile(c + 2, c);
+  b = Light_Compute(map, c, c);
+  CheckLight(LightAt(b, 2, 0) == 255 && LightAt(b, 3, 0) == ReduceBrightness(255, 2),
+      "a semi-opaque tile dims the light behind it");
+  SetOpacity(map, c + 3, c, 1);
+  SetOpacity(map, c + 4, c, 4);
+  Light_InvalidateTile(c + 3, c);
+  b = Light_Compute(map, c, c);
+  CheckLight(LightAt(b, 4, 0) == ReduceBrightness(ReduceBrightness(255, 2), 1),
+      "opacity accumulates along a ray");
+  CheckLight(LightAt(b, 5, 0) == 0, "light below the threshold is cut off");
+
+  // Stacked layers dim the light as if it passed through each in turn.
+  TiledMap* stacked = TiledMap_Create(4, 4, 2, 32, 32);
+  stacked->nTilesets = 1;
+  stacked->tilesetRefs = map->tilesetRefs;
+  TiledMap_BuildGidTable(stacked);
+  TiledMap_DeriveCellFlags(stacked);
+  static const int layerOpacities[][3] = { { 3, 3, 5 }, { 1, 1, 2 }, { 0, 4, 4 }, { 7, 0, 7 } };
+  int stackedOk = 1;
+  for (int i=0; i < 4; ++i)
+  {
+    Sint16* cell = TiledMap_GetCell(stacked, i, 0);
+    cell[0] = 1 + layerOpacities[i][0];
+    cell[stacked->cellLayerStride] = 1 + layerOpacities[i][1];
+    TiledMap_UpdateCellFlags(stacked, i, 0);
+    stackedOk = stackedOk && TiledMap_Opacity(stacked, i, 0) == layerOpacities[i][2];
+  }
+  CheckLight(stackedOk, "opacity accumulates across layers");
+
+  LightStats before = Light_GetStats();
+  Light_Compute(map, c, c);
+  LightStats after = Light_GetStats();
+  CheckLight(after.hits == before.hits + 1 && after.computes == before.computes,
+      "an unchanged view comes from the cache");
+  Light_InvalidateTile(c + LIGHT_TEST_RADIUS + 1, c);
+  Light_Compute(map, c, c);
+  before = after;
+  after = Light_GetStats();
+  CheckLight(after.hits == before.hits + 1, "changes out of range keep the cache");
+  SetOpacity(map, c - LIGHT_TEST_RADIUS, c, 7);
+  Light_InvalidateTile(c - LIGHT_TEST_RADIUS, c);
+  b = Light_Compute(map, c, c);
+  before = after;
+  after = Light_GetStats();
+  CheckLight(after.computes == before.computes + 1 && LightAt(b, -LIGHT_TEST_RADIUS, 0) == 0,
+      "changes in range are recomputed");
+
+  // Benchmark on a random map that's mostly open with scattered walls and
+  // semi-opaque tiles.
+  map = CreateLightTestMap(LIGHT_BENCH_MAP_SIZE);
+  for (int y=0; y < LIGHT_BENCH_MAP_SIZE; ++y)
+  {
+    for (int x=0; x < LIGHT_BENCH_MAP_SIZE; ++x)
+    {
+      int r = rand() % 10;
+      SetOpacity(map, x, y, r == 0 ? 7 : r == 1 ? 1 + rand() % 6 : 0);
+    }
+  }
+  Light_InvalidateAll();
+  before = Light_GetStats();
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int v=0; v < LIGHT_BENCH_VIEWS; ++v)
+  {
+    Light_InvalidateAll();
+    Light_Compute(map, rand() % LIGHT_BENCH_MAP_SIZE, rand() % LIGHT_BENCH_MAP_SIZE);
+  }
+  Uint64 elapsed = SDL_GetPerformanceCounter() - startTime;
+  after = Light_GetStats();
+  double us = elapsed * 1e6 / SDL_GetPerformanceFrequency();
+  Uint64 cells = after.cellsProcessed - before.cellsProcessed;
+  printf("Light: Views=%d; UsPerView=%g; CellsPerView=%g; CellsPerUs=%g; Failures=%d\n",
+      LIGHT_BENCH_VIEWS, us / LIGHT_BENCH_VIEWS, (double)cells / LIGHT_BENCH_VIEWS,
+      cells / us, lightFailures);
+  fflush(stdout);
+  Light_Destroy();
+}
+
+#define GRID_BENCH_NPCS 100000
+#define GRID_BENCH_MAP_TILES 1000
+#define GRID_BENCH_TILE 32
+#define GRID_BENCH_TICKS 100
+#define GRID_BENCH_AI_QUERIES 100
+#define GRID_BENCH_AI_RADIUS (5 * GRID_BENCH_TILE)
+
+static int gridFailures;
+
+static int RectsOverlap(SDL_Rect* a, SDL_Rect* b)
+{
+  return a->x < b->x + b->w && b->x < a->x + a->w
+    && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+static int WithinRadius(SDL_Rect* r, Coords center, int radius)
+{
+  int dx = center.x < r->x ? r->x - center.x
+    : center.x >= r->x + r->w ? center.x - (r->x + r->w - 1) : 0;
+  int dy = center.y < r->y ? r->y - center.y
+    : center.y >= r->y + r->h ? center.y - (r->y + r->h - 1) : 0;
+  return (long)dx * dx + (long)dy * dy <= (long)radius * radius;
+}
+
+// Simulates ticks of 100k wandering NPCs, each tick doing a collision test,
+// a view query and a batch of AI radius queries, by scanning every NPC and
+// through the grid. Both must find the same number of NPCs.
+void TestSpatialGrid()
+{
+  int mapPixels = GRID_BENCH_MAP_TILES * GRID_BENCH_TILE;
+  SDL_Rect* rects = MallocOrDie(GRID_BENCH_NPCS * sizeof(SDL_Rect));
+  SpatialGrid* grid = SpatialGrid_Create(GRID_BENCH_MAP_TILES, GRID_BENCH_MAP_TILES,
+      GRID_BENCH_TILE, GRID_BENCH_TILE);
+  for (int i=0; i < GRID_BENCH_NPCS; ++i)
+  {
+    SDL_Rect r = { rand() % mapPixels, rand() % mapPixels, GRID_BENCH_TILE, GRID_BENCH_TILE };
+    rects[i] = r;
+    SpatialGrid_Insert(grid, i, &rects[i]);
+  }
+  int* found = MallocOrDie(GRID_BENCH_NPCS * sizeof(int));
+  Uint64 moveTime = 0, linearTime = 0, gridTime = 0;
+  long linearFound = 0, gridFound = 0;
+  for (int tick=0; tick < GRID_BENCH_TICKS; ++tick)
+  {
+    Uint64 startTime = SDL_GetPerformanceCounter();
+    for (int i=0; i < GRID_BENCH_NPCS; ++i)
+    {
+      Coords pos = {
+        rects[i].x + (rand() % 3 - 1) * 8, rects[i].y + (rand() % 3 - 1) * 8 };
+      rects[i].x = pos.x;
+      rects[i].y = pos.y;
+      SpatialGrid_Move(grid, i, pos);
+    }
+    moveTime += SDL_GetPerformanceCounter() - startTime;
+    Coords player = { rand() % mapPixels, rand() % mapPixels };
+    SDL_Rect playerRect = { player.x, player.y, GRID_BENCH_TILE, GRID_BENCH_TILE };
+    SDL_Rect viewRect = {
+      player.x - 10 * GRID_BENCH_TILE, player.y - 10 * GRID_BENCH_TILE,
+      21 * GRID_BENCH_TILE, 21 * GRID_BENCH_TILE };
+    Coords aiCenters[GRID_BENCH_AI_QUERIES];
+    for (int q=0; q < GRID_BENCH_AI_QUERIES; ++q)
+    {
+      // NPCs looking around themselves.
+      SDL_Rect* npc = &rects[rand() % GRID_BENCH_NPCS];
+      aiCenters[q] = (Coords){ npc->x, npc->y };
+    }
+    startTime = SDL_GetPerformanceCounter();
+    for (int i=0; i < GRID_BENCH_NPCS; ++i)
+    {
+      linearFound += RectsOverlap(&playerRect, &rects[i]);
+      linearFound += RectsOverlap(&viewRect, &rects[i]);
+    }
+    for (int q=0; q < GRID_BENCH_AI_QUERIES; ++q)
+      for (int i=0; i < GRID_BENCH_NPCS; ++i)
+        linearFound += WithinRadius(&rects[i], aiCenters[q], GRID_BENCH_AI_RADIUS);
+    linearTime += SDL_GetPerformanceCounter() - startTime;
+    startTime = SDL_GetPerformanceCounter();
+    gridFound += SpatialGrid_QueryRect(grid, &playerRect, found, GRID_BENCH_NPCS);
+    gridFound += SpatialGrid_QueryRect(grid, &viewRect, found, GRID_BENCH_NPCS);
+    for (int q=0; q < GRID_BENCH_AI_QUERIES; ++q)
+      gridFound += SpatialGrid_QueryRadius(grid, aiCenters[q], GRID_BENCH_AI_RADIUS,
+          found, GRID_BENCH_NPCS);
+    gridTime += SDL_GetPerformanceCounter() - startTime;
+  }
+  double usPerTick = 1e6 / SDL_GetPerformanceFrequency() / GRID_BENCH_TICKS;
+  printf("SpatialGrid: Npcs=%d; MoveUsPerTick=%g; LinearQueryUsPerTick=%g;"
+      " GridQueryUsPerTick=%g; Found=%ld; Match=%s\n",
+      GRID_BENCH_NPCS, moveTime * usPerTick, linearTime * usPerTick,
+      gridTime * usPerTick, gridFound, linearFound == gridFound ? "yes" : "NO");
+  fflush(stdout);
+  if (linearFound != gridFound)
+    ++gridFailures;
+  SpatialGrid_Destroy(grid);
+  free(rects);
+  free(found);
+}
+
+#define ENTITY_BENCH_COUNT 1000000
+#define ENTITY_BENCH_TICKS 100
+
+static int entityFailures;
+
+// Checks handle validation and slot bookkeeping under random spawning and
+// despawning, then times the per-tick move loop over a million entities.
+void TestEntityStore()
+{
+  struct Image sprite = { .path = "none" };
+  EntityStore* store = EntityStore_Create(0, 0);
+  store->sprites = &sprite; // no grid, so the image is never looked at
+  store->nSprites = 1;
+  int nHandles = ENTITY_BENCH_COUNT / 10;
+  Entity* handles = MallocOrDie(nHandles * sizeof(Entity));
+  int* alive = MallocOrDie(nHandles * sizeof(int));
+  int errors = 0;
+  for (int i=0; i < nHandles; ++i)
+  {
+    handles[i] = EntityStore_Spawn(store, "npc", 0, (Coords){ i, -i }, i);
+    alive[i] = 1;
+  }
+  // The next index has never been spawned but already has generation 1.
+  if (EntityStore_Slot(store, handles[nHandles - 1] + 1) >= 0)
+    ++errors;
+  for (int round=0; round < 4 * nHandles; ++round)
+  {
+    int i = rand() % nHandles;
+    if (alive[i])
+    {
+      Entity old = handles[i];
+      EntityStore_Despawn(store, old);
+      if (EntityStore_Slot(store, old) >= 0)
+        ++errors; // stale handle accepted
+      handles[i] = EntityStore_Spawn(store, "npc", 0, (Coords){ i, -i }, i);
+      if (EntityStore_Slot(store, old) >= 0)
+        ++errors; // reused index accepted the old generation
+      if (rand() % 2)
+      {
+        EntityStore_Despawn(store, handles[i]);
+        alive[i] = 0;
+      }
+    }
+  }
+  int nAlive = 0;
+  for (int i=0; i < nHandles; ++i)
+  {
+    if (!alive[i])
+      continue;
+    ++nAlive;
+    int slot = EntityStore_Slot(store, handles[i]);
+    if (slot < 0 || store->posX[slot] != i || store->posY[slot] != -i
+        || store->hpCur[slot] != i || EntityStore_Handle(store, slot) != handles[i])
+      ++errors;
+  }
+  if (nAlive != store->count || EntityStore_Slot(store, 0) >= 0)
+    ++errors;
+  store->sprites = 0;
+  EntityStore_Destroy(store);
+  free(handles);
+  free(alive);
+
+  store = EntityStore_Create(0, 0);
+  store->sprites = &sprite;
+  store->nSprites = 1;
+  for (int i=0; i < ENTITY_BENCH_COUNT; ++i)
+  {
+    int slot = store->count;
+    EntityStore_Spawn(store, "npc", 0, (Coords){ rand() % 32000, rand() % 32000 }, 10);
+    store->movX[slot] = rand() % 3 - 1;
+    store->movY[slot] = rand() % 3 - 1;
+  }
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int tick=0; tick < ENTITY_BENCH_TICKS; ++tick)
+    EntityStore_ApplyMoves(store);
+  Uint64 elapsed = SDL_GetPerformanceCounter() - startTime;
+  // Radius query against a plain scan.
+  Coords center = { 16000, 16000 };
+  int radius = 3000, nInside = 0;
+  int* slots = MallocOrDie(ENTITY_BENCH_COUNT * sizeof(int));
+  for (int slot=0; slot < store->count; ++slot)
+  {
+    long dx = store->posX[slot] - center.x, dy = store->posY[slot] - center.y;
+    if (dx * dx + dy * dy <= (long)radius * radius)
+      ++nInside;
+  }
+  int nFound = EntityStore_QueryRadius(store, center, radius, slots, ENTITY_BENCH_COUNT);
+  if (nFound != nInside)
+    ++errors;
+  for (int i=0; i < nFound && i < ENTITY_BENCH_COUNT; ++i)
+  {
+    long dx = store->posX[slots[i]] - center.x, dy = store->posY[slots[i]] - center.y;
+    if (dx * dx + dy * dy > (long)radius * radius || (i && slots[i] <= slots[i - 1]))
+      ++errors;
+  }
+  free(slots);
+  printf("EntityStore: Errors=%d; Live=%d; Entities=%d; NsPerEntityMove=%g\n",
+      errors, nAlive, ENTITY_BENCH_COUNT,
+      elapsed * 1e9 / SDL_GetPerformanceFrequency() / ENTITY_BENCH_TICKS / ENTITY_BENCH_COUNT);
+  fflush(stdout);
+  entityFailures += errors;
+  store->sprites = 0;
+  EntityStore_Destroy(store);
+}
+
+#define PATH_BENCH_MAP_SIZE 1000
+#define PATH_BENCH_SHORT 2000
+#define PATH_BENCH_SHORT_RANGE 30
+#define PATH_BENCH_LONG 200
+#define PATH_BENCH_CHECKED 40
+#define PATH_BENCH_QUEUED 1000
+#define PATH_BENCH_BUDGET_US 2000
+
+static int pathFailures;
+
+typedef struct PathBenchHeap {
+  Uint64* items;
+  int n, capacity;
+} PathBenchHeap;
+
+static void PathBenchHeap_Push(PathBenchHeap* heap, Uint32 f, int cell)
+{
+  if (heap->n == heap->capacity)
+  {
+    int capacity = heap->capacity ? 2 * heap->capacity : 1024;
+    Uint64* items = MallocOrDie(capacity * sizeof(Uint64));
+    if (heap->n)
+      memcpy(items, heap->items, heap->n * sizeof(Uint64));
+    free(heap->items);
+    heap->items = items;
+    heap->capacity = capacity;
+  }
+  int i = heap->n++;
+  Uint64 item = ((Uint64)f << 32) | (Uint32)cell;
+  for (; i > 0 && heap->items[(i - 1) / 2] > item; i = (i - 1) / 2)
+    heap->items[i] = heap->items[(i - 1) / 2];
+  heap->items[i] = item;
+}
+
+static int PathBenchHeap_Pop(PathBenchHeap* heap)
+{
+  if (heap->n == 0)
+    return -1;
+  int cell = (int)(Uint32)heap->items[0];
+  Uint64 last = heap->items[--heap->n];
+  int i = 0, child;
+  while ((child = 2 * i + 1) < heap->n)
+  {
+    if (child + 1 < heap->n && heap->items[child + 1] < heap->items[child])
+      ++child;
+    if (heap->items[child] >= last)
+      break;
+    heap->items[i] = heap->items[child];
+    i = child;
+  }
+  heap->items[i] = last;
+  return cell;
+}
+
+// Diagonal steps can't cut corners.
+static int PathStepAllowed(TiledMap* map, int x, int y, int dx, int dy)
+{
+  return !TiledMap_IsObstacle(map, x + dx, y + dy)
+    && (!dx || !dy
+      || (!TiledMap_IsObstacle(map, x + dx, y) && !TiledMap_IsObstacle(map, x, y + dy)));
+}
+
+// Plain A* with the same movement rules as path.c, for checking its costs.
+static int ReferencePathCost(TiledMap* map, Coords start, Coords goal)
+{
+  static int* g;
+  static Uint8* closed;
+  static PathBenchHeap heap;
+  int w = map->width, n = map->width * map->height;
+  if (!g)
+  {
+    g = MallocOrDie(n * sizeof(int));
+    closed = MallocOrDie(n);
+  }
+  for (int i=0; i < n; ++i)
+  {
+    g[i] = INT_MAX;
+    closed[i] = 0;
+  }
+  if (TiledMap_IsObstacle(map, start.x, start.y) || TiledMap_IsObstacle(map, goal.x, goal.y))
+    return -1;
+  heap.n = 0;
+  g[start.y * w + start.x] = 0;
+  PathBenchHeap_Push(&heap, 0, start.y * w + start.x);
+  int cell;
+  while ((cell = PathBenchHeap_Pop(&heap)) >= 0)
+  {
+    if (closed[cell])
+      continue;
+    closed[cell] = 1;
+    int x = cell % w, y = cell / w;
+    if (x == goal.x && y == goal.y)
+      return g[cell];
+    for (int dy = -1; dy <= 1; ++dy)
+    {
+      for (int dx = -1; dx <= 1; ++dx)
+      {
+        if ((!dx && !dy) || !PathStepAllowed(map, x, y, dx, dy))
+          continue;
+        int next = (y + dy) * w + x + dx;
+        int cost = g[cell] + (dx && dy ? 14 : 10);
+        if (cost >= g[next])
+          continue;
+        g[next] = cost;
+        int hx = Abs(goal.x - x - dx), hy = Abs(goal.y - y - dy);
+        int h = hx < hy ? 14 * hx + 10 * (hy - hx) : 14 * hy + 10 * (hx - hy);
+        PathBenchHeap_Push(&heap, cost + h, next);
+      }
+    }
+  }
+  return -1;
+}
+
+// Checks that the path runs from start to goal in straight or diagonal legs
+// of allowed steps, and costs what it says.
+static int PathIsValid(TiledMap* map, const Path* path, Coords start, Coords goal)
+{
+  if (path->nWaypoints < 1)
+    return 0;
+  Coords first = path->waypoints[0], last = path->waypoints[path->nWaypoints - 1];
+  if (first.x != start.x || first.y != start.y || last.x != goal.x || last.y != goal.y)
+    return 0;
+  int cost = 0;
+  for (int i=1; i < path->nWaypoints; ++i)
+  {
+    Coords a = path->waypoints[i - 1], b = path->waypoints[i];
+    int dx = SigNum(b.x - a.x), dy = SigNum(b.y - a.y);
+    int steps = Abs(b.x - a.x) > Abs(b.y - a.y) ? Abs(b.x - a.x) : Abs(b.y - a.y);
+    if (steps == 0 || (dx && dy && Abs(b.x - a.x) != Abs(b.y - a.y)))
+      return 0;
+    for (int s=0; s < steps; ++s)
+      if (!PathStepAllowed(map, a.x + s * dx, a.y + s * dy, dx, dy))
+        return 0;
+    cost += steps * (dx && dy ? 14 : 10);
+  }
+  return cost == path->cost;
+}
+
+static Coords RandomOpenTile(TiledMap* map, Coords near, int range)
+{
+  Coords c;
+  do {
+    if (range)
+    {
+      c.x = near.x + rand() % (2 * range + 1) - range;
+      c.y = near.y + rand() % (2 * range + 1) - range;
+    }
+    else
+    {
+      c.x = rand() % map->width;
+      c.y = rand() % map->height;
+    }
+  } while (TiledMap_IsObstacle(map, c.x, c.y));
+  return c;
+}
+
+static double PathsPerSecond(int nPaths, Uint64 elapsed)
+{
+  return nPaths * (double)SDL_GetPerformanceFrequency() / (elapsed ? elapsed : 1);
+}
+
+// A map with scattered blocked tiles and straight walls.
+static TiledMap* CreatePathBenchMap()
+{
+  TiledMap* map = CreateLightTestMap(PATH_BENCH_MAP_SIZE);
+  for (int y=0; y < PATH_BENCH_MAP_SIZE; ++y)
+    for (int x=0; x < PATH_BENCH_MAP_SIZE; ++x)
+      if (rand() % 10 == 0)
+        SetOpacity(map, x, y, 7);
+  for (int wall=0; wall < PATH_BENCH_MAP_SIZE * 3; ++wall)
+  {
+    int x = rand() % PATH_BENCH_MAP_SIZE, y = rand() % PATH_BENCH_MAP_SIZE;
+    int length = 5 + rand() % 40, vertical = rand() % 2;
+    for (int i=0; i < length && x < PATH_BENCH_MAP_SIZE && y < PATH_BENCH_MAP_SIZE; ++i)
+    {
+      SetOpacity(map, x, y, 7);
+      if (vertical) ++y; else ++x;
+    }
+  }
+  return map;
+}
+
+// Checks paths against plain A* and times short (jump point search) and
+// long (cluster graph) requests on a generated map with scattered walls.
+void TestPathfinding()
+{
+  TiledMap* map = CreatePathBenchMap();
+  Path_Init(map, 0);
+  Path path = { 0 };
+  int nQueries = PATH_BENCH_SHORT > PATH_BENCH_LONG ? PATH_BENCH_SHORT : PATH_BENCH_LONG;
+  Coords* starts = MallocOrDie(nQueries * sizeof(Coords));
+  Coords* goals = MallocOrDie(nQueries * sizeof(Coords));
+  Coords center = { PATH_BENCH_MAP_SIZE / 2, PATH_BENCH_MAP_SIZE / 2 };
+  int centerRange = PATH_BENCH_MAP_SIZE / 2 - PATH_BENCH_SHORT_RANGE;
+
+  // Short paths.
+  for (int i=0; i < PATH_BENCH_SHORT; ++i)
+  {
+    starts[i] = RandomOpenTile(map, center, centerRange);
+    goals[i] = RandomOpenTile(map, starts[i], PATH_BENCH_SHORT_RANGE);
+  }
+  int found = 0;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int i=0; i < PATH_BENCH_SHORT; ++i)
+    found += Path_Find(starts[i], goals[i], &path);
+  Uint64 elapsed = SDL_GetPerformanceCounter() - startTime;
+  int mismatches = 0, invalid = 0, suboptimal = 0;
+  for (int i=0; i < PATH_BENCH_SHORT; ++i)
+  {
+    Path_Find(starts[i], goals[i], &path);
+    int best = ReferencePathCost(map, starts[i], goals[i]);
+    if ((best < 0) != (path.cost < 0))
+      ++mismatches;
+    else if (best >= 0 && !PathIsValid(map, &path, starts[i], goals[i]))
+      ++invalid;
+    else if (path.cost > best)
+      ++suboptimal;
+  }
+  printf("Path: Short: Paths=%d; Found=%d; PathsPerSec=%g; "
+      "ReachMismatches=%d; Invalid=%d; Suboptimal=%d\n",
+      PATH_BENCH_SHORT, found, PathsPerSecond(PATH_BENCH_SHORT, elapsed),
+      mismatches, invalid, suboptimal);
+  pathFailures += mismatches + invalid;
+
+  // Long paths, first with the clusters being built as they're reached.
+  for (int i=0; i < PATH_BENCH_LONG; ++i)
+  {
+    starts[i] = RandomOpenTile(map, center, 0);
+    goals[i] = RandomOpenTile(map, center, 0);
+  }
+  Uint64 coldElapsed = 0, warmElapsed = 0;
+  for (int pass=0; pass < 2; ++pass)
+  {
+    found = 0;
+    startTime = SDL_GetPerformanceCounter();
+    for (int i=0; i < PATH_BENCH_LONG; ++i)
+      found += Path_Find(starts[i], goals[i], &path);
+    *(pass ? &warmElapsed : &coldElapsed) = SDL_GetPerformanceCounter() - startTime;
+  }
+  mismatches = invalid = 0;
+  double excess = 0;
+  for (int i=0; i < PATH_BENCH_CHECKED; ++i)
+  {
+    Path_Find(starts[i], goals[i], &path);
+    int best = ReferencePathCost(map, starts[i], goals[i]);
+    if ((best < 0) != (path.cost < 0))
+      ++mismatches;
+    else if (best > 0)
+    {
+      if (!PathIsValid(map, &path, starts[i], goals[i]))
+        ++invalid;
+      excess += (double)(path.cost - best) / best;
+    }
+  }
+  PathStats stats = Path_GetStats();
+  printf("Path: Long: Paths=%d; Found=%d; ColdPathsPerSec=%g; WarmPathsPerSec=%g; "
+      "Clusters=%u; ReachMismatches=%d; Invalid=%d; AvgExcessCost=%.2f%%\n",
+      PATH_BENCH_LONG, found, PathsPerSecond(PATH_BENCH_LONG, coldElapsed),
+      PathsPerSecond(PATH_BENCH_LONG, warmElapsed), stats.clusterBuilds,
+      mismatches, invalid, 100 * excess / PATH_BENCH_CHECKED);
+  pathFailures += mismatches + invalid;
+
+  // Blocking a tile on a path rebuilds only the clusters around it.
+  Path_Find(starts[0], goals[0], &path);
+  if (path.nWaypoints > 2)
+  {
+    Coords blocked = path.waypoints[path.nWaypoints / 2];
+    SetOpacity(map, blocked.x, blocked.y, 7);
+    Path_InvalidateTile(blocked.x, blocked.y);
+    PathStats before = Path_GetStats();
+    Path_Find(starts[0], goals[0], &path);
+    PathStats after = Path_GetStats();
+    int rebuilt = after.clusterBuilds - before.clusterBuilds;
+    int best = ReferencePathCost(map, starts[0], goals[0]);
+    int ok = rebuilt >= 1 && rebuilt <= 4 && (best < 0) == (path.cost < 0)
+      && (best < 0 || PathIsValid(map, &path, starts[0], goals[0]));
+    printf("Path: Invalidation: ClustersRebuilt=%d; %s\n", rebuilt, ok ? "PASS" : "FAIL");
+    pathFailures += !ok;
+  }
+
+  // Queued requests from many NPCs, resolved within a per-tick budget.
+  for (int i=0; i < PATH_BENCH_QUEUED; ++i)
+  {
+    Coords start = RandomOpenTile(map, center, centerRange);
+    Coords goal = i % 4 ? RandomOpenTile(map, start, PATH_BENCH_SHORT_RANGE)
+      : RandomOpenTile(map, center, 0);
+    Path_Request(start, goal);
+  }
+  int ticks = 0, resolved = 0;
+  startTime = SDL_GetPerformanceCounter();
+  while (resolved < PATH_BENCH_QUEUED)
+  {
+    resolved += Path_Update(PATH_BENCH_BUDGET_US);
+    ++ticks;
+  }
+  elapsed = SDL_GetPerformanceCounter() - startTime;
+  for (int ticket=1; ticket <= PATH_BENCH_QUEUED; ++ticket)
+    if (Path_GetResult(ticket, 0) == PATH_PENDING)
+      ++pathFailures;
+  printf("Path: Queued: Requests=%d; BudgetUs=%d; Ticks=%d; PathsPerTick=%g; PathsPerSec=%g\n",
+      PATH_BENCH_QUEUED, PATH_BENCH_BUDGET_US, ticks, (double)PATH_BENCH_QUEUED / ticks,
+      PathsPerSecond(PATH_BENCH_QUEUED, elapsed));
+
+  // A request released while queued keeps its slot until it leaves the
+  // queue, so the next one isn't resolved twice.
+  for (int ticket=1; ticket <= PATH_BENCH_QUEUED; ++ticket)
+    Path_Release(ticket);
+  int released = Path_Request(starts[0], goals[0]);
+  Path_Release(released);
+  int reissued = Path_Request(starts[0], goals[0]);
+  const Path* result = 0;
+  int requeued = 0;
+  for (int i=0; i < 4; ++i)
+    requeued += Path_Update(PATH_BENCH_BUDGET_US);
+  int reused = Path_Request(starts[0], goals[0]);
+  int ok = reissued != released && requeued == 1 && reused == released
+    && Path_GetResult(reissued, &result) != PATH_PENDING
+    && (result->cost < 0) == (ReferencePathCost(map, starts[0], goals[0]) < 0);
+  printf("Path: Released While Queued: Resolved=%d; %s\n", requeued, ok ? "PASS" : "FAIL");
+  pathFailures += !ok;
+  fflush(stdout);
+  free(path.waypoints);
+  free(starts);
+  free(goals);
+  Path_Destroy();
+}
+
+#define JOB_BENCH_ITEMS 2000000
+#define JOB_BENCH_GRAIN 4096
+#define JOB_BENCH_PATHS 400
+
+static int jobFailures;
+
+typedef struct JobBenchData {
+  const float* values;
+  double* partials; // one per chunk
+} JobBenchData;
+
+// A few dozen flops per item, summed per chunk.
+static void JobBenchSum(void* data, int chunk, int first, int end)
+{
+  JobBenchData* bench = data;
+  double sum = 0;
+  for (int i = first; i < end; ++i)
+  {
+    float v = bench->values[i];
+    for (int k=0; k < 8; ++k)
+      v = v * 0.999f + 0.5f / (1.0f + v * v);
+    sum += v;
+  }
+  bench->partials[chunk] = sum;
+}
+
+// Sums values on the job threads, adding up the chunks in order.
+static double JobBenchRun(JobBenchData* bench)
+{
+  Job_ParallelFor(JobBenchSum, bench, JOB_BENCH_ITEMS, JOB_BENCH_GRAIN);
+  double sum = 0;
+  int nChunks = Job_ChunkCount(JOB_BENCH_ITEMS, JOB_BENCH_GRAIN);
+  for (int chunk=0; chunk < nChunks; ++chunk)
+    sum += bench->partials[chunk];
+  return sum;
+}
+
+// Times a compute loop and a batch of queued path requests with 1 to N job
+// threads, and checks that deterministic mode gives the same results for
+// every thread count.
+void TestJobSystem()
+{
+  int maxThreads = SDL_GetCPUCount();
+  if (maxThreads < 4)
+    maxThreads = 4; // still exercises stealing, if not speed
+  JobBenchData bench;
+  float* values = MallocOrDie(JOB_BENCH_ITEMS * sizeof(float));
+  for (int i=0; i < JOB_BENCH_ITEMS; ++i)
+    values[i] = (float)randomInt() / RANDOM_RANGE;
+  bench.values = values;
+  // Chunks are never smaller than the grain.
+  bench.partials = MallocOrDie((JOB_BENCH_ITEMS / JOB_BENCH_GRAIN + 1) * sizeof(double));
+  TiledMap* map = CreatePathBenchMap();
+  Coords center = { PATH_BENCH_MAP_SIZE / 2, PATH_BENCH_MAP_SIZE / 2 };
+  Coords* starts = MallocOrDie(JOB_BENCH_PATHS * sizeof(Coords));
+  Coords* goals = MallocOrDie(JOB_BENCH_PATHS * sizeof(Coords));
+  for (int i=0; i < JOB_BENCH_PATHS; ++i)
+  {
+    starts[i] = RandomOpenTile(map, center, PATH_BENCH_MAP_SIZE / 2 - PATH_BENCH_SHORT_RANGE);
+    goals[i] = i % 4 ? RandomOpenTile(map, starts[i], PATH_BENCH_SHORT_RANGE)
+      : RandomOpenTile(map, center, 0);
+  }
+  int* costs = MallocOrDie(JOB_BENCH_PATHS * sizeof(int));
+  int* singleCosts = MallocOrDie(JOB_BENCH_PATHS * sizeof(int));
+  double singleSum = 0, singleSumUs = 0, singlePathsPerSec = 0;
+  for (int deterministic=1; deterministic >= 0; --deterministic)
+  {
+    Job_SetDeterministic(deterministic);
+    for (int nThreads=1; nThreads <= maxThreads; ++nThreads)
+    {
+      Job_Init(nThreads);
+      JobStats before = Job_GetStats();
+      Uint64 startTime = SDL_GetPerformanceCounter();
+      double sum = JobBenchRun(&bench);
+      double sumUs = (SDL_GetPerformanceCounter() - startTime) * 1e6
+        / SDL_GetPerformanceFrequency();
+      // Fresh clusters each time, so that every run builds the same ones.
+      Path_Init(map, 0);
+      for (int i=0; i < JOB_BENCH_PATHS; ++i)
+        Path_Request(starts[i], goals[i]);
+      startTime = SDL_GetPerformanceCounter();
+      int resolved = 0;
+      while (resolved < JOB_BENCH_PATHS)
+        resolved += Path_Update(PATH_BENCH_BUDGET_US);
+      double pathsPerSec = PathsPerSecond(JOB_BENCH_PATHS, SDL_GetPerformanceCounter() - startTime);
+      int mismatches = 0;
+      for (int ticket=1; ticket <= JOB_BENCH_PATHS; ++ticket)
+      {
+        const Path* path;
+        int status = Path_GetResult(ticket, &path);
+        costs[ticket - 1] = status == PATH_FOUND ? path->cost
+          : status == PATH_NOT_FOUND ? -1 : -2;
+        if (costs[ticket - 1] == -2)
+          ++mismatches;
+      }
+      Path_Destroy();
+      JobStats after = Job_GetStats();
+      if (nThreads == 1)
+      {
+        singleSum = sum;
+        singleSumUs = sumUs;
+        singlePathsPerSec = pathsPerSec;
+        memcpy(singleCosts, costs, JOB_BENCH_PATHS * sizeof(int));
+      }
+      else
+      {
+        for (int i=0; i < JOB_BENCH_PATHS; ++i)
+          mismatches += costs[i] != singleCosts[i];
+        if (deterministic && sum != singleSum)
+          ++mismatches;
+      }
+      printf("Job: %s: Threads=%d; SumUs=%.0f; SumSpeedup=%.2f; PathsPerSec=%g; "
+          "PathSpeedup=%.2f; Jobs=%u; Stolen=%u; Mismatches=%d\n",
+          deterministic ? "Deterministic" : "Balanced", Job_ThreadCount(), sumUs,
+          singleSumUs / sumUs, pathsPerSec, pathsPerSec / singlePathsPerSec,
+          after.jobsRun - before.jobsRun, after.jobsStolen - before.jobsStolen,
+          mismatches);
+      fflush(stdout);
+      jobFailures += mismatches;
+    }
+  }
+  Job_Destroy();
+  Job_SetDeterministic(0);
+  free(values);
+  free(bench.partials);
+  free(starts);
+  free(goals);
+  free(costs);
+  free(singleCosts);
+}
+
+#define BUNDLE_BENCH_IMAGE "sharmt16-basictiles-32.png"
+#define BUNDLE_BENCH_FILE "utiltest.wtb"
+#define BUNDLE_BENCH_LOADS 20
+static int bundleFailures;
+
+// Writes the tileset image to a bundle and reads it back, checking the
+// pixels and timing it against decoding the PNG. Run from the source
+// directory, where the image is.
+void TestAssetBundle()
+{
+  struct Image img = { .path = BUNDLE_BENCH_IMAGE };
+  Bundle_BeginRecording();
+  if (!LoadImage(&img, 0) || !Bundle_Write(BUNDLE_BENCH_FILE, SDL_PIXELFORMAT_ARGB8888))
+  {
+    printf("Bundle: Unable to make bundle from '%s'\n", BUNDLE_BENCH_IMAGE);
+    ++bundleFailures;
+    return;
+  }
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int i=0; i < BUNDLE_BENCH_LOADS; ++i)
+    SDL_FreeSurface(IMG_Load(BUNDLE_BENCH_IMAGE));
+  Uint64 pngTime = SDL_GetPerformanceCounter() - startTime;
+  startTime = SDL_GetPerformanceCounter();
+  int loaded = Bundle_Open(BUNDLE_BENCH_FILE);
+  SDL_Surface* bundled = 0;
+  for (int i=0; loaded && i < BUNDLE_BENCH_LOADS; ++i)
+  {
+    SDL_FreeSurface(bundled);
+    bundled = Bundle_LoadSurface(BUNDLE_BENCH_IMAGE);
+  }
+  Uint64 bundleTime = SDL_GetPerformanceCounter() - startTime;
+  // Compare with the image converted the same way.
+  int mismatches = 0;
+  SDL_Surface* expected = SDL_ConvertSurfaceFormat(img.sfc, SDL_PIXELFORMAT_ARGB8888, 0);
+  if (!bundled || !expected || bundled->w != expected->w || bundled->h != expected->h)
+    mismatches = 1;
+  for (int y=0; !mismatches && y < expected->h; ++y)
+    mismatches += 0 != memcmp((char*)bundled->pixels + y * bundled->pitch,
+        (char*)expected->pixels + y * expected->pitch, 4 * expected->w);
+  double msPerCount = 1e3 / SDL_GetPerformanceFrequency();
+  printf("Bundle: Image=%s; Size=%dx%d; PngMs=%.3f; BundleMs=%.3f; Speedup=%.0f; Mismatches=%d\n",
+      BUNDLE_BENCH_IMAGE, img.sfc->w, img.sfc->h,
+      pngTime * msPerCount / BUNDLE_BENCH_LOADS, bundleTime * msPerCount / BUNDLE_BENCH_LOADS,
+      bundleTime ? (double)pngTime / bundleTime : 0.0, mismatches);
+  bundleFailures += mismatches;
+  SDL_FreeSurface(bundled);
+  SDL_FreeSurface(expected);
+  SDL_FreeSurface(img.sfc);
+  Bundle_Close();
+  remove(BUNDLE_BENCH_FILE);
+}
+
+#define LOADER_BENCH_IMAGES 32
+static int loaderFailures;
+
+// Loads copies of the tileset image on the loader threads, and one that
+// doesn't exist, checking what comes back. Loading them one after another
+// blocks the main thread for the whole time; with the loader, it's only
+// held up by the calls it makes. With no renderer, there are no textures
+// to make.
+void TestAssetLoader()
+{
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int i=0; i < LOADER_BENCH_IMAGES; ++i)
+    SDL_FreeSurface(IMG_Load(BUNDLE_BENCH_IMAGE));
+  Uint64 syncTime = SDL_GetPerformanceCounter() - startTime;
+  Loader_Init();
+  int tickets[LOADER_BENCH_IMAGES];
+  startTime = SDL_GetPerformanceCounter();
+  for (int i=0; i < LOADER_BENCH_IMAGES; ++i)
+    tickets[i] = Loader_Request(BUNDLE_BENCH_IMAGE);
+  int missingTicket = Loader_Request("no such image.png");
+  Uint64 mainTime = SDL_GetPerformanceCounter() - startTime;
+  int nDone = 0;
+  while (nDone < LOADER_BENCH_IMAGES + 1)
+  {
+    Uint64 callTime = SDL_GetPerformanceCounter();
+    Loader_Upload(0);
+    mainTime += SDL_GetPerformanceCounter() - callTime;
+    LoaderStats stats = Loader_GetStats();
+    nDone = stats.loaded + stats.failed;
+    if (nDone < LOADER_BENCH_IMAGES + 1)
+      SDL_Delay(1);
+  }
+  Uint64 asyncTime = SDL_GetPerformanceCounter() - startTime;
+  int mismatches = 0;
+  for (int i=0; i < LOADER_BENCH_IMAGES; ++i)
+  {
+    SDL_Surface* sfc;
+    SDL_Texture* tex;
+    if (Loader_GetResult(tickets[i], &sfc, &tex) != LOAD_READY || !sfc
+        || sfc->w != 256 || sfc->h != 480)
+      ++mismatches;
+    SDL_FreeSurface(sfc);
+  }
+  SDL_Surface* sfc;
+  SDL_Texture* tex;
+  if (Loader_GetResult(missingTicket, &sfc, &tex) != LOAD_FAILED)
+    ++mismatches;
+  double msPerCount = 1e3 / SDL_GetPerformanceFrequency();
+  printf("Loader: Images=%d; SyncMs=%.2f; AsyncMs=%.2f; MainThreadMs=%.2f; Mismatches=%d\n",
+      LOADER_BENCH_IMAGES, syncTime * msPerCount, asyncTime * msPerCount,
+      mainTime * msPerCount, mismatches);
+  Loader_PrintStats();
+  loaderFailures += mismatches;
+
+  // NPC sprites loaded in the background go in a bundle made afterwards,
+  // as with -makebundle, and NPCs spawned before theirs arrived are resized
+  // in the grid once it has.
+  Bundle_BeginRecording();
+  SpatialGrid* grid = SpatialGrid_Create(64, 64, 32, 32);
+  EntityStore* store = EntityStore_Create(0, grid);
+  int sprite = EntityStore_AddSprite(store, BUNDLE_BENCH_IMAGE);
+  EntityStore_Spawn(store, "npc", sprite, (Coords){ 0, 0 }, 10);
+  SDL_Rect farCorner = { 255, 479, 1, 1 };
+  int foundEarly = SpatialGrid_QueryRect(grid, &farCorner, 0, 0);
+  Loader_Finish();
+  Loader_Upload(0);
+  EntityStore_PlaceSprites(store);
+  int foundLate = SpatialGrid_QueryRect(grid, &farCorner, 0, 0);
+  int bundled = Bundle_Write(BUNDLE_BENCH_FILE, SDL_PIXELFORMAT_ARGB8888)
+    && Bundle_Open(BUNDLE_BENCH_FILE);
+  sfc = bundled ? Bundle_LoadSurface(BUNDLE_BENCH_IMAGE) : 0;
+  int ok = sfc && sfc->w == 256 && sfc->h == 480;
+  printf("Loader: Bundled Sprites: %s\n", ok ? "PASS" : "FAIL");
+  loaderFailures += !ok;
+  ok = foundEarly == 0 && foundLate == 1;
+  printf("Loader: Resized Sprites: %s\n", ok ? "PASS" : "FAIL");
+  loaderFailures += !ok;
+  SDL_FreeSurface(sfc);
+  SDL_FreeSurface(store->sprites[0].sfc);
+  EntityStore_Destroy(store);
+  SpatialGrid_Destroy(grid);
+  Bundle_Close();
+  remove(BUNDLE_BENCH_FILE);
+  Loader_Destroy();
+}
+
+#define CSV_BENCH_ROWS 2048
+#define CSV_BENCH_COLS 2048
+#define CSV_BENCH_PASSES 3
+static int csvFailures;
+
+// How ReadGridFile used to parse each row.
+static void StrtolParseGrid(const char* text, Sint16* cells, int nRows, int nCols)
+{
+  const char* p = text;
+  for (int r=0; r < nRows; ++r)
+  {
+    for (int c=0; c < nCols; ++c)
+    {
+      char* e;
+      cells[r * nCols + c] = strtol(p, &e, 10);
+      p = e + 1;
+    }
+  }
+}
+
+static double CsvMBps(size_t len, Uint64 elapsed)
+{
+  return len * CSV_BENCH_PASSES / 1e6 * SDL_GetPerformanceFrequency() / elapsed;
+}
+
+// Parses the text and counts the cells that differ from expected, or the
+// whole grid if it fails to parse.
+static int CsvMismatches(const char* text, size_t len, const Sint16* expected,
+    int nRows, int nCols)
+{
+  struct IntGrid* grid = Csv_ParseGrid(text, len, nRows, nCols, "bench");
+  if (!grid)
+    return nRows * nCols;
+  int mismatches = grid->rows != nRows || grid->cols != nCols;
+  for (int i=0; !mismatches && i < nRows * nCols; ++i)
+    mismatches += grid->cells[i] != expected[i];
+  FreeIntGrid(grid);
+  return mismatches;
+}
+
+typedef struct CsvCase {
+  const char* text;
+  int nRows, nCols; // expected, or 0 to infer
+  int ok;
+  Sint16 lastCell;
+} CsvCase;
+
+// Checks that malformed grids are reported rather than parsed, including
+// ones with the problem past the first SIMD block of a row.
+static int CheckCsvErrors()
+{
+  static const CsvCase cases[] = {
+    { "1,2,3\n4,5,6\n", 0, 0, 1, 6 },
+    { "1,2,3\r\n4,5,6", 2, 3, 1, 6 },
+    { "-32768,32767\n", 1, 2, 1, 32767 },
+    { "1,2\n3,4,5\n", 0, 0, 0, 0 },
+    { "1,2,3\n4,5\n", 2, 3, 0, 0 },
+    { "1,,3\n", 1, 3, 0, 0 },
+    { "1,2,40000\n", 1, 3, 0, 0 },
+    { "1,-,3\n", 1, 3, 0, 0 },
+    { "1,x,3\n", 1, 3, 0, 0 },
+    { "1,2,3\n", 2, 3, 0, 0 },
+    { "", 0, 0, 0, 0 },
+    { "1,2,3,\n", 1, 3, 0, 0 },
+    { "10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30\n", 1, 21, 1, 30 },
+    { "10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30\n", 1, 20, 0, 0 },
+    { "10,11,12,13,14,15,16,17,1-8,19,20,21,22,23,24,25,26,27,28,29,30\n", 1, 21, 0, 0 },
+    { "10,11,12,13,14,15,16,17,99999,19,20,21,22,23,24,25,26,27,28,29,30\n", 1, 21, 0, 0 },
+    { "10,11,12,13,14,15,16,17,,19,20,21,22,23,24,25,26,27,28,29,30\n", 1, 21, 0, 0 },
+  };
+  int failures = 0;
+  for (size_t i=0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+  {
+    const CsvCase* test = &cases[i];
+    struct IntGrid* grid = Csv_ParseGrid(test->text, strlen(test->text),
+        test->nRows, test->nCols, "test");
+    if (!grid != !test->ok
+        || (grid && grid->cells[grid->rows * grid->cols - 1] != test->lastCell))
+    {
+      printf("Csv: Case %d: Expected %s\n", (int)i, test->ok ? "success" : "an error");
+      ++failures;
+    }
+    if (grid)
+      FreeIntGrid(grid);
+  }
+  return failures;
+}
+
+// Parses a large grid of tile IDs the old way, then with each SIMD level on
+// one thread, then with the best level on 1 to N threads.
+void TestCsvParser()
+{
+  size_t capacity = (size_t)CSV_BENCH_ROWS * CSV_BENCH_COLS * 7;
+  char* text = MallocOrDie(capacity);
+  Sint16* expected = MallocOrDie(CSV_BENCH_ROWS * CSV_BENCH_COLS * sizeof(Sint16));
+  size_t len = 0;
+  for (int r=0; r < CSV_BENCH_ROWS; ++r)
+  {
+    for (int c=0; c < CSV_BENCH_COLS; ++c)
+    {
+      // Mostly small tile IDs and empty cells, with some big ones.
+      int value = randomInt() % 200 - 1;
+      if (value > 190)
+        value = (randomInt() * 16 - RANDOM_RANGE * 8) % 32768;
+      expected[r * CSV_BENCH_COLS + c] = value;
+      len += sprintf(text + len, c ? ",%d" : "%d", value);
+    }
+    text[len++] = '\n';
+  }
+  Sint16* cells = MallocOrDie(CSV_BENCH_ROWS * CSV_BENCH_COLS * sizeof(Sint16));
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (int pass=0; pass < CSV_BENCH_PASSES; ++pass)
+    StrtolParseGrid(text, cells, CSV_BENCH_ROWS, CSV_BENCH_COLS);
+  double strtolMBps = CsvMBps(len, SDL_GetPerformanceCounter() - startTime);
+  int mismatches = memcmp(cells, expected, CSV_BENCH_ROWS * CSV_BENCH_COLS * sizeof(Sint16)) != 0;
+  printf("Csv: Strtol: Size=%.1fMB; MBps=%.0f; Mismatches=%d\n", len / 1e6, strtolMBps,
+      mismatches);
+  csvFailures += mismatches;
+  free(cells);
+  Job_Init(1);
+  int maxLevel = Csv_SetSimd(SIMD_AVX2);
+  for (int level = SIMD_SCALAR; level <= maxLevel; ++level)
+  {
+    Csv_SetSimd(level);
+    startTime = SDL_GetPerformanceCounter();
+    for (int pass=0; pass < CSV_BENCH_PASSES; ++pass)
+      FreeIntGrid(Csv_ParseGrid(text, len, CSV_BENCH_ROWS, CSV_BENCH_COLS, "bench"));
+    double mbps = CsvMBps(len, SDL_GetPerformanceCounter() - startTime);
+    mismatches = CsvMismatches(text, len, expected, CSV_BENCH_ROWS, CSV_BENCH_COLS);
+    printf("Csv: %s: Threads=1; MBps=%.0f; Speedup=%.2f; Mismatches=%d\n",
+        Coords_BatchSimdName(level), mbps, mbps / strtolMBps, mismatches);
+    csvFailures += mismatches;
+  }
+  int maxThreads = SDL_GetCPUCount();
+  if (maxThreads < 4)
+    maxThreads = 4;
+  for (int nThreads=2; nThreads <= maxThreads; ++nThreads)
+  {
+    Job_Init(nThreads);
+    startTime = SDL_GetPerformanceCounter();
+    for (int pass=0; pass < CSV_BENCH_PASSES; ++pass)
+      FreeIntGrid(Csv_ParseGrid(text, len, 0, 0, "bench"));
+    double mbps = CsvMBps(len, SDL_GetPerformanceCounter() - startTime);
+    mismatches = CsvMismatches(text, len, expected, CSV_BENCH_ROWS, CSV_BENCH_COLS);
+    printf("Csv: %s: Threads=%d; MBps=%.0f; Speedup=%.2f; Mismatches=%d\n",
+        Coords_BatchSimdName(maxLevel), Job_ThreadCount(), mbps, mbps / strtolMBps, mismatches);
+    csvFailures += mismatches;
+  }
+  Job_Destroy();
+  csvFailures += CheckCsvErrors();
+  free(text);
+  free(expected);
+}
+
+#define TMX_TEST_WIDTH 40
+#define TMX_TEST_HEIGHT 30
+#define TMX_TEST_GID(x, y) (((x) + 3 * (y)) % 37)
+#define TMX_BENCH_SIZE 1024
+#define TMX_TEST_FILE "utiltest.wtm"
+#define TMX_EXPECTED_FILE "utiltest-expected.wtm"
+static int tmxFailures;
+
+// The test layer, compressed by zlib.
+static const char* TMX_TEST_ZLIB = "eNrtztUNQgEUBcGLOw93h/5rZAhtnE3mf6uqWrTp0KVHnwFDRoyZMGXGnIYFS1as2bBlx54DR06cuXDlxp0HT168+dS/POUpT3nKU57ylKc85SlPecpTnvKUpzzl6ff0BZTBU7k=";
+static const char* TMX_TEST_GZIP = "H4sIAAAAAAACA+3O1Q1CARQFwYs7D3eH/mtkCG2cTeZ/q6patOnQpUefAUNGjJkwZcachgVLVqzZsGXHngNHTpy5cOXGnQdPXrz51L885SlPecpTnvKUpzzlKU95ylOe8pSnPOXp9/QFrDLbj8ASAAA=";
+
+static char* Base64Encode(const Uint8* bytes, size_t n)
+{
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  char* text = MallocOrDie((n + 2) / 3 * 4 + 1);
+  char* t = text;
+  for (size_t i=0; i < n; i += 3)
+  {
+    Uint32 group = bytes[i] << 16 | (i + 1 < n ? bytes[i + 1] << 8 : 0)
+      | (i + 2 < n ? bytes[i + 2] : 0);
+    *t++ = digits[group >> 18];
+    *t++ = digits[(group >> 12) & 63];
+    *t++ = i + 1 < n ? digits[(group >> 6) & 63] : '=';
+    *t++ = i + 2 < n ? digits[group & 63] : '=';
+  }
+  *t = '\0';
+  return text;
+}
+
+// Wraps bytes in zlib's format without compressing them (stored blocks).
+static Uint8* ZlibStore(const Uint8* bytes, size_t n, size_t* storedLen)
+{
+  Uint8* stored = MallocOrDie(n + n / 65535 * 5 + 16);
+  Uint8* s = stored;
+  *s++ = 0x78;
+  *s++ = 0x01;
+  Uint32 a = 1, b = 0;
+  size_t i = 0;
+  do
+  {
+    size_t len = n - i < 65535 ? n - i : 65535;
+    *s++ = i + len == n; // last block flag, type 0
+    *s++ = len;
+    *s++ = len >> 8;
+    *s++ = ~len;
+    *s++ = ~len >> 8;
+    for (size_t k=0; k < len; ++k, ++i)
+    {
+      *s++ = bytes[i];
+      a = (a + bytes[i]) % 65521;
+      b = (b + a) % 65521;
+    }
+  } while (i < n);
+  Uint32 adler = b << 16 | a;
+  for (int k=3; k >= 0; --k)
+    *s++ = adler >> (8 * k);
+  *storedLen = s - stored;
+  return stored;
+}
+
+// Makes a one-layer map whose layer holds the given <data> element.
+static char* MakeTmx(int width, int height, const char* data)
+{
+  static const char* format = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+    "<map version=\"1.2\" orientation=\"orthogonal\" renderorder=\"right-down\""
+    " width=\"%d\" height=\"%d\" tilewidth=\"32\" tileheight=\"32\" infinite=\"0\">\n"
+    " <tileset firstgid=\"1\" source=\"test.tsx\"/>\n"
+    " <layer id=\"1\" name=\"Ground &amp; walls\" width=\"%d\" height=\"%d\">\n"
+    "  %s\n"
+    " </layer>\n"
+    " <!-- <layer> -->\n"
+    " <objectgroup id=\"2\" name=\"Objects\"><object id=\"1\" x=\"0\" y=\"0\"/></objectgroup>\n"
+    "</map>\n";
+  size_t len = strlen(format) + strlen(data) + 64;
+  char* tmx = MallocOrDie(len);
+  snprintf(tmx, len, format, width, height, width, height, data);
+  return tmx;
+}
+
+// Makes the <data> element for the gids in an encoding: "csv", "base64",
+// "stored" (base64 and zlib, uncompressed) or "tile".
+static char* MakeTmxData(const char* encoding, const Sint16* gids, int width, int height)
+{
+  int n = width * height;
+  char* data = MallocOrDie((size_t)n * 24 + 128);
+  char* d = data;
+  if (!strcmp(encoding, "csv") || !strcmp(encoding, "tile"))
+  {
+    int csv = !strcmp(encoding, "csv");
+    d += sprintf(d, csv ? "<data encoding=\"csv\">\n" : "<data>\n");
+    for (int i=0; i < n; ++i)
+      d += csv ? sprintf(d, i == n - 1 ? "%d\n" : (i + 1) % width ? "%d," : "%d,\n", gids[i])
+        : sprintf(d, "<tile gid=\"%d\"/>", gids[i]);
+  }
+  else
+  {
+    Uint8* bytes = MallocOrDie(n * 4);
+    for (int i=0; i < n; ++i)
+    {
+      bytes[4 * i] = gids[i];
+      bytes[4 * i + 1] = gids[i] >> 8;
+    }
+    size_t len = n * 4;
+    int stored = !strcmp(encoding, "stored");
+    Uint8* zlib = stored ? ZlibStore(bytes, n * 4, &len) : 0;
+    char* text = Base64Encode(stored ? zlib : bytes, len);
+    d += sprintf(d, "<data encoding=\"base64\"%s>\n   %s\n  ",
+        stored ? " compression=\"zlib\"" : "", text);
+    free(text);
+    free(zlib);
+    free(bytes);
+  }
+  sprintf(d, "</data>");
+  return data;
+}
+
+// Converts TMX text and compares the file with the expected one. Returns
+// 1 if they match (or if it was meant to fail and did).
+static int CheckTmx(const char* tmx, int shouldWork)
+{
+  int converted = Tmx_ConvertText(tmx, strlen(tmx), "test", TMX_TEST_FILE, 32, 0);
+  if (!shouldWork || !converted)
+    return converted == shouldWork;
+  char *expected, *actual;
+  long expectedLen, actualLen;
+  if (!ReadBinFile(TMX_EXPECTED_FILE, &expected, &expectedLen))
+    return 0;
+  if (!ReadBinFile(TMX_TEST_FILE, &actual, &actualLen))
+  {
+    free(expected);
+    return 0;
+  }
+  int same = expectedLen == actualLen && !memcmp(expected, actual, expectedLen);
+  free(expected);
+  free(actual);
+  return same;
+}
+
+static int WriteTestWtm(const char* filename, const Sint16* const* layers, int nLayers,
+    int width, int height, int compressed)
+{
+  Sint32 firstGid = 1;
+  const char* tilesetFilename = "test.wts";
+  TiledNativeSpec spec = { width, height, 32, 32, 32, 1, &firstGid, &tilesetFilename,
+    nLayers, layers, compressed };
+  return TiledMap_WriteNative(filename, &spec);
+}
+
+// Converts a small map in each layer encoding and checks the result against
+// TiledMap_WriteNative's, checks that broken maps are refused, and times a
+// larger map in each encoding.
+void TestTmxConversion()
+{
+  Sint16 gids[TMX_TEST_WIDTH * TMX_TEST_HEIGHT];
+  for (int y=0; y < TMX_TEST_HEIGHT; ++y)
+    for (int x=0; x < TMX_TEST_WIDTH; ++x)
+      gids[y * TMX_TEST_WIDTH + x] = TMX_TEST_GID(x, y);
+  const Sint16* layer = gids;
+  WriteTestWtm(TMX_EXPECTED_FILE, &layer, 1, TMX_TEST_WIDTH, TMX_TEST_HEIGHT, 0);
+  static const char* encodings[] = { "csv", "tile", "base64", "stored" };
+  char data[512];
+  for (int i=0; i < 6; ++i)
+  {
+    char* element;
+    if (i < 4)
+      element = MakeTmxData(encodings[i], gids, TMX_TEST_WIDTH, TMX_TEST_HEIGHT);
+    else
+    {
+      snprintf(data, sizeof(data), "<data encoding=\"base64\" compression=\"%s\">%s</data>",
+          i == 4 ? "zlib" : "gzip", i == 4 ? TMX_TEST_ZLIB : TMX_TEST_GZIP);
+      element = data;
+    }
+    char* tmx = MakeTmx(TMX_TEST_WIDTH, TMX_TEST_HEIGHT, element);
+    if (!CheckTmx(tmx, 1))
+    {
+      printf("Tmx: Encoding %s: Mismatch\n", i < 4 ? encodings[i] : i == 4 ? "zlib" : "gzip");
+      ++tmxFailures;
+    }
+    free(tmx);
+    if (element != data)
+      free(element);
+  }
+  // Broken maps.
+  static const char* brokenData[] = {
+    "<data encoding=\"csv\">1,2,3</data>",
+    "<data encoding=\"csv\">1,,2</data>",
+    "<data encoding=\"csv\">2147483649</data>",
+    "<data encoding=\"base64\">AAA*</data>",
+    "<data encoding=\"base64\" compression=\"zlib\">eNrtztUNQgEUBcGLOw93h/5rZAhtnE3mf6uq</data>",
+    "<data encoding=\"base64\" compression=\"zstd\">AAAA</data>",
+    "<data encoding=\"csv\">1</layer>",
+    "<data><chunk x=\"0\" y=\"0\" width=\"16\" height=\"16\"/></data>",
+  };
+  for (size_t i=0; i < sizeof(brokenData) / sizeof(brokenData[0]); ++i)
+  {
+    char* tmx = MakeTmx(TMX_TEST_WIDTH, TMX_TEST_HEIGHT, brokenData[i]);
+    if (!CheckTmx(tmx, 0))
+    {
+      printf("Tmx: Broken data %d: Converted\n", (int)i);
+      ++tmxFailures;
+    }
+    free(tmx);
+  }
+  const char* embedded = "<map orientation=\"orthogonal\" width=\"1\" height=\"1\""
+    " tilewidth=\"32\" tileheight=\"32\"><tileset firstgid=\"1\" name=\"x\"/>"
+    "<layer width=\"1\" height=\"1\"><data encoding=\"csv\">1</data></layer></map>";
+  if (!CheckTmx(embedded, 0))
+  {
+    printf("Tmx: Embedded tileset: Converted\n");
+    ++tmxFailures;
+  }
+  // Throughput.
+  int n = TMX_BENCH_SIZE * TMX_BENCH_SIZE;
+  Sint16* benchGids = MallocOrDie(n * sizeof(Sint16));
+  for (int i=0; i < n; ++i)
+    benchGids[i] = randomInt() % 8 ? randomInt() % 120 + 1 : 0;
+  layer = benchGids;
+  WriteTestWtm(TMX_EXPECTED_FILE, &layer, 1, TMX_BENCH_SIZE, TMX_BENCH_SIZE, 0);
+  for (int i=0; i < 4; ++i)
+  {
+    char* element = MakeTmxData(encodings[i], benchGids, TMX_BENCH_SIZE, TMX_BENCH_SIZE);
+    char* tmx = MakeTmx(TMX_BENCH_SIZE, TMX_BENCH_SIZE, element);
+    Uint64 startTime = SDL_GetPerformanceCounter();
+    int same = CheckTmx(tmx, 1);
+    double seconds = (double)(SDL_GetPerformanceCounter() - startTime)
+      / SDL_GetPerformanceFrequency();
+    printf("Tmx: Encoding=%s; Cells=%d; Size=%.1fMB; MBps=%.0f; MCellsPerSec=%.0f; Mismatches=%d\n",
+        encodings[i], n, strlen(tmx) / 1e6, strlen(tmx) / 1e6 / seconds, n / 1e6 / seconds,
+        !same);
+    tmxFailures += !same;
+    free(tmx);
+    free(element);
+  }
+  free(benchGids);
+  remove(TMX_TEST_FILE);
+  remove(TMX_EXPECTED_FILE);
+}
+
+#define RLZ_CHUNK_SIZE 32
+#define RLZ_PLANE_CELLS (RLZ_CHUNK_SIZE * RLZ_CHUNK_SIZE)
+#define RLZ_BENCH_SIZE 1024
+#define RLZ_BENCH_BYTES (512 << 20) // decoded per timing
+#define RLZ_TEST_FILE "utiltest.wtm"
+static int rlzFailures;
+
+// Packs a plane, checks that it unpacks the same and that damaged copies
+// are refused or at least stay in bounds. Returns the packed size.
+static size_t CheckRlzPlane(const char* what, const Sint16* cells, size_t nCells,
+    size_t rowLength)
+{
+  Uint8* packed = MallocOrDie(Rlz_Bound(nCells));
+  size_t len = Rlz_Compress(cells, nCells, rowLength, packed);
+  Sint16* unpacked = MallocOrDie((nCells + 1) * sizeof(Sint16));
+  int ok = len <= Rlz_Bound(nCells)
+    && Rlz_Decompress(packed, len, unpacked, nCells)
+    && !memcmp(cells, unpacked, nCells * sizeof(Sint16))
+    // Too short, and expecting too much or too little.
+    && !Rlz_Decompress(packed, len - 1, unpacked, nCells)
+    && !Rlz_Decompress(packed, len, unpacked, nCells + 1)
+    && (nCells < 2 || !Rlz_Decompress(packed, len, unpacked, nCells - 1));
+  // Flipped bits mustn't make it write past the end (ASan checks this).
+  for (size_t i=0; i < len && i < 64; ++i)
+  {
+    packed[i] ^= 1 << (i % 8);
+    Rlz_Decompress(packed, len, unpacked, nCells);
+    packed[i] ^= 1 << (i % 8);
+  }
+  if (!ok)
+  {
+    printf("Rlz: %s: FAIL\n", what);
+    ++rlzFailures;
+  }
+  free(unpacked);
+  free(packed);
+  return len;
+}
+
+// A map like the ones the game uses: patches of ground with a little noise,
+// and a layer that's mostly empty with things scattered over it.
+static void MakeRlzBenchMap(Sint16* ground, Sint16* stuff, int size)
+{
+  for (int y=0; y < size; ++y)
+  {
+    for (int x=0; x < size; ++x)
+    {
+      int patch = (x / 24 * 7 + y / 16 * 13) % 11;
+      ground[y * size + x] = randomInt() % 20 ? patch + 1 : randomInt() % 120 + 1;
+      stuff[y * size + x] = randomInt() % 30 ? 0 : randomInt() % 120 + 1;
+    }
+  }
+}
+
+// Splits a layer into chunk planes, padded with zeroes, as in map files.
+static Sint16* SplitRlzPlanes(const Sint16* cells, int width, int height, int* nPlanes)
+{
+  int chunkCols = (width + RLZ_CHUNK_SIZE - 1) / RLZ_CHUNK_SIZE;
+  int chunkRows = (height + RLZ_CHUNK_SIZE - 1) / RLZ_CHUNK_SIZE;
+  *nPlanes = chunkCols * chunkRows;
+  Sint16* planes = MallocOrDie((size_t)*nPlanes * RLZ_PLANE_CELLS * sizeof(Sint16));
+  for (int y=0; y < height; ++y)
+    for (int x=0; x < width; ++x)
+      planes[((y / RLZ_CHUNK_SIZE * chunkCols + x / RLZ_CHUNK_SIZE) * RLZ_CHUNK_SIZE
+          + y % RLZ_CHUNK_SIZE) * RLZ_CHUNK_SIZE + x % RLZ_CHUNK_SIZE] = cells[y * width + x];
+  return planes;
+}
+
+// Packs a map's layers a chunk plane at a time, as compressed map files do,
+// and reports the ratio and how fast the planes unpack. Also writes the map
+// both ways and compares the file sizes.
+static void BenchRlzMap(const char* name, const Sint16* const* layers, int nLayers,
+    int width, int height)
+{
+  int nPlanes = 0;
+  Sint16* planes[2];
+  for (int l=0; l < nLayers; ++l)
+    planes[l] = SplitRlzPlanes(layers[l], width, height, &nPlanes);
+  size_t totalPlanes = (size_t)nPlanes * nLayers;
+  Uint8* packed = MallocOrDie(totalPlanes * Rlz_Bound(RLZ_PLANE_CELLS));
+  size_t* offsets = MallocOrDie((totalPlanes + 1) * sizeof(size_t));
+  offsets[0] = 0;
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  for (size_t p=0; p < totalPlanes; ++p)
+    offsets[p + 1] = offsets[p] + Rlz_Compress(planes[p % nLayers]
+        + p / nLayers * RLZ_PLANE_CELLS, RLZ_PLANE_CELLS, RLZ_CHUNK_SIZE, packed + offsets[p]);
+  double packSeconds = (double)(SDL_GetPerformanceCounter() - startTime)
+    / SDL_GetPerformanceFrequency();
+  size_t rawBytes = totalPlanes * RLZ_PLANE_CELLS * sizeof(Sint16);
+  int passes = RLZ_BENCH_BYTES / rawBytes + 1;
+  Sint16* unpacked = MallocOrDie(RLZ_PLANE_CELLS * sizeof(Sint16));
+  int mismatches = 0;
+  startTime = SDL_GetPerformanceCounter();
+  for (int pass=0; pass < passes; ++pass)
+    for (size_t p=0; p < totalPlanes; ++p)
+      mismatches += !Rlz_Decompress(packed + offsets[p], offsets[p + 1] - offsets[p],
+          unpacked, RLZ_PLANE_CELLS);
+  double unpackSeconds = (double)(SDL_GetPerformanceCounter() - startTime)
+    / SDL_GetPerformanceFrequency();
+  for (size_t p=0; p < totalPlanes; ++p)
+  {
+    Rlz_Decompress(packed + offsets[p], offsets[p + 1] - offsets[p], unpacked, RLZ_PLANE_CELLS);
+    mismatches += memcmp(unpacked, planes[p % nLayers] + p / nLayers * RLZ_PLANE_CELLS,
+        RLZ_PLANE_CELLS * sizeof(Sint16)) != 0;
+  }
+  Sint64 plainSize = 0, packedSize = 0, modified;
+  WriteTestWtm(RLZ_TEST_FILE, layers, nLayers, width, height, 0);
+  GetFileStamp(RLZ_TEST_FILE, &plainSize, &modified);
+  WriteTestWtm(RLZ_TEST_FILE, layers, nLayers, width, height, 1);
+  GetFileStamp(RLZ_TEST_FILE, &packedSize, &modified);
+  printf("Rlz: Map=%s; Size=%dx%dx%d; Ratio=%.1f; PackMBps=%.0f; UnpackGBps=%.2f;"
+      " FileKB=%d; PackedFileKB=%d; Mismatches=%d\n",
+      name, width, height, nLayers, (double)rawBytes / offsets[totalPlanes],
+      rawBytes / 1e6 / packSeconds, rawBytes * (double)passes / 1e9 / unpackSeconds,
+      (int)(plainSize / 1024), (int)(packedSize / 1024), mismatches);
+  rlzFailures += mismatches;
+  for (int l=0; l < nLayers; ++l)
+    free(planes[l]);
+  free(packed);
+  free(offsets);
+  free(unpacked);
+}
+
+// Checks the cell coder on planes that exercise each kind of token, then
+// benchmarks it on the game's map (if its CSV exports are at hand), on a
+// bigger generated one, and on noise, the worst case.
+void TestMapCompression()
+{
+  static Sint16 plane[RLZ_PLANE_CELLS * 4];
+  size_t n = sizeof(plane) / sizeof(plane[0]);
+  CheckRlzPlane("Zeroes", plane, n, RLZ_CHUNK_SIZE);
+  CheckRlzPlane("One cell", plane, 1, RLZ_CHUNK_SIZE);
+  for (size_t i=0; i < n; ++i)
+    plane[i] = randomInt() % 3 ? (Sint16)(i % 5 * 1000 - 2000) : (Sint16)randomInt();
+  CheckRlzPlane("Short repeats", plane, n, RLZ_CHUNK_SIZE);
+  for (size_t i=0; i < n; ++i)
+    plane[i] = (i / 100) % 2 ? (Sint16)(i / 100) : (Sint16)(i % RLZ_CHUNK_SIZE);
+  CheckRlzPlane("Long runs and rows", plane, n, RLZ_CHUNK_SIZE);
+  for (size_t i=0; i < n; ++i)
+    plane[i] = (Sint16)(randomInt() * 16 + randomInt() % 16);
+  size_t noiseLen = CheckRlzPlane("Noise", plane, n, RLZ_CHUNK_SIZE);
+  if (noiseLen > Rlz_Bound(n))
+    ++rlzFailures;
+  struct IntGrid* tiles = ReadGridFile("map._Tiles.csv", 0, 0);
+  struct IntGrid* stuff = tiles ? ReadGridFile("map._Stuff.csv", tiles->rows, tiles->cols) : 0;
+  if (stuff)
+  {
+    // The exports hold tile IDs in the map's one tileset, -1 for empty.
+    size_t nCells = (size_t)tiles->rows * tiles->cols;
+    for (size_t i=0; i < nCells; ++i)
+    {
+      tiles->cells[i] = tiles->cells[i] < 0 ? 0 : tiles->cells[i] + 1;
+      stuff->cells[i] = stuff->cells[i] < 0 ? 0 : stuff->cells[i] + 1;
+    }
+    const Sint16* layers[2] = { tiles->cells, stuff->cells };
+    BenchRlzMap("map", layers, 2, tiles->cols, tiles->rows);
+  }
+  FreeIntGrid(tiles);
+  FreeIntGrid(stuff);
+  size_t nCells = (size_t)RLZ_BENCH_SIZE * RLZ_BENCH_SIZE;
+  Sint16* ground = MallocOrDie(nCells * sizeof(Sint16));
+  Sint16* objects = MallocOrDie(nCells * sizeof(Sint16));
+  MakeRlzBenchMap(ground, objects, RLZ_BENCH_SIZE);
+  const Sint16* layers[2] = { ground, objects };
+  BenchRlzMap("generated", layers, 2, RLZ_BENCH_SIZE, RLZ_BENCH_SIZE);
+  for (size_t i=0; i < nCells; ++i)
+    ground[i] = randomInt() % 120 + 1;
+  BenchRlzMap("noise", layers, 1, RLZ_BENCH_SIZE, RLZ_BENCH_SIZE);
+  free(ground);
+  free(objects);
+  remove(RLZ_TEST_FILE);
+}
+
+#define PACE_TEST_RATE 200
+#define PACE_TEST_TICKS 100
+#define PACE_TEST_CATCH_UP 4
+static int paceFailures;
+
+static void CheckPace(int ok, const char* what)
+{
+  printf("Pace: %s: %s\n", what, ok ? "PASS" : "FAIL");
+  if (!ok)
+    ++paceFailures;
+}
+
+// Sleeps to a run of tick deadlines and reports how late it woke, then
+// stalls to check that catching up is capped and that game time picks up
+// again from the present rather than from where it fell behind.
+void TestFramePacer()
+{
+  for (int spin=0; spin < 2; ++spin)
+  {
+    Pacer pacer;
+    Pacer_Init(&pacer, PACE_TEST_RATE, 0, PACE_TEST_CATCH_UP);
+    pacer.spin = spin;
+    int phasesOk = 1;
+    while (pacer.ticksRun < PACE_TEST_TICKS)
+    {
+      Pacer_SleepUntil(&pacer, Pacer_NextTick(&pacer));
+      Pacer_TicksDue(&pacer);
+      int phase = Pacer_Phase(&pacer, PHASE_GRAIN);
+      phasesOk &= phase >= 0 && phase <= PHASE_GRAIN;
+    }
+    Pacer_Print(&pacer, spin ? "Pace: Spin" : "Pace: Sleep");
+    CheckPace(phasesOk, "Phase in range");
+  }
+  Pacer pacer;
+  Pacer_Init(&pacer, PACE_TEST_RATE, 0, PACE_TEST_CATCH_UP);
+  Pacer_SleepUntil(&pacer, Pacer_NextTick(&pacer));
+  CheckPace(Pacer_TicksDue(&pacer) == 1, "First tick");
+  // Long enough for several times the catch-up limit to come due.
+  SDL_Delay(4 * PACE_TEST_CATCH_UP * 1000 / PACE_TEST_RATE);
+  CheckPace(Pacer_TicksDue(&pacer) == PACE_TEST_CATCH_UP && pacer.ticksDropped > 0,
+      "Catch-up capped");
+  CheckPace(Pacer_NextTick(&pacer) > SDL_GetPerformanceCounter() - pacer.frequency / PACE_TEST_RATE,
+      "Resumes from now");
+  CheckPace(Pacer_TicksDue(&pacer) <= 1, "No second burst");
+  // The pacer's histograms should give the exact percentiles, or up to an
+  // eighth more, over durations spread across many powers of two.
+  TimeSamples exact = { 0 };
+  TimeHistogram histogram;
+  memset(&histogram, 0, sizeof(histogram));
+  for (int i=0; i < 10000; ++i)
+  {
+    Uint64 duration = (Uint64)rand() << (rand() % 32);
+    TimeSamples_Add(&exact, duration);
+    TimeHistogram_Add(&histogram, duration);
+  }
+  int histogramOk = histogram.max == TimeSamples_Percentile(&exact, 100);
+  for (int percent=0; percent <= 100; ++percent)
+  {
+    Uint64 want = TimeSamples_Percentile(&exact, percent),
+           got = TimeHistogram_Percentile(&histogram, percent);
+    histogramOk &= got >= want && got - want <= want / 8;
+  }
+  CheckPace(histogramOk, "Histogram percentiles");
+  TimeSamples_Free(&exact);
+}
+
+// Runs the test named on the command line, or all of them.
+static int ShouldRun(int argc, char** argv, const char* testName)
+{
+  return argc < 2 || !strcmp(argv[1], testName);
+}
+
 int main(int argc, char** argv)
 {
   assert(RAND_MAX > RANDOM_RANGE);
   srand(1);
-  TestDistanceFunctions();
-  return 0;
+  if (ShouldRun(argc, argv, "dist")) TestDistanceFunctions();
+  if (ShouldRun(argc, argv, "sqrt")) TestIntSqrt();
+  if (ShouldRun(argc, argv, "gid")) TestGidResolution();
+  if (ShouldRun(argc, argv, "layout")) TestCellLayouts();
+  if (ShouldRun(argc, argv, "light")) TestLighting();
+  if (ShouldRun(argc, argv, "grid")) TestSpatialGrid();
+  if (ShouldRun(argc, argv, "entity")) TestEntityStore();
+  if (ShouldRun(argc, argv, "path")) TestPathfinding();
+  if (ShouldRun(argc, argv, "job")) TestJobSystem();
+  if (ShouldRun(argc, argv, "bundle")) TestAssetBundle();
+  if (ShouldRun(argc, argv, "loader")) TestAssetLoader();
+  if (ShouldRun(argc, argv, "csv")) TestCsvParser();
+  if (ShouldRun(argc, argv, "tmx")) TestTmxConversion();
+  if (ShouldRun(argc, argv, "rlz")) TestMapCompression();
+  if (ShouldRun(argc, argv, "pace")) TestFramePacer();
+  return distFailures || sqrtFailures || lightFailures || pathFailures || jobFailures
+    || bundleFailures || loaderFailures || csvFailures || tmxFailures
+    || rlzFailures || paceFailures || entityFailures
+    || gridFailures || gidFailures || layoutFailures ? 1 : 0;
 }
 
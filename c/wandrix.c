@@ -7,8 +7,14 @@ const char* WINDOW_NAME = "Wandrix";
 const int SCREEN_W = 800, SCREEN_H = 600;
 const Uint32 LOGIC_FRAMES_PER_SEC = 20; // fixed rate
 const int MIN_FRAME_RATE_CAP = 30;
+const int MAX_CATCH_UP_TICKS = 4; // logic ticks in one frame before game time slows down
 const char* MAP_MASTER_FILENAME = "map_master.txt";
-#define NPC_COUNT 128
+const size_t MAP_CHUNK_BUDGET = 8 << 20; // bytes of map chunks kept resident
+const size_t MAP_TEXTURE_BUDGET = 32 << 20; // bytes of pre-rendered map in video memory
+const Uint32 PATH_BUDGET_US = 2000; // pathfinding time per logic frame
+const Uint32 UPLOAD_BUDGET_US = 1000; // texture making per frame, for images loaded in the background
+const int BENCH_FRAMES_PER_TICK = 3; // 60 FPS at the logic rate
+const char* BUNDLE_FILENAME = "assets.wtb"; // decoded images (see bundle.c)
 
 // Keep track of some keydown events that need to be combined with scan handling.
 Uint32 keypresses;
@@ -19,9 +25,27 @@ const Uint32
   KEY_RIGHT = 0x08;
 
 static int frameRateCap;
+static int frameRateOverride = -1; // from -fps, or -1 to go by the display
+static int spinWait = 0; // wait for frames by spinning, as the old loop did
 static int quitting = 0;
+static int jobThreads = 0; // 0 for one per core
+static int headless = 0; // no window: just run the logic
+static int fastForward = 0; // headless ticks as fast as possible
+static Uint32 maxTicks = 0; // headless ticks to run, or 0 for no limit
+static int benchmark = 0; // replay the script on a fixed timeline, timing frames
+static int useAtlas = 1; // pack images into shared textures (see atlas.c)
+static int useBundle = 1; // load images from the bundle when it has them
+static int makeBundle = 0; // write the images loaded to the bundle, then quit
+static const char* scriptFilename = 0;
+static InputScript* script = 0;
+static struct Coords scriptMove; // keys held this tick, by the script
+static const char* recordFilename = 0;
+static InputScript* recording = 0;
+static Uint32 logicTick = 0;
 
 TiledMap* tiledMap = 0;
+EntityStore* npcs = 0;
+SpatialGrid* npcGrid = 0; // NPC handle indexes by position
 
 struct Player player = {
   { .name = "Player", .img = { .path = "testimg/swordguy1.png" },
@@ -30,48 +54,83 @@ struct Player player = {
   }
 };
 
-struct Npc npcs[NPC_COUNT] = {
-  { .c = { .name = "Kit", .img = { .path = "testimg/ckclose32.png" }, .pos = {128,128}, } },
-  { .c = { .name = "Daisy", .img = { .path = "testimg/daisy32.png" }, .pos = {96,64}, } },
-  { .c = { .name = "Cindy", .img = { .path = "testimg/cstar32.png" }, .pos = {64,96}, } },
-  { .c = { .name = "Desix", .img = { .path = "testimg/desix32.png" }, .pos = {96,96}, } },
+struct NpcDef {
+  const char* name; const char* imagePath; struct Coords pos; int hp;
+};
+static const struct NpcDef NPC_DEFS[] = {
+  { "Kit", "testimg/ckclose32.png", {128,128}, 0 },
+  { "Daisy", "testimg/daisy32.png", {96,64}, 0 },
+  { "Cindy", "testimg/cstar32.png", {64,96}, 0 },
+  { "Desix", "testimg/desix32.png", {96,96}, 0 },
 };
 
 void AtExitHandler()
 {
-  DestroyDisplay();
+  Loader_Destroy();
+  if (!headless)
+    DestroyDisplay();
+  Bundle_Close();
+  InputScript_Destroy(script);
+  InputScript_Destroy(recording);
+  Job_Destroy();
+  Path_Destroy();
   SDL_Quit();
 }
 
+// Headless, SDL video is never started, so there's no window, renderer or
+// textures; images are loaded as surfaces only.
 int Init()
 {
-  if(SDL_Init(SDL_INIT_VIDEO) < 0)
+  // Benchmarks draw offscreen, unless SDL_VIDEODRIVER says otherwise.
+  if (benchmark)
+    SDL_SetHint(SDL_HINT_VIDEODRIVER, "dummy");
+  if(SDL_Init(headless ? SDL_INIT_TIMER : SDL_INIT_VIDEO) < 0)
   {
     fprintf(stderr, "SDL init failed: %s\n", SDL_GetError());
     return 0;
   }
   if (!InitImage()) return 0;
-  InitDisplay(WINDOW_NAME, SCREEN_W, SCREEN_H, MIN_FRAME_RATE_CAP, &frameRateCap);
+  if (!Job_Init(jobThreads)) return 0;
+  if (!Loader_Init()) return 0;
+  if (!headless
+      && !InitDisplay(WINDOW_NAME, SCREEN_W, SCREEN_H, MIN_FRAME_RATE_CAP, &frameRateCap))
+    return 0;
+  if (frameRateOverride >= 0)
+    frameRateCap = frameRateOverride;
+  if (!headless && useAtlas)
+    Atlas_Begin();
+  Sint64 size, modified;
+  if (makeBundle)
+    Bundle_BeginRecording();
+  else if (useBundle && GetFileStamp(BUNDLE_FILENAME, &size, &modified))
+    Bundle_Open(BUNDLE_FILENAME); // the images are decoded if this fails
   atexit(AtExitHandler);
+  if (scriptFilename && !(script = InputScript_Load(scriptFilename))) return 0;
+  if (recordFilename)
+    recording = InputScript_Create();
   tiledMap = TiledMap_Load("map.wtm");
   if (!tiledMap) return 0;
-  if (!InitTileCache(tiledMap)) return 0;
+  TiledMap_SetChunkBudget(tiledMap, MAP_CHUNK_BUDGET);
+  if (!headless)
+  {
+    SetRenderChunkBudget(MAP_TEXTURE_BUDGET);
+    if (!InitTileCache(tiledMap)) return 0;
+  }
+  Path_Init(tiledMap, 0);
   return 1;
 }
 
 int LoadNpcs()
 {
-  for (int i=0; i < NPC_COUNT; ++i)
+  npcGrid = SpatialGrid_Create(tiledMap->width, tiledMap->height,
+      tiledMap->tileWidth, tiledMap->tileHeight);
+  npcs = EntityStore_Create(0, npcGrid);
+  int nDefs = sizeof(NPC_DEFS) / sizeof(NPC_DEFS[0]);
+  for (int i=0; i < nDefs; ++i)
   {
-    if (npcs[i].c.img.path)
-    {
-      npcs[i].id = i;
-      if (!LoadImage(&npcs[i].c.img, 1))
-      {
-        fprintf(stderr, "Unable to load NPC image.\n");
-        return 0;
-      }
-    }
+    const struct NpcDef* def = &NPC_DEFS[i];
+    int sprite = EntityStore_AddSprite(npcs, def->imagePath);
+    EntityStore_Spawn(npcs, def->name, sprite, def->pos, def->hp);
   }
   return 1;
 }
@@ -84,6 +143,14 @@ int LoadAssets()
     return 0;
   }
   if (!LoadNpcs()) return 0;
+  // The NPC images were loading in the background all along. Wait for them
+  // here, so that they go in the atlas; ones that failed show placeholders.
+  Loader_Finish();
+  Loader_Upload(0);
+  if (!Atlas_Build()) return 0;
+  if (!TiledMap_PlaceTilesets(tiledMap)) return 0;
+  Atlas_Place(&player.c.img);
+  EntityStore_PlaceSprites(npcs);
   return 1;
 }
 
@@ -102,39 +169,69 @@ struct Coords ScanMoveKeys()
   return move;
 }
 
+// The arrow keys held this tick, from the script if there is one.
+struct Coords ReadMoveInput()
+{
+  struct Coords move = {0,0};
+  if (script)
+    move = scriptMove;
+  else if (!headless)
+    move = ScanMoveKeys();
+  if (recording)
+    InputScript_RecordMove(recording, logicTick, move);
+  return move;
+}
+
 int DetectPlayerCollision()
 {
   struct Coords playerMovedPos = Coords_Add(player.c.pos, player.c.mov);
   SDL_Rect playerRect = Rect_Combine(playerMovedPos, CharBase_GetSize(&player.c));
-  for (int i=0; i < NPC_COUNT; ++i)
-  {
-    if (npcs[i].id)
-    {
-      SDL_Rect npcRect = CharBase_GetRect(&npcs[i].c);
-      SDL_Rect intersectRect;
-      //printf("INTERSECT: PC=(%d,%d,%d,%d) NPC=(%d,%d,%d,%d)\n",
-      //    playerRect.x, playerRect.y, playerRect.w, playerRect.h,
-      //    npcRect.x, npcRect.y, npcRect.w, npcRect.h);
-      int collide = (SDL_TRUE == SDL_IntersectRect(&playerRect, &npcRect, &intersectRect));
-      if (collide) return npcs[i].id;
-    }
-  }
+  int npcIndex;
+  if (SpatialGrid_QueryRect(npcGrid, &playerRect, &npcIndex, 1))
+    return EntityStore_Handle(npcs, npcs->indexSlot[npcIndex]);
   return 0;
 }
 
+// True if the player's move would take them into an obstacle.
+int DetectTileCollision()
+{
+  struct Coords playerMovedPos = Coords_Add(player.c.pos, player.c.mov);
+  SDL_Rect playerRect = Rect_Combine(playerMovedPos, CharBase_GetSize(&player.c));
+  return TiledMap_RectHitsObstacle(tiledMap, &playerRect);
+}
+
 void UpdateLogic()
 {
   struct Coords noMove = {0,0};
   // Apply previous move.
   player.c.pos = Coords_Add(player.c.pos, player.c.mov);
+  EntityStore_ApplyMoves(npcs);
+  // Sprites that failed to load in time for the atlas may have arrived.
+  EntityStore_PlaceSprites(npcs);
+  // Resolve queued path requests.
+  Path_Update(PATH_BUDGET_US);
   // Get next move. (We need it now to interpolate.)
-  player.c.mov = ScanMoveKeys();
+  player.c.mov = ReadMoveInput();
   player.c.mov = Coords_Scale(8, player.c.mov);
   // Cancel move if invalid.
-  if (DetectPlayerCollision())
+  if (DetectPlayerCollision() || DetectTileCollision())
     player.c.mov = noMove;
   // Reset keypress monitor.
   keypresses = 0;
+  ++logicTick;
+}
+
+// Runs the next logic tick, unless the script quits first. Returns 0 if it
+// does.
+int RunLogicTick()
+{
+  if (script && !InputScript_Next(script, logicTick, &scriptMove))
+  {
+    quitting = 1;
+    return 0;
+  }
+  UpdateLogic();
+  return 1;
 }
 
 int printLight = 1;
@@ -147,6 +244,7 @@ void HandleKeypress(SDL_KeyboardEvent* e)
     case SDLK_q: quitting = 1; break;
     case SDLK_p: printf("PLAYER: (%d,%d)\n", player.c.pos.x, player.c.pos.y); break;
     case SDLK_l: printLight = 1; break;
+    case SDLK_c: PrintTileCacheStats(); PrintRenderStats(); Loader_PrintStats(); break;
     case SDLK_UP: keypresses |= KEY_UP; break;
     case SDLK_DOWN: keypresses |= KEY_DOWN; break;
     case SDLK_LEFT: keypresses |= KEY_LEFT; break;
@@ -174,72 +272,194 @@ void PollEvents()
       HandleKeypress(&e.key);
     if (e.type == SDL_MOUSEBUTTONDOWN)
       HandleMouseClick(&e.button);
+    if (e.type == SDL_RENDER_TARGETS_RESET)
+      InvalidateRenderChunks();
   }
 }
 
+// Runs the logic at the fixed rate and draws between ticks, sleeping until
+// the next is due when the frame rate is capped (see pace.c).
 int MainLoop()
 {
-  Uint32 startTime = SDL_GetTicks(),
-         nextLogicFrameTime = 0,
-         nextRenderFrame = 0,
-         nextSecond = 0,
-         logicFrameDurationMs = 1000 / LOGIC_FRAMES_PER_SEC,
-         logicFramesCount = 0,
-         renderFrameDurationMs = frameRateCap > 0 ? 1000 / frameRateCap : 0,
-         renderFramesCount = 0;
+  Pacer pacer;
+  Pacer_Init(&pacer, LOGIC_FRAMES_PER_SEC, frameRateCap, MAX_CATCH_UP_TICKS);
+  pacer.spin = spinWait;
   fflush(stdout); // flush output from the init process
   while (!quitting)
   {
-    // TODO: Reset frame times once per second to prevent rounding
-    // error from accumulating.
-    Uint32 time = SDL_GetTicks() - startTime;
     PollEvents();
-    if (nextLogicFrameTime > time)
-      SDL_Delay(0); // Be a little nice with the CPU when ahead of schedule.
-    while (nextSecond < time)
+    for (int due = Pacer_TicksDue(&pacer); due > 0; --due)
+      if (!RunLogicTick())
+        break;
+    if (Pacer_FrameDue(&pacer))
     {
-      nextSecond += 1000;
-      //printf("FPS: LOGIC=%d, RENDER=%d\n", logicFramesCount, renderFramesCount);
-      logicFramesCount = renderFramesCount = 0;
+      Loader_Upload(UPLOAD_BUDGET_US);
+      Draw(Pacer_Phase(&pacer, PHASE_GRAIN), tiledMap, &player, npcs);
+      Pacer_EndFrame(&pacer);
     }
-    while (nextLogicFrameTime < time)
-    {
-      nextLogicFrameTime += logicFrameDurationMs;
-      ++logicFramesCount;
-      UpdateLogic();
-    }
-    int draw = 0;
-    if (frameRateCap == 0)
+    Pacer_Wait(&pacer);
+  }
+  Pacer_Print(&pacer, "PACER");
+  return 1;
+}
+
+// Runs the logic with no display, either at the fixed rate or as fast as it
+// will go, until the script quits or maxTicks have run. Reports the rate.
+int HeadlessLoop()
+{
+  Uint64 frequency = SDL_GetPerformanceFrequency();
+  Uint64 startTime = SDL_GetPerformanceCounter(),
+         logicTime = 0,
+         maxLogicTime = 0;
+  Uint32 ticks = 0;
+  Pacer pacer;
+  Pacer_Init(&pacer, LOGIC_FRAMES_PER_SEC, 0, MAX_CATCH_UP_TICKS);
+  pacer.spin = spinWait;
+  fflush(stdout); // flush output from the init process
+  while (!quitting && (maxTicks == 0 || ticks < maxTicks))
+  {
+    int due = 1;
+    if (!fastForward)
     {
-      ++renderFramesCount;
-      draw = 1;
+      Pacer_SleepUntil(&pacer, Pacer_NextTick(&pacer));
+      due = Pacer_TicksDue(&pacer);
     }
-    else
+    for (; due > 0 && (maxTicks == 0 || ticks < maxTicks); --due)
     {
-      while (nextRenderFrame < time)
-      {
-        nextRenderFrame += renderFrameDurationMs;
-        ++renderFramesCount;
-        draw = 1;
-      }
+      Uint64 time = SDL_GetPerformanceCounter();
+      if (!RunLogicTick())
+        break;
+      Uint64 elapsed = SDL_GetPerformanceCounter() - time;
+      logicTime += elapsed;
+      if (elapsed > maxLogicTime)
+        maxLogicTime = elapsed;
+      ++ticks;
+      // Without a renderer, this only hands out images as they're decoded.
+      Loader_Upload(0);
     }
-    if (draw)
+  }
+  if (!fastForward)
+    Pacer_Print(&pacer, "PACER");
+  double seconds = (double)(SDL_GetPerformanceCounter() - startTime) / frequency;
+  double usPerCount = 1e6 / frequency;
+  printf("HEADLESS: TICKS=%u, SECONDS=%.3f, TICKS/SEC=%.1f, LOGIC AVG=%.1fus, MAX=%.1fus\n",
+      ticks, seconds, seconds > 0 ? ticks / seconds : 0,
+      ticks ? logicTime * usPerCount / ticks : 0, maxLogicTime * usPerCount);
+  printf("PLAYER: (%d,%d)\n", player.c.pos.x, player.c.pos.y);
+  return 1;
+}
+
+// Replays the script on a fixed timeline rather than the clock, drawing
+// BENCH_FRAMES_PER_TICK frames at evenly spaced phases after each logic
+// tick, and reports the spread of Draw and UpdateLogic times.
+int BenchLoop()
+{
+  TimeSamples logicTimes = { 0 }, drawTimes = { 0 };
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  fflush(stdout); // flush output from the init process
+  while (!quitting)
+  {
+    Uint64 time = SDL_GetPerformanceCounter();
+    if (!RunLogicTick())
+      break;
+    TimeSamples_Add(&logicTimes, SDL_GetPerformanceCounter() - time);
+    for (int frame=0; frame < BENCH_FRAMES_PER_TICK; ++frame)
     {
-      int phase = PHASE_GRAIN - (nextLogicFrameTime - time) * PHASE_GRAIN / logicFrameDurationMs;
-      assert(phase >= 0);
-      assert(phase <= PHASE_GRAIN);
-      //printf("PHASE: %d\n", phase);
-      Draw(phase, tiledMap, &player, npcs, NPC_COUNT);
+      int phase = frame * PHASE_GRAIN / BENCH_FRAMES_PER_TICK;
+      time = SDL_GetPerformanceCounter();
+      Loader_Upload(UPLOAD_BUDGET_US);
+      Draw(phase, tiledMap, &player, npcs);
+      TimeSamples_Add(&drawTimes, SDL_GetPerformanceCounter() - time);
     }
   }
+  double seconds = (double)(SDL_GetPerformanceCounter() - startTime)
+    / SDL_GetPerformanceFrequency();
+  printf("BENCH: SCRIPT=%s, TICKS=%u, FRAMES=%d, SECONDS=%.3f\n",
+      scriptFilename, logicTick, drawTimes.count, seconds);
+  TimeSamples_Print(&logicTimes, "BENCH: UPDATELOGIC");
+  TimeSamples_Print(&drawTimes, "BENCH: DRAW");
+  PrintRenderStats();
+  Loader_PrintStats();
+  printf("PLAYER: (%d,%d)\n", player.c.pos.x, player.c.pos.y);
+  TimeSamples_Free(&logicTimes);
+  TimeSamples_Free(&drawTimes);
   return 1;
 }
 
-#pragma GCC diagnostic ignored "-Wunused-parameter"
+// Options:
+//   -threads N        job threads, counting the main thread (default: one per core)
+//   -deterministic    split jobs the same way whatever the thread count
+//   -headless         run the logic only, with no window
+//   -fast             headless, tick as fast as possible instead of at the fixed rate
+//   -ticks N          headless, stop after N ticks
+//   -fps N            cap the frame rate at N instead of going by the display (0: no cap)
+//   -spin             wait for frames and ticks by spinning rather than sleeping
+//   -script FILE      take input from a script (see script.c), deterministically
+//   -record FILE      save the input to a script on exit
+//   -bench            replay the script offscreen as fast as possible, timing frames
+//   -noatlas          give every image its own texture
+//   -nobundle         decode every image instead of using the asset bundle
+//   -makebundle       decode the images and write the asset bundle, then quit
 int WandrixMain(int argc, char** argv)
 {
+  for (int i=1; i < argc; ++i)
+  {
+    if (!strcmp(argv[i], "-deterministic"))
+      Job_SetDeterministic(1);
+    else if (!strcmp(argv[i], "-threads") && i + 1 < argc)
+      jobThreads = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-headless"))
+      headless = 1;
+    else if (!strcmp(argv[i], "-fast"))
+      fastForward = 1;
+    else if (!strcmp(argv[i], "-ticks") && i + 1 < argc)
+      maxTicks = strtoul(argv[++i], 0, 10);
+    else if (!strcmp(argv[i], "-fps") && i + 1 < argc)
+      frameRateOverride = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "-spin"))
+      spinWait = 1;
+    else if (!strcmp(argv[i], "-script") && i + 1 < argc)
+      scriptFilename = argv[++i];
+    else if (!strcmp(argv[i], "-record") && i + 1 < argc)
+      recordFilename = argv[++i];
+    else if (!strcmp(argv[i], "-bench"))
+      benchmark = 1;
+    else if (!strcmp(argv[i], "-noatlas"))
+      useAtlas = 0;
+    else if (!strcmp(argv[i], "-nobundle"))
+      useBundle = 0;
+    else if (!strcmp(argv[i], "-makebundle"))
+      makeBundle = 1;
+    else
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+  }
+  if (benchmark && (headless || !scriptFilename))
+  {
+    fprintf(stderr, "A benchmark needs a script to replay, and draws.\n");
+    return 1;
+  }
+  // Replays have to come out the same as the recording.
+  if (scriptFilename)
+    Job_SetDeterministic(1);
   printf("STARTED\n");
-  int success = Init() && LoadAssets() && MainLoop();
+  Uint64 startTime = SDL_GetPerformanceCounter();
+  int success = Init() && LoadAssets();
+  if (success)
+  {
+    BundleStats bundleStats = Bundle_GetStats();
+    printf("STARTUP: SECONDS=%.3f, BUNDLED=%d, DECODED=%d, STALE=%d\n",
+        (double)(SDL_GetPerformanceCounter() - startTime) / SDL_GetPerformanceFrequency(),
+        bundleStats.loaded, bundleStats.missed, bundleStats.stale);
+  }
+  if (success && makeBundle)
+    success = Bundle_Write(BUNDLE_FILENAME, GetPreferredTextureFormat());
+  else if (success)
+    success = benchmark ? BenchLoop() : headless ? HeadlessLoop() : MainLoop();
+  if (recording)
+  {
+    InputScript_RecordQuit(recording, logicTick);
+    success = InputScript_Save(recording, recordFilename) && success;
+  }
   printf("FINISHED\n");
   return !success;
 }
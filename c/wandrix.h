@@ -13,17 +13,53 @@ typedef struct Coords { int x, y; } Coords;
 struct Size { int w, h; };
 struct Image { 
   const char* path; SDL_Surface* sfc; SDL_Texture* tex;
+  int texX, texY; // where the image starts within tex (see atlas.c)
+  int loadTicket; // while loading in the background (see loader.c)
 };
+// Size of what's drawn for an image that hasn't loaded yet.
+#define PLACEHOLDER_SIZE 32
 struct CharBase {
   const char* name; struct Image img; struct Coords pos, mov; int hpCur, hpMax;
 };
 struct Player {
   struct CharBase c;
 };
-struct Npc {
-  int id; // set to 0 if this slot is empty
-  struct CharBase c;
-};
+
+// Uniform grid indexing characters by map position (see grid.c).
+typedef struct SpatialGrid {
+  int cols, rows, cellW, cellH;
+  int* cellHeads; // first item filed in each cell, or -1
+  // Per item: the cell list links, the cell it's filed in (-1 if it's not
+  // in the grid) and its rectangle on the map.
+  int *next, *prev, *itemCell;
+  SDL_Rect* rects;
+  int capacity, nItems;
+  int maxItemW, maxItemH;
+} SpatialGrid;
+
+// Handle to an entity: an index into the store's handle table in the low
+// bits and a generation in the high bits. 0 is never a valid handle.
+typedef Uint32 Entity;
+// Entities (NPCs) in structure-of-arrays form (see entity.c). Slots 0 to
+// count-1 hold live entities.
+typedef struct EntityStore {
+  int count, capacity;
+  // Components, by slot.
+  Sint32 *posX, *posY, *movX, *movY;
+  Sint32 *hpCur, *hpMax;
+  Uint16* sprite; // index into sprites
+  const char** name;
+  int* slotIndex; // handle index of the entity in each slot
+  // Handle table, by handle index: the entity's slot (or the next free
+  // index) and the current generation.
+  int* indexSlot;
+  Uint32* generation;
+  int freeIndex; // -1 if none
+  struct Image* sprites;
+  Uint8* spritePlaced; // by sprite: loaded, and its entities' rects resized
+  int nSprites;
+  SpatialGrid* grid; // kept up to date with positions if not 0
+} EntityStore;
 
 struct TextFile {
   int nLines;
@@ -33,10 +69,68 @@ struct IntGrid {
   Uint16 rows, cols;
   Sint16* cells;
 };
+// Durations in performance counter units, for percentiles.
+typedef struct TimeSamples {
+  Uint64* samples;
+  int count, capacity;
+  int sorted;
+} TimeSamples;
+// Eighths of a power of two, so a histogram bucket is at most an eighth
+// wider than the durations it starts at.
+#define TIME_HISTOGRAM_SUBBITS 3
+#define TIME_HISTOGRAM_BUCKETS ((64 - TIME_HISTOGRAM_SUBBITS + 1) << TIME_HISTOGRAM_SUBBITS)
+// Durations in performance counter units counted in log-spaced buckets, for
+// percentiles from runs of any length in a fixed size.
+typedef struct TimeHistogram {
+  Uint32 counts[TIME_HISTOGRAM_BUCKETS];
+  Uint32 count;
+  Uint64 max;
+} TimeHistogram;
+// Keeps the logic ticking at a fixed rate and frames at a capped one (see
+// pace.c). Times are in performance counter units.
+typedef struct Pacer {
+  Uint64 frequency;
+  Uint32 tickRate, frameRate; // per second; frameRate 0 for uncapped
+  int maxCatchUp; // ticks run in one go before game time slows down
+  int spin; // wait by spinning rather than sleeping, as the old loop did
+  Uint64 origin; // when the first tick was due
+  Uint32 tickSlot, framesDrawn; // deadlines are counted from the origin
+  Uint32 frameSlot, ticksRun, ticksDropped;
+  int mostCaughtUp;
+  double sleepMean, sleepVariance; // how long SDL_Delay(1) really takes
+  Uint64 asleep, frameStart, lastFrame;
+  long cpuStart;
+  TimeHistogram frameTimes, frameLateness, tickLateness;
+} Pacer;
+// A piece of an XML document, which is not null-terminated (see xml.c).
+typedef struct XmlSlice {
+  const char* text;
+  size_t len;
+} XmlSlice;
+#define XML_MAX_DEPTH 64
+enum { XML_START, XML_END, XML_TEXT, XML_EOF, XML_ERROR };
+typedef struct XmlParser {
+  const char* xml;
+  size_t len, pos;
+  int event; // the last one returned by Xml_Next
+  XmlSlice name; // of the element started or ended
+  XmlSlice attributes; // of the element started
+  XmlSlice text;
+  const char* error;
+  int selfClosing;
+  int depth;
+  XmlSlice open[XML_MAX_DEPTH]; // names of the elements we're inside
+} XmlParser;
+
+// Opacity at which a tile blocks light completely.
+#define MAX_TILE_OPACITY 7
+// Brightness of unobstructed light.
+#define MAX_LIGHT 0xFF
 
 enum {
   TILE_PROP_OPACITY = 0,
-  TILE_PROP_OBSTACLE
+  TILE_PROP_OBSTACLE,
+  TILE_PROP_COUNT
 };
 
 typedef Sint8 TiledProperty;
@@ -57,10 +151,52 @@ typedef struct TiledTilesetRef {
   Sint32 firstGid;
   TiledTileset* tileset;
 } TiledTilesetRef;
+struct TiledMap;
+struct TiledChunk;
+// Fills in a chunk's cells from wherever the map keeps them.
+typedef int (*TiledChunkLoader)(struct TiledMap* map, struct TiledChunk* chunk);
+typedef struct TiledChunk {
+  Sint32 col, row; // position in chunks, not tiles
+  Sint16* gids; // first cell of the chunk in layer 0's plane
+  size_t bytes; // memory owned by this chunk (0 if it points into the map)
+  Uint32 lastUsed; // streaming clock value when last touched
+  // Planes derived from the tile properties of all layers when the chunk is
+  // loaded: one obstacle bit per cell (the map's obstacleStride words per
+  // row), and an opacity nibble per cell, even x in the low nibble (its
+  // opacityStride bytes per row). The nibble is the opacity that dims light
+  // about as much as passing through every layer in turn (see
+  // OpacityForBrightness).
+  Uint64* obstacleBits;
+  Uint8* opacityNibbles;
+} TiledChunk;
 typedef struct TiledMap {
   Sint32 width, height, tileWidth, tileHeight, nTilesets, nLayers;
   TiledTilesetRef* tilesetRefs;
-  TiledTile** layerTiles;
+  // Dense per-GID tables. Index 0 and GIDs no tileset covers are empty.
+  TiledTile** gidTiles;
+  SDL_Texture** gidTex;
+  SDL_Point* gidAtlasPos; // position of the tile in its texture
+  TiledProperty* gidProps; // nTileProperties per GID
+  Sint32 nGids, nTileProperties;
+  // Cells are GIDs, stored as one plane per layer. Within a chunk, the next
+  // cell down is cellRowStride entries on, and the same cell in the next
+  // layer is cellLayerStride entries on.
+  Sint32 cellRowStride, cellLayerStride;
+  Sint16* cells; // planes for the whole map for old-format files, otherwise 0
+  void* mappedFile; // native-format files are mapped and used in place
+  size_t mappedFileLen;
+  // Chunk layer. All cell access goes through here.
+  Sint32 chunkSize, chunkShift, chunkCols, chunkRows;
+  TiledChunk** chunks; // chunkCols * chunkRows; 0 where not resident
+  TiledChunk** residentChunks;
+  int nResidentChunks;
+  size_t residentBytes, chunkBudget;
+  Uint32 chunkClock;
+  TiledChunkLoader loadChunk;
+  SDL_RWops* chunkSource;
+  Sint64 chunkDataOffset;
+  // Row strides of each chunk's derived planes.
+  Sint32 obstacleStride, opacityStride;
 } TiledMap;
 
 #define Rect_UNPACK(SDL_RECT_PTR) \
@@ -76,6 +212,22 @@ int Coords_SimpleApproxDist(struct Coords point1, struct Coords point2);
 int Coords_ApproxDist(struct Coords point1, struct Coords point2);
 int Coords_ExactDist(struct Coords point1, struct Coords point2);
 int Coords_FloatDist(struct Coords point1, struct Coords point2);
+// Batch versions (see dist.c): from origin to each of the points xs[i],ys[i].
+enum { SIMD_SCALAR, SIMD_SSE2, SIMD_AVX2 };
+int Simd_Limit(int level);
+int Coords_SetBatchSimd(int level);
+int Coords_GetBatchSimd();
+const char* Coords_BatchSimdName(int level);
+void Coords_BatchSimpleApproxDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out);
+void Coords_BatchApproxDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out);
+void Coords_BatchExactDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out);
+void Coords_BatchFloatDist(struct Coords origin,
+    const Sint32* xs, const Sint32* ys, int n, Sint32* out);
+int Coords_BatchWithinRadius(struct Coords origin, const Sint32* xs, const Sint32* ys,
+    int n, int radius, int* indexes);
 struct SDL_Rect Rect_Combine(struct Coords c, struct Size s);
 SDL_Rect CharBase_GetRect(struct CharBase* c);
 struct Size CharBase_GetSize(struct CharBase* c);
@@ -83,29 +235,289 @@ const char* Rect_ToString(SDL_Rect* r, char* buf);
 
 void* MallocOrDie(size_t size);
 int ReadBinFile(const char* filename, char** filePtr, long* fileLen);
+void* MapFile(const char* filename, size_t* fileLen);
+void UnmapFile(void* data, size_t fileLen);
+int GetFileStamp(const char* filename, Sint64* size, Sint64* modified);
 struct TextFile* ReadTextFile(const char* filename);
 void FreeTextFile(struct TextFile* lines);
+// CSV grids (see csv.c).
+int Csv_SetSimd(int level);
+int Csv_GetSimd();
+struct IntGrid* Csv_ParseGrid(const char* text, size_t len, int nRows, int nCols,
+    const char* name);
 struct IntGrid* ReadGridFile(const char* filename, int nRows, int nCols);
 void FreeIntGrid(struct IntGrid* grid);
+// XML pull parsing (see xml.c).
+void Xml_Init(XmlParser* p, const char* xml, size_t len);
+int Xml_Next(XmlParser* p);
+int Xml_Line(XmlParser* p);
+int Xml_Attribute(XmlParser* p, const char* name, XmlSlice* value);
+int Xml_SliceIs(XmlSlice slice, const char* str);
+int Xml_SliceToInt(XmlSlice slice, long* value);
+int Xml_Unescape(XmlSlice slice, char* buf, size_t size);
+// Streaming decompression (see inflate.c). A reader returns 0 at the end of
+// the input; a writer returns 0 to stop.
+enum { INFLATE_RAW, INFLATE_ZLIB, INFLATE_GZIP };
+typedef size_t (*InflateReader)(void* data, Uint8* buf, size_t size);
+typedef int (*InflateWriter)(void* data, const Uint8* bytes, size_t n);
+Sint64 Inflate(int format, InflateReader read, InflateWriter write, void* data);
+size_t Rlz_Bound(size_t nCells);
+size_t Rlz_Compress(const Sint16* cells, size_t nCells, size_t rowLength, Uint8* out);
+int Rlz_Decompress(const Uint8* packed, size_t len, Sint16* cells, size_t nCells);
+
+void TimeSamples_Add(TimeSamples* times, Uint64 duration);
+Uint64 TimeSamples_Percentile(TimeSamples* times, int percent);
+void TimeSamples_Print(TimeSamples* times, const char* name);
+void TimeSamples_Free(TimeSamples* times);
+void TimeHistogram_Add(TimeHistogram* times, Uint64 duration);
+Uint64 TimeHistogram_Percentile(TimeHistogram* times, int percent);
+void TimeHistogram_Print(TimeHistogram* times, const char* name);
+void Pacer_Init(Pacer* pacer, Uint32 tickRate, Uint32 frameRate, int maxCatchUp);
+int Pacer_TicksDue(Pacer* pacer);
+int Pacer_Phase(Pacer* pacer, int grain);
+Uint64 Pacer_NextTick(Pacer* pacer);
+int Pacer_FrameDue(Pacer* pacer);
+void Pacer_EndFrame(Pacer* pacer);
+void Pacer_SleepUntil(Pacer* pacer, Uint64 deadline);
+void Pacer_Wait(Pacer* pacer);
+void Pacer_Print(Pacer* pacer, const char* name);
 
 Sint32 ParseInt32(const char* str);
 Sint16 ParseInt16(const char* str);
 
 Sint32 SignExtend(Sint32 n);
+int IntSqrt(int n);
 int Abs(int n);
 int SigNum(int n);
 
+SpatialGrid* SpatialGrid_Create(int cols, int rows, int cellW, int cellH);
+void SpatialGrid_Destroy(SpatialGrid* grid);
+void SpatialGrid_Insert(SpatialGrid* grid, int item, SDL_Rect* rect);
+void SpatialGrid_Remove(SpatialGrid* grid, int item);
+void SpatialGrid_Move(SpatialGrid* grid, int item, struct Coords pos);
+int SpatialGrid_QueryRect(SpatialGrid* grid, SDL_Rect* rect, int* items, int maxItems);
+int SpatialGrid_QueryRadius(SpatialGrid* grid, struct Coords center, int radius,
+    int* items, int maxItems);
+
+EntityStore* EntityStore_Create(int initialCapacity, SpatialGrid* grid);
+void EntityStore_Destroy(EntityStore* store);
+void EntityStore_Reserve(EntityStore* store, int capacity);
+int EntityStore_AddSprite(EntityStore* store, const char* path);
+void EntityStore_PlaceSprites(EntityStore* store);
+Entity EntityStore_Spawn(EntityStore* store, const char* name, int sprite,
+    struct Coords pos, int hp);
+void EntityStore_Despawn(EntityStore* store, Entity e);
+int EntityStore_Slot(EntityStore* store, Entity e);
+Entity EntityStore_Handle(EntityStore* store, int slot);
+SDL_Rect EntityStore_GetRect(EntityStore* store, int slot);
+void EntityStore_ApplyMoves(EntityStore* store);
+int EntityStore_QueryRadius(EntityStore* store, struct Coords center, int radius,
+    int* slots, int maxSlots);
+
 int LoadImage(struct Image* img, int createTexture);
 int InitImage();
 
 TiledMap* TiledMap_Load(const char* filename);
+TiledMap* TiledMap_Create(int width, int height, int nLayers, int tileWidth, int tileHeight);
+int TiledMap_BuildGidTable(TiledMap* map);
+int TiledMap_PlaceTilesets(TiledMap* map);
+// What TiledMap_WriteNative writes: layers[i] holds the GIDs of layer i,
+// row by row.
+typedef struct TiledNativeSpec {
+  int width, height, tileWidth, tileHeight, chunkSize;
+  int nTilesets;
+  const Sint32* firstGids;
+  const char* const* tilesetFilenames;
+  int nLayers;
+  const Sint16* const* layers;
+  int compressed; // pack each chunk on its own, with an index (see rlz.c)
+} TiledNativeSpec;
+int TiledMap_WriteNative(const char* filename, const TiledNativeSpec* spec);
+typedef struct TiledNativeWriter TiledNativeWriter;
+TiledNativeWriter* TiledMap_BeginNative(const char* filename, const TiledNativeSpec* spec);
+int TiledMap_WriteNativeRow(TiledNativeWriter* writer, const Sint16* gids);
+int TiledMap_EndNative(TiledNativeWriter* writer, const char* filename);
+int Tmx_ConvertText(const char* xml, size_t len, const char* name,
+    const char* wtmFilename, int chunkSize, int compressed);
+int Tmx_Convert(const char* tmxFilename, const char* wtmFilename, int chunkSize,
+    int compressed);
+
+// Returns the tile for a GID, or 0 for empty cells and GIDs that no tileset covers.
+static inline TiledTile* TiledMap_FindTile(TiledMap* map, Sint16 gid)
+{
+  return (gid > 0 && gid < map->nGids) ? map->gidTiles[gid] : 0;
+}
+
+// Returns the GID's index into the dense per-GID tables, or 0 (always empty).
+static inline Sint16 TiledMap_GidIndex(TiledMap* map, Sint16 gid)
+{
+  return (gid > 0 && gid < map->nGids) ? gid : 0;
+}
+
+int TiledMap_InitChunks(TiledMap* map, int chunkSize, TiledChunkLoader loadChunk);
+void TiledMap_SetChunkBudget(TiledMap* map, size_t bytes);
+Sint16* TiledMap_GetCell(TiledMap* map, int x, int y);
+Sint16 TiledMap_GetGid(TiledMap* map, int x, int y, int layer);
+void TiledMap_StreamChunks(TiledMap* map, SDL_Rect* viewRect, struct Coords mov);
+TiledChunk* TiledMap_LoadChunk(TiledMap* map, int col, int row);
+void TiledMap_DeriveCellFlags(TiledMap* map);
+void TiledMap_CopyObstacles(TiledMap* map, Uint64* bits, int stride);
+void TiledMap_ReadOpacityRow(TiledMap* map, int x, int y, int n, Uint8* out);
+void TiledMap_UpdateCellFlags(TiledMap* map, int x, int y);
+int TiledMap_RectHitsObstacle(TiledMap* map, SDL_Rect* rect);
+
+// The chunk holding cell (x, y), which must be on the map, loading it if
+// need be. 0 if it can't be loaded.
+static inline TiledChunk* TiledMap_ChunkAt(TiledMap* map, int x, int y)
+{
+  int col = x >> map->chunkShift, row = y >> map->chunkShift;
+  TiledChunk* chunk = map->chunks[row * map->chunkCols + col];
+  if (!chunk && !(chunk = TiledMap_LoadChunk(map, col, row)))
+    return 0;
+  chunk->lastUsed = map->chunkClock;
+  return chunk;
+}
+
+// Combined opacity of the cell's layers. Off the map, or in a chunk that
+// won't load, nothing is visible.
+static inline int TiledMap_Opacity(TiledMap* map, int x, int y)
+{
+  if (x < 0 || x >= map->width || y < 0 || y >= map->height)
+    return MAX_TILE_OPACITY;
+  TiledChunk* chunk = TiledMap_ChunkAt(map, x, y);
+  if (!chunk)
+    return MAX_TILE_OPACITY;
+  x &= map->chunkSize - 1;
+  y &= map->chunkSize - 1;
+  return chunk->opacityNibbles[y * map->opacityStride + (x >> 1)] >> ((x & 1) << 2) & 0xF;
+}
+
+// Loads chunks as it goes, so call it from the main thread.
+static inline int TiledMap_IsObstacle(TiledMap* map, int x, int y)
+{
+  if (x < 0 || x >= map->width || y < 0 || y >= map->height)
+    return 1;
+  TiledChunk* chunk = TiledMap_ChunkAt(map, x, y);
+  if (!chunk)
+    return 1;
+  x &= map->chunkSize - 1;
+  y &= map->chunkSize - 1;
+  return chunk->obstacleBits[y * map->obstacleStride + (x >> 6)] >> (x & 63) & 1;
+}
 
 int InitDisplay(
     const char* windowName, int screenW, int screenH,
     int minFrameRateCap, int* frameRateCap);
 int InitTileCache(TiledMap* map);
 void DestroyDisplay();
+void PrintTileCacheStats();
+void PrintRenderStats();
+int GetMaxTextureSize();
+int HasRenderer();
+Uint32 GetPreferredTextureFormat();
+SDL_Texture* SurfaceToTexture(SDL_Surface* surface, int freeSurfaceWhenDone);
+void SetRenderChunkBudget(size_t bytes);
+void InvalidateMapCell(TiledMap* map, int x, int y);
+void InvalidateRenderChunks();
+
+void Atlas_Begin();
+int Atlas_IsCollecting();
+void Atlas_Add(SDL_Surface* sfc);
+int Atlas_Build();
+int Atlas_Place(struct Image* img);
+void Atlas_Destroy();
+
+typedef struct BundleStats {
+  int loaded; // images taken from the bundle
+  int stale; // in the bundle, but their files have changed since
+  int missed; // not taken from the bundle, for whatever reason
+} BundleStats;
+int Bundle_Open(const char* filename);
+void Bundle_Close();
+SDL_Surface* Bundle_LoadSurface(const char* path);
+void Bundle_BeginRecording();
+void Bundle_Record(const char* path, SDL_Surface* sfc);
+int Bundle_Write(const char* filename, Uint32 format);
+BundleStats Bundle_GetStats();
+
+enum { LOAD_PENDING, LOAD_READY, LOAD_FAILED };
+typedef struct LoaderStats {
+  int queued, decoding, awaitingUpload, peakQueueDepth;
+  Uint32 loaded, failed;
+} LoaderStats;
+int Loader_Init();
+void Loader_Destroy();
+int Loader_Request(const char* path);
+void Loader_Finish();
+void Loader_Upload(Uint32 budgetUs);
+int Loader_GetResult(int ticket, SDL_Surface** sfc, SDL_Texture** tex);
+void Loader_LoadImage(struct Image* img);
+int Loader_Poll(struct Image* img);
+LoaderStats Loader_GetStats();
+void Loader_PrintStats();
+
+typedef struct LightStats {
+  Uint32 lookups, hits, computes;
+  Uint64 cellsProcessed;
+} LightStats;
+int ReduceBrightness(int brightness, int tileOpacity);
+int OpacityForBrightness(int brightness);
+void Light_Init(int radius, int dropoffDistance, int threshold);
+void Light_Destroy();
+const Uint8* Light_Compute(TiledMap* map, int viewerX, int viewerY);
+void Light_InvalidateTile(int x, int y);
+void Light_InvalidateAll();
+LightStats Light_GetStats();
+
+// A path in map tiles (see path.c). Consecutive waypoints are joined by
+// straight or diagonal lines of open tiles.
+typedef struct Path {
+  Coords* waypoints;
+  int nWaypoints, capacity;
+  int cost; // in tenths of a straight step
+} Path;
+enum { PATH_PENDING, PATH_FOUND, PATH_NOT_FOUND };
+typedef struct PathStats {
+  Uint32 requests, shortSearches, longSearches, failures, clusterBuilds;
+  Uint64 nodesExpanded;
+  int queueLength;
+} PathStats;
+void Path_Init(TiledMap* map, int clusterSize);
+void Path_Destroy();
+int Path_Find(Coords start, Coords goal, Path* path);
+int Path_Request(Coords start, Coords goal);
+int Path_GetResult(int ticket, const Path** path);
+void Path_Release(int ticket);
+int Path_Update(Uint32 budgetUs);
+void Path_InvalidateTile(int x, int y);
+PathStats Path_GetStats();
+
+#define MAX_JOB_THREADS 64
+// Job system (see job.c). A job handles items first to end-1 of a range,
+// which is chunk number 'chunk' of the range's split.
+typedef void (*JobFunction)(void* data, int chunk, int first, int end);
+typedef struct JobStats {
+  Uint32 jobsRun, jobsStolen;
+} JobStats;
+int Job_Init(int nThreads);
+void Job_Destroy();
+void Job_SetDeterministic(int deterministic);
+int Job_IsDeterministic();
+int Job_ThreadCount();
+int Job_ThreadIndex();
+int Job_ChunkCount(int count, int grain);
+void Job_ParallelFor(JobFunction function, void* data, int count, int grain);
+JobStats Job_GetStats();
+
+typedef struct InputScript InputScript;
+InputScript* InputScript_Load(const char* filename);
+void InputScript_Destroy(InputScript* script);
+int InputScript_Next(InputScript* script, Uint32 tick, struct Coords* move);
+InputScript* InputScript_Create();
+void InputScript_RecordMove(InputScript* script, Uint32 tick, struct Coords move);
+void InputScript_RecordQuit(InputScript* script, Uint32 tick);
+int InputScript_Save(InputScript* script, const char* filename);
 void Draw(
     int phase, TiledMap* map,
-    struct Player* player, struct Npc* npcs, int npcCount);
+    struct Player* player, EntityStore* npcs);
 
@@ -3,36 +3,317 @@
 
 #include "wandrix.h"
 
-typedef struct XmlAttribute {
-  const char* name;
-  const char* value;
-  struct XmlAttribute* next;
-} XmlAttribute;
+// Zero-copy XML pull parser.
+//
+// Xml_Next steps through the document a tag or a run of text at a time, and
+// the names, attribute values and text it hands back are slices of the
+// caller's buffer (usually a mapped file), so nothing is copied or built.
+// Entities are left as they are; Xml_Unescape decodes the common ones where
+// that matters. Comments, processing instructions and the doctype are
+// skipped, as is text that's all whitespace. Start and end tags are checked
+// to match, which is the only state kept besides the position.
 
-typedef struct XmlElement {
-  const char* name;
-  struct XmlAttribute* attribute;
-  struct XmlElement* child;
-  struct XmlElement* sibling;
-  //struct XmlElement* parent;
-} XmlElement;
+static int IsSpace(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int IsNameChar(char c)
+{
+  return !IsSpace(c) && c != '/' && c != '>' && c != '=' && c != '<'
+    && c != '"' && c != '\'';
+}
 
-struct XmlParser {
-  char* xml;
-  int pos, len;
-};
+void Xml_Init(XmlParser* p, const char* xml, size_t len)
+{
+  memset(p, 0, sizeof(*p));
+  p->xml = xml;
+  p->len = len;
+}
+
+static int XmlError(XmlParser* p, const char* problem)
+{
+  p->error = problem;
+  p->event = XML_ERROR;
+  return XML_ERROR;
+}
 
-XmlElement* ParseElement(XmlParser* p);
+// Returns the line the parser has reached, from 1, for error messages.
+int Xml_Line(XmlParser* p)
+{
+  int line = 1;
+  for (size_t i=0; i < p->pos && i < p->len; ++i)
+    line += p->xml[i] == '\n';
+  return line;
+}
 
-XmlElement* XmlParse(const char* filename)
+static int StartsWith(XmlParser* p, const char* prefix)
 {
-  XmlParser parser;
-  if (!ReadBinFile(filename, &parser.xml, &parser.len)) return 0;
-  return ParseElement(&parser);
+  size_t n = strlen(prefix);
+  return p->len - p->pos >= n && !memcmp(p->xml + p->pos, prefix, n);
 }
 
-XmlElement* ParseElement(XmlParser* p)
+// Moves past the next occurrence of end. Returns 0 if there isn't one.
+static int SkipPast(XmlParser* p, const char* end)
 {
+  size_t n = strlen(end);
+  for (; p->pos + n <= p->len; ++p->pos)
+  {
+    if (p->xml[p->pos] == end[0] && !memcmp(p->xml + p->pos, end, n))
+    {
+      p->pos += n;
+      return 1;
+    }
+  }
   return 0;
 }
 
+static XmlSlice ReadName(XmlParser* p)
+{
+  XmlSlice name = { p->xml + p->pos, 0 };
+  while (p->pos < p->len && IsNameChar(p->xml[p->pos]))
+    ++p->pos, ++name.len;
+  return name;
+}
+
+static void SkipSpace(XmlParser* p)
+{
+  while (p->pos < p->len && IsSpace(p->xml[p->pos]))
+    ++p->pos;
+}
+
+// Reads the attributes of a start tag up to its end, checking their syntax,
+// so that Xml_Attribute can go through them again without checking.
+static int ReadStartTag(XmlParser* p)
+{
+  p->name = ReadName(p);
+  if (!p->name.len)
+    return XmlError(p, "expected an element name");
+  p->attributes.text = p->xml + p->pos;
+  for (;;)
+  {
+    SkipSpace(p);
+    if (p->pos == p->len)
+      return XmlError(p, "unterminated start tag");
+    char c = p->xml[p->pos];
+    if (c == '>' || (c == '/' && StartsWith(p, "/>")))
+      break;
+    if (!ReadName(p).len)
+      return XmlError(p, "expected an attribute name");
+    SkipSpace(p);
+    if (p->pos == p->len || p->xml[p->pos] != '=')
+      return XmlError(p, "expected '=' after attribute name");
+    ++p->pos;
+    SkipSpace(p);
+    if (p->pos == p->len || (p->xml[p->pos] != '"' && p->xml[p->pos] != '\''))
+      return XmlError(p, "expected a quoted attribute value");
+    const char* quote = memchr(p->xml + p->pos + 1, p->xml[p->pos], p->len - p->pos - 1);
+    if (!quote)
+      return XmlError(p, "unterminated attribute value");
+    p->pos = quote + 1 - p->xml;
+  }
+  p->attributes.len = p->xml + p->pos - p->attributes.text;
+  p->selfClosing = p->xml[p->pos] == '/';
+  p->pos += p->selfClosing ? 2 : 1;
+  if (p->depth == XML_MAX_DEPTH)
+    return XmlError(p, "elements nested too deeply");
+  p->open[p->depth++] = p->name;
+  p->event = XML_START;
+  return XML_START;
+}
+
+static int ReadEndTag(XmlParser* p)
+{
+  p->name = ReadName(p);
+  SkipSpace(p);
+  if (p->pos == p->len || p->xml[p->pos] != '>')
+    return XmlError(p, "unterminated end tag");
+  ++p->pos;
+  if (!p->depth)
+    return XmlError(p, "end tag with no start tag");
+  XmlSlice open = p->open[--p->depth];
+  if (open.len != p->name.len || memcmp(open.text, p->name.text, open.len))
+    return XmlError(p, "end tag doesn't match start tag");
+  p->event = XML_END;
+  return XML_END;
+}
+
+// Moves to the next start tag, end tag or run of text, and returns what it
+// is: XML_START, XML_END, XML_TEXT, or XML_EOF at the end of the document.
+// On XML_ERROR, error says what's wrong (see also Xml_Line). A self-closing
+// tag gives an XML_START and then an XML_END.
+int Xml_Next(XmlParser* p)
+{
+  if (p->event == XML_ERROR)
+    return XML_ERROR;
+  if (p->selfClosing)
+  {
+    p->selfClosing = 0;
+    p->name = p->open[--p->depth];
+    p->event = XML_END;
+    return XML_END;
+  }
+  for (;;)
+  {
+    if (p->pos == p->len)
+    {
+      if (p->depth)
+        return XmlError(p, "document ends inside an element");
+      p->event = XML_EOF;
+      return XML_EOF;
+    }
+    if (p->xml[p->pos] != '<')
+    {
+      const char* start = p->xml + p->pos;
+      const char* end = memchr(start, '<', p->len - p->pos);
+      if (!end)
+        end = p->xml + p->len;
+      p->pos = end - p->xml;
+      int blank = 1;
+      for (const char* c = start; c < end && blank; ++c)
+        blank = IsSpace(*c);
+      if (blank)
+        continue;
+      if (!p->depth)
+        return XmlError(p, "text outside the root element");
+      p->text.text = start;
+      p->text.len = end - start;
+      p->event = XML_TEXT;
+      return XML_TEXT;
+    }
+    if (StartsWith(p, "<!--"))
+    {
+      if (!SkipPast(p, "-->"))
+        return XmlError(p, "unterminated comment");
+    }
+    else if (StartsWith(p, "<![CDATA["))
+    {
+      p->pos += 9;
+      p->text.text = p->xml + p->pos;
+      if (!SkipPast(p, "]]>"))
+        return XmlError(p, "unterminated CDATA section");
+      p->text.len = p->xml + p->pos - 3 - p->text.text;
+      p->event = XML_TEXT;
+      return XML_TEXT;
+    }
+    else if (StartsWith(p, "<?"))
+    {
+      if (!SkipPast(p, "?>"))
+        return XmlError(p, "unterminated processing instruction");
+    }
+    else if (StartsWith(p, "<!"))
+    {
+      // Doctypes with internal subsets aren't handled.
+      if (!SkipPast(p, ">"))
+        return XmlError(p, "unterminated declaration");
+    }
+    else if (StartsWith(p, "</"))
+    {
+      p->pos += 2;
+      return ReadEndTag(p);
+    }
+    else
+    {
+      ++p->pos;
+      return ReadStartTag(p);
+    }
+  }
+}
+
+// Finds an attribute of the element just started. Returns 1 and sets value
+// to its value (without the quotes, and not unescaped) if it's there.
+int Xml_Attribute(XmlParser* p, const char* name, XmlSlice* value)
+{
+  size_t nameLen = strlen(name);
+  const char* a = p->attributes.text;
+  const char* end = a + p->attributes.len;
+  while (a < end)
+  {
+    while (a < end && IsSpace(*a))
+      ++a;
+    const char* attrName = a;
+    while (a < end && IsNameChar(*a))
+      ++a;
+    size_t attrNameLen = a - attrName;
+    a = memchr(a, '=', end - a);
+    if (!a)
+      break;
+    for (++a; IsSpace(*a); ++a)
+      ;
+    const char* quote = memchr(a + 1, *a, end - a - 1);
+    if (!quote)
+      break;
+    if (attrNameLen == nameLen && !memcmp(attrName, name, nameLen))
+    {
+      value->text = a + 1;
+      value->len = quote - a - 1;
+      return 1;
+    }
+    a = quote + 1;
+  }
+  return 0;
+}
+
+int Xml_SliceIs(XmlSlice slice, const char* str)
+{
+  size_t len = strlen(str);
+  return slice.len == len && !memcmp(slice.text, str, len);
+}
+
+// Parses a slice as a whole decimal number. Returns 0 if it isn't one.
+int Xml_SliceToInt(XmlSlice slice, long* value)
+{
+  char buf[24];
+  if (!slice.len || slice.len >= sizeof(buf))
+    return 0;
+  memcpy(buf, slice.text, slice.len);
+  buf[slice.len] = '\0';
+  char* end;
+  *value = strtol(buf, &end, 10);
+  return *end == '\0';
+}
+
+// Copies a slice into buf, decoding the predefined entities and character
+// references. Returns 0 if it doesn't fit in size bytes, with the null.
+int Xml_Unescape(XmlSlice slice, char* buf, size_t size)
+{
+  static const char* const entities[5][2] = { { "lt;", "<" }, { "gt;", ">" },
+    { "amp;", "&" }, { "quot;", "\"" }, { "apos;", "'" } };
+  size_t n = 0;
+  for (size_t i=0; i < slice.len; )
+  {
+    char c = slice.text[i++];
+    if (c == '&')
+    {
+      size_t left = slice.len - i;
+      int e = 0;
+      for (; e < 5; ++e)
+      {
+        size_t len = strlen(entities[e][0]);
+        if (left >= len && !memcmp(slice.text + i, entities[e][0], len))
+        {
+          c = entities[e][1][0];
+          i += len;
+          break;
+        }
+      }
+      if (e == 5 && left > 1 && slice.text[i] == '#')
+      {
+        // Only characters that fit in a byte are kept as they are.
+        const char* semicolon = memchr(slice.text + i, ';', left);
+        if (semicolon)
+        {
+          int hex = slice.text[i + 1] == 'x';
+          long code = strtol(slice.text + i + 1 + hex, 0, hex ? 16 : 10);
+          c = code > 0 && code < 128 ? (char)code : '?';
+          i = semicolon + 1 - slice.text;
+        }
+      }
+    }
+    if (n + 1 >= size)
+      return 0;
+    buf[n++] = c;
+  }
+  buf[n] = '\0';
+  return 1;
+}